@@ -0,0 +1,318 @@
+#include "columnar_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "columnar_file.c reads and writes its integers in host order, which must be little-endian"
+#endif
+
+// --- Structs ---
+
+typedef struct {
+    char magic[COLUMNAR_MAGIC_LEN];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t count;
+    uint64_t lsn;
+    uint64_t heap_size;
+    uint32_t crc_ages;
+    uint32_t crc_added;
+    uint32_t crc_names;
+    uint32_t crc_genders;
+    uint32_t crc_heap;
+    uint32_t crc_header;    // Over the header (header_size bytes) with this field zeroed
+    // Version 2 on; a version 1 header ends here
+    uint32_t crc_ids;
+    uint32_t next_id;
+} ColumnarHeader;
+
+#define HEADER_V1_SIZE offsetof(ColumnarHeader, crc_ids)
+
+// Byte offsets of the sections for a given row count
+typedef struct {
+    size_t ages;
+    size_t added;
+    size_t names;
+    size_t genders;
+    size_t ids;             // Version 2 on
+    size_t heap;
+    size_t end;
+} ColumnarLayout;
+
+#define MAX_GENDERS 32
+
+struct ColumnarWriter {
+    uint16_t *ages;
+    int64_t *added;
+    uint32_t *name_offsets;
+    uint32_t *gender_offsets;
+    uint32_t *ids;
+    size_t count;
+    size_t capacity;
+    char *heap;
+    size_t heap_size;
+    size_t heap_capacity;
+    uint32_t genders[MAX_GENDERS];      // Heap offsets of the distinct genders so far
+    size_t gender_count;
+    bool failed;
+};
+
+// --- Helpers ---
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static ColumnarLayout columnar_layout(uint32_t version, uint64_t count, uint64_t heap_size) {
+    ColumnarLayout layout;
+    layout.ages = align8(version == 1 ? HEADER_V1_SIZE : sizeof(ColumnarHeader));
+    layout.added = align8(layout.ages + count * sizeof(uint16_t));
+    layout.names = layout.added + count * sizeof(int64_t);
+    layout.genders = align8(layout.names + count * sizeof(uint32_t));
+    layout.ids = align8(layout.genders + count * sizeof(uint32_t));
+    layout.heap = version == 1 ? layout.ids : align8(layout.ids + count * sizeof(uint32_t));
+    layout.end = layout.heap + heap_size;
+    return layout;
+}
+
+static uint32_t checksum(const void *data, size_t len) {
+    return crc32_z(crc32_z(0, NULL, 0), data, len);
+}
+
+// header_size must be one this build knows
+static uint32_t header_checksum(const ColumnarHeader *header) {
+    ColumnarHeader copy = *header;
+    copy.crc_header = 0;
+    return checksum(&copy, header->header_size);
+}
+
+// --- Reading ---
+
+bool columnar_file_detect(const char *path) {
+    char magic[COLUMNAR_MAGIC_LEN];
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    bool found = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+                 && memcmp(magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN) == 0;
+    fclose(file);
+    return found;
+}
+
+int columnar_file_open(const char *path, ColumnarFile *file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if ((size_t)st.st_size < HEADER_V1_SIZE) {
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+    file->map = map;
+    file->map_size = st.st_size;
+
+    // Only the fields of a version 1 header may be read until the version is known
+    ColumnarHeader header = {0};
+    memcpy(&header, map, HEADER_V1_SIZE);
+    bool valid = memcmp(header.magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN) == 0
+                 && (header.version == 1 || header.version == COLUMNAR_VERSION)
+                 && header.header_size == (header.version == 1 ? HEADER_V1_SIZE : sizeof(ColumnarHeader))
+                 && header.header_size <= file->map_size;
+    if (valid) memcpy(&header, map, header.header_size);
+    ColumnarLayout layout = columnar_layout(header.version, header.count, header.heap_size);
+    valid = valid && header.crc_header == header_checksum(&header)
+            && header.count <= file->map_size / sizeof(uint16_t)
+            && header.heap_size <= file->map_size
+            && layout.end == file->map_size;
+    if (valid) {
+        madvise(map, file->map_size, MADV_WILLNEED);
+        const char *base = map;
+        file->count = header.count;
+        file->lsn = header.lsn;
+        file->next_id = header.next_id;
+        file->ages = (const uint16_t*)(base + layout.ages);
+        file->added = (const int64_t*)(base + layout.added);
+        file->name_offsets = (const uint32_t*)(base + layout.names);
+        file->gender_offsets = (const uint32_t*)(base + layout.genders);
+        file->ids = header.version == 1 ? NULL : (const uint32_t*)(base + layout.ids);
+        file->heap = base + layout.heap;
+        valid = checksum(file->ages, file->count * sizeof(uint16_t)) == header.crc_ages
+                && checksum(file->added, file->count * sizeof(int64_t)) == header.crc_added
+                && checksum(file->name_offsets, file->count * sizeof(uint32_t)) == header.crc_names
+                && checksum(file->gender_offsets, file->count * sizeof(uint32_t)) == header.crc_genders
+                && (!file->ids || checksum(file->ids, file->count * sizeof(uint32_t)) == header.crc_ids)
+                && checksum(file->heap, header.heap_size) == header.crc_heap;
+        // Offsets must land inside the heap, whose last byte must end a string
+        valid = valid && (header.count == 0 || (header.heap_size > 0 && file->heap[header.heap_size - 1] == '\0'));
+        for (uint64_t row = 0; valid && row < header.count; row++) {
+            valid = file->name_offsets[row] < header.heap_size && file->gender_offsets[row] < header.heap_size;
+        }
+    }
+    if (!valid) {
+        columnar_file_close(file);
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+void columnar_file_close(ColumnarFile *file) {
+    if (file->map) munmap(file->map, file->map_size);
+    memset(file, 0, sizeof(*file));
+}
+
+// --- Writing ---
+
+ColumnarWriter* columnar_writer_new(void) {
+    return calloc(1, sizeof(ColumnarWriter));
+}
+
+void columnar_writer_free(ColumnarWriter *writer) {
+    if (!writer) return;
+    free(writer->ages);
+    free(writer->added);
+    free(writer->name_offsets);
+    free(writer->gender_offsets);
+    free(writer->ids);
+    free(writer->heap);
+    free(writer);
+}
+
+#define GROW_COLUMN(column, capacity) do { \
+        void *grown = realloc((column), (capacity) * sizeof(*(column))); \
+        if (!grown) return false; \
+        (column) = grown; \
+    } while (0)
+
+static bool writer_reserve(ColumnarWriter *writer) {
+    if (writer->count < writer->capacity) return true;
+    size_t capacity = writer->capacity ? writer->capacity * 2 : 4096;
+    GROW_COLUMN(writer->ages, capacity);
+    GROW_COLUMN(writer->added, capacity);
+    GROW_COLUMN(writer->name_offsets, capacity);
+    GROW_COLUMN(writer->gender_offsets, capacity);
+    GROW_COLUMN(writer->ids, capacity);
+    writer->capacity = capacity;
+    return true;
+}
+
+// Appends text to the heap and stores its offset
+static bool writer_put_string(ColumnarWriter *writer, const char *text, uint32_t *offset) {
+    size_t len = strlen(text) + 1;
+    if (writer->heap_size + len > UINT32_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+    if (writer->heap_size + len > writer->heap_capacity) {
+        size_t capacity = writer->heap_capacity ? writer->heap_capacity : 1 << 16;
+        while (capacity < writer->heap_size + len) capacity *= 2;
+        char *heap = realloc(writer->heap, capacity);
+        if (!heap) return false;
+        writer->heap = heap;
+        writer->heap_capacity = capacity;
+    }
+    memcpy(writer->heap + writer->heap_size, text, len);
+    *offset = writer->heap_size;
+    writer->heap_size += len;
+    return true;
+}
+
+static bool writer_put_gender(ColumnarWriter *writer, const char *gender, uint32_t *offset) {
+    for (size_t i = 0; i < writer->gender_count; i++) {
+        if (strcmp(writer->heap + writer->genders[i], gender) == 0) {
+            *offset = writer->genders[i];
+            return true;
+        }
+    }
+    if (!writer_put_string(writer, gender, offset)) return false;
+    if (writer->gender_count < MAX_GENDERS) writer->genders[writer->gender_count++] = *offset;
+    return true;
+}
+
+bool columnar_writer_add(ColumnarWriter *writer, const char *name, unsigned age, const char *gender, int64_t added,
+                         uint32_t id) {
+    size_t row = writer->count;
+    bool ok = !writer->failed && writer_reserve(writer)
+              && writer_put_string(writer, name, &writer->name_offsets[row])
+              && writer_put_gender(writer, gender, &writer->gender_offsets[row]);
+    if (!ok) {
+        writer->failed = true;
+        return false;
+    }
+    writer->ages[row] = age > UINT16_MAX ? UINT16_MAX : age;
+    writer->added[row] = added;
+    writer->ids[row] = id;
+    writer->count++;
+    return true;
+}
+
+static bool write_section(FILE *file, size_t *written, size_t offset, const void *data, size_t len) {
+    static const char zeros[8];
+    if (offset > *written && fwrite(zeros, 1, offset - *written, file) != offset - *written) return false;
+    if (len > 0 && fwrite(data, 1, len, file) != len) return false;
+    *written = offset + len;
+    return true;
+}
+
+bool columnar_writer_finish(ColumnarWriter *writer, const char *path, const char *tmp_path, uint64_t lsn,
+                            uint32_t next_id) {
+    if (writer->failed) return false;
+    size_t n = writer->count;
+    ColumnarHeader header = {0};
+    memcpy(header.magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN);
+    header.version = COLUMNAR_VERSION;
+    header.header_size = sizeof(ColumnarHeader);
+    header.count = n;
+    header.lsn = lsn;
+    header.next_id = next_id;
+    header.heap_size = writer->heap_size;
+    header.crc_ages = checksum(writer->ages, n * sizeof(uint16_t));
+    header.crc_added = checksum(writer->added, n * sizeof(int64_t));
+    header.crc_names = checksum(writer->name_offsets, n * sizeof(uint32_t));
+    header.crc_genders = checksum(writer->gender_offsets, n * sizeof(uint32_t));
+    header.crc_ids = checksum(writer->ids, n * sizeof(uint32_t));
+    header.crc_heap = checksum(writer->heap, writer->heap_size);
+    header.crc_header = header_checksum(&header);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) return false;
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    ColumnarLayout layout = columnar_layout(COLUMNAR_VERSION, n, writer->heap_size);
+    size_t written = 0;
+    bool ok = write_section(file, &written, 0, &header, sizeof(header))
+              && write_section(file, &written, layout.ages, writer->ages, n * sizeof(uint16_t))
+              && write_section(file, &written, layout.added, writer->added, n * sizeof(int64_t))
+              && write_section(file, &written, layout.names, writer->name_offsets, n * sizeof(uint32_t))
+              && write_section(file, &written, layout.genders, writer->gender_offsets, n * sizeof(uint32_t))
+              && write_section(file, &written, layout.ids, writer->ids, n * sizeof(uint32_t))
+              && write_section(file, &written, layout.heap, writer->heap, writer->heap_size);
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef COLUMNAR_FILE_H
+#define COLUMNAR_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Columnar Snapshot File ---
+//
+// Binary alternative to the text snapshot, laid out so a store can map it
+// and use it in place instead of parsing it:
+//
+//     header | ages u16[n] | added i64[n] | name offsets u32[n] | gender offsets u32[n]
+//            | ids u32[n] | string heap
+//
+// Integers are little-endian and every section starts 8-byte aligned. The
+// heap holds NUL-terminated strings, with genders stored once each. The
+// header carries the format version, row count, the journal lsn folded into
+// the file, the next patient ID to give out, and a CRC-32 for every section
+// and for the header itself. Version 1 files, which have no IDs and a
+// shorter header, are still read.
+
+#define COLUMNAR_MAGIC "HMSCOL\r\n"     // The CR LF catches text-mode mangling
+#define COLUMNAR_MAGIC_LEN 8
+#define COLUMNAR_VERSION 2
+
+// A validated, read-only mapping; the pointers stay valid until closed
+typedef struct {
+    void *map;
+    size_t map_size;
+    uint64_t count;
+    uint64_t lsn;
+    uint32_t next_id;               // 0 in a version 1 file
+    const uint16_t *ages;
+    const int64_t *added;
+    const uint32_t *name_offsets;
+    const uint32_t *gender_offsets;
+    const uint32_t *ids;            // NULL in a version 1 file
+    const char *heap;
+} ColumnarFile;
+
+typedef struct ColumnarWriter ColumnarWriter;
+
+// Whether path starts with COLUMNAR_MAGIC
+bool columnar_file_detect(const char *path);
+// Maps and checks path. Returns 0, or -1 with errno set (EBADMSG if the
+// file is truncated, fails a checksum or has an unknown version).
+int columnar_file_open(const char *path, ColumnarFile *file);
+void columnar_file_close(ColumnarFile *file);
+
+static inline const char* columnar_file_name(const ColumnarFile *file, size_t row) {
+    return file->heap + file->name_offsets[row];
+}
+
+static inline const char* columnar_file_gender(const ColumnarFile *file, size_t row) {
+    return file->heap + file->gender_offsets[row];
+}
+
+// Collects rows in memory, then writes them out in one go
+ColumnarWriter* columnar_writer_new(void);
+bool columnar_writer_add(ColumnarWriter *writer, const char *name, unsigned age, const char *gender, int64_t added,
+                         uint32_t id);
+// Writes tmp_path, syncs it and renames it over path
+bool columnar_writer_finish(ColumnarWriter *writer, const char *path, const char *tmp_path, uint64_t lsn,
+                            uint32_t next_id);
+void columnar_writer_free(ColumnarWriter *writer);
+
+#endif
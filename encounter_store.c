@@ -0,0 +1,714 @@
+#include "encounter_store.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "encounter_store.c reads and writes its integers in host order, which must be little-endian"
+#endif
+
+#define CHUNK_TAG 0xE7
+#define CHUNK_CRC_LEN 4
+#define INDEX_FILE "index"
+#define PATIENT_PATH_MAX 32     // "/ff/4294967295" and then some
+
+// --- Structs ---
+
+typedef struct {
+    int64_t time;
+    uint32_t patient;
+    uint32_t reserved;      // Zero
+} IndexEntry;
+
+struct EncounterStore {
+    char *dir;
+    char *index_path;
+    int index_fd;           // -1 until the index exists
+    IndexEntry *entries;    // Sorted by time, then MRN
+    size_t count;
+    size_t capacity;
+    off_t index_size;       // Bytes of the index taken in so far
+};
+
+struct EncounterList {
+    Encounter *items;
+    size_t count;
+    size_t capacity;
+    char **blocks;          // The strings the items point into
+    size_t n_blocks;
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} Bytes;
+
+// --- Helpers ---
+
+static bool bytes_reserve(Bytes *bytes, size_t extra) {
+    if (bytes->len + extra <= bytes->capacity) return true;
+    size_t capacity = bytes->capacity ? bytes->capacity : 256;
+    while (capacity < bytes->len + extra) capacity *= 2;
+    uint8_t *data = realloc(bytes->data, capacity);
+    if (!data) return false;
+    bytes->data = data;
+    bytes->capacity = capacity;
+    return true;
+}
+
+static bool put_varint(Bytes *bytes, uint64_t value) {
+    if (!bytes_reserve(bytes, 10)) return false;
+    while (value >= 0x80) {
+        bytes->data[bytes->len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes->data[bytes->len++] = (uint8_t)value;
+    return true;
+}
+
+static bool put_bytes(Bytes *bytes, const void *data, size_t len) {
+    if (!bytes_reserve(bytes, len)) return false;
+    memcpy(bytes->data + bytes->len, data, len);
+    bytes->len += len;
+    return true;
+}
+
+static bool put_string(Bytes *bytes, const char *text) {
+    size_t len = strlen(text);
+    return put_varint(bytes, len) && put_bytes(bytes, text, len);
+}
+
+static bool get_varint(const uint8_t *data, size_t len, size_t *pos, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64 && *pos < len; shift += 7) {
+        uint8_t byte = data[(*pos)++];
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static char* derive_dir(const char *registry_path) {
+    size_t base = strlen(registry_path);
+    const char *dot = strrchr(registry_path, '.');
+    const char *slash = strrchr(registry_path, '/');
+    if (dot && (!slash || dot > slash)) base = dot - registry_path;
+    char *dir = malloc(base + sizeof(ENCOUNTER_DIR_SUFFIX));
+    if (!dir) return NULL;
+    memcpy(dir, registry_path, base);
+    strcpy(dir + base, ENCOUNTER_DIR_SUFFIX);
+    return dir;
+}
+
+// The patient's file, fanned out over 256 directories by the MRN's last byte
+static char* patient_path(const EncounterStore *store, PatientId patient, bool subdir_only) {
+    char *path = malloc(strlen(store->dir) + PATIENT_PATH_MAX);
+    if (!path) return NULL;
+    if (subdir_only) sprintf(path, "%s/%02x", store->dir, patient & 0xFF);
+    else sprintf(path, "%s/%02x/%u", store->dir, patient & 0xFF, patient);
+    return path;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Reads the whole file at path into *data; a missing file is empty
+static int read_file(const char *path, uint8_t **data, size_t *len) {
+    *data = NULL;
+    *len = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !(*data = malloc(st.st_size ? st.st_size : 1))) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t got = read(fd, *data + done, st.st_size - done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            int saved = errno;
+            close(fd);
+            free(*data);
+            *data = NULL;
+            errno = saved;
+            return -1;
+        }
+        if (got == 0) break;    // Truncated meanwhile
+        done += got;
+    }
+    close(fd);
+    *len = done;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const IndexEntry *x = a, *y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return (x->patient > y->patient) - (x->patient < y->patient);
+}
+
+static int compare_encounters(const Encounter *x, const Encounter *y) {
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return (x->patient > y->patient) - (x->patient < y->patient);
+}
+
+// Stable, so visits at the same minute keep the order they were recorded in
+static bool sort_encounters(Encounter *items, size_t count) {
+    bool sorted = true;
+    for (size_t i = 1; sorted && i < count; i++) sorted = compare_encounters(&items[i - 1], &items[i]) <= 0;
+    if (sorted) return true;
+    Encounter *scratch = malloc(count * sizeof(Encounter));
+    if (!scratch) return false;
+    Encounter *from = items, *to = scratch;
+    for (size_t width = 1; width < count; width *= 2) {
+        for (size_t lo = 0; lo < count; lo += 2 * width) {
+            size_t mid = lo + width < count ? lo + width : count;
+            size_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) to[k++] = compare_encounters(&from[j], &from[i]) < 0 ? from[j++] : from[i++];
+            while (i < mid) to[k++] = from[i++];
+            while (j < hi) to[k++] = from[j++];
+        }
+        Encounter *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != items) memcpy(items, from, count * sizeof(Encounter));
+    free(scratch);
+    return true;
+}
+
+// --- Lists ---
+
+static EncounterList* list_new(void) {
+    EncounterList *list = calloc(1, sizeof(EncounterList));
+    if (!list) errno = ENOMEM;
+    return list;
+}
+
+static bool list_push(EncounterList *list, const Encounter *encounter) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        Encounter *items = realloc(list->items, capacity * sizeof(Encounter));
+        if (!items) return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = *encounter;
+    return true;
+}
+
+static bool list_adopt_block(EncounterList *list, char *block) {
+    char **blocks = realloc(list->blocks, (list->n_blocks + 1) * sizeof(char*));
+    if (!blocks) return false;
+    blocks[list->n_blocks++] = block;
+    list->blocks = blocks;
+    return true;
+}
+
+size_t encounter_list_count(const EncounterList *list) {
+    return list->count;
+}
+
+const Encounter* encounter_list_get(const EncounterList *list, size_t i) {
+    return &list->items[i];
+}
+
+void encounter_list_free(EncounterList *list) {
+    if (!list) return;
+    for (size_t i = 0; i < list->n_blocks; i++) free(list->blocks[i]);
+    free(list->blocks);
+    free(list->items);
+    free(list);
+}
+
+// --- Chunks ---
+
+// One patient's encounters, in the order given
+static bool encode_chunk(Bytes *out, Bytes *payload, const Encounter *const *encounters, size_t count) {
+    const char **departments = malloc(count * sizeof(char*));
+    if (!departments) return false;
+    size_t n_departments = 0;
+    payload->len = 0;
+    int64_t previous = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        const Encounter *encounter = encounters[i];
+        ok = put_varint(payload, zigzag((int64_t)((uint64_t)encounter->time - (uint64_t)previous)));
+        previous = encounter->time;
+        const char *department = encounter->department ? encounter->department : "";
+        size_t known = 0;
+        while (known < n_departments && strcmp(departments[known], department) != 0) known++;
+        if (known < n_departments) {
+            ok = ok && put_varint(payload, known + 1);
+        } else {
+            departments[n_departments++] = department;
+            ok = ok && put_varint(payload, 0) && put_string(payload, department);
+        }
+        ok = ok && put_string(payload, encounter->note ? encounter->note : "");
+    }
+    free(departments);
+    uint8_t tag = CHUNK_TAG;
+    uint32_t crc = crc32_z(crc32_z(0, NULL, 0), payload->data, payload->len);
+    return ok && put_bytes(out, &tag, 1) && put_varint(out, count) && put_varint(out, payload->len)
+           && put_bytes(out, payload->data, payload->len) && put_bytes(out, &crc, CHUNK_CRC_LEN);
+}
+
+static bool decode_string(const uint8_t *data, size_t len, size_t *pos, char **strings, const char **text) {
+    uint64_t n;
+    if (!get_varint(data, len, pos, &n) || n > len - *pos) return false;
+    memcpy(*strings, data + *pos, n);
+    (*strings)[n] = '\0';
+    *text = *strings;
+    *strings += n + 1;
+    *pos += n;
+    return true;
+}
+
+// Appends the chunk's count encounters to list, copying their strings to
+// *strings; false, with nothing added, if the payload doesn't hold them
+static bool decode_chunk(const uint8_t *payload, size_t len, uint64_t count, PatientId patient, EncounterList *list,
+                         char **strings, const char ***departments, size_t *departments_capacity) {
+    size_t before = list->count;
+    if (count > len) return false;     // Each takes three bytes at least
+    if (count > *departments_capacity) {
+        const char **grown = realloc(*departments, count * sizeof(char*));
+        if (!grown) return false;
+        *departments = grown;
+        *departments_capacity = count;
+    }
+    size_t n_departments = 0, pos = 0;
+    int64_t previous = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        Encounter encounter = { .patient = patient };
+        uint64_t delta, code;
+        bool ok = get_varint(payload, len, &pos, &delta) && get_varint(payload, len, &pos, &code);
+        if (ok && code == 0) {
+            ok = decode_string(payload, len, &pos, strings, &encounter.department);
+            if (ok) (*departments)[n_departments++] = encounter.department;
+        } else if (ok) {
+            ok = code <= n_departments;
+            if (ok) encounter.department = (*departments)[code - 1];
+        }
+        ok = ok && decode_string(payload, len, &pos, strings, &encounter.note);
+        encounter.time = previous = (int64_t)((uint64_t)previous + (uint64_t)unzigzag(delta));
+        if (!ok || !list_push(list, &encounter)) {
+            list->count = before;
+            return false;
+        }
+    }
+    if (pos != len) list->count = before;
+    return pos == len;
+}
+
+// Every encounter in a patient's file, in file order. Damaged bytes are
+// stepped over one at a time until a chunk checks out again.
+static int decode_history(const uint8_t *data, size_t len, PatientId patient, EncounterList *list) {
+    // A string's NUL takes the place of its length on disk, so no string
+    // block needs more room than the file
+    char *block = malloc(len + 1);
+    if (!block || !list_adopt_block(list, block)) {
+        free(block);
+        errno = ENOMEM;
+        return -1;
+    }
+    char *strings = block;
+    const char **departments = NULL;
+    size_t departments_capacity = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t start = pos;
+        uint64_t count, payload_len;
+        uint32_t crc;
+        pos++;
+        if (data[start] != CHUNK_TAG || !get_varint(data, len, &pos, &count)
+            || !get_varint(data, len, &pos, &payload_len) || payload_len > len - pos
+            || CHUNK_CRC_LEN > len - pos - payload_len) {
+            pos = start + 1;
+            continue;
+        }
+        memcpy(&crc, data + pos + payload_len, CHUNK_CRC_LEN);
+        char *mark = strings;
+        if (crc != crc32_z(crc32_z(0, NULL, 0), data + pos, payload_len)
+            || !decode_chunk(data + pos, payload_len, count, patient, list, &strings, &departments,
+                             &departments_capacity)) {
+            strings = mark;
+            pos = start + 1;
+            continue;
+        }
+        pos += payload_len + CHUNK_CRC_LEN;
+    }
+    free(departments);
+    return 0;
+}
+
+static EncounterList* read_history(const EncounterStore *store, PatientId patient) {
+    char *path = patient_path(store, patient, false);
+    EncounterList *list = path ? list_new() : NULL;
+    if (!list) {
+        free(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint8_t *data;
+    size_t len;
+    int result = read_file(path, &data, &len);
+    free(path);
+    if (result == 0) result = decode_history(data, len, patient, list);
+    free(data);
+    if (result == 0 && !sort_encounters(list->items, list->count)) {
+        result = -1;
+        errno = ENOMEM;
+    }
+    if (result != 0) {
+        int saved = errno;
+        encounter_list_free(list);
+        errno = saved;
+        return NULL;
+    }
+    return list;
+}
+
+// --- Index ---
+
+// Merges entries, sorted or not, into the sorted index. Visits are mostly
+// recorded in time order, so they usually just go on the end.
+static int index_merge(EncounterStore *store, IndexEntry *entries, size_t n) {
+    if (n == 0) return 0;
+    if (store->count + n > store->capacity) {
+        size_t capacity = store->capacity ? store->capacity : 1024;
+        while (capacity < store->count + n) capacity *= 2;
+        IndexEntry *grown = realloc(store->entries, capacity * sizeof(IndexEntry));
+        if (!grown) {
+            errno = ENOMEM;
+            return -1;
+        }
+        store->entries = grown;
+        store->capacity = capacity;
+    }
+    qsort(entries, n, sizeof(IndexEntry), compare_entries);
+    IndexEntry *all = store->entries;
+    size_t i = store->count, j = n, k = store->count + n;
+    // From the back, so nothing is overwritten before it has moved
+    while (j > 0) {
+        if (i > 0 && compare_entries(&all[i - 1], &entries[j - 1]) > 0) all[--k] = all[--i];
+        else all[--k] = entries[--j];
+    }
+    store->count += n;
+    return 0;
+}
+
+// Takes in whatever was appended to the index since, by this process or another
+static int index_refresh(EncounterStore *store) {
+    if (store->index_fd < 0) {
+        store->index_fd = open(store->index_path, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (store->index_fd < 0) return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(store->index_fd, &st) != 0) return -1;
+    off_t end = st.st_size - st.st_size % sizeof(IndexEntry);
+    if (end <= store->index_size) return 0;
+    size_t n = (end - store->index_size) / sizeof(IndexEntry);
+    IndexEntry *entries = malloc(n * sizeof(IndexEntry));
+    if (!entries) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t done = 0, want = n * sizeof(IndexEntry);
+    while (done < want) {
+        ssize_t got = pread(store->index_fd, (char*)entries + done, want - done, store->index_size + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            free(entries);
+            if (got == 0) errno = EIO;
+            return -1;
+        }
+        done += got;
+    }
+    int result = index_merge(store, entries, n);
+    if (result == 0) store->index_size = end;
+    free(entries);
+    return result;
+}
+
+// Lists every encounter in every patient file into a new index, for a
+// directory whose index is gone
+static int index_rebuild(EncounterStore *store) {
+    DIR *dir = opendir(store->dir);
+    if (!dir) return errno == ENOENT ? 0 : -1;
+    Bytes entries = {0};
+    bool ok = true;
+    for (struct dirent *fan; ok && (fan = readdir(dir));) {
+        if (strlen(fan->d_name) != 2 || !isxdigit((unsigned char)fan->d_name[0])) continue;
+        char *sub_path = malloc(strlen(store->dir) + 4);
+        if (!sub_path) {
+            ok = false;
+            break;
+        }
+        sprintf(sub_path, "%s/%s", store->dir, fan->d_name);
+        DIR *sub = opendir(sub_path);
+        free(sub_path);
+        for (struct dirent *file; ok && sub && (file = readdir(sub));) {
+            char *end;
+            unsigned long patient = strtoul(file->d_name, &end, 10);
+            if (file->d_name[0] < '1' || file->d_name[0] > '9' || *end != '\0' || patient > UINT32_MAX) continue;
+            EncounterList *history = read_history(store, patient);
+            ok = history != NULL;
+            for (size_t i = 0; ok && i < history->count; i++) {
+                IndexEntry entry = { history->items[i].time, patient, 0 };
+                ok = put_bytes(&entries, &entry, sizeof(entry));
+            }
+            encounter_list_free(history);
+        }
+        if (sub) closedir(sub);
+    }
+    closedir(dir);
+    char *tmp_path = ok ? malloc(strlen(store->index_path) + 5) : NULL;
+    int fd = -1;
+    if (tmp_path) {
+        sprintf(tmp_path, "%s.tmp", store->index_path);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    ok = fd >= 0 && write_all(fd, entries.data, entries.len) && fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = false;
+    if (ok && rename(tmp_path, store->index_path) != 0) ok = false;
+    int saved = errno;
+    if (!ok && tmp_path) unlink(tmp_path);
+    free(tmp_path);
+    free(entries.data);
+    if (!ok) {
+        errno = saved ? saved : ENOMEM;
+        return -1;
+    }
+    return index_refresh(store);
+}
+
+// --- Store ---
+
+EncounterStore* encounter_store_open(const char *registry_path) {
+    EncounterStore *store = calloc(1, sizeof(EncounterStore));
+    if (!store) return NULL;
+    store->index_fd = -1;
+    store->dir = derive_dir(registry_path);
+    store->index_path = store->dir ? malloc(strlen(store->dir) + sizeof("/" INDEX_FILE)) : NULL;
+    if (!store->index_path) {
+        encounter_store_close(store);
+        errno = ENOMEM;
+        return NULL;
+    }
+    sprintf(store->index_path, "%s/" INDEX_FILE, store->dir);
+    store->index_fd = open(store->index_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    int result;
+    if (store->index_fd < 0 && errno == ENOENT) {
+        result = index_rebuild(store);
+    } else {
+        // An entry cut short by a crash would put every later one out of step
+        struct stat st;
+        result = store->index_fd >= 0 && fstat(store->index_fd, &st) == 0 ? 0 : -1;
+        if (result == 0 && st.st_size % sizeof(IndexEntry) != 0) {
+            result = ftruncate(store->index_fd, st.st_size - st.st_size % sizeof(IndexEntry));
+        }
+        if (result == 0) result = index_refresh(store);
+    }
+    if (result != 0) {
+        int saved = errno;
+        encounter_store_close(store);
+        errno = saved;
+        return NULL;
+    }
+    return store;
+}
+
+void encounter_store_close(EncounterStore *store) {
+    if (!store) return;
+    if (store->index_fd >= 0) close(store->index_fd);
+    free(store->entries);
+    free(store->index_path);
+    free(store->dir);
+    free(store);
+}
+
+static int compare_by_patient(const void *a, const void *b) {
+    const Encounter *x = *(const Encounter *const *)a, *y = *(const Encounter *const *)b;
+    if (x->patient != y->patient) return x->patient < y->patient ? -1 : 1;
+    return (x > y) - (x < y);   // Given order within a patient
+}
+
+static bool append_chunk(EncounterStore *store, PatientId patient, const Bytes *chunk) {
+    char *path = patient_path(store, patient, false);
+    if (!path) {
+        errno = ENOMEM;
+        return false;
+    }
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        char *sub_path = patient_path(store, patient, true);
+        if (sub_path && (mkdir(sub_path, 0777) == 0 || errno == EEXIST)) {
+            fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        }
+        free(sub_path);
+    }
+    free(path);
+    bool ok = fd >= 0 && write_all(fd, chunk->data, chunk->len) && fdatasync(fd) == 0;
+    int saved = errno;
+    if (fd >= 0) close(fd);
+    errno = saved;
+    return ok;
+}
+
+int encounter_store_append(EncounterStore *store, const Encounter *encounters, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (encounters[i].patient == PATIENT_NO_ID) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (count == 0) return 0;
+    if (mkdir(store->dir, 0777) != 0 && errno != EEXIST) return -1;
+    if (store->index_fd < 0) {
+        store->index_fd = open(store->index_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (store->index_fd < 0) return -1;
+    }
+    const Encounter **sorted = malloc(count * sizeof(Encounter*));
+    IndexEntry *entries = malloc(count * sizeof(IndexEntry));
+    if (!sorted || !entries) {
+        free(sorted);
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) sorted[i] = &encounters[i];
+    qsort(sorted, count, sizeof(Encounter*), compare_by_patient);
+    // The chunks first, so the index never lists a visit that isn't on disk
+    Bytes chunk = {0}, payload = {0};
+    bool ok = true;
+    for (size_t first = 0, last; ok && first < count; first = last) {
+        for (last = first + 1; last < count && sorted[last]->patient == sorted[first]->patient; last++) {}
+        chunk.len = 0;
+        if (!encode_chunk(&chunk, &payload, sorted + first, last - first)) {
+            ok = false;
+            errno = ENOMEM;
+        } else {
+            ok = append_chunk(store, sorted[first]->patient, &chunk);
+        }
+    }
+    for (size_t i = 0; i < count; i++) entries[i] = (IndexEntry){ encounters[i].time, encounters[i].patient, 0 };
+    ok = ok && write_all(store->index_fd, entries, count * sizeof(IndexEntry)) && fdatasync(store->index_fd) == 0;
+    int saved = errno;
+    free(chunk.data);
+    free(payload.data);
+    free(entries);
+    free(sorted);
+    if (!ok) {
+        errno = saved;
+        return -1;
+    }
+    return index_refresh(store);
+}
+
+EncounterList* encounter_store_history(EncounterStore *store, PatientId patient) {
+    if (patient == PATIENT_NO_ID) return list_new();
+    return read_history(store, patient);
+}
+
+// First entry at or after time, or (after) past it
+static size_t index_bound(const EncounterStore *store, int64_t time, bool after) {
+    size_t lo = 0, hi = store->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (store->entries[mid].time < time || (after && store->entries[mid].time == time)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+EncounterList* encounter_store_range(EncounterStore *store, int64_t from, int64_t to) {
+    if (index_refresh(store) != 0) return NULL;
+    EncounterList *list = list_new();
+    if (!list || from > to) return list;
+    size_t lo = index_bound(store, from, false), hi = index_bound(store, to, true);
+    uint32_t *patients = malloc((hi - lo + 1) * sizeof(uint32_t));
+    if (!patients) {
+        encounter_list_free(list);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = lo; i < hi; i++) patients[i - lo] = store->entries[i].patient;
+    qsort(patients, hi - lo, sizeof(uint32_t), compare_ids);
+    bool ok = true;
+    for (size_t i = 0; ok && i < hi - lo; i++) {
+        if (i > 0 && patients[i] == patients[i - 1]) continue;
+        EncounterList *history = read_history(store, patients[i]);
+        if (!history) {
+            ok = false;
+            break;
+        }
+        for (size_t j = 0; ok && j < history->count; j++) {
+            const Encounter *encounter = &history->items[j];
+            if (encounter->time >= from && encounter->time <= to) ok = list_push(list, encounter);
+        }
+        // The strings move over to the range, block by block
+        for (size_t b = 0; ok && b < history->n_blocks; b++) {
+            ok = list_adopt_block(list, history->blocks[b]);
+            if (ok) history->blocks[b] = NULL;
+        }
+        encounter_list_free(history);
+        if (!ok) errno = ENOMEM;
+    }
+    free(patients);
+    if (ok && !sort_encounters(list->items, list->count)) {
+        ok = false;
+        errno = ENOMEM;
+    }
+    if (!ok) {
+        int saved = errno;
+        encounter_list_free(list);
+        errno = saved;
+        return NULL;
+    }
+    return list;
+}
+
+size_t encounter_store_count(EncounterStore *store) {
+    index_refresh(store);
+    return store->count;
+}
@@ -0,0 +1,74 @@
+#ifndef ENCOUNTER_STORE_H
+#define ENCOUNTER_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+
+// --- Encounter History ---
+//
+// The visits of every patient, kept next to the registry in a directory of
+// their own (patients.txt -> patients.encounters/). A patient's visits live
+// in one append-only file named by MRN (patients.encounters/39/12345), so
+// the whole history comes back in a single read however long it is. Each
+// append adds one chunk to it:
+//
+//     0xE7 | count varint | length varint | payload | CRC-32 of payload u32
+//
+// The payload holds count encounters, each as the zigzag varint of its time
+// less the one before it in the chunk (the first less zero), its department
+// as 0 and a varint length and bytes, or as n for the n-th department given
+// in full earlier in the chunk, and its note as a varint length and bytes.
+// A chunk cut short by a crash, or otherwise damaged, is skipped.
+//
+// Alongside, patients.encounters/index lists every encounter's time and MRN
+// in fixed 16-byte entries, appended after the chunk is on disk. It is
+// loaded and kept sorted by time, so the encounters in a time range are
+// found by binary search. If it goes missing it is rebuilt from the patient
+// files at the next open.
+//
+// Both files are only ever appended to with O_APPEND, so several processes
+// (the window and hms-cli, say) can add visits to the same directory; each
+// picks up the others' index entries at its next range query. An encounter
+// store is not thread-safe.
+//
+// Functions returning int give 0 on success and -1 with errno set on failure.
+
+#define ENCOUNTER_DIR_SUFFIX ".encounters"
+
+typedef struct EncounterStore EncounterStore;
+typedef struct EncounterList EncounterList;
+
+typedef struct {
+    PatientId patient;
+    int64_t time;               // In patient_time_parse seconds, like PatientRecord.added
+    const char *department;     // As suggested by triage; "" if none
+    const char *note;           // Reason for the visit, kept byte for byte; "" if none
+} Encounter;
+
+// Opens the encounter history kept next to the registry at registry_path,
+// loading its index. The directory is created by the first append.
+EncounterStore* encounter_store_open(const char *registry_path);
+void encounter_store_close(EncounterStore *store);
+
+// Appends the encounters, in any order and for any patients, as one chunk
+// per patient, and syncs them and their index entries to disk. A patient of
+// PATIENT_NO_ID fails with EINVAL and nothing is written.
+int encounter_store_append(EncounterStore *store, const Encounter *encounters, size_t count);
+
+// Every visit of one patient, oldest first (an empty list if none), or NULL
+// with errno set
+EncounterList* encounter_store_history(EncounterStore *store, PatientId patient);
+// Every visit from from to to, both inclusive, oldest first, or NULL with
+// errno set. Reads the history of each patient seen in that window once.
+EncounterList* encounter_store_range(EncounterStore *store, int64_t from, int64_t to);
+// Encounters in the index
+size_t encounter_store_count(EncounterStore *store);
+
+size_t encounter_list_count(const EncounterList *list);
+// Valid until the list is freed
+const Encounter* encounter_list_get(const EncounterList *list, size_t i);
+void encounter_list_free(EncounterList *list);
+
+#endif
@@ -0,0 +1,911 @@
+#include "encounter_store.h"
+#include "patient_duplicates.h"
+#include "patient_export.h"
+#include "patient_stats.h"
+#include "patient_store.h"
+#include "symptom_triage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// --- hms-bench ---
+//
+// Repeatable benchmarks for the patient-data hot paths. A deterministic
+// generator writes a synthetic registry (the same seed always gives the
+// same file), then each benchmark runs a fixed number of timed iterations
+// against it and the results are printed as one JSON document:
+//
+//     {"rows": ..., "benchmarks": [{"name": ..., "p50_ms": ..., "p99_ms": ...,
+//      "throughput": ..., "unit": ...}, ...]}
+//
+// Throughput is items per second over all iterations together.
+
+#define DEFAULT_ROWS 10000
+#define DEFAULT_ITERATIONS 5
+#define DEFAULT_SEED 42
+#define KEYSTROKE_QUERIES 40
+#define SINGLE_EDITS 200
+#define TRIAGE_NOTES_MAX 1000000
+#define TRIAGE_SINGLE_NOTES 10000
+#define DUPLICATE_CHECKS 200
+#define ID_LOOKUPS 10000
+#define STATISTICS_REFRESHES 1000
+#define CHANGE_EDITS 1000           // Edits between two change exports
+#define RECENT_DAYS 90              // What load_recent keeps out of the archive, rounded to whole months
+#define BULK_SHARE 10               // One in this many patients is edited, then deleted, as one batch
+#define BULK_MAX 100000
+#define VISIT_PATIENTS_MAX 2000     // Patients given visits, each appended and synced as one chunk
+#define VISITS_PER_PATIENT 10
+#define LONG_HISTORY_VISITS 5000    // Of the one patient whose history visit_history reads...
+#define LONG_HISTORY_CHUNK 100      // ...recorded this many at a time
+#define HISTORY_LOADS 200
+#define RANGE_QUERIES 200
+
+// --- Deterministic Generator ---
+
+static const char *FIRST_NAMES[] = {
+    "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "William", "Elizabeth",
+    "David", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah", "Charles", "Karen",
+    "Christopher", "Nancy", "Daniel", "Lisa", "Matthew", "Betty", "Anthony", "Margaret", "Mark", "Sandra",
+    "Donald", "Ashley", "Steven", "Kimberly", "Paul", "Emily", "Andrew", "Donna", "Joshua", "Michelle",
+    "Kenneth", "Carol", "Kevin", "Amanda", "Brian", "Dorothy", "George", "Melissa", "Timothy", "Deborah",
+    "Aisha", "Mohammed", "Wei", "Priya", "Olga", "Mateo", "Sofia", "Yuki", "Kwame", "Fatima",
+};
+
+static const char *LAST_NAMES[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis", "Rodriguez", "Martinez",
+    "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin",
+    "Lee", "Perez", "Thompson", "White", "Harris", "Sanchez", "Clark", "Ramirez", "Lewis", "Robinson",
+    "Walker", "Young", "Allen", "King", "Wright", "Scott", "Torres", "Nguyen", "Hill", "Flores",
+    "Green", "Adams", "Nelson", "Baker", "Hall", "Rivera", "Campbell", "Mitchell", "Carter", "Roberts",
+    "Ivanova", "O'Brien", "Kowalski", "Chen", "Patel", "Okafor", "Schmidt", "Rossi", "Tanaka", "Haddad",
+    "Nakamura", "Dubois", "Jensen", "Novak", "Popescu", "Yilmaz", "Silva", "Khan", "Murphy", "Cohen",
+    "Svensson", "Moreau", "Fischer", "Costa", "Kim", "Singh", "Ali", "Mensah", "Alvarez", "Petrov",
+};
+
+static const char *SYMPTOM_WORDS[] = {
+    "patient", "reports", "severe", "mild", "pain", "since", "yesterday", "and", "with", "no", "fever",
+    "chest", "pressure", "heart", "racing", "skin", "rash", "itchy", "acne", "headache", "dizzy", "numbness",
+    "left", "arm", "bone", "fracture", "joint", "swelling", "child", "baby", "infant", "stomach", "acid",
+    "reflux", "digest", "nausea", "cough", "tired", "after", "fall", "at", "home", "worse", "at", "night",
+};
+
+#define COUNT_OF(array) (sizeof(array) / sizeof((array)[0]))
+
+// splitmix64: tiny, fast and identical on every platform
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static unsigned random_below(uint64_t *state, unsigned bound) {
+    return (unsigned)(next_random(state) % bound);
+}
+
+// Children, working-age adults and the elderly, weighted towards the old as in hospital intake
+static unsigned random_age(uint64_t *state) {
+    unsigned band = random_below(state, 100);
+    if (band < 12) return random_below(state, 18);
+    if (band < 62) return 18 + random_below(state, 47);
+    return 65 + random_below(state, 35);
+}
+
+static const char* random_gender(uint64_t *state) {
+    unsigned pick = random_below(state, 100);
+    return pick < 49 ? "Male" : pick < 98 ? "Female" : "Other";
+}
+
+// Admissions move forward through time, mostly in daytime hours
+static int64_t next_admission(uint64_t *state, int64_t previous, size_t rows) {
+    int64_t spread = rows < 365 * 24 ? 3600 : (int64_t)365 * 24 * 3600 * 2 / (int64_t)rows + 1;
+    int64_t at = previous + random_below(state, spread * 2);
+    int hour = (int)(at / 3600 % 24);
+    if (hour < 7) at += (7 - hour) * 3600;
+    return at;
+}
+
+static int generate_registry(const char *path, size_t rows, uint64_t seed) {
+    FILE *out = fopen(path, "w");
+    if (!out) return -1;
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    uint64_t state = seed;
+    int64_t added = patient_time_parse("2025-01-01 08:00");
+    for (size_t i = 0; i < rows; i++) {
+        char when[PATIENT_ADDED_LEN];
+        added = next_admission(&state, added, rows);
+        patient_time_format(added, when);
+        const char *first = FIRST_NAMES[random_below(&state, COUNT_OF(FIRST_NAMES))];
+        const char *last = LAST_NAMES[random_below(&state, COUNT_OF(LAST_NAMES))];
+        unsigned initial = random_below(&state, 100);
+        if (initial < 30) fprintf(out, "%s %c. %s,", first, 'A' + initial % 26, last);
+        else fprintf(out, "%s %s,", first, last);
+        fprintf(out, "%u,%s,%s,%zu\n", random_age(&state), random_gender(&state), when, i + 1);
+    }
+    bool ok = fflush(out) == 0 && !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+static int generate_notes(const char *path, size_t notes, uint64_t seed) {
+    FILE *out = fopen(path, "w");
+    if (!out) return -1;
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    uint64_t state = seed ^ 0x5EED;
+    for (size_t i = 0; i < notes; i++) {
+        unsigned words = 4 + random_below(&state, 12);
+        for (unsigned w = 0; w < words; w++) {
+            fprintf(out, w ? " %s" : "%s", SYMPTOM_WORDS[random_below(&state, COUNT_OF(SYMPTOM_WORDS))]);
+        }
+        fputc('\n', out);
+    }
+    bool ok = fflush(out) == 0 && !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+// --- Timing and Reporting ---
+
+typedef struct {
+    double *samples;        // Milliseconds
+    size_t count;
+    size_t cap;
+    double items;           // Work done over all samples, for throughput
+} Samples;
+
+typedef struct {
+    size_t rows;
+    unsigned iterations;
+    uint64_t seed;
+    const char *only;       // Comma-separated benchmark names, or NULL for all
+    bool first_result;
+} BenchConfig;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void samples_add(Samples *samples, double ms, double items) {
+    if (samples->count == samples->cap) {
+        samples->cap = samples->cap ? samples->cap * 2 : 64;
+        samples->samples = realloc(samples->samples, samples->cap * sizeof(double));
+        if (!samples->samples) {
+            perror("hms-bench");
+            exit(1);
+        }
+    }
+    samples->samples[samples->count++] = ms;
+    samples->items += items;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile
+static double percentile(const Samples *samples, double p) {
+    size_t rank = (size_t)(p / 100 * samples->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > samples->count) rank = samples->count;
+    return samples->samples[rank - 1];
+}
+
+static bool wanted(const BenchConfig *config, const char *name) {
+    if (!config->only) return true;
+    size_t len = strlen(name);
+    for (const char *p = config->only; (p = strstr(p, name)); p += len) {
+        if ((p == config->only || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) return true;
+    }
+    return false;
+}
+
+static void report(BenchConfig *config, const char *name, Samples *samples, const char *unit) {
+    if (samples->count == 0) return;
+    double total = 0;
+    for (size_t i = 0; i < samples->count; i++) total += samples->samples[i];
+    qsort(samples->samples, samples->count, sizeof(double), compare_doubles);
+    printf("%s\n    {\"name\": \"%s\", \"samples\": %zu, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"min_ms\": %.4f, "
+           "\"max_ms\": %.4f, \"throughput\": %.1f, \"unit\": \"%s\"}",
+           config->first_result ? "" : ",", name, samples->count, percentile(samples, 50), percentile(samples, 99),
+           samples->samples[0], samples->samples[samples->count - 1],
+           total > 0 ? samples->items / (total / 1e3) : 0.0, unit);
+    config->first_result = false;
+    fflush(stdout);
+    free(samples->samples);
+    *samples = (Samples){0};
+}
+
+static PatientStore* open_or_die(const char *path, PatientLoadStats *stats) {
+    PatientStore *store = patient_store_open(path, stats);
+    if (!store) {
+        fprintf(stderr, "hms-bench: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return store;
+}
+
+// Removes the encounter directory next to path and the patient files in it
+static void remove_encounters(const char *path) {
+    char dir[4096], file[4096 + 256];
+    snprintf(dir, sizeof(dir), "%.*s" ENCOUNTER_DIR_SUFFIX, (int)(strrchr(path, '.') - path), path);
+    DIR *top = opendir(dir);
+    for (struct dirent *fan; top && (fan = readdir(top));) {
+        if (fan->d_name[0] == '.') continue;
+        snprintf(file, sizeof(file), "%s/%s", dir, fan->d_name);
+        DIR *sub = opendir(file);
+        for (struct dirent *entry; sub && (entry = readdir(sub));) {
+            if (entry->d_name[0] == '.') continue;
+            char patient[sizeof(file) + 256];
+            snprintf(patient, sizeof(patient), "%s/%s", file, entry->d_name);
+            unlink(patient);
+        }
+        if (sub) closedir(sub);
+        if (rmdir(file) != 0) unlink(file);
+    }
+    if (top) closedir(top);
+    rmdir(dir);
+}
+
+// --- Benchmarks ---
+
+static void bench_load(BenchConfig *config, const char *name, const char *path) {
+    if (!wanted(config, name)) return;
+    Samples samples = {0};
+    for (unsigned i = 0; i < config->iterations; i++) {
+        double started = now_ms();
+        PatientStore *store = open_or_die(path, NULL);
+        double elapsed = now_ms() - started;
+        samples_add(&samples, elapsed, patient_store_count(store));
+        patient_store_close(store);
+    }
+    report(config, name, &samples, "rows/s");
+}
+
+// A full snapshot rewrite, and single durable edits (what a save costs now)
+static void bench_save(BenchConfig *config, PatientStore *store) {
+    Samples samples = {0};
+    if (wanted(config, "compact")) {
+        for (unsigned i = 0; i < config->iterations; i++) {
+            double started = now_ms();
+            if (patient_store_compact(store) != 0) perror("hms-bench: compact");
+            samples_add(&samples, now_ms() - started, patient_store_count(store));
+        }
+        report(config, "compact", &samples, "rows/s");
+    }
+    if (wanted(config, "save_edit") && patient_store_count(store) > 0) {
+        uint64_t state = config->seed;
+        for (unsigned i = 0; i < SINGLE_EDITS; i++) {
+            PatientRecord record;
+            patient_store_get(store, random_below(&state, patient_store_count(store)), &record);
+            double started = now_ms();
+            patient_store_update(store, record.handle, record.name, (record.age + 1) % 100, record.gender);
+            if (patient_store_sync(store) != 0) perror("hms-bench: sync");
+            samples_add(&samples, now_ms() - started, 1);
+        }
+        report(config, "save_edit", &samples, "edits/s");
+    }
+}
+
+// Types names from the registry one character at a time, as a user would
+// in the search box, and times the match behind every keystroke
+static void bench_filter(BenchConfig *config, const char *name, PatientStore *store) {
+    if (!wanted(config, name) || patient_store_count(store) == 0) return;
+    Samples samples = {0};
+    uint64_t state = config->seed ^ 0xF1;
+    for (unsigned q = 0; q < KEYSTROKE_QUERIES; q++) {
+        PatientRecord record;
+        patient_store_get(store, random_below(&state, patient_store_count(store)), &record);
+        size_t len = strlen(record.name);
+        if (len > 12) len = 12;
+        char query[16];
+        for (size_t typed = 1; typed <= len; typed++) {
+            memcpy(query, record.name, typed);
+            query[typed] = '\0';
+            PatientHandle *handles = NULL;
+            double started = now_ms();
+            long matches = patient_store_match(store, query, &handles);
+            samples_add(&samples, now_ms() - started, 1);
+            free(handles);
+            if (matches < 0) perror("hms-bench: match");
+        }
+    }
+    report(config, name, &samples, "keystrokes/s");
+}
+
+// Structured search-box queries, from one broad term to several narrow ones
+static void bench_query(BenchConfig *config, PatientStore *store) {
+    static const char *const QUERIES[] = {
+        "age:60..80", "gender:F age:>=65", "added:2025-03-01..2025-03-31 gender:M",
+        "sha age:60..80 gender:F added:>2025-02-01", "an age:20..40", "age:90.. added:<2025-06-01 gender:O",
+    };
+    if (!wanted(config, "query")) return;
+    // The range terms read the sorted orders, which a saved snapshot brings along
+    patient_store_order(store, PATIENT_SORT_AGE);
+    patient_store_order(store, PATIENT_SORT_ADDED);
+    Samples samples = {0};
+    for (unsigned i = 0; i < config->iterations; i++) {
+        for (size_t q = 0; q < COUNT_OF(QUERIES); q++) {
+            PatientQuery query;
+            char error[128];
+            if (patient_query_parse(QUERIES[q], patient_time_now(), &query, error, sizeof(error)) != 0) {
+                fprintf(stderr, "hms-bench: %s: %s\n", QUERIES[q], error);
+                continue;
+            }
+            PatientHandle *handles = NULL;
+            double started = now_ms();
+            long matches = patient_store_query(store, &query, &handles);
+            samples_add(&samples, now_ms() - started, 1);
+            if (matches < 0) perror("hms-bench: query");
+            free(handles);
+            patient_query_clear(&query);
+        }
+    }
+    report(config, "query", &samples, "queries/s");
+}
+
+// Patients looked up by MRN, as a clerk would type #12345, including some
+// MRNs that no patient holds
+static void bench_lookup(BenchConfig *config, PatientStore *store) {
+    if (!wanted(config, "lookup_id") || patient_store_count(store) == 0) return;
+    Samples samples = {0};
+    uint64_t state = config->seed ^ 0x1D;
+    unsigned span = patient_store_count(store) + patient_store_count(store) / 8;
+    for (unsigned i = 0; i < ID_LOOKUPS; i++) {
+        PatientId id = 1 + random_below(&state, span);
+        double started = now_ms();
+        long row = patient_store_find(store, patient_store_find_id(store, id));
+        samples_add(&samples, now_ms() - started, 1);
+        if (row >= 0) {
+            PatientRecord record;
+            patient_store_get(store, row, &record);
+            if (record.id != id) fprintf(stderr, "hms-bench: MRN %u found patient %u\n", id, record.id);
+        }
+    }
+    report(config, "lookup_id", &samples, "lookups/s");
+}
+
+// The whole-registry scan, and the check the window runs before each add,
+// for names from the registry with two letters swapped as a typist would
+static void bench_duplicates(BenchConfig *config, PatientStore *store) {
+    Samples samples = {0};
+    if (wanted(config, "duplicate_scan")) {
+        for (unsigned i = 0; i < config->iterations; i++) {
+            PatientDuplicate *pairs = NULL;
+            double started = now_ms();
+            PatientSnapshot *snapshot = patient_store_snapshot(store);
+            if (!snapshot || patient_duplicates_scan(snapshot, NULL, &pairs, NULL) < 0) perror("hms-bench: duplicates");
+            samples_add(&samples, now_ms() - started, patient_store_count(store));
+            patient_snapshot_free(snapshot);
+            free(pairs);
+        }
+        report(config, "duplicate_scan", &samples, "rows/s");
+    }
+    if (wanted(config, "duplicate_check") && patient_store_count(store) > 0) {
+        patient_store_order(store, PATIENT_SORT_AGE);
+        uint64_t state = config->seed ^ 0xD0;
+        for (unsigned i = 0; i < DUPLICATE_CHECKS; i++) {
+            PatientRecord record;
+            patient_store_get(store, random_below(&state, patient_store_count(store)), &record);
+            char name[128];
+            snprintf(name, sizeof(name), "%s", record.name);
+            size_t len = strlen(name);
+            if (len > 2) {
+                size_t at = 1 + random_below(&state, len - 2);
+                char swapped = name[at];
+                name[at] = name[at + 1];
+                name[at + 1] = swapped;
+            }
+            PatientDuplicate *pairs = NULL;
+            double started = now_ms();
+            if (patient_duplicates_check(store, name, record.age, record.gender, &pairs) < 0) {
+                perror("hms-bench: duplicates");
+            }
+            samples_add(&samples, now_ms() - started, 1);
+            free(pairs);
+        }
+        report(config, "duplicate_check", &samples, "checks/s");
+    }
+}
+
+// The count at load, and what a dashboard reads on each refresh afterwards
+static void bench_statistics(BenchConfig *config, PatientStore *store) {
+    Samples samples = {0};
+    if (wanted(config, "statistics_build")) {
+        for (unsigned i = 0; i < config->iterations; i++) {
+            double started = now_ms();
+            PatientSnapshot *snapshot = patient_store_snapshot(store);
+            PatientStats *stats = snapshot ? patient_stats_build(snapshot) : NULL;
+            samples_add(&samples, now_ms() - started, patient_store_count(store));
+            if (!stats) perror("hms-bench: statistics");
+            patient_stats_free(stats);
+            patient_snapshot_free(snapshot);
+        }
+        report(config, "statistics_build", &samples, "rows/s");
+    }
+    if (wanted(config, "statistics_refresh") && patient_store_track_stats(store) == 0) {
+        const PatientStats *stats = patient_store_stats(store);
+        for (unsigned i = 0; i < STATISTICS_REFRESHES; i++) {
+            PatientGenderCount genders[PATIENT_STATS_GENDERS + 1];
+            size_t ages[PATIENT_STATS_AGES], hours[24], days[14];
+            int64_t first, last;
+            double started = now_ms();
+            patient_stats_genders(stats, genders);
+            patient_stats_ages(stats, ages);
+            patient_stats_hours_of_day(stats, hours);
+            if (patient_stats_range(stats, &first, &last) == 0) {
+                patient_stats_admissions(stats, PATIENT_STATS_DAILY, last - 13 * 86400, 14, days);
+            }
+            samples_add(&samples, now_ms() - started, 1);
+        }
+        report(config, "statistics_refresh", &samples, "refreshes/s");
+    }
+}
+
+// Archives all but the last months on record, then times opening just the
+// recent ones, and loading the whole archive on top of them
+static void bench_archive(BenchConfig *config, const char *path) {
+    if (!wanted(config, "load_recent") && !wanted(config, "load_archive")) return;
+    PatientStore *store = open_or_die(path, NULL);
+    const PatientHandle *order = patient_store_order(store, PATIENT_SORT_ADDED);
+    long moved = -1;
+    if (order && patient_store_count(store) > 0) {
+        PatientRecord latest;
+        patient_store_get(store, patient_store_find(store, order[patient_store_count(store) - 1]), &latest);
+        moved = patient_store_archive(store, latest.added - (int64_t)RECENT_DAYS * 86400);
+    }
+    patient_store_close(store);
+    if (moved < 0) {
+        perror("hms-bench: archive");
+        return;
+    }
+    Samples recent = {0}, archive = {0};
+    for (unsigned i = 0; i < config->iterations; i++) {
+        double started = now_ms();
+        store = open_or_die(path, NULL);
+        double opened = now_ms();
+        size_t rows = patient_store_count(store);
+        long loaded = patient_store_load_archive(store, INT64_MIN, INT64_MAX, NULL);
+        if (loaded < 0) perror("hms-bench: load archive");
+        if (wanted(config, "load_recent")) samples_add(&recent, opened - started, rows);
+        if (wanted(config, "load_archive")) samples_add(&archive, now_ms() - opened, loaded > 0 ? loaded : 0);
+        patient_store_close(store);
+    }
+    report(config, "load_recent", &recent, "rows/s");
+    report(config, "load_archive", &archive, "rows/s");
+}
+
+static void bench_sort(BenchConfig *config, PatientStore *store) {
+    static const struct {
+        const char *name;
+        PatientSortKey key;
+    } keys[] = {
+        { "sort_name", PATIENT_SORT_NAME }, { "sort_age", PATIENT_SORT_AGE },
+        { "sort_gender", PATIENT_SORT_GENDER }, { "sort_added", PATIENT_SORT_ADDED },
+    };
+    size_t count = patient_store_count(store);
+    PatientHandle *handles = malloc((count ? count : 1) * sizeof(PatientHandle));
+    if (!handles) return;
+    for (size_t k = 0; k < COUNT_OF(keys); k++) {
+        if (!wanted(config, keys[k].name)) continue;
+        Samples samples = {0};
+        for (unsigned i = 0; i < config->iterations; i++) {
+            // Start from store order each time, as a fresh view would
+            for (size_t row = 0; row < count; row++) {
+                PatientRecord record;
+                patient_store_get(store, row, &record);
+                handles[row] = record.handle;
+            }
+            double started = now_ms();
+            if (patient_store_sort(store, keys[k].key, handles, count) != 0) perror("hms-bench: sort");
+            samples_add(&samples, now_ms() - started, count);
+        }
+        report(config, keys[k].name, &samples, "rows/s");
+    }
+    free(handles);
+}
+
+// Switching a view to a column the store keeps an order of; the first call
+// sorts unless the order came with the snapshot
+static void bench_order(BenchConfig *config, PatientStore *store) {
+    static const struct {
+        const char *name;
+        PatientSortKey key;
+    } keys[] = {
+        { "order_name", PATIENT_SORT_NAME }, { "order_age", PATIENT_SORT_AGE }, { "order_added", PATIENT_SORT_ADDED },
+    };
+    for (size_t k = 0; k < COUNT_OF(keys); k++) {
+        if (!wanted(config, keys[k].name)) continue;
+        Samples samples = {0};
+        for (unsigned i = 0; i < config->iterations; i++) {
+            double started = now_ms();
+            if (!patient_store_order(store, keys[k].key)) perror("hms-bench: order");
+            samples_add(&samples, now_ms() - started, patient_store_count(store));
+        }
+        report(config, keys[k].name, &samples, "rows/s");
+    }
+}
+
+static void bench_export(BenchConfig *config, const char *name, PatientStore *store, const char *path, bool gzip) {
+    if (!wanted(config, name)) return;
+    Samples samples = {0};
+    PatientExportOptions options = { .gzip = gzip };
+    for (unsigned i = 0; i < config->iterations; i++) {
+        double started = now_ms();
+        PatientSnapshot *snapshot = patient_store_snapshot(store);
+        if (!snapshot || patient_export_csv(snapshot, path, &options) != 0) perror("hms-bench: export");
+        samples_add(&samples, now_ms() - started, patient_store_count(store));
+        patient_snapshot_free(snapshot);
+    }
+    unlink(path);
+    report(config, name, &samples, "rows/s");
+}
+
+// What the store holds per patient, with whatever orders and index the
+// benchmarks before it built
+static void bench_memory(BenchConfig *config, PatientStore *store) {
+    if (!wanted(config, "memory") || patient_store_count(store) == 0) return;
+    PatientMemory memory;
+    patient_store_memory(store, &memory);
+    double records = memory.records;
+    printf("%s\n    {\"name\": \"memory\", \"records\": %zu, \"bytes_per_patient\": %.1f, \"columns\": %.1f, "
+           "\"strings\": %.1f, \"orders\": %.1f, \"name_index\": %.1f, \"unit\": \"bytes/patient\"}",
+           config->first_result ? "" : ",", memory.records, memory.total / records, memory.columns / records,
+           memory.strings / records, memory.orders / records, memory.name_index / records);
+    config->first_result = false;
+    fflush(stdout);
+}
+
+// A change export after every CHANGE_EDITS edits, to set against export_csv;
+// the first export, which starts over, isn't timed
+static void bench_changes(BenchConfig *config, PatientStore *store, const char *path, const char *watermark_path) {
+    if (!wanted(config, "export_changes") || patient_store_count(store) == 0) return;
+    Samples samples = {0};
+    PatientExportOptions options = {0};
+    uint64_t state = config->seed ^ 0xC4;
+    for (unsigned i = 0; i <= config->iterations; i++) {
+        double started = now_ms();
+        PatientChanges *changes = patient_store_changes(store, patient_export_watermark(path));
+        if (!changes || patient_export_changes(changes, path, &options) != 0) perror("hms-bench: export changes");
+        if (i > 0) samples_add(&samples, now_ms() - started, changes ? patient_changes_count(changes) : 0);
+        patient_changes_free(changes);
+        for (unsigned e = 0; e < CHANGE_EDITS; e++) {
+            PatientRecord record;
+            patient_store_get(store, random_below(&state, patient_store_count(store)), &record);
+            patient_store_update(store, record.handle, record.name, (record.age + 1) % 100, record.gender);
+        }
+    }
+    unlink(watermark_path);
+    unlink(path);
+    report(config, "export_changes", &samples, "changes/s");
+}
+
+// Edits, then deletes, a selection of the registry as one batch each, as the
+// window does, on a copy with its sort orders and name index in place
+static void bench_bulk(BenchConfig *config, PatientStore *store, const char *path, const char *journal_path) {
+    if (!wanted(config, "update_batch") && !wanted(config, "delete_batch")) return;
+    size_t count = patient_store_count(store) / BULK_SHARE;
+    if (count > BULK_MAX) count = BULK_MAX;
+    if (count == 0) return;
+    Samples updates = {0}, deletes = {0};
+    PatientRecord *records = malloc(count * sizeof *records);
+    PatientHandle *handles = malloc(count * sizeof *handles);
+    if (!records || !handles) {
+        perror("hms-bench: bulk");
+        free(records);
+        free(handles);
+        return;
+    }
+    uint64_t state = config->seed ^ 0xB7;
+    for (unsigned i = 0; i < config->iterations; i++) {
+        unlink(journal_path);
+        if (patient_store_write_snapshot(store, path, PATIENT_FORMAT_TEXT) != 0) {
+            perror("hms-bench: bulk snapshot");
+            break;
+        }
+        PatientStore *copy = open_or_die(path, NULL);
+        for (int key = 0; key <= PATIENT_SORT_ADDED; key++) patient_store_order(copy, key);
+        patient_store_index_names(copy);
+        // Every BULK_SHARE-th row from a random start: distinct and spread out
+        size_t start = random_below(&state, BULK_SHARE);
+        for (size_t j = 0; j < count; j++) {
+            patient_store_get(copy, start + j * BULK_SHARE, &records[j]);
+            records[j].age = (records[j].age + 1) % 100;
+            handles[j] = records[j].handle;
+        }
+        double started = now_ms();
+        if (patient_store_update_batch(copy, records, count) != 0 || patient_store_sync(copy) != 0) {
+            perror("hms-bench: update batch");
+        }
+        double updated = now_ms();
+        if (patient_store_delete_batch(copy, handles, count) != 0 || patient_store_sync(copy) != 0) {
+            perror("hms-bench: delete batch");
+        }
+        samples_add(&updates, updated - started, count);
+        samples_add(&deletes, now_ms() - updated, count);
+        patient_store_close(copy);
+    }
+    unlink(journal_path);
+    free(records);
+    free(handles);
+    if (wanted(config, "update_batch")) report(config, "update_batch", &updates, "rows/s");
+    if (wanted(config, "delete_batch")) report(config, "delete_batch", &deletes, "rows/s");
+}
+
+// Gives a share of the registry a few visits each and one patient thousands,
+// then times reading that long history and finding the visits of a week
+static void bench_encounters(BenchConfig *config, PatientStore *store, const char *path) {
+    if (!wanted(config, "visit_history") && !wanted(config, "visit_range")) return;
+    size_t patients = patient_store_count(store) < VISIT_PATIENTS_MAX ? patient_store_count(store) : VISIT_PATIENTS_MAX;
+    EncounterStore *encounters = patients ? encounter_store_open(path) : NULL;
+    TriageEngine *engine = encounters ? triage_engine_new_default() : NULL;
+    if (!engine) {
+        if (patients) perror("hms-bench: encounters");
+        encounter_store_close(encounters);
+        return;
+    }
+    uint64_t state = config->seed ^ 0xE7;
+    Encounter visits[LONG_HISTORY_CHUNK];
+    char notes[LONG_HISTORY_CHUNK][128];
+    int64_t first = INT64_MAX, last = INT64_MIN;
+    PatientId long_history = PATIENT_NO_ID;
+    for (size_t p = 0; p < patients; p++) {
+        PatientRecord record;
+        patient_store_get(store, p, &record);
+        if (p == 0) long_history = record.id;
+        size_t total = p == 0 ? LONG_HISTORY_VISITS : VISITS_PER_PATIENT;
+        int64_t at = record.added;
+        for (size_t done = 0; done < total;) {
+            size_t n = 0;
+            for (; n < LONG_HISTORY_CHUNK && done < total; n++, done++) {
+                size_t len = 0;
+                for (unsigned w = 0; w < 4; w++) {
+                    len += snprintf(notes[n] + len, sizeof(notes[n]) - len, w ? " %s" : "%s",
+                                    SYMPTOM_WORDS[random_below(&state, COUNT_OF(SYMPTOM_WORDS))]);
+                }
+                at += 3600 + random_below(&state, p == 0 ? 86400 : 30 * 86400);
+                visits[n] = (Encounter){ record.id, at, triage_suggest(engine, notes[n], NULL), notes[n] };
+                // Windows are picked where the ordinary patients' visits fall
+                if (p > 0 && at < first) first = at;
+                if (p > 0 && at > last) last = at;
+            }
+            if (encounter_store_append(encounters, visits, n) != 0) {
+                perror("hms-bench: record visits");
+                patients = 0;
+                break;
+            }
+        }
+    }
+    if (wanted(config, "visit_history") && patients > 0) {
+        Samples samples = {0};
+        for (unsigned i = 0; i < HISTORY_LOADS; i++) {
+            double started = now_ms();
+            EncounterList *history = encounter_store_history(encounters, long_history);
+            samples_add(&samples, now_ms() - started, history ? encounter_list_count(history) : 0);
+            if (!history) perror("hms-bench: history");
+            encounter_list_free(history);
+        }
+        report(config, "visit_history", &samples, "visits/s");
+    }
+    if (wanted(config, "visit_range") && patients > 0) {
+        Samples samples = {0};
+        for (unsigned i = 0; i < RANGE_QUERIES; i++) {
+            int64_t from = first + (int64_t)random_below(&state, (unsigned)((last - first) / 86400 + 1)) * 86400;
+            double started = now_ms();
+            EncounterList *range = encounter_store_range(encounters, from, from + 7 * 86400 - 1);
+            samples_add(&samples, now_ms() - started, range ? encounter_list_count(range) : 0);
+            if (!range) perror("hms-bench: range");
+            encounter_list_free(range);
+        }
+        report(config, "visit_range", &samples, "visits/s");
+    }
+    triage_engine_free(engine);
+    encounter_store_close(encounters);
+    remove_encounters(path);
+}
+
+static void bench_triage(BenchConfig *config, const char *notes_path, const char *notes_out) {
+    TriageEngine *engine = triage_engine_new_default();
+    if (!engine) return;
+    Samples samples = {0};
+    if (wanted(config, "triage_note")) {
+        uint64_t state = config->seed ^ 0x7A;
+        for (unsigned i = 0; i < TRIAGE_SINGLE_NOTES; i++) {
+            char note[256];
+            size_t len = 0;
+            for (unsigned w = 0, words = 4 + random_below(&state, 12); w < words; w++) {
+                len += snprintf(note + len, sizeof(note) - len, "%s ", SYMPTOM_WORDS[random_below(&state, COUNT_OF(SYMPTOM_WORDS))]);
+            }
+            TriageResult result;
+            double started = now_ms();
+            triage_classify(engine, note, len, &result);
+            samples_add(&samples, now_ms() - started, 1);
+        }
+        report(config, "triage_note", &samples, "notes/s");
+    }
+    if (wanted(config, "triage_batch")) {
+        for (unsigned i = 0; i < config->iterations; i++) {
+            FILE *out = fopen(notes_out, "w");
+            TriageBatchStats stats = {0};
+            double started = now_ms();
+            if (!out || triage_batch_file(engine, notes_path, out, &stats) != 0) perror("hms-bench: triage");
+            if (out) fclose(out);
+            samples_add(&samples, now_ms() - started, stats.notes);
+        }
+        unlink(notes_out);
+        report(config, "triage_batch", &samples, "notes/s");
+    }
+    triage_engine_free(engine);
+}
+
+// --- Main ---
+
+static void print_usage(FILE *out) {
+    fprintf(out,
+            "usage: hms-bench [-n ROWS] [-i ITERATIONS] [-s SEED] [-d DIR] [-b NAME,...]\n"
+            "       hms-bench generate ROWS FILE [SEED]\n"
+            "\n"
+            "Generates a synthetic registry of ROWS patients (default %d) in DIR (default a\n"
+            "fresh directory under /tmp, removed afterwards) and prints JSON timings for:\n"
+            "  load_text load_binary compact save_edit filter_index filter_scan\n"
+            "  sort_name sort_age sort_gender sort_added order_name order_age order_added\n"
+            "  query lookup_id duplicate_scan duplicate_check statistics_build statistics_refresh\n"
+            "  export_csv export_csv_gz export_changes update_batch delete_batch memory\n"
+            "  visit_history visit_range load_recent load_archive\n"
+            "  triage_note triage_batch\n"
+            "-b runs only the named benchmarks. The same seed always yields the same data.\n",
+            DEFAULT_ROWS);
+}
+
+static char* join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+        perror("hms-bench");
+        exit(1);
+    }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = { DEFAULT_ROWS, DEFAULT_ITERATIONS, DEFAULT_SEED, NULL, true };
+    if (argc >= 4 && strcmp(argv[1], "generate") == 0) {
+        uint64_t seed = argc > 4 ? strtoull(argv[4], NULL, 10) : DEFAULT_SEED;
+        if (generate_registry(argv[3], strtoull(argv[2], NULL, 10), seed) != 0) {
+            fprintf(stderr, "hms-bench: %s: %s\n", argv[3], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    const char *dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:s:d:b:h")) != -1) {
+        switch (opt) {
+        case 'n': config.rows = strtoull(optarg, NULL, 10); break;
+        case 'i': config.iterations = strtoul(optarg, NULL, 10); break;
+        case 's': config.seed = strtoull(optarg, NULL, 10); break;
+        case 'd': dir = optarg; break;
+        case 'b': config.only = optarg; break;
+        case 'h': print_usage(stdout); return 0;
+        default: print_usage(stderr); return 2;
+        }
+    }
+    if (config.iterations == 0) config.iterations = 1;
+    char temp_dir[] = "/tmp/hms-bench-XXXXXX";
+    bool own_dir = dir == NULL;
+    if (own_dir && !(dir = mkdtemp(temp_dir))) {
+        perror("hms-bench: mkdtemp");
+        return 1;
+    }
+
+    char *text_path = join_path(dir, "patients.txt");
+    char *binary_path = join_path(dir, "patients.hms");
+    char *export_path = join_path(dir, "export.csv");
+    char *export_gz_path = join_path(dir, "export.csv.gz");
+    char *changes_path = join_path(dir, "changes.csv");
+    char *watermark_path = join_path(dir, "changes.csv" PATIENT_WATERMARK_SUFFIX);
+    char *history_path = join_path(dir, "patients.changes");
+    char *notes_path = join_path(dir, "notes.txt");
+    char *notes_out = join_path(dir, "notes.tsv");
+    char *journal_path = join_path(dir, "patients.journal");
+    char *order_path = join_path(dir, "patients.hms.order");
+    char *text_order_path = join_path(dir, "patients.txt.order");
+    char *archive_path = join_path(dir, "patients.archive");
+    char *bulk_path = join_path(dir, "bulk.txt");
+    char *bulk_order_path = join_path(dir, "bulk.txt.order");
+    char *bulk_history_path = join_path(dir, "bulk.changes");
+    char *bulk_journal_path = join_path(dir, "bulk.journal");
+    char *visits_path = join_path(dir, "visits.txt");
+    size_t notes = config.rows < TRIAGE_NOTES_MAX ? config.rows : TRIAGE_NOTES_MAX;
+
+    double started = now_ms();
+    if (generate_registry(text_path, config.rows, config.seed) != 0 || generate_notes(notes_path, notes, config.seed) != 0) {
+        fprintf(stderr, "hms-bench: could not generate data in %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    double generated = now_ms() - started;
+    printf("{\n  \"rows\": %zu,\n  \"notes\": %zu,\n  \"iterations\": %u,\n  \"seed\": %llu,\n  \"cpus\": %ld,\n"
+           "  \"generate_ms\": %.1f,\n  \"benchmarks\": [",
+           config.rows, notes, config.iterations, (unsigned long long)config.seed, sysconf(_SC_NPROCESSORS_ONLN),
+           generated);
+
+    bench_load(&config, "load_text", text_path);
+    PatientStore *store = open_or_die(text_path, NULL);
+    bool have_binary = patient_store_write_snapshot(store, binary_path, PATIENT_FORMAT_BINARY) == 0;
+    patient_store_close(store);
+    if (have_binary) {
+        bench_load(&config, "load_binary", binary_path);
+        // The binary snapshot was written with its sort orders alongside
+        store = open_or_die(binary_path, NULL);
+        bench_order(&config, store);
+        patient_store_close(store);
+    }
+
+    store = open_or_die(text_path, NULL);
+    bench_sort(&config, store);
+    bench_filter(&config, "filter_scan", store);
+    if (patient_store_index_names(store) == 0) bench_filter(&config, "filter_index", store);
+    bench_query(&config, store);
+    bench_lookup(&config, store);
+    bench_encounters(&config, store, visits_path);
+    bench_memory(&config, store);
+    bench_duplicates(&config, store);
+    bench_statistics(&config, store);
+    bench_export(&config, "export_csv", store, export_path, false);
+    bench_export(&config, "export_csv_gz", store, export_gz_path, true);
+    bench_save(&config, store);
+    bench_changes(&config, store, changes_path, watermark_path);
+    bench_bulk(&config, store, bulk_path, bulk_journal_path);
+    patient_store_close(store);
+    // Last, as it leaves only the recent months in the text snapshot
+    bench_archive(&config, text_path);
+    bench_triage(&config, notes_path, notes_out);
+    printf("\n  ]\n}\n");
+
+    if (own_dir) {
+        const char *files[] = { text_path, binary_path, notes_path, journal_path, order_path, text_order_path,
+                                history_path, bulk_path, bulk_order_path, bulk_history_path };
+        for (size_t i = 0; i < COUNT_OF(files); i++) unlink(files[i]);
+        DIR *archive = opendir(archive_path);
+        for (struct dirent *entry; archive && (entry = readdir(archive));) {
+            if (entry->d_name[0] == '.') continue;
+            char *part = join_path(archive_path, entry->d_name);
+            unlink(part);
+            free(part);
+        }
+        if (archive) closedir(archive);
+        rmdir(archive_path);
+        rmdir(dir);
+    }
+    free(text_path);
+    free(binary_path);
+    free(export_path);
+    free(export_gz_path);
+    free(changes_path);
+    free(watermark_path);
+    free(history_path);
+    free(notes_path);
+    free(notes_out);
+    free(journal_path);
+    free(order_path);
+    free(text_order_path);
+    free(archive_path);
+    free(bulk_path);
+    free(bulk_order_path);
+    free(bulk_history_path);
+    free(bulk_journal_path);
+    free(visits_path);
+    return 0;
+}
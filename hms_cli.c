@@ -0,0 +1,894 @@
+#include "encounter_store.h"
+#include "latency_stats.h"
+#include "patient_duplicates.h"
+#include "patient_export.h"
+#include "patient_import.h"
+#include "patient_stats.h"
+#include "patient_store.h"
+#include "registry_client.h"
+#include "registry_server.h"
+#include "symptom_triage.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// --- hms-cli ---
+//
+// Headless front end to the patient store for scripts and servers. Each
+// invocation loads the registry once, runs one command (or a whole batch of
+// them) and flushes the journal on exit. With -s it works against a
+// registry daemon instead, which serve starts.
+
+#define DEFAULT_PATIENTS_FILE "patients.txt"
+#define MAX_ARGS 8
+#define PIPELINE_DEPTH 256      // Batch requests in flight to the daemon at once
+#define SUMMARY_DAYS 14         // Days of admissions summary prints, up to the latest
+#define ARCHIVE_MONTHS 3        // Months archive keeps in the snapshot, this one included
+#define ARCHIVE_MAX_MONTHS 1200 // A century; anything longer is a typo
+#define TRIAGE_RULES_FILE "triage_rules.txt"    // What visit suggests departments by, if present, as the window does
+
+static void print_usage(FILE *out) {
+    fprintf(out,
+            "usage: hms-cli [-f FILE | -s SOCKET] [-L STATS] COMMAND [ARGS...]\n"
+            "\n"
+            "Commands:\n"
+            "  list                          print every patient as ROW<TAB>name,age,gender,added,MRN\n"
+            "  count                         print the number of patients\n"
+            "  search QUERY...               list matching patients, e.g. sha age:60..80 gender:F added:7d,\n"
+            "                                or #12345 for the patient with that MRN\n"
+            "  add NAME AGE GENDER [ADDED]   add a patient (ADDED is \"YYYY-MM-DD HH:MM\", default now)\n"
+            "  update ROW NAME AGE GENDER    change the patient at ROW\n"
+            "  delete ROW...                 delete the patients at each ROW, as one change\n"
+            "  visit ROW REASON...           record a visit of the patient at ROW now, in the department\n"
+            "                                triage suggests for REASON, and print that department\n"
+            "  visits ROW                    print the patient's visits, oldest first, as\n"
+            "                                added<TAB>department<TAB>reason\n"
+            "  encounters WHEN               print every visit in WHEN, a window as in added:, e.g. 7d or\n"
+            "                                2026-10-01..2026-10-07, as added<TAB>MRN<TAB>department<TAB>reason\n"
+            "  export FILE                   write all patients as CSV (gzipped if FILE ends in .gz)\n"
+            "  changes FILE                  write the patients added, changed and deleted since the last\n"
+            "                                changes to FILE, as CSV or, for FILE.jsonl, JSON Lines\n"
+            "  import FILE [COLUMNS]         add every new, valid patient from a CSV file (or .gz) at\n"
+            "                                once; COLUMNS maps fields, e.g. name=Patient,age=3,gender=Sex\n"
+            "  duplicates [NAME AGE GENDER]  list pairs of patients that are probably the same person,\n"
+            "                                as ROW<TAB>ROW<TAB>edits<TAB>both records, or those a\n"
+            "                                new patient would duplicate\n"
+            "  summary                       print patients by gender, age band and hour of admission,\n"
+            "                                and admissions per day for the last 14 days on record\n"
+            "  compact                       fold the journal into the snapshot now\n"
+            "  archive [MONTHS]              move admissions older than the last MONTHS months (default 3)\n"
+            "                                out of the snapshot into the compressed, read-only archive\n"
+            "  convert text|binary OUT       write all patients to OUT in the given format\n"
+            "  stats                         print load statistics and the memory taken per patient\n"
+            "  batch [SCRIPT]                run one command per line from SCRIPT or stdin\n"
+            "  serve [SOCKET]                share FILE with other clients through a daemon listening\n"
+            "                                on SOCKET (default " REGISTRY_SOCKET ") until interrupted\n"
+            "  triage NOTES [RULES]          suggest a department for each line of NOTES, using\n"
+            "                                the keyword table RULES or the built-in one\n"
+            "\n"
+            "ROW is the row number printed by list at that point; deleting a patient\n"
+            "moves the last row into its place. ROW may also be #MRN, the medical record number\n"
+            "list prints last, which stays with the patient for good and is never given out again.\n"
+            "FILE defaults to " DEFAULT_PATIENTS_FILE " and may be in either format; a converted file\n"
+            "can replace it and keeps using the same journal.\n"
+            "Archived patients are loaded for every command but add, changes, compact, archive, convert\n"
+            "and stats, and can't be updated or deleted.\n"
+            "changes records where it got to in FILE.watermark. It starts over with a reset line and\n"
+            "every patient when there is no watermark or the changes since are no longer kept.\n"
+            "In batch scripts, quote arguments containing spaces with \"double quotes\"; a word that\n"
+            "starts with # begins a comment, unless it is an MRN.\n"
+            "-s sends list, count, search, add, update, delete, export, changes, import, duplicates,\n"
+            "summary and batch to the daemon on SOCKET; ROW is then the ID that list prints, which no\n"
+            "other change moves, and export and changes write the file on the daemon's side. A batch\n"
+            "is pipelined.\n"
+            "-L writes latency statistics for every operation as JSON to STATS (- for stderr) on exit.\n");
+}
+
+static const char *latency_path;
+static const char *registry_path = DEFAULT_PATIENTS_FILE;   // -f; visits are kept next to it
+
+static void dump_latency(void) {
+    int result = strcmp(latency_path, "-") == 0 ? latency_write_json(stderr) : latency_dump_json(latency_path);
+    if (result != 0) fprintf(stderr, "hms-cli: %s: %s\n", latency_path, strerror(errno));
+}
+
+static void print_record(const PatientRecord *record, size_t row, void *user_data) {
+    char added[PATIENT_ADDED_LEN];
+    patient_time_format(record->added, added);
+    printf("%zu\t%s,%u,%s,%s,%u\n", row, record->name, record->age, record->gender, added, record->id);
+}
+
+// Reads "#12345" as an MRN; false if text isn't one
+static bool parse_mrn(const char *text, PatientId *id) {
+    if (text[0] != '#') return false;
+    char *end;
+    unsigned long value = strtoul(text + 1, &end, 10);
+    if (text[1] == '\0' || *end != '\0' || value == PATIENT_NO_ID || value > UINT32_MAX) return false;
+    *id = value;
+    return true;
+}
+
+// Joins words with single spaces; free() the result
+static char* join_words(int n, char **words) {
+    size_t len = 1;
+    for (int i = 0; i < n; i++) len += strlen(words[i]) + 1;
+    char *text = malloc(len);
+    if (!text) return NULL;
+    text[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        if (i > 0) strcat(text, " ");
+        strcat(text, words[i]);
+    }
+    return text;
+}
+
+// An AGE argument, held to the importer's rule; complains about anything else
+static bool parse_age(const char *command, const char *text, unsigned *age) {
+    if (patient_import_parse_age(text, age)) return true;
+    fprintf(stderr, "hms-cli: %s: age is not a whole number from 0 to %d: %s\n", command, PATIENT_MAX_AGE, text);
+    return false;
+}
+
+static int parse_row(PatientStore *store, const char *text, PatientHandle *handle) {
+    PatientId id;
+    if (parse_mrn(text, &id)) {
+        *handle = patient_store_find_id(store, id);
+        if (*handle != PATIENT_NO_HANDLE) return 0;
+        fprintf(stderr, "hms-cli: no patient with MRN %s\n", text + 1);
+        return -1;
+    }
+    char *end;
+    unsigned long row = strtoul(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || row >= patient_store_count(store)) {
+        fprintf(stderr, "hms-cli: no patient at row %s\n", text);
+        return -1;
+    }
+    PatientRecord record;
+    patient_store_get(store, row, &record);
+    *handle = record.handle;
+    return 0;
+}
+
+// Start of the month that lies months before the current one
+static int64_t months_back(unsigned long months) {
+    char text[PATIENT_ADDED_LEN];
+    patient_time_format(patient_time_now(), text);
+    long index = strtol(text, NULL, 10) * 12 + strtol(text + 5, NULL, 10) - 1 - (long)months;
+    if (index < 0) index = 0;
+    snprintf(text, sizeof(text), "%04ld-%02ld-01 00:00", index / 12 % 10000, index % 12 + 1);
+    return patient_time_parse(text);
+}
+
+// Commands that only touch recent patients, or none, leave the archive on disk;
+// changes loads it only when starting over
+static bool needs_archive(const char *command) {
+    return strcmp(command, "add") != 0 && strcmp(command, "changes") != 0 && strcmp(command, "compact") != 0
+           && strcmp(command, "archive") != 0 && strcmp(command, "convert") != 0 && strcmp(command, "stats") != 0;
+}
+
+static int report(int result, const char *what) {
+    if (result != 0) {
+        fprintf(stderr, "hms-cli: %s: %s\n", what, errno == EROFS ? "archived patients are read-only" : strerror(errno));
+    }
+    return result == 0 ? 0 : 1;
+}
+
+static int run_command(PatientStore *store, const PatientLoadStats *stats, int argc, char **argv);
+
+// Needs no patient records, so it runs without opening the store
+static int triage_notes(const char *notes, const char *rules) {
+    unsigned bad_line = 0;
+    TriageEngine *engine = rules ? triage_engine_load(rules, &bad_line) : triage_engine_new_default();
+    if (!engine) {
+        if (bad_line) fprintf(stderr, "hms-cli: %s:%u: expected keyword<TAB>department[<TAB>weight]\n", rules, bad_line);
+        else fprintf(stderr, "hms-cli: %s: %s\n", rules ? rules : "triage rules", strerror(errno));
+        return 1;
+    }
+    TriageBatchStats stats = {0};
+    int result = triage_batch_file(engine, notes, stdout, &stats);
+    if (result == 0) {
+        fprintf(stderr, "triaged %zu notes (%zu matched) with %zu rules in %.3f s: %.0f notes/s on %u threads\n",
+                stats.notes, stats.matched, triage_engine_rule_count(engine), stats.seconds,
+                stats.seconds > 0 ? stats.notes / stats.seconds : 0.0, stats.threads);
+    }
+    triage_engine_free(engine);
+    return report(result, notes);
+}
+
+// --- Visits ---
+
+static void print_encounter(const Encounter *encounter, bool with_patient) {
+    char added[PATIENT_ADDED_LEN];
+    patient_time_format(encounter->time, added);
+    if (with_patient) printf("%s\t%u\t%s\t%s\n", added, encounter->patient, encounter->department, encounter->note);
+    else printf("%s\t%s\t%s\n", added, encounter->department, encounter->note);
+}
+
+static int record_visit(PatientStore *store, PatientHandle handle, int n_words, char **words) {
+    PatientRecord record;
+    patient_store_get(store, patient_store_find(store, handle), &record);
+    unsigned bad_line = 0;
+    TriageEngine *engine = access(TRIAGE_RULES_FILE, F_OK) == 0 ? triage_engine_load(TRIAGE_RULES_FILE, &bad_line)
+                                                                : triage_engine_new_default();
+    if (!engine && bad_line) {
+        fprintf(stderr, "hms-cli: %s:%u: expected keyword<TAB>department[<TAB>weight]\n", TRIAGE_RULES_FILE, bad_line);
+        return 1;
+    }
+    char *reason = engine ? join_words(n_words, words) : NULL;
+    EncounterStore *encounters = reason ? encounter_store_open(registry_path) : NULL;
+    int result = -1;
+    if (encounters) {
+        Encounter visit = { record.id, patient_time_now(), triage_suggest(engine, reason, NULL), reason };
+        result = encounter_store_append(encounters, &visit, 1);
+        if (result == 0) printf("%s\n", visit.department);
+    }
+    encounter_store_close(encounters);
+    free(reason);
+    triage_engine_free(engine);
+    return report(result, "visit");
+}
+
+static int print_visits(PatientStore *store, PatientHandle handle) {
+    PatientRecord record;
+    patient_store_get(store, patient_store_find(store, handle), &record);
+    EncounterStore *encounters = encounter_store_open(registry_path);
+    EncounterList *visits = encounters ? encounter_store_history(encounters, record.id) : NULL;
+    for (size_t i = 0; visits && i < encounter_list_count(visits); i++) {
+        print_encounter(encounter_list_get(visits, i), false);
+    }
+    int result = visits ? 0 : -1;
+    encounter_list_free(visits);
+    encounter_store_close(encounters);
+    return report(result, "visits");
+}
+
+// Needs no patient records either: the window is read like an added: term
+static int print_encounters(const char *when) {
+    char *text = malloc(strlen(when) + sizeof("added:"));
+    if (!text) return report(-1, "encounters");
+    sprintf(text, "added:%s", when);
+    PatientQuery query;
+    char error[128];
+    int result = patient_query_parse(text, patient_time_now(), &query, error, sizeof(error));
+    free(text);
+    if (result == 0 && (!patient_query_has_added(&query) || query.name)) {
+        snprintf(error, sizeof(error), "expected a time window such as 7d or 2026-10-01..2026-10-07");
+        result = -1;
+        errno = EINVAL;
+    }
+    if (result != 0) {
+        if (errno == EINVAL) fprintf(stderr, "hms-cli: encounters: %s\n", error);
+        else report(result, "encounters");
+        patient_query_clear(&query);
+        return 1;
+    }
+    EncounterStore *encounters = encounter_store_open(registry_path);
+    EncounterList *visits = encounters ? encounter_store_range(encounters, query.added_min, query.added_max) : NULL;
+    for (size_t i = 0; visits && i < encounter_list_count(visits); i++) {
+        print_encounter(encounter_list_get(visits, i), true);
+    }
+    result = visits ? 0 : -1;
+    encounter_list_free(visits);
+    encounter_store_close(encounters);
+    patient_query_clear(&query);
+    return report(result, "encounters");
+}
+
+// gzip for FILE.gz, and for change exports JSON Lines for FILE.jsonl[.gz]
+static PatientExportOptions export_options(const char *path) {
+    size_t len = strlen(path);
+    PatientExportOptions options = { .gzip = len > 3 && strcmp(path + len - 3, ".gz") == 0 };
+    if (options.gzip) len -= 3;
+    options.json_lines = len > 6 && strncmp(path + len - 6, ".jsonl", 6) == 0;
+    return options;
+}
+
+static int export_csv(PatientStore *store, const char *path) {
+    PatientExportOptions options = export_options(path);
+    PatientSnapshot *snapshot = patient_store_snapshot(store);
+    int result = snapshot ? patient_export_csv(snapshot, path, &options) : -1;
+    patient_snapshot_free(snapshot);
+    return report(result, path);
+}
+
+// Goes on from the watermark the last change export to path left there
+static int export_changes(PatientStore *store, const char *path) {
+    uint64_t since = patient_export_watermark(path);
+    // Starting over means every patient, archived ones included
+    if (!patient_store_changes_kept(store, since) && patient_store_load_archive(store, INT64_MIN, INT64_MAX, NULL) < 0) {
+        return report(-1, "could not load the archive");
+    }
+    PatientExportOptions options = export_options(path);
+    PatientChanges *changes = patient_store_changes(store, since);
+    int result = changes ? patient_export_changes(changes, path, &options) : -1;
+    if (result == 0) {
+        fprintf(stderr, "hms-cli: wrote %zu changes up to %llu%s\n", patient_changes_count(changes),
+                (unsigned long long)patient_changes_watermark(changes), patient_changes_full(changes) ? ", starting over" : "");
+    }
+    patient_changes_free(changes);
+    return report(result, path);
+}
+
+static void print_rejected(size_t line, const char *reason, void *user_data) {
+    fprintf(stderr, "hms-cli: %s:%zu: %s\n", (const char*)user_data, line, reason);
+}
+
+// Reads and checks the feed against store, the registry or its mirror
+static PatientImport* read_import(const PatientStore *store, const char *path, const char *columns,
+                                  PatientImportStats *stats) {
+    PatientImportOptions options = { .columns = columns, .reject = print_rejected, .user_data = (void*)path };
+    char error[160];
+    PatientImport *import = patient_import_read(path, store, &options, stats, error, sizeof(error));
+    if (!import) fprintf(stderr, "hms-cli: %s: %s\n", path, errno == EINVAL ? error : strerror(errno));
+    return import;
+}
+
+static void print_import_stats(const PatientImportStats *stats, size_t imported) {
+    fprintf(stderr, "imported %zu of %zu rows (%zu rejected, %zu duplicates) in %.3f s on %u threads\n",
+            imported, stats->rows, stats->rejected, stats->duplicates, stats->seconds, stats->threads);
+}
+
+static int import_csv(PatientStore *store, const char *path, const char *columns) {
+    PatientImportStats stats;
+    PatientImport *import = read_import(store, path, columns, &stats);
+    if (!import) return 1;
+    size_t count;
+    const PatientRecord *records = patient_import_records(import, &count);
+    int result = patient_store_add_batch(store, records, count, NULL);
+    // Added in memory even when the journal write failed
+    if (result == 0 || errno == EIO) print_import_stats(&stats, count);
+    patient_import_free(import);
+    return report(result, path);
+}
+
+// With no arguments scans the whole registry; with a patient, checks it the
+// way the window does before adding one
+static int find_duplicates(PatientStore *store, int argc, char **argv, bool ids) {
+    PatientDuplicate *pairs;
+    long count;
+    if (argc == 4) {
+        unsigned age;
+        if (!parse_age("duplicates", argv[2], &age)) return 1;
+        count = patient_duplicates_check(store, argv[1], age, argv[3], &pairs);
+        for (long i = 0; i < count; i++) {
+            long row = patient_store_find(store, pairs[i].second);
+            PatientRecord record;
+            patient_store_get(store, row, &record);
+            printf("%lu\t%u\t%s,%u,%s\n", ids ? (unsigned long)record.handle : (unsigned long)row, pairs[i].distance,
+                   record.name, record.age, record.gender);
+        }
+        free(pairs);
+        return report(count < 0 ? -1 : 0, "duplicates");
+    }
+    PatientSnapshot *snapshot = patient_store_snapshot(store);
+    PatientDuplicateStats stats;
+    count = snapshot ? patient_duplicates_scan(snapshot, NULL, &pairs, &stats) : -1;
+    patient_snapshot_free(snapshot);
+    if (count < 0) return report(-1, "duplicates");
+    for (long i = 0; i < count; i++) {
+        PatientRecord a, b;
+        long first = patient_store_find(store, pairs[i].first), second = patient_store_find(store, pairs[i].second);
+        patient_store_get(store, first, &a);
+        patient_store_get(store, second, &b);
+        printf("%lu\t%lu\t%u\t%s,%u,%s\t%s,%u,%s\n", ids ? (unsigned long)a.handle : (unsigned long)first,
+               ids ? (unsigned long)b.handle : (unsigned long)second, pairs[i].distance, a.name, a.age, a.gender,
+               b.name, b.age, b.gender);
+    }
+    free(pairs);
+    fprintf(stderr, "found %ld likely duplicate pairs among %zu patients in %.3f s on %u threads "
+                    "(%zu blocks, %zu names compared)\n",
+            count, stats.patients, stats.seconds, stats.threads, stats.blocks, stats.comparisons);
+    return 0;
+}
+
+// Counted once, then kept up to date by the store, so a batch can ask again cheaply
+static int print_summary(PatientStore *store) {
+    if (patient_store_track_stats(store) != 0) return report(-1, "summary");
+    const PatientStats *stats = patient_store_stats(store);
+    printf("patients\t%zu\nundated\t%zu\n", patient_stats_total(stats), patient_stats_undated(stats));
+    PatientGenderCount genders[PATIENT_STATS_GENDERS + 1];
+    size_t n_genders = patient_stats_genders(stats, genders);
+    for (size_t i = 0; i < n_genders; i++) {
+        printf("gender\t%s\t%zu\n", genders[i].gender ? genders[i].gender : "(others)", genders[i].count);
+    }
+    size_t ages[PATIENT_STATS_AGES];
+    patient_stats_ages(stats, ages);
+    for (unsigned band = 0; band < PATIENT_STATS_AGES; band += 10) {
+        size_t count = 0;
+        for (unsigned age = band; age < band + 10 && age < PATIENT_STATS_AGES; age++) count += ages[age];
+        if (band + 10 < PATIENT_STATS_AGES) printf("age\t%u-%u\t%zu\n", band, band + 9, count);
+        else printf("age\t%u+\t%zu\n", band, count);
+    }
+    size_t hours[24];
+    patient_stats_hours_of_day(stats, hours);
+    for (int hour = 0; hour < 24; hour++) printf("hour\t%02d\t%zu\n", hour, hours[hour]);
+    int64_t first, last;
+    if (patient_stats_range(stats, &first, &last) == 0) {
+        int64_t from = last - (last % 86400 + 86400) % 86400 - (int64_t)(SUMMARY_DAYS - 1) * 86400;
+        size_t days[SUMMARY_DAYS];
+        patient_stats_admissions(stats, PATIENT_STATS_DAILY, from, SUMMARY_DAYS, days);
+        for (int day = 0; day < SUMMARY_DAYS; day++) {
+            char added[PATIENT_ADDED_LEN];
+            patient_time_format(from + (int64_t)day * 86400, added);
+            printf("day\t%.10s\t%zu\n", added, days[day]);
+        }
+    }
+    return 0;
+}
+
+// Splits a script line into whitespace-separated words, honouring "quotes".
+// A # starts a comment unless it begins an MRN such as #12345.
+static int split_words(char *line, char **words, int max_words) {
+    int n = 0;
+    char *p = line;
+    while (*p && n < max_words) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (!*p || (*p == '#' && !isdigit((unsigned char)p[1]))) break;
+        char *out = p;
+        words[n++] = out;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            if (*p == '"') {
+                p++;
+                while (*p && *p != '"') *out++ = *p++;
+                if (*p) p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (*p) p++;
+        *out = '\0';
+    }
+    return n;
+}
+
+static int run_batch(PatientStore *store, const PatientLoadStats *stats, const char *script) {
+    FILE *in = script ? fopen(script, "r") : stdin;
+    if (!in) {
+        fprintf(stderr, "hms-cli: %s: %s\n", script, strerror(errno));
+        return 1;
+    }
+    // A script may search many times, which pays for building the index
+    if (patient_store_index_names(store) != 0) fprintf(stderr, "hms-cli: searching without an index\n");
+    char *line = NULL;
+    size_t line_cap = 0;
+    int failures = 0;
+    unsigned long line_no = 0;
+    while (getline(&line, &line_cap, in) > 0) {
+        line_no++;
+        char *words[MAX_ARGS];
+        int n = split_words(line, words, MAX_ARGS);
+        if (n == 0) continue;
+        if (strcmp(words[0], "batch") == 0) {
+            fprintf(stderr, "hms-cli: line %lu: batch cannot be nested\n", line_no);
+            failures++;
+        } else if (run_command(store, stats, n, words) != 0) {
+            fprintf(stderr, "hms-cli: line %lu failed\n", line_no);
+            failures++;
+        }
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    return failures ? 1 : 0;
+}
+
+static int run_command(PatientStore *store, const PatientLoadStats *stats, int argc, char **argv) {
+    const char *command = argv[0];
+    PatientHandle handle;
+
+    if (strcmp(command, "list") == 0 && argc == 1) {
+        for (size_t row = 0; row < patient_store_count(store); row++) {
+            PatientRecord record;
+            patient_store_get(store, row, &record);
+            print_record(&record, row, NULL);
+        }
+        return 0;
+    }
+    if (strcmp(command, "count") == 0 && argc == 1) {
+        printf("%zu\n", patient_store_count(store));
+        return 0;
+    }
+    if (strcmp(command, "search") == 0 && argc >= 2) {
+        // The words form one query, so it needn't be quoted as a whole
+        char *text = join_words(argc - 1, argv + 1);
+        if (!text) return report(-1, "search");
+        PatientQuery query;
+        char error[128];
+        int result = patient_query_parse(text, patient_time_now(), &query, error, sizeof(error));
+        free(text);
+        if (result == 0) {
+            patient_store_search(store, &query, print_record, NULL);
+        } else if (errno == EINVAL) {
+            fprintf(stderr, "hms-cli: search: %s\n", error);
+        } else {
+            report(result, "search");
+        }
+        patient_query_clear(&query);
+        return result == 0 ? 0 : 1;
+    }
+    unsigned age;
+    if (strcmp(command, "add") == 0 && (argc == 4 || argc == 5)) {
+        if (!parse_age(command, argv[2], &age)) return 1;
+        int64_t added = argc == 5 ? patient_time_parse(argv[4]) : patient_time_now();
+        if (added == PATIENT_TIME_UNKNOWN) {
+            fprintf(stderr, "hms-cli: add: expected ADDED as YYYY-MM-DD HH:MM, got %s\n", argv[4]);
+            return 1;
+        }
+        return report(patient_store_add(store, argv[1], age, argv[3], added, NULL), "add");
+    }
+    if (strcmp(command, "update") == 0 && argc == 5) {
+        if (!parse_age(command, argv[3], &age) || parse_row(store, argv[1], &handle) != 0) return 1;
+        return report(patient_store_update(store, handle, argv[2], age, argv[4]), "update");
+    }
+    if (strcmp(command, "delete") == 0 && argc == 2) {
+        if (parse_row(store, argv[1], &handle) != 0) return 1;
+        return report(patient_store_delete(store, handle), "delete");
+    }
+    if (strcmp(command, "delete") == 0 && argc > 2) {
+        // Every row is read before any moves
+        PatientHandle *handles = malloc((argc - 1) * sizeof(PatientHandle));
+        if (!handles) return report(-1, "delete");
+        int result = 0;
+        for (int i = 1; result == 0 && i < argc; i++) result = parse_row(store, argv[i], &handles[i - 1]);
+        if (result == 0) result = report(patient_store_delete_batch(store, handles, argc - 1), "delete");
+        free(handles);
+        return result == 0 ? 0 : 1;
+    }
+    if (strcmp(command, "visit") == 0 && argc >= 3) {
+        if (parse_row(store, argv[1], &handle) != 0) return 1;
+        return record_visit(store, handle, argc - 2, argv + 2);
+    }
+    if (strcmp(command, "visits") == 0 && argc == 2) {
+        if (parse_row(store, argv[1], &handle) != 0) return 1;
+        return print_visits(store, handle);
+    }
+    if (strcmp(command, "encounters") == 0 && argc == 2) {
+        return print_encounters(argv[1]);
+    }
+    if (strcmp(command, "export") == 0 && argc == 2) {
+        return export_csv(store, argv[1]);
+    }
+    if (strcmp(command, "changes") == 0 && argc == 2) {
+        return export_changes(store, argv[1]);
+    }
+    if (strcmp(command, "import") == 0 && (argc == 2 || argc == 3)) {
+        return import_csv(store, argv[1], argc == 3 ? argv[2] : NULL);
+    }
+    if (strcmp(command, "duplicates") == 0 && (argc == 1 || argc == 4)) {
+        return find_duplicates(store, argc, argv, false);
+    }
+    if (strcmp(command, "summary") == 0 && argc == 1) {
+        return print_summary(store);
+    }
+    if (strcmp(command, "compact") == 0 && argc == 1) {
+        return report(patient_store_compact(store), "compact");
+    }
+    if (strcmp(command, "archive") == 0 && argc <= 2) {
+        unsigned long months = ARCHIVE_MONTHS;
+        if (argc == 2) {
+            char *end;
+            months = strtoul(argv[1], &end, 10);
+            if (!isdigit((unsigned char)argv[1][0]) || *end != '\0' || months == 0 || months > ARCHIVE_MAX_MONTHS) {
+                fprintf(stderr, "hms-cli: archive: expected MONTHS from 1 to %d, got %s\n", ARCHIVE_MAX_MONTHS, argv[1]);
+                return 1;
+            }
+        }
+        long moved = patient_store_archive(store, months_back(months - 1));
+        if (moved < 0) return report(-1, "archive");
+        fprintf(stderr, "hms-cli: archived %ld patients\n", moved);
+        return 0;
+    }
+    if (strcmp(command, "convert") == 0 && argc == 3) {
+        PatientFileFormat format;
+        if (strcmp(argv[1], "text") == 0) {
+            format = PATIENT_FORMAT_TEXT;
+        } else if (strcmp(argv[1], "binary") == 0) {
+            format = PATIENT_FORMAT_BINARY;
+        } else {
+            fprintf(stderr, "hms-cli: unknown format %s\n", argv[1]);
+            return 1;
+        }
+        return report(patient_store_write_snapshot(store, argv[2], format), argv[2]);
+    }
+    if (strcmp(command, "stats") == 0 && argc == 1) {
+        PatientMemory memory;
+        patient_store_memory(store, &memory);
+        printf("rows\t%zu\nbad_lines\t%zu\njournal_records\t%zu\nthreads\t%u\nload_seconds\t%.3f\nrows_per_second\t%.0f\n",
+               stats->rows, stats->bad_lines, stats->journal_records, stats->threads, stats->seconds,
+               stats->seconds > 0 ? stats->rows / stats->seconds : 0.0);
+        printf("memory_bytes\t%zu\nbytes_per_patient\t%.1f\n", memory.total,
+               memory.records ? (double)memory.total / memory.records : 0.0);
+        return 0;
+    }
+    fprintf(stderr, "hms-cli: unknown command or wrong arguments: %s\n", command);
+    return 2;
+}
+
+// --- Registry Daemon ---
+
+static RegistryServer *serving;
+
+static void stop_serving(int signo) {
+    registry_server_stop(serving);
+}
+
+static int serve(PatientStore *store, const char *socket_path) {
+    // Every client searches, so the index pays for itself
+    if (patient_store_index_names(store) != 0) fprintf(stderr, "hms-cli: searching without an index\n");
+    serving = registry_server_new(store, socket_path);
+    if (!serving) {
+        fprintf(stderr, "hms-cli: %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    struct sigaction action = { .sa_handler = stop_serving };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "hms-cli: serving %zu patients on %s\n", patient_store_count(store), socket_path);
+    int result = registry_server_run(serving);
+    registry_server_free(serving);
+    serving = NULL;
+    return report(result, socket_path);
+}
+
+static void print_remote_record(const PatientRecord *record, size_t row, void *user_data) {
+    print_record(record, record->handle, user_data);
+}
+
+// Names the patient of an update or delete by ID, or by #MRN for the daemon to look up
+static int parse_id(const char *text, PatientRecord *record) {
+    if (parse_mrn(text, &record->id)) return 0;
+    char *end;
+    unsigned long id = strtoul(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || id >= PATIENT_NO_HANDLE) {
+        fprintf(stderr, "hms-cli: no patient with ID %s\n", text);
+        return -1;
+    }
+    record->handle = id;
+    return 0;
+}
+
+// Deletes every patient named, by ID or #MRN, with the requests pipelined
+static int delete_remote(RegistryClient *client, int count, char **ids) {
+    PatientRecord *records = calloc(count, sizeof(PatientRecord));
+    if (!records) return report(-1, "delete");
+    int result = 0;
+    for (int i = 0; result == 0 && i < count; i++) result = parse_id(ids[i], &records[i]);
+    if (result == 0 && registry_client_delete_batch(client, records, count, NULL) != 0) {
+        const char *error = registry_client_error(client);
+        fprintf(stderr, "hms-cli: delete: %s\n", *error ? error : strerror(errno));
+        result = -1;
+    }
+    free(records);
+    return result == 0 ? 0 : 1;
+}
+
+// The daemon resolves paths from its own directory
+static char* absolute_path(const char *path) {
+    if (path[0] == '/') return strdup(path);
+    char *cwd = getcwd(NULL, 0);
+    char *absolute = cwd ? malloc(strlen(cwd) + strlen(path) + 2) : NULL;
+    if (absolute) sprintf(absolute, "%s/%s", cwd, path);
+    free(cwd);
+    return absolute;
+}
+
+// Sends the request for one command without waiting for the reply. Returns
+// 0, 1 if it failed, or 2 if the command is unknown here.
+static int send_remote(RegistryClient *client, int argc, char **argv, RegistryFrameType *type) {
+    const char *command = argv[0];
+    RegistryFrame request = {0};
+    char *text = NULL;
+    if (strcmp(command, "list") == 0 && argc == 1) {
+        request.type = REGISTRY_LIST;
+    } else if (strcmp(command, "count") == 0 && argc == 1) {
+        request.type = REGISTRY_COUNT;
+    } else if (strcmp(command, "search") == 0 && argc >= 2) {
+        request.type = REGISTRY_QUERY;
+        request.text = text = join_words(argc - 1, argv + 1);
+        if (!text) return report(-1, command);
+    } else if (strcmp(command, "add") == 0 && (argc == 4 || argc == 5)) {
+        request.type = REGISTRY_ADD;
+        unsigned age;
+        if (!parse_age(command, argv[2], &age)) return 1;
+        request.record = (PatientRecord){ .name = argv[1], .age = age, .gender = argv[3],
+                                          .added = argc == 5 ? patient_time_parse(argv[4]) : patient_time_now() };
+        if (request.record.added == PATIENT_TIME_UNKNOWN) {
+            fprintf(stderr, "hms-cli: add: expected ADDED as YYYY-MM-DD HH:MM, got %s\n", argv[4]);
+            return 1;
+        }
+    } else if (strcmp(command, "update") == 0 && argc == 5) {
+        request.type = REGISTRY_UPDATE;
+        unsigned age;
+        if (!parse_age(command, argv[3], &age)) return 1;
+        request.record = (PatientRecord){ .name = argv[2], .age = age, .gender = argv[4] };
+        if (parse_id(argv[1], &request.record) != 0) return 1;
+    } else if (strcmp(command, "delete") == 0 && argc == 2) {
+        request.type = REGISTRY_DELETE;
+        if (parse_id(argv[1], &request.record) != 0) return 1;
+    } else if ((strcmp(command, "export") == 0 || strcmp(command, "changes") == 0) && argc == 2) {
+        PatientExportOptions options = export_options(argv[1]);
+        bool changes = strcmp(command, "changes") == 0;
+        request.type = changes ? REGISTRY_EXPORT_CHANGES : REGISTRY_EXPORT;
+        request.value = (options.gzip ? REGISTRY_EXPORT_GZIP : 0)
+                        | (changes && options.json_lines ? REGISTRY_EXPORT_JSON_LINES : 0);
+        request.text = text = absolute_path(argv[1]);
+        if (!text) return report(-1, command);
+    } else {
+        return 2;
+    }
+    int result = registry_client_send(client, &request);
+    free(text);
+    *type = request.type;
+    return report(result, command);
+}
+
+// Waits for the reply to the oldest request and prints what it returned
+static int finish_remote(RegistryClient *client, RegistryFrameType type, const char *what) {
+    uint32_t value;
+    bool lists = type == REGISTRY_LIST || type == REGISTRY_QUERY;
+    if (registry_client_receive(client, lists ? print_remote_record : NULL, NULL, &value) != 0) {
+        const char *error = registry_client_error(client);
+        fprintf(stderr, "hms-cli: %s: %s\n", what, *error ? error : strerror(errno));
+        return 1;
+    }
+    if (type == REGISTRY_COUNT) printf("%u\n", value);
+    if (type == REGISTRY_EXPORT_CHANGES) fprintf(stderr, "hms-cli: wrote %u changes %s\n", value, registry_client_note(client));
+    return 0;
+}
+
+// Keeps up to PIPELINE_DEPTH requests in flight, so a long script costs
+// about one round trip per PIPELINE_DEPTH lines instead of one per line
+static int run_remote_batch(RegistryClient *client, const char *script) {
+    FILE *in = script ? fopen(script, "r") : stdin;
+    if (!in) {
+        fprintf(stderr, "hms-cli: %s: %s\n", script, strerror(errno));
+        return 1;
+    }
+    struct {
+        RegistryFrameType type;
+        char what[32];
+    } in_flight[PIPELINE_DEPTH];
+    size_t first = 0, count = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int failures = 0;
+    unsigned long line_no = 0;
+    bool lost = false;
+    while (!lost && getline(&line, &line_cap, in) > 0) {
+        line_no++;
+        char *words[MAX_ARGS];
+        int n = split_words(line, words, MAX_ARGS);
+        if (n == 0) continue;
+        if (count == PIPELINE_DEPTH) {
+            failures += finish_remote(client, in_flight[first].type, in_flight[first].what);
+            first = (first + 1) % PIPELINE_DEPTH;
+            count--;
+        }
+        size_t slot = (first + count) % PIPELINE_DEPTH;
+        int result = send_remote(client, n, words, &in_flight[slot].type);
+        if (result == 0) {
+            snprintf(in_flight[slot].what, sizeof(in_flight[slot].what), "line %lu", line_no);
+            count++;
+        } else {
+            if (result == 2) fprintf(stderr, "hms-cli: line %lu: unknown command or wrong arguments: %s\n", line_no, words[0]);
+            failures++;
+            lost = errno == EPIPE;
+        }
+    }
+    for (; count > 0; count--, first = (first + 1) % PIPELINE_DEPTH) {
+        failures += finish_remote(client, in_flight[first].type, in_flight[first].what);
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    return failures ? 1 : 0;
+}
+
+// Deduplicates against a mirror of the registry, then pipelines the adds.
+// The feed is read here, so relative paths need no fixing up.
+static int import_remote(RegistryClient *client, const char *path, const char *columns) {
+    if (registry_client_subscribe(client, NULL) != 0) return report(-1, "import");
+    PatientImportStats stats;
+    PatientImport *import = read_import(registry_client_store(client), path, columns, &stats);
+    if (!import) return 1;
+    size_t count, added;
+    const PatientRecord *records = patient_import_records(import, &count);
+    int result = registry_client_add_batch(client, records, count, &added);
+    print_import_stats(&stats, added);
+    if (result != 0) {
+        const char *error = registry_client_error(client);
+        fprintf(stderr, "hms-cli: %s: %s\n", path, *error ? error : strerror(errno));
+    }
+    patient_import_free(import);
+    return result == 0 ? 0 : 1;
+}
+
+static int run_remote(const char *socket_path, int argc, char **argv) {
+    RegistryClient *client = registry_client_connect(socket_path);
+    if (!client) {
+        fprintf(stderr, "hms-cli: %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    int status;
+    if (strcmp(argv[0], "batch") == 0 && argc <= 2) {
+        status = run_remote_batch(client, argc == 2 ? argv[1] : NULL);
+    } else if (strcmp(argv[0], "import") == 0 && (argc == 2 || argc == 3)) {
+        status = import_remote(client, argv[1], argc == 3 ? argv[2] : NULL);
+    } else if (strcmp(argv[0], "duplicates") == 0 && (argc == 1 || argc == 4)) {
+        // Searched in a mirror of the registry, under the daemon's IDs
+        status = registry_client_subscribe(client, NULL) == 0
+                     ? find_duplicates(registry_client_store(client), argc, argv, true) : report(-1, "duplicates");
+    } else if (strcmp(argv[0], "delete") == 0 && argc > 2) {
+        status = delete_remote(client, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "summary") == 0 && argc == 1) {
+        status = registry_client_subscribe(client, NULL) == 0 ? print_summary(registry_client_store(client))
+                                                               : report(-1, "summary");
+    } else {
+        RegistryFrameType type;
+        status = send_remote(client, argc, argv, &type);
+        if (status == 0) status = finish_remote(client, type, argv[0]);
+        if (status == 2) fprintf(stderr, "hms-cli: unknown command or wrong arguments with -s: %s\n", argv[0]);
+    }
+    registry_client_close(client);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = DEFAULT_PATIENTS_FILE;
+    const char *socket_path = NULL;
+    int first = 1;
+    while (argc - first > 1 && argv[first][0] == '-' && strchr("fLs", argv[first][1]) && argv[first][2] == '\0') {
+        if (argv[first][1] == 'f') path = argv[first + 1];
+        else if (argv[first][1] == 's') socket_path = argv[first + 1];
+        else latency_path = argv[first + 1];
+        first += 2;
+    }
+    if (latency_path) atexit(dump_latency);
+    if (first >= argc || strcmp(argv[first], "-h") == 0 || strcmp(argv[first], "--help") == 0) {
+        print_usage(first >= argc ? stderr : stdout);
+        return first >= argc ? 2 : 0;
+    }
+
+    if (strcmp(argv[first], "triage") == 0 && (argc - first == 2 || argc - first == 3)) {
+        return triage_notes(argv[first + 1], argc - first == 3 ? argv[first + 2] : NULL);
+    }
+    registry_path = path;
+    if (strcmp(argv[first], "encounters") == 0 && argc - first == 2) {
+        return print_encounters(argv[first + 1]);
+    }
+
+    if (socket_path) return run_remote(socket_path, argc - first, argv + first);
+
+    PatientLoadStats stats = {0};
+    PatientStore *store = patient_store_open(path, &stats);
+    if (!store) {
+        fprintf(stderr, "hms-cli: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    // Row numbers must mean the same whichever command comes next
+    if (needs_archive(argv[first]) && patient_store_load_archive(store, INT64_MIN, INT64_MAX, NULL) < 0) {
+        fprintf(stderr, "hms-cli: %s: could not load the archive: %s\n", path, strerror(errno));
+        patient_store_close(store);
+        return 1;
+    }
+
+    int status;
+    if (strcmp(argv[first], "batch") == 0 && argc - first <= 2) {
+        status = run_batch(store, &stats, argc - first == 2 ? argv[first + 1] : NULL);
+    } else if (strcmp(argv[first], "serve") == 0 && argc - first <= 2) {
+        status = serve(store, argc - first == 2 ? argv[first + 1] : REGISTRY_SOCKET);
+    } else {
+        status = run_command(store, &stats, argc - first, argv + first);
+        if (status == 2) print_usage(stderr);
+    }
+
+    if (patient_store_sync(store) != 0) {
+        fprintf(stderr, "hms-cli: could not write the journal: %s\n", strerror(errno));
+        status = 1;
+    }
+    patient_store_close(store);
+    return status;
+}
@@ -1,12 +1,44 @@
 #include <gtk/gtk.h>
-#include <time.h>
-#include <ctype.h>
+#include <glib-unix.h>
 #include <string.h>
 #include <stdlib.h>
-#include <unistd.h> // For g_usleep
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "encounter_store.h"
+#include "latency_stats.h"
+#include "patient_duplicates.h"
+#include "patient_export.h"
+#include "patient_import.h"
+#include "patient_model.h"
+#include "patient_stats.h"
+#include "patient_store.h"
+#include "registry_client.h"
+#include "symptom_triage.h"
 
 // --- File Paths ---
 #define PATIENTS_FILE "patients.txt"
+#define PATIENTS_BINARY_FILE "patients.hms"    // Preferred when present; see hms-cli convert
+#define TRIAGE_RULES_FILE "triage_rules.txt"    // Optional; the built-in rules apply without it
+#define SEARCH_DEBOUNCE_MS 150
+#define SEARCH_HINT "Name, plus any of age:60..80 gender:F added:>2026-10-10 added:7d, or #12345 for an MRN"
+#define EXPORT_POLL_MS 100
+#define IMPORT_REJECTS_SHOWN 20
+#define DUPLICATES_SHOWN 1000           // Pairs listed after a scan
+#define DUPLICATE_MATCHES_SHOWN 5       // Similar patients listed when adding one
+#define BULK_ROWS 64              // More new or changed rows than this refilter the view once instead of one by one
+#define STARTUP_POLL_MS 50
+#define STREAM_BATCH_ROWS 2000
+#define STREAM_BUDGET_US 8000     // Per idle callback, so input and redraws get a turn between batches
+#define LATENCY_STATS_FILE "latency_stats.json"     // Written on SIGUSR1 and at exit
+#define HEARTBEAT_MS 50
+#define STALL_THRESHOLD_MS 250
+#define DIAGNOSTICS_REFRESH_MS 1000
+#define STATISTICS_REFRESH_MS 500
+#define STATISTICS_DAYS 14        // Days of admissions charted, up to the latest
+#define STATISTICS_AGE_BAND 10
+#define STATISTICS_AGE_BANDS ((PATIENT_STATS_AGES + STATISTICS_AGE_BAND - 1) / STATISTICS_AGE_BAND)
+#define HISTORY_HEIGHT 160        // Of the visits pane under the patients table
 // CSS is now embedded, so CSS_FILE is no longer needed.
 
 // --- Structs and Enums ---
@@ -19,37 +51,164 @@ typedef struct {
     gboolean success;
 } LoginData;
 
-// For the patients tab
+// For the patients tab (columns are in patient_model.h)
 enum {
-    COL_NAME = 0,
-    COL_AGE,
-    COL_GENDER,
-    COL_TIMESTAMP,
-    NUM_COLS
+    HISTORY_COL_WHEN,
+    HISTORY_COL_DEPARTMENT,
+    HISTORY_COL_NOTE,
+    HISTORY_NUM_COLS
 };
 
+typedef struct ExportTask ExportTask;
+typedef struct DuplicateTask DuplicateTask;
+typedef struct StartupTask StartupTask;
+
 typedef struct {
-    GtkListStore *store;
-    GtkTreeModel *filter_model;
+    PatientStore *patients;     // NULL until startup has loaded it
+    RegistryClient *client;     // Set if a registry daemon serves patients, which then mirrors it
+    guint registry_watch;       // Waits for the daemon's change events once streaming is done
+    GArray *registry_added;     // Handles the daemon just announced, shown together at the end of a sync
+    GArray *registry_changed;   // Likewise for records it changed or deleted
+    EncounterStore *encounters; // Visits, next to the registry files; NULL if they can't be read
+    TriageEngine *triage;       // Suggests each new visit's department
+    PatientModel *model;
+    GtkWidget *toolbar;
     GtkWidget *tree_view;
     GtkWidget *search_entry;
+    GtkWidget *export_button;
+    GtkWidget *duplicates_button;
+    GtkWidget *status_label;
+    GtkListStore *history;      // Visits of the one selected patient, newest first
+    GtkWidget *history_view;
+    GtkWidget *history_label;
+    GtkWidget *visit_entry;
+    GtkWidget *visit_button;
+    PatientId history_patient;  // Whose visits are shown, PATIENT_NO_ID if nobody's
+    guint history_idle;         // Pending refresh of the visits after selection changes
+    guint search_timeout;       // Pending debounced query, 0 if none
+    guint stream_idle;          // Rows still being moved into the view, 0 once done
+    ExportTask *export;         // Running export, NULL if none
+    DuplicateTask *duplicates;  // Running duplicate scan, NULL if none
+    StartupTask *startup;
 } PatientWidgets;
 
+typedef enum {
+    STARTUP_OPENING,
+    STARTUP_INDEXING,       // Name index, statistics and initial sort, side by side
+    STARTUP_DONE
+} StartupStage;
+
+// Loads the store, builds its name index and sorts the initial view on
+// worker threads while the splash and login dialog are up. The patients tab
+// adopts the result once both it and the data are ready, whichever comes
+// last. Times are g_get_monotonic_time() microseconds.
+struct StartupTask {
+    GThread *thread;
+    atomic_int stage;
+    atomic_bool finished;
+    gboolean ready;             // Thread joined; patients and model are valid
+    const char *path;
+    PatientStore *patients;     // Handed over to the patients tab on adoption
+    RegistryClient *client;     // Owns patients when a registry daemon answered
+    EncounterStore *encounters; // Handed over with patients
+    PatientModel *model;
+    PatientLoadStats stats;
+    int error;
+    GtkWidget *splash;
+    GtkWidget *progress_bar;
+    guint poll_timeout;
+    PatientWidgets *widgets;    // The patients tab, once it exists
+    gint64 launched;
+    gint64 gtk_ready;
+    gint64 css_ready;
+    gint64 index_us;
+    gint64 sort_us;
+    gint64 loaded;
+    gint64 logged_in;
+    gint64 first_rows;
+};
+
+// A CSV export streaming a snapshot, or the changes since the last export to
+// the same file, on its own thread; the main loop polls it for progress and
+// completion
+struct ExportTask {
+    PatientWidgets *widgets;
+    PatientSnapshot *snapshot;
+    PatientChanges *changes;    // Instead of snapshot for a change export
+    char *path;
+    gboolean gzip;
+    gboolean json_lines;
+    GThread *thread;
+    atomic_bool cancel;
+    atomic_bool finished;
+    atomic_size_t rows_done;
+    int result;
+    int error;
+    GtkWidget *dialog;
+    GtkWidget *progress_bar;
+    guint poll_timeout;
+};
+
+// A duplicate scan over a snapshot on worker threads, polled like an export
+struct DuplicateTask {
+    PatientWidgets *widgets;
+    PatientSnapshot *snapshot;
+    GThread *thread;
+    atomic_bool cancel;
+    atomic_bool finished;
+    atomic_size_t blocks_done;
+    atomic_size_t blocks_total;
+    PatientDuplicate *pairs;
+    long count;
+    int error;
+    PatientDuplicateStats stats;
+    GtkWidget *dialog;
+    GtkWidget *progress_bar;
+    guint poll_timeout;
+};
+
 // For the AI Assistant tab
 typedef struct {
     GtkWidget *symptom_entry;
     GtkWidget *result_label;
+    TriageEngine *triage;
 } AIAssistantWidgets;
 
+// One row of a Statistics chart
+typedef struct {
+    GtkWidget *label;
+    GtkWidget *bar;
+    GtkWidget *count;
+} StatisticsBar;
+
+// For the Statistics tab, which reads the store's running totals
+typedef struct {
+    StartupTask *startup;       // Its patients tab owns the store once loaded
+    GtkWidget *summary_label;
+    GtkListStore *genders;
+    StatisticsBar ages[STATISTICS_AGE_BANDS];
+    StatisticsBar hours[24];
+    StatisticsBar days[STATISTICS_DAYS];
+    guint refresh_timeout;      // Only while the tab is on screen
+} StatisticsWidgets;
+
+// For the hidden Diagnostics tab (Ctrl+Shift+D)
+typedef struct {
+    StartupTask *startup;       // Its widgets hold the records once loaded
+    GtkListStore *operations;
+    GtkListStore *stalls;
+    GtkWidget *summary_label;
+    guint refresh_timeout;      // Only while the tab is on screen
+} DiagnosticsWidgets;
+
 
 // --- Function Prototypes ---
 
 // Main Application
-static void create_main_window();
+static void create_main_window(StartupTask *startup);
 static void load_css();
 
 // Utility Functions
-char* get_current_timestamp();
 void show_message(GtkWindow *parent, GtkMessageType type, const char *title, const char *message);
 
 // Login Window
@@ -57,27 +216,22 @@ gboolean show_login_window(GtkWindow *parent);
 static void on_login_clicked(GtkButton *button, gpointer user_data);
 
 // Patients Tab
-GtkWidget* create_patients_tab();
-static void load_patients(GtkListStore *store);
-// Modified to accept a parent window for its message dialogs
-static void save_patients(GtkListStore *store, GtkWindow *parent_window);
+GtkWidget* create_patients_tab(StartupTask *startup);
+static void adopt_patients(PatientWidgets *widgets);
+// Reports a failed store mutation; the journal write itself happens off the main thread
+static void check_patient_saved(int result, GtkWindow *parent_window);
 
 // AI Assistant Tab
 GtkWidget* create_ai_assistant_tab();
 
+// Statistics Tab
+static GtkWidget* create_statistics_tab(StartupTask *startup);
 
-// --- Utility Function Implementations ---
+// Diagnostics Tab
+static GtkWidget* create_diagnostics_tab(StartupTask *startup);
 
-// Gets the current timestamp as a formatted string
-char* get_current_timestamp() {
-    time_t rawtime;
-    struct tm *timeinfo;
-    static char buffer[20]; // Static buffer to be returned
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", timeinfo);
-    return buffer;
-}
+
+// --- Utility Function Implementations ---
 
 // Shows a simple information or error message dialog
 void show_message(GtkWindow *parent, GtkMessageType type, const char *title, const char *message) {
@@ -158,40 +312,52 @@ gboolean show_login_window(GtkWindow *parent) {
 
 // --- AI Assistant Implementations ---
 
-static void to_lower_case(char *str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower(str[i]);
-    }
-}
-
 static void on_suggest_department(GtkButton *button, gpointer user_data) {
     AIAssistantWidgets *widgets = (AIAssistantWidgets *)user_data;
-    const char *symptoms_const = gtk_entry_get_text(GTK_ENTRY(widgets->symptom_entry));
-    if (strlen(symptoms_const) == 0) {
+    const char *symptoms = gtk_entry_get_text(GTK_ENTRY(widgets->symptom_entry));
+    if (strlen(symptoms) == 0) {
         gtk_label_set_markup(GTK_LABEL(widgets->result_label), "<span size='large' weight='bold' foreground='#d35400'>Please enter symptoms first.</span>");
         return;
     }
-    
-    char *symptoms = g_strdup(symptoms_const);
-    to_lower_case(symptoms);
-
-    const char *suggestion = "General Medicine (More specific symptoms needed)";
-
-    if (strstr(symptoms, "chest") || strstr(symptoms, "heart") || strstr(symptoms, "pressure")) suggestion = "Cardiology";
-    else if (strstr(symptoms, "skin") || strstr(symptoms, "rash") || strstr(symptoms, "acne")) suggestion = "Dermatology";
-    else if (strstr(symptoms, "headache") || strstr(symptoms, "dizzy") || strstr(symptoms, "numbness")) suggestion = "Neurology";
-    else if (strstr(symptoms, "bone") || strstr(symptoms, "fracture") || strstr(symptoms, "joint")) suggestion = "Orthopedics";
-    else if (strstr(symptoms, "child") || strstr(symptoms, "baby") || strstr(symptoms, "infant")) suggestion = "Pediatrics";
-    else if (strstr(symptoms, "stomach") || strstr(symptoms, "digest") || strstr(symptoms, "acid")) suggestion = "Gastroenterology";
 
+    TriageResult result;
+    char *department = g_markup_escape_text(triage_suggest(widgets->triage, symptoms, &result), -1);
     char result_text[256];
-    snprintf(result_text, sizeof(result_text), "<span size='large' weight='bold'>Suggested Department: %s</span>", suggestion);
+    if (result.department < 0) {
+        snprintf(result_text, sizeof(result_text),
+                 "<span size='large' weight='bold'>Suggested Department: %s (More specific symptoms needed)</span>",
+                 department);
+    } else {
+        snprintf(result_text, sizeof(result_text),
+                 "<span size='large' weight='bold'>Suggested Department: %s</span>\n<span>Confidence %.0f%%</span>",
+                 department, result.confidence * 100);
+    }
+    g_free(department);
     gtk_label_set_markup(GTK_LABEL(widgets->result_label), result_text);
-    g_free(symptoms);
+}
+
+static void on_ai_assistant_destroy(GtkWidget *widget, AIAssistantWidgets *widgets) {
+    triage_engine_free(widgets->triage);
+    g_slice_free(AIAssistantWidgets, widgets);
+}
+
+// The rule table from TRIAGE_RULES_FILE if there is one, else the built-in rules
+static TriageEngine* load_triage_rules() {
+    if (g_file_test(TRIAGE_RULES_FILE, G_FILE_TEST_EXISTS)) {
+        unsigned bad_line = 0;
+        TriageEngine *engine = triage_engine_load(TRIAGE_RULES_FILE, &bad_line);
+        if (engine) return engine;
+        if (bad_line) g_warning("%s:%u: expected keyword<TAB>department[<TAB>weight]", TRIAGE_RULES_FILE, bad_line);
+        else g_warning("Could not load %s: %s", TRIAGE_RULES_FILE, g_strerror(errno));
+    }
+    TriageEngine *engine = triage_engine_new_default();
+    if (!engine) g_error("Could not build the triage rules: %s", g_strerror(errno));
+    return engine;
 }
 
 GtkWidget* create_ai_assistant_tab() {
     AIAssistantWidgets *widgets = g_slice_new(AIAssistantWidgets);
+    widgets->triage = load_triage_rules();
     GtkWidget *grid = gtk_grid_new();
     gtk_widget_set_halign(grid, GTK_ALIGN_CENTER);
     gtk_widget_set_valign(grid, GTK_ALIGN_CENTER);
@@ -220,120 +386,399 @@ GtkWidget* create_ai_assistant_tab() {
 
     g_signal_connect(suggest_button, "clicked", G_CALLBACK(on_suggest_department), widgets);
     g_signal_connect_swapped(widgets->symptom_entry, "activate", G_CALLBACK(gtk_button_clicked), suggest_button);
+    g_signal_connect(grid, "destroy", G_CALLBACK(on_ai_assistant_destroy), widgets);
 
     return grid;
 }
 
 // --- Patients Tab Implementations ---
 
-static gboolean filter_patients(GtkTreeModel *model, GtkTreeIter *iter, gpointer data);
-static void on_search_changed(GtkSearchEntry *entry, PatientWidgets *widgets);
+static void on_search_changed(GtkEditable *editable, PatientWidgets *widgets);
 static void on_add_patient(GtkButton *button, PatientWidgets *widgets);
 static void on_edit_patient(GtkButton *button, PatientWidgets *widgets);
 static void on_delete_patient(GtkButton *button, PatientWidgets *widgets);
+static void on_select_all(GtkButton *button, PatientWidgets *widgets);
 static void on_export_csv(GtkButton *button, PatientWidgets *widgets);
+static void on_import_csv(GtkButton *button, PatientWidgets *widgets);
+static void on_find_duplicates(GtkButton *button, PatientWidgets *widgets);
+static void on_patients_edge(GtkScrolledWindow *scrolled_window, GtkPositionType pos, PatientWidgets *widgets);
+static void on_patients_tab_destroy(GtkWidget *widget, PatientWidgets *widgets);
+static void on_patient_selection_changed(GtkTreeSelection *selection, PatientWidgets *widgets);
+static void on_record_visit(GtkButton *button, PatientWidgets *widgets);
+static void export_task_free(ExportTask *task);
+static void duplicate_task_free(DuplicateTask *task);
+
+// The visits of the selected patient, and a line to record a new one
+static GtkWidget* create_history_pane(PatientWidgets *widgets) {
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    widgets->history_label = gtk_label_new("Select a patient to see their visits.");
+    gtk_label_set_xalign(GTK_LABEL(widgets->history_label), 0);
+    gtk_box_pack_start(GTK_BOX(box), widgets->history_label, FALSE, FALSE, 0);
+
+    widgets->history = gtk_list_store_new(HISTORY_NUM_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    widgets->history_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(widgets->history));
+    const char *titles[] = {"When", "Department", "Reason"};
+    for (int i = 0; i < HISTORY_NUM_COLS; i++) {
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(
+            titles[i], gtk_cell_renderer_text_new(), "text", i, NULL);
+        gtk_tree_view_column_set_resizable(column, TRUE);
+        gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+        gtk_tree_view_column_set_fixed_width(column, i == HISTORY_COL_NOTE ? 400 : 160);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(widgets->history_view), column);
+    }
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(widgets->history_view), TRUE);
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled_window), HISTORY_HEIGHT);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), widgets->history_view);
+    gtk_box_pack_start(GTK_BOX(box), scrolled_window, TRUE, TRUE, 0);
+
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    widgets->visit_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->visit_entry), "Reason for the visit, e.g. chest pain");
+    gtk_box_pack_start(GTK_BOX(hbox), widgets->visit_entry, TRUE, TRUE, 0);
+    widgets->visit_button = gtk_button_new_with_label("Record Visit");
+    gtk_widget_set_tooltip_text(widgets->visit_button, "Records a visit now, in the department the AI assistant suggests for the reason");
+    gtk_box_pack_start(GTK_BOX(hbox), widgets->visit_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(box), hbox, FALSE, FALSE, 0);
+    gtk_widget_set_sensitive(hbox, FALSE);
+
+    g_signal_connect(widgets->visit_button, "clicked", G_CALLBACK(on_record_visit), widgets);
+    g_signal_connect_swapped(widgets->visit_entry, "activate", G_CALLBACK(gtk_button_clicked), widgets->visit_button);
+    return box;
+}
 
-GtkWidget* create_patients_tab() {
-    PatientWidgets *widgets = g_slice_new(PatientWidgets);
+GtkWidget* create_patients_tab(StartupTask *startup) {
+    PatientWidgets *widgets = g_slice_new0(PatientWidgets);
+    widgets->startup = startup;
+    widgets->triage = load_triage_rules();
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
     gtk_container_set_border_width(GTK_CONTAINER(vbox), 10);
 
     GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     widgets->search_entry = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->search_entry), "Search patients...");
+    gtk_widget_set_tooltip_text(widgets->search_entry, SEARCH_HINT);
+    gtk_entry_set_width_chars(GTK_ENTRY(widgets->search_entry), 40);
     gtk_box_pack_start(GTK_BOX(hbox), widgets->search_entry, FALSE, FALSE, 0);
 
+    GtkWidget *select_all_button = gtk_button_new_with_label("Select All");
+    gtk_widget_set_tooltip_text(select_all_button, "Select every patient the search shows, to edit or delete them together");
     GtkWidget *add_button = gtk_button_new_with_label("Add");
     GtkWidget *edit_button = gtk_button_new_with_label("Edit");
     GtkWidget *delete_button = gtk_button_new_with_label("Delete");
+    GtkWidget *duplicates_button = gtk_button_new_with_label("Find Duplicates");
+    GtkWidget *import_button = gtk_button_new_with_label("Import CSV");
     GtkWidget *export_button = gtk_button_new_with_label("Export to CSV");
+    widgets->export_button = export_button;
+    widgets->duplicates_button = duplicates_button;
 
     gtk_box_pack_end(GTK_BOX(hbox), export_button, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(hbox), import_button, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(hbox), duplicates_button, FALSE, FALSE, 0);
     gtk_box_pack_end(GTK_BOX(hbox), delete_button, FALSE, FALSE, 0);
     gtk_box_pack_end(GTK_BOX(hbox), edit_button, FALSE, FALSE, 0);
     gtk_box_pack_end(GTK_BOX(hbox), add_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), select_all_button, FALSE, FALSE, 0);
     
     gtk_widget_set_name(add_button, "addButton");
 
     gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+    // Nothing to search or edit until every row has arrived
+    widgets->toolbar = hbox;
+    gtk_widget_set_sensitive(hbox, FALSE);
 
     widgets->tree_view = gtk_tree_view_new();
     gtk_tree_view_set_grid_lines(GTK_TREE_VIEW(widgets->tree_view), GTK_TREE_VIEW_GRID_LINES_VERTICAL);
-    const char *column_titles[] = {"Name", "Age", "Gender", "Added"};
-    for (int i = 0; i < NUM_COLS; i++) {
+    // Shift- and Ctrl-click, or Ctrl+A, pick several rows for Edit and Delete
+    gtk_tree_selection_set_mode(gtk_tree_view_get_selection(GTK_TREE_VIEW(widgets->tree_view)), GTK_SELECTION_MULTIPLE);
+    const char *column_titles[] = {"Name", "Age", "Gender", "Added", "MRN"};
+    for (int i = 0; i < NUM_VISIBLE_COLS; i++) {
         GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
         GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(
             column_titles[i], renderer, "text", i, NULL);
         gtk_tree_view_column_set_resizable(column, TRUE);
-        gtk_tree_view_column_set_sort_column_id(column, i);
+        gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+        gtk_tree_view_column_set_fixed_width(column, i == COL_NAME ? 240 : i == COL_TIMESTAMP ? 160 : 90);
+        if (i != COL_MRN) gtk_tree_view_column_set_sort_column_id(column, i);
         gtk_tree_view_append_column(GTK_TREE_VIEW(widgets->tree_view), column);
     }
 
-    widgets->store = gtk_list_store_new(NUM_COLS, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_STRING);
-    load_patients(widgets->store);
-
-    // Sorting
-    for(int i = 0; i < NUM_COLS; ++i) {
-        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(widgets->store), i, GTK_SORT_ASCENDING);
-    }
-
-    widgets->filter_model = gtk_tree_model_filter_new(GTK_TREE_MODEL(widgets->store), NULL);
-    gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(widgets->filter_model), filter_patients, widgets->search_entry, NULL);
-    
-    gtk_tree_view_set_model(GTK_TREE_VIEW(widgets->tree_view), widgets->filter_model);
+    // Every row has the same height, so the view can skip measuring them
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(widgets->tree_view), TRUE);
+    gtk_tree_view_set_headers_clickable(GTK_TREE_VIEW(widgets->tree_view), FALSE);
 
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     gtk_container_add(GTK_CONTAINER(scrolled_window), widgets->tree_view);
     gtk_widget_set_vexpand(scrolled_window, TRUE);
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
-
+    // The selected patient's visits sit under the table
+    GtkWidget *paned = gtk_paned_new(GTK_ORIENTATION_VERTICAL);
+    gtk_paned_pack1(GTK_PANED(paned), scrolled_window, TRUE, FALSE);
+    gtk_paned_pack2(GTK_PANED(paned), create_history_pane(widgets), FALSE, FALSE);
+    gtk_box_pack_start(GTK_BOX(vbox), paned, TRUE, TRUE, 0);
+    // Reaching the end, or pushing past it when already there
+    g_signal_connect(scrolled_window, "edge-reached", G_CALLBACK(on_patients_edge), widgets);
+    g_signal_connect(scrolled_window, "edge-overshot", G_CALLBACK(on_patients_edge), widgets);
+
+    widgets->status_label = gtk_label_new("Loading patients...");
+    gtk_label_set_xalign(GTK_LABEL(widgets->status_label), 0);
+    gtk_box_pack_start(GTK_BOX(vbox), widgets->status_label, FALSE, FALSE, 0);
+
+    g_signal_connect(select_all_button, "clicked", G_CALLBACK(on_select_all), widgets);
     g_signal_connect(add_button, "clicked", G_CALLBACK(on_add_patient), widgets);
     g_signal_connect(edit_button, "clicked", G_CALLBACK(on_edit_patient), widgets);
     g_signal_connect(delete_button, "clicked", G_CALLBACK(on_delete_patient), widgets);
     g_signal_connect(export_button, "clicked", G_CALLBACK(on_export_csv), widgets);
-    g_signal_connect(widgets->search_entry, "search-changed", G_CALLBACK(on_search_changed), widgets);
-
+    g_signal_connect(import_button, "clicked", G_CALLBACK(on_import_csv), widgets);
+    g_signal_connect(duplicates_button, "clicked", G_CALLBACK(on_find_duplicates), widgets);
+    g_signal_connect(gtk_tree_view_get_selection(GTK_TREE_VIEW(widgets->tree_view)), "changed",
+                     G_CALLBACK(on_patient_selection_changed), widgets);
+    // Plain "changed" so the debounce below is the only delay
+    g_signal_connect(widgets->search_entry, "changed", G_CALLBACK(on_search_changed), widgets);
+    g_signal_connect(vbox, "destroy", G_CALLBACK(on_patients_tab_destroy), widgets);
+
+    startup->widgets = widgets;
+    if (startup->ready) adopt_patients(widgets);
     return vbox;
 }
 
-static void load_patients(GtkListStore *store) {
-    FILE *file = fopen(PATIENTS_FILE, "r");
-    if (!file) return;
+static void on_patients_tab_destroy(GtkWidget *widget, PatientWidgets *widgets) {
+    if (widgets->search_timeout) g_source_remove(widgets->search_timeout);
+    widgets->search_timeout = 0;
+    if (widgets->stream_idle) g_source_remove(widgets->stream_idle);
+    widgets->stream_idle = 0;
+    if (widgets->registry_watch) g_source_remove(widgets->registry_watch);
+    widgets->registry_watch = 0;
+    if (widgets->history_idle) g_source_remove(widgets->history_idle);
+    widgets->history_idle = 0;
+    if (widgets->registry_added) g_array_free(widgets->registry_added, TRUE);
+    if (widgets->registry_changed) g_array_free(widgets->registry_changed, TRUE);
+    widgets->registry_added = NULL;
+    widgets->registry_changed = NULL;
+    widgets->startup->widgets = NULL;
+    if (widgets->export) {
+        // The snapshot borrows the store's strings, so the export ends first
+        atomic_store(&widgets->export->cancel, true);
+        g_thread_join(widgets->export->thread);
+        export_task_free(widgets->export);
+        widgets->export = NULL;
+    }
+    if (widgets->duplicates) {
+        atomic_store(&widgets->duplicates->cancel, true);
+        g_thread_join(widgets->duplicates->thread);
+        duplicate_task_free(widgets->duplicates);
+        widgets->duplicates = NULL;
+    }
+    gtk_tree_view_set_model(GTK_TREE_VIEW(widgets->tree_view), NULL);
+    g_clear_object(&widgets->model);
+    g_clear_object(&widgets->history);
+    encounter_store_close(widgets->encounters);
+    widgets->encounters = NULL;
+    triage_engine_free(widgets->triage);
+    widgets->triage = NULL;
+    // Flushes the last group commit to disk, or drops the mirror
+    if (widgets->client) registry_client_close(widgets->client);
+    else patient_store_close(widgets->patients);
+    widgets->client = NULL;
+    widgets->patients = NULL;
+}
 
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
-        char *name = strtok(line, ",");
-        char *age_str = strtok(NULL, ",");
-        char *gender = strtok(NULL, ",");
-        char *timestamp = strtok(NULL, ",");
+// Many rows at once (an import) refilter the view in one go, detached from it meanwhile
+static void show_added_patients(PatientWidgets *widgets, const PatientHandle *handles, guint count) {
+    if (count <= BULK_ROWS) {
+        for (guint i = 0; i < count; i++) patient_model_record_added(widgets->model, handles[i]);
+        return;
+    }
+    GtkTreeView *view = GTK_TREE_VIEW(widgets->tree_view);
+    LatencyProbe probe = latency_begin(LATENCY_REFILTER);
+    gtk_tree_view_set_model(view, NULL);
+    patient_model_records_added(widgets->model, handles, count);
+    gtk_tree_view_set_model(view, GTK_TREE_MODEL(widgets->model));
+    latency_end(probe);
+}
 
-        if (name && age_str && gender && timestamp) {
-            GtkTreeIter iter;
-            gtk_list_store_append(store, &iter);
-            gtk_list_store_set(store, &iter, COL_NAME, name, COL_AGE, atoi(age_str), COL_GENDER, gender, COL_TIMESTAMP, timestamp, -1);
+// The same for rows changed or deleted together (a bulk edit), which may
+// move or leave the view
+static void show_changed_patients(PatientWidgets *widgets, const PatientHandle *handles, guint count) {
+    if (count <= BULK_ROWS) {
+        for (guint i = 0; i < count; i++) {
+            if (patient_store_find(widgets->patients, handles[i]) >= 0) {
+                patient_model_record_changed(widgets->model, handles[i]);
+            } else {
+                patient_model_record_deleted(widgets->model, handles[i]);
+            }
         }
+        return;
     }
-    fclose(file);
+    GtkTreeView *view = GTK_TREE_VIEW(widgets->tree_view);
+    LatencyProbe probe = latency_begin(LATENCY_REFILTER);
+    gtk_tree_view_set_model(view, NULL);
+    patient_model_records_changed(widgets->model, handles, count);
+    gtk_tree_view_set_model(view, GTK_TREE_MODEL(widgets->model));
+    latency_end(probe);
 }
 
-static void save_patients(GtkListStore *store, GtkWindow *parent_window) {
-    FILE *file = fopen(PATIENTS_FILE, "w");
-    if (!file) {
-        show_message(parent_window, GTK_MESSAGE_ERROR, "Error", "Could not save patient data.");
+// Loads the archived months that overlap from..to and shows their patients.
+// A mirror of the daemon has no archive of its own: the daemon loaded it all.
+static void show_archived_patients(PatientWidgets *widgets, int64_t from, int64_t to) {
+    int64_t horizon = patient_store_archive_horizon(widgets->patients);
+    if (horizon == PATIENT_TIME_UNKNOWN || from >= horizon) return;
+    PatientHandle first;
+    size_t before = patient_store_count(widgets->patients);
+    if (patient_store_load_archive(widgets->patients, from, to, &first) < 0) {
+        g_warning("Could not load all of the archive: %s", g_strerror(errno));
+    }
+    guint loaded = patient_store_count(widgets->patients) - before;
+    PatientHandle *handles = g_new(PatientHandle, loaded);
+    for (guint i = 0; i < loaded; i++) handles[i] = first + i;
+    show_added_patients(widgets, handles, loaded);
+    g_free(handles);
+}
+
+// Scrolling to the oldest end of the list, sorted by admission, brings in the
+// latest archived month still on disk. In ascending order its rows land above
+// those in view, which are scrolled back to.
+static void on_patients_edge(GtkScrolledWindow *scrolled_window, GtkPositionType pos, PatientWidgets *widgets) {
+    gint column;
+    GtkSortType order;
+    if (!widgets->patients || widgets->stream_idle || (pos != GTK_POS_TOP && pos != GTK_POS_BOTTOM)) return;
+    if (!gtk_tree_sortable_get_sort_column_id(GTK_TREE_SORTABLE(widgets->model), &column, &order)
+        || column != COL_TIMESTAMP || (order == GTK_SORT_ASCENDING) != (pos == GTK_POS_TOP)) {
         return;
     }
-    GtkTreeIter iter;
-    if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter)) {
-        do {
-            char *name, *gender, *timestamp;
-            guint age;
-            gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, COL_NAME, &name, COL_AGE, &age, COL_GENDER, &gender, COL_TIMESTAMP, &timestamp, -1);
-            fprintf(file, "%s,%u,%s,%s\n", name, age, gender, timestamp);
-            g_free(name); g_free(gender); g_free(timestamp);
-        } while (gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter));
+    int64_t horizon = patient_store_archive_horizon(widgets->patients);
+    if (horizon == PATIENT_TIME_UNKNOWN) return;
+    guint visible = patient_model_visible_count(widgets->model);
+    show_archived_patients(widgets, horizon - 1, horizon - 1);
+    guint shown = patient_model_visible_count(widgets->model) - visible;
+    if (order == GTK_SORT_ASCENDING && shown > 0 && visible > 0) {
+        GtkTreePath *path = gtk_tree_path_new_from_indices(shown, -1);
+        gtk_tree_view_scroll_to_cell(GTK_TREE_VIEW(widgets->tree_view), path, NULL, TRUE, 0, 0);
+        gtk_tree_path_free(path);
+    }
+}
+
+// --- Registry Daemon ---
+
+static void show_registry_added(PatientWidgets *widgets) {
+    GArray *added = widgets->registry_added;
+    show_added_patients(widgets, (const PatientHandle*)added->data, added->len);
+    g_array_set_size(added, 0);
+}
+
+static void show_registry_changed(PatientWidgets *widgets) {
+    GArray *changed = widgets->registry_changed;
+    show_changed_patients(widgets, (const PatientHandle*)changed->data, changed->len);
+    g_array_set_size(changed, 0);
+}
+
+// Gathers runs of additions, and of changes and deletions, so a bulk edit
+// at any workstation reaches the view in one go. Each run is shown before
+// one of the other kind starts, as it may concern the same rows.
+static void on_registry_change(RegistryChange change, PatientHandle handle, void *user_data) {
+    PatientWidgets *widgets = user_data;
+    if (change == REGISTRY_CHANGE_ADDED) {
+        show_registry_changed(widgets);
+        g_array_append_val(widgets->registry_added, handle);
+    } else {
+        show_registry_added(widgets);
+        g_array_append_val(widgets->registry_changed, handle);
+    }
+}
+
+// Brings the view up to date with every change the daemon has announced,
+// this window's own included. Returns FALSE once the daemon is gone.
+static gboolean sync_registry(PatientWidgets *widgets) {
+    int result = registry_client_dispatch(widgets->client, on_registry_change, widgets);
+    show_registry_added(widgets);
+    show_registry_changed(widgets);
+    if (result == 0) return TRUE;
+    g_warning("Lost the registry daemon: %s", g_strerror(errno));
+    if (widgets->registry_watch) g_source_remove(widgets->registry_watch);
+    widgets->registry_watch = 0;
+    // What's shown stays readable, but changes would go nowhere
+    gtk_widget_set_sensitive(widgets->toolbar, FALSE);
+    gtk_label_set_text(GTK_LABEL(widgets->status_label), "The registry daemon has stopped; restart to reconnect.");
+    gtk_widget_show(widgets->status_label);
+    return FALSE;
+}
+
+static gboolean on_registry_readable(gint fd, GIOCondition condition, gpointer data) {
+    PatientWidgets *widgets = data;
+    if (sync_registry(widgets)) return G_SOURCE_CONTINUE;
+    // sync_registry removed the source already
+    return G_SOURCE_REMOVE;
+}
+
+static void log_startup_times(StartupTask *task, guint rows) {
+    gint64 streamed = g_get_monotonic_time();
+    double ms = 1e-3;
+    g_message("Startup: gtk_init %.0f ms, CSS %.0f ms, store open %.0f ms, name index %.0f ms alongside sort %.0f ms; "
+              "data ready at %.0f ms, login at %.0f ms, first rows at %.0f ms, all %u rows at %.0f ms",
+              (task->gtk_ready - task->launched) * ms, (task->css_ready - task->gtk_ready) * ms,
+              task->stats.seconds * 1e3, task->index_us * ms, task->sort_us * ms,
+              (task->loaded - task->launched) * ms, (task->logged_in - task->launched) * ms,
+              (task->first_rows - task->launched) * ms, rows, (streamed - task->launched) * ms);
+}
+
+// Moves rows into the view in batches from an idle callback, so the window
+// paints and reacts between them instead of freezing for the whole table
+static gboolean stream_patients(gpointer data) {
+    PatientWidgets *widgets = data;
+    StartupTask *startup = widgets->startup;
+    gint64 deadline = g_get_monotonic_time() + STREAM_BUDGET_US;
+    gboolean more;
+    do {
+        more = patient_model_stream_rows(widgets->model, STREAM_BATCH_ROWS);
+        if (!startup->first_rows) startup->first_rows = g_get_monotonic_time();
+    } while (more && g_get_monotonic_time() < deadline);
+
+    guint shown = patient_model_visible_count(widgets->model), total = patient_model_total_count(widgets->model);
+    if (more) {
+        char *text = g_strdup_printf("Loading patients... %u of %u", shown, total);
+        gtk_label_set_text(GTK_LABEL(widgets->status_label), text);
+        g_free(text);
+        return G_SOURCE_CONTINUE;
+    }
+    widgets->stream_idle = 0;
+    gtk_widget_hide(widgets->status_label);
+    gtk_widget_set_sensitive(widgets->toolbar, TRUE);
+    gtk_tree_view_set_headers_clickable(GTK_TREE_VIEW(widgets->tree_view), TRUE);
+    log_startup_times(startup, total);
+    if (widgets->client) {
+        // Events queued up while streaming; the model can take them now
+        widgets->registry_added = g_array_new(FALSE, FALSE, sizeof(PatientHandle));
+        widgets->registry_changed = g_array_new(FALSE, FALSE, sizeof(PatientHandle));
+        widgets->registry_watch = g_unix_fd_add(registry_client_fd(widgets->client), G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                                on_registry_readable, widgets);
+        sync_registry(widgets);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Takes over the store and model that startup loaded; the model serves rows
+// from the store directly, so nothing is copied into the view
+static void adopt_patients(PatientWidgets *widgets) {
+    StartupTask *startup = widgets->startup;
+    widgets->patients = startup->patients;
+    widgets->client = startup->client;
+    widgets->encounters = startup->encounters;
+    widgets->model = startup->model;
+    startup->patients = NULL;
+    startup->client = NULL;
+    startup->encounters = NULL;
+    startup->model = NULL;
+    gtk_tree_view_set_model(GTK_TREE_VIEW(widgets->tree_view), GTK_TREE_MODEL(widgets->model));
+    widgets->stream_idle = g_idle_add(stream_patients, widgets);
+}
+
+static void check_patient_saved(int result, GtkWindow *parent_window) {
+    if (result != 0 && errno == EROFS) {
+        show_message(parent_window, GTK_MESSAGE_INFO, "Archived Patient", "Archived patients are read-only.");
+    } else if (result != 0) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Error", "Could not save patient data.");
     }
-    fclose(file);
 }
 
 static gboolean show_patient_dialog(GtkWindow *parent, const char* title, char **name, guint *age, char **gender) {
@@ -351,7 +796,7 @@ static gboolean show_patient_dialog(GtkWindow *parent, const char* title, char *
     gtk_grid_attach(GTK_GRID(grid), name_entry, 1, 0, 1, 1);
 
     gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Age:"), 0, 1, 1, 1);
-    GtkWidget *age_spin = gtk_spin_button_new_with_range(0, 150, 1);
+    GtkWidget *age_spin = gtk_spin_button_new_with_range(0, PATIENT_MAX_AGE, 1);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(age_spin), *age);
     gtk_grid_attach(GTK_GRID(grid), age_spin, 1, 1, 1, 1);
     
@@ -387,141 +832,1182 @@ static gboolean show_patient_dialog(GtkWindow *parent, const char* title, char *
     return result;
 }
 
+// Asks before adding someone who looks registered already. A check that
+// runs out of memory doesn't stand in the way.
+static gboolean confirm_new_patient(PatientWidgets *widgets, GtkWindow *parent_window, const char *name, guint age,
+                                    const char *gender) {
+    PatientDuplicate *pairs;
+    long count = patient_duplicates_check(widgets->patients, name, age, gender, &pairs);
+    if (count <= 0) return TRUE;
+    GString *similar = g_string_new(NULL);
+    for (long i = 0; i < count && i < DUPLICATE_MATCHES_SHOWN; i++) {
+        PatientRecord record;
+        char added[PATIENT_ADDED_LEN];
+        patient_store_get(widgets->patients, patient_store_find(widgets->patients, pairs[i].second), &record);
+        patient_time_format(record.added, added);
+        g_string_append_printf(similar, "\n%s, %u, %s, added %s", record.name, record.age, record.gender, added);
+    }
+    if (count > DUPLICATE_MATCHES_SHOWN) g_string_append_printf(similar, "\n... and %ld more", count - DUPLICATE_MATCHES_SHOWN);
+    free(pairs);
+    GtkWidget *dialog = gtk_message_dialog_new(parent_window, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION,
+                                               GTK_BUTTONS_YES_NO, "%s may already be registered. Add anyway?", name);
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), "Similar patients:%s", similar->str);
+    gboolean confirmed = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES;
+    gtk_widget_destroy(dialog);
+    g_string_free(similar, TRUE);
+    return confirmed;
+}
+
 static void on_add_patient(GtkButton *button, PatientWidgets *widgets) {
     char *name = NULL, *gender = NULL; guint age = 30;
     GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
-    if (show_patient_dialog(parent_window, "Add New Patient", &name, &age, &gender)) {
-        GtkTreeIter iter;
-        gtk_list_store_append(widgets->store, &iter);
-        gtk_list_store_set(widgets->store, &iter, COL_NAME, name, COL_AGE, age, COL_GENDER, gender, COL_TIMESTAMP, get_current_timestamp(), -1);
-        save_patients(widgets->store, parent_window);
+    if (show_patient_dialog(parent_window, "Add New Patient", &name, &age, &gender)
+        && confirm_new_patient(widgets, parent_window, name, age, gender)) {
+        PatientHandle handle = PATIENT_NO_HANDLE;
+        int result;
+        if (widgets->client) {
+            result = registry_client_add(widgets->client, name, age, gender, patient_time_now(), &handle);
+            sync_registry(widgets);
+        } else {
+            result = patient_store_add(widgets->patients, name, age, gender, patient_time_now(), &handle);
+            // Added in memory even when the journal write failed
+            if (result == 0 || errno == EIO) patient_model_record_added(widgets->model, handle);
+        }
+        check_patient_saved(result, parent_window);
     }
     g_free(name); g_free(gender);
 }
 
-static void on_edit_patient(GtkButton *button, PatientWidgets *widgets) {
+static void collect_selected(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data) {
+    guint handle;
+    gtk_tree_model_get(model, iter, COL_HANDLE, &handle, -1);
+    g_array_append_val((GArray*)data, handle);
+}
+
+// Handles of the selected rows, in view order
+static GArray* selected_handles(PatientWidgets *widgets) {
     GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(widgets->tree_view));
-    GtkTreeIter iter, store_iter; GtkTreeModel *model;
-    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        char *name = NULL, *gender = NULL; guint age = 0;
-        gtk_tree_model_filter_convert_iter_to_child_iter(GTK_TREE_MODEL_FILTER(model), &store_iter, &iter);
-        gtk_tree_model_get(GTK_TREE_MODEL(widgets->store), &store_iter, COL_NAME, &name, COL_AGE, &age, COL_GENDER, &gender, -1);
-        if (show_patient_dialog(parent_window, "Edit Patient", &name, &age, &gender)) {
-            gtk_list_store_set(widgets->store, &store_iter, COL_NAME, name, COL_AGE, age, COL_GENDER, gender, -1);
-            save_patients(widgets->store, parent_window);
+    GArray *handles = g_array_sized_new(FALSE, FALSE, sizeof(PatientHandle),
+                                        gtk_tree_selection_count_selected_rows(selection));
+    gtk_tree_selection_selected_foreach(selection, collect_selected, handles);
+    return handles;
+}
+
+// Age and gender to give every selected patient; FALSE if cancelled. *age
+// is -1 and *gender NULL where the field stays as it is.
+static gboolean show_bulk_edit_dialog(GtkWindow *parent, guint count, gint *age, char **gender) {
+    char *title = g_strdup_printf("Edit %u Patients", count);
+    GtkWidget *dialog = gtk_dialog_new_with_buttons(title, parent, GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT, "_OK", GTK_RESPONSE_ACCEPT, "_Cancel", GTK_RESPONSE_CANCEL, NULL);
+    g_free(title);
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 10);
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
+    gtk_container_set_border_width(GTK_CONTAINER(grid), 10);
+    gtk_container_add(GTK_CONTAINER(content_area), grid);
+
+    GtkWidget *age_check = gtk_check_button_new_with_label("Age:");
+    GtkWidget *age_spin = gtk_spin_button_new_with_range(0, PATIENT_MAX_AGE, 1);
+    gtk_grid_attach(GTK_GRID(grid), age_check, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), age_spin, 1, 0, 1, 1);
+
+    GtkWidget *gender_check = gtk_check_button_new_with_label("Gender:");
+    GtkWidget *gender_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gender_combo), "Male");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gender_combo), "Female");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gender_combo), "Other");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(gender_combo), 0);
+    gtk_grid_attach(GTK_GRID(grid), gender_check, 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gender_combo, 1, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Only the ticked fields change; names stay as they are."), 0, 2, 2, 1);
+    gtk_widget_show_all(dialog);
+
+    gboolean result = FALSE;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        gboolean set_age = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(age_check));
+        gboolean set_gender = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gender_check));
+        *age = set_age ? gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(age_spin)) : -1;
+        *gender = set_gender ? gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(gender_combo)) : NULL;
+        result = set_age || set_gender;
+    }
+    gtk_widget_destroy(dialog);
+    return result;
+}
+
+static void edit_one_patient(PatientWidgets *widgets, GtkWindow *parent_window, PatientHandle handle) {
+    PatientRecord record;
+    patient_store_get(widgets->patients, patient_store_find(widgets->patients, handle), &record);
+    char *name = g_strdup(record.name), *gender = g_strdup(record.gender);
+    guint age = record.age;
+    if (show_patient_dialog(parent_window, "Edit Patient", &name, &age, &gender)) {
+        int result;
+        if (widgets->client) {
+            result = registry_client_update(widgets->client, handle, name, age, gender);
+            sync_registry(widgets);
+        } else {
+            result = patient_store_update(widgets->patients, handle, name, age, gender);
+            patient_model_record_changed(widgets->model, handle);
         }
-        g_free(name); g_free(gender);
+        check_patient_saved(result, parent_window);
+    }
+    g_free(name); g_free(gender);
+}
+
+// One batch for the store or the daemon, and one refilter for the view
+static void edit_many_patients(PatientWidgets *widgets, GtkWindow *parent_window, const PatientHandle *handles,
+                               guint count) {
+    gint age;
+    char *gender;
+    if (!show_bulk_edit_dialog(parent_window, count, &age, &gender)) return;
+    PatientRecord *records = g_new(PatientRecord, count);
+    for (guint i = 0; i < count; i++) {
+        patient_store_get(widgets->patients, patient_store_find(widgets->patients, handles[i]), &records[i]);
+        if (age >= 0) records[i].age = age;
+        if (gender) records[i].gender = gender;
+    }
+    int result;
+    if (widgets->client) {
+        result = registry_client_update_batch(widgets->client, records, count, NULL);
+        sync_registry(widgets);
+    } else {
+        result = patient_store_update_batch(widgets->patients, records, count);
+        show_changed_patients(widgets, handles, count);
+    }
+    check_patient_saved(result, parent_window);
+    g_free(records);
+    g_free(gender);
+}
+
+static void on_edit_patient(GtkButton *button, PatientWidgets *widgets) {
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
+    GArray *handles = selected_handles(widgets);
+    if (handles->len == 1) {
+        edit_one_patient(widgets, parent_window, g_array_index(handles, PatientHandle, 0));
+    } else if (handles->len > 1) {
+        edit_many_patients(widgets, parent_window, (const PatientHandle*)handles->data, handles->len);
     } else {
         show_message(parent_window, GTK_MESSAGE_INFO, "No Selection", "Please select a patient to edit.");
     }
+    g_array_free(handles, TRUE);
 }
 
+// However many are selected, one question, one batch and one refilter
 static void on_delete_patient(GtkButton *button, PatientWidgets *widgets) {
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
+    GArray *handles = selected_handles(widgets);
+    guint count = handles->len;
+    if (count == 0) {
+        show_message(parent_window, GTK_MESSAGE_INFO, "No Selection", "Please select a patient to delete.");
+        g_array_free(handles, TRUE);
+        return;
+    }
+    GtkWidget *dialog = count == 1
+        ? gtk_message_dialog_new(parent_window, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO, "Are you sure you want to delete this patient?")
+        : gtk_message_dialog_new(parent_window, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO, "Are you sure you want to delete these %u patients?", count);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES) {
+        const PatientHandle *selected = (const PatientHandle*)handles->data;
+        int result;
+        if (widgets->client) {
+            PatientRecord *records = g_new0(PatientRecord, count);
+            for (guint i = 0; i < count; i++) records[i].handle = selected[i];
+            result = registry_client_delete_batch(widgets->client, records, count, NULL);
+            g_free(records);
+            sync_registry(widgets);
+        } else {
+            result = patient_store_delete_batch(widgets->patients, selected, count);
+            show_changed_patients(widgets, selected, count);
+        }
+        check_patient_saved(result, parent_window);
+    }
+    gtk_widget_destroy(dialog);
+    g_array_free(handles, TRUE);
+}
+
+// Every row the search shows, for a bulk edit or delete
+static void on_select_all(GtkButton *button, PatientWidgets *widgets) {
+    gtk_tree_selection_select_all(gtk_tree_view_get_selection(GTK_TREE_VIEW(widgets->tree_view)));
+}
+
+// --- Visit History ---
+
+// Lists the visits of the one selected patient, newest first, from a single
+// read of their file; anything else selected clears the pane
+static void show_history(PatientWidgets *widgets) {
     GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(widgets->tree_view));
-    GtkTreeIter iter, store_iter; GtkTreeModel *model;
+    PatientRecord record;
+    PatientId patient = PATIENT_NO_ID;
+    if (widgets->patients && gtk_tree_selection_count_selected_rows(selection) == 1) {
+        GArray *handles = selected_handles(widgets);
+        long row = patient_store_find(widgets->patients, g_array_index(handles, PatientHandle, 0));
+        g_array_free(handles, TRUE);
+        if (row >= 0) {
+            patient_store_get(widgets->patients, row, &record);
+            patient = record.id;
+        }
+    }
+    widgets->history_patient = widgets->encounters ? patient : PATIENT_NO_ID;
+    gtk_widget_set_sensitive(gtk_widget_get_parent(widgets->visit_entry), widgets->history_patient != PATIENT_NO_ID);
+
+    GtkTreeView *view = GTK_TREE_VIEW(widgets->history_view);
+    gtk_tree_view_set_model(view, NULL);
+    gtk_list_store_clear(widgets->history);
+    if (patient == PATIENT_NO_ID) {
+        gtk_label_set_text(GTK_LABEL(widgets->history_label), "Select a patient to see their visits.");
+    } else if (!widgets->encounters) {
+        gtk_label_set_text(GTK_LABEL(widgets->history_label), "Patient visits are unavailable.");
+    } else {
+        LatencyProbe probe = latency_begin(LATENCY_HISTORY);
+        EncounterList *visits = encounter_store_history(widgets->encounters, patient);
+        char *text;
+        if (visits) {
+            size_t count = encounter_list_count(visits);
+            for (size_t i = count; i-- > 0;) {
+                const Encounter *visit = encounter_list_get(visits, i);
+                char when[PATIENT_ADDED_LEN];
+                patient_time_format(visit->time, when);
+                gtk_list_store_insert_with_values(widgets->history, NULL, -1, HISTORY_COL_WHEN, when,
+                                                  HISTORY_COL_DEPARTMENT, visit->department,
+                                                  HISTORY_COL_NOTE, visit->note, -1);
+            }
+            text = g_strdup_printf("Visits of %s, MRN %u: %zu", record.name, patient, count);
+            encounter_list_free(visits);
+        } else {
+            text = g_strdup_printf("Could not read the visits of %s: %s", record.name, g_strerror(errno));
+        }
+        latency_end(probe);
+        gtk_label_set_text(GTK_LABEL(widgets->history_label), text);
+        g_free(text);
+    }
+    gtk_tree_view_set_model(view, GTK_TREE_MODEL(widgets->history));
+}
+
+static gboolean refresh_history(gpointer data) {
+    PatientWidgets *widgets = data;
+    widgets->history_idle = 0;
+    show_history(widgets);
+    return G_SOURCE_REMOVE;
+}
+
+// A bulk change can change the selection once per row; the pane catches up once
+static void on_patient_selection_changed(GtkTreeSelection *selection, PatientWidgets *widgets) {
+    if (!widgets->history_idle) widgets->history_idle = g_idle_add(refresh_history, widgets);
+}
+
+// Records a visit now, in the department triage suggests for its reason
+static void on_record_visit(GtkButton *button, PatientWidgets *widgets) {
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
+    const char *reason = gtk_entry_get_text(GTK_ENTRY(widgets->visit_entry));
+    if (widgets->history_patient == PATIENT_NO_ID) return;
+    if (strlen(reason) == 0) {
+        show_message(parent_window, GTK_MESSAGE_INFO, "No Reason", "Please enter the reason for the visit.");
+        return;
+    }
+    Encounter visit = { widgets->history_patient, patient_time_now(), triage_suggest(widgets->triage, reason, NULL),
+                        reason };
+    if (encounter_store_append(widgets->encounters, &visit, 1) != 0) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Error", "Could not save the visit.");
+        return;
+    }
+    gtk_entry_set_text(GTK_ENTRY(widgets->visit_entry), "");
+    show_history(widgets);
+}
+
+typedef struct {
+    GString *text;
+    size_t count;
+} ImportRejects;
+
+static void collect_rejected(size_t line, const char *reason, void *user_data) {
+    ImportRejects *rejects = user_data;
+    if (rejects->count++ < IMPORT_REJECTS_SHOWN) g_string_append_printf(rejects->text, "\nLine %zu: %s", line, reason);
+}
+
+// One batch for the store or the daemon, and one refilter for the view
+static void commit_import(PatientWidgets *widgets, const PatientRecord *records, size_t count, GtkWindow *parent) {
+    int result;
+    if (widgets->client) {
+        result = registry_client_add_batch(widgets->client, records, count, NULL);
+        sync_registry(widgets);
+    } else {
+        PatientHandle first;
+        size_t before = patient_store_count(widgets->patients);
+        result = patient_store_add_batch(widgets->patients, records, count, &first);
+        // Whatever went in is shown, even if memory or the journal failed partway
+        guint added = patient_store_count(widgets->patients) - before;
+        PatientHandle *handles = g_new(PatientHandle, added);
+        for (guint i = 0; i < added; i++) handles[i] = first + i;
+        show_added_patients(widgets, handles, added);
+        g_free(handles);
+    }
+    check_patient_saved(result, parent);
+}
+
+// Reads and checks the whole file first, then asks before adding anything
+static void on_import_csv(GtkButton *button, PatientWidgets *widgets) {
     GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        GtkWidget *dialog = gtk_message_dialog_new(parent_window, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO, "Are you sure you want to delete this patient?");
-        if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES) {
-            gtk_tree_model_filter_convert_iter_to_child_iter(GTK_TREE_MODEL_FILTER(model), &store_iter, &iter);
-            gtk_list_store_remove(widgets->store, &store_iter);
-            save_patients(widgets->store, parent_window);
+    GtkWidget *chooser = gtk_file_chooser_dialog_new("Import Patients", parent_window, GTK_FILE_CHOOSER_ACTION_OPEN,
+                                                     "_Cancel", GTK_RESPONSE_CANCEL, "_Import", GTK_RESPONSE_ACCEPT, NULL);
+    GtkFileFilter *filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "CSV files");
+    gtk_file_filter_add_pattern(filter, "*.csv");
+    gtk_file_filter_add_pattern(filter, "*.CSV");
+    gtk_file_filter_add_pattern(filter, "*.csv.gz");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(chooser), filter);
+    GtkWidget *columns_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(columns_entry), "Columns if the titles differ, e.g. name=Patient Name,age=3");
+    gtk_entry_set_width_chars(GTK_ENTRY(columns_entry), 50);
+    gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(chooser), columns_entry);
+    char *path = NULL, *columns = NULL;
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+        path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+        columns = g_strdup(gtk_entry_get_text(GTK_ENTRY(columns_entry)));
+    }
+    gtk_widget_destroy(chooser);
+    if (!path) return;
+
+    // Patients registered long ago count as already there too
+    show_archived_patients(widgets, INT64_MIN, INT64_MAX);
+    ImportRejects rejects = { g_string_new(NULL), 0 };
+    PatientImportOptions options = { .columns = columns, .reject = collect_rejected, .user_data = &rejects };
+    PatientImportStats stats;
+    char error[160];
+    PatientImport *import = patient_import_read(path, widgets->patients, &options, &stats, error, sizeof(error));
+    if (!import) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Import Error", errno == EINVAL ? error : g_strerror(errno));
+    } else {
+        size_t count;
+        const PatientRecord *records = patient_import_records(import, &count);
+        if (rejects.count > IMPORT_REJECTS_SHOWN) {
+            g_string_append_printf(rejects.text, "\n... and %zu more", rejects.count - IMPORT_REJECTS_SHOWN);
         }
+        GtkWidget *dialog = gtk_message_dialog_new(parent_window, GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                   count ? GTK_MESSAGE_QUESTION : GTK_MESSAGE_INFO,
+                                                   count ? GTK_BUTTONS_YES_NO : GTK_BUTTONS_OK,
+                                                   "Add %zu new patients from %zu rows?", count, stats.rows);
+        gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+                                                 "%zu rows were rejected and %zu were already registered.%s",
+                                                 stats.rejected, stats.duplicates, rejects.text->str);
+        gboolean confirmed = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES;
         gtk_widget_destroy(dialog);
-    } else {
-        show_message(parent_window, GTK_MESSAGE_INFO, "No Selection", "Please select a patient to delete.");
+        if (confirmed) commit_import(widgets, records, count, parent_window);
+        patient_import_free(import);
     }
+    g_string_free(rejects.text, TRUE);
+    g_free(columns);
+    g_free(path);
+}
+
+static void export_progress(size_t rows_done, size_t rows_total, void *user_data) {
+    ExportTask *task = user_data;
+    atomic_store(&task->rows_done, rows_done);
+}
+
+static gpointer export_worker(gpointer data) {
+    ExportTask *task = data;
+    PatientExportOptions options = { .gzip = task->gzip, .json_lines = task->json_lines, .cancel = &task->cancel,
+                                     .progress = export_progress, .user_data = task };
+    task->result = task->changes ? patient_export_changes(task->changes, task->path, &options)
+                                 : patient_export_csv(task->snapshot, task->path, &options);
+    task->error = errno;
+    atomic_store(&task->finished, true);
+    return NULL;
+}
+
+static void export_task_free(ExportTask *task) {
+    if (task->poll_timeout) g_source_remove(task->poll_timeout);
+    if (task->dialog) gtk_widget_destroy(task->dialog);
+    patient_snapshot_free(task->snapshot);
+    patient_changes_free(task->changes);
+    g_free(task->path);
+    g_free(task);
 }
 
+static gboolean poll_export(gpointer data) {
+    ExportTask *task = data;
+    size_t total = task->changes ? patient_changes_count(task->changes) : patient_snapshot_count(task->snapshot);
+    size_t done = atomic_load(&task->rows_done);
+    if (task->progress_bar) {
+        char *text = g_strdup_printf(task->changes ? "%zu of %zu changes" : "%zu of %zu patients", done, total);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(task->progress_bar), total ? (double)done / total : 1.0);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(task->progress_bar), text);
+        g_free(text);
+    }
+    if (!atomic_load(&task->finished)) return G_SOURCE_CONTINUE;
+
+    g_thread_join(task->thread);
+    task->poll_timeout = 0;
+    PatientWidgets *widgets = task->widgets;
+    widgets->export = NULL;
+    gtk_widget_set_sensitive(widgets->export_button, TRUE);
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(widgets->export_button));
+    if (task->result == 0 && task->changes) {
+        char *message = g_strdup_printf(patient_changes_full(task->changes)
+                                            ? "No earlier changes were kept, so all %zu patients were exported to %s"
+                                            : "%zu changes exported to %s",
+                                        patient_changes_count(task->changes), task->path);
+        show_message(parent_window, GTK_MESSAGE_INFO, "Export Success", message);
+        g_free(message);
+    } else if (task->result == 0) {
+        char *message = g_strdup_printf("Patient data exported to %s", task->path);
+        show_message(parent_window, GTK_MESSAGE_INFO, "Export Success", message);
+        g_free(message);
+    } else if (task->error != ECANCELED) {
+        char *message = g_strdup_printf("Could not write %s: %s", task->path, g_strerror(task->error));
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Export Error", message);
+        g_free(message);
+    }
+    export_task_free(task);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_export_dialog_response(GtkDialog *dialog, gint response_id, ExportTask *task) {
+    // Closing the window cancels too; the poll tears the dialog down
+    atomic_store(&task->cancel, true);
+    gtk_dialog_set_response_sensitive(dialog, GTK_RESPONSE_CANCEL, FALSE);
+}
+
+// Asks for a target file, then streams a snapshot of the records, or what
+// changed since the last change export to that file, to it on a worker
+// thread so the window stays responsive; edits made meanwhile don't affect
+// the file
 static void on_export_csv(GtkButton *button, PatientWidgets *widgets) {
     GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
-    FILE *file = fopen("patients_export.csv", "w");
-    if (!file) {
-        show_message(parent_window, GTK_MESSAGE_ERROR, "Export Error", "Could not create patients_export.csv");
+    if (widgets->export) return;
+    GtkWidget *chooser = gtk_file_chooser_dialog_new("Export Patients", parent_window, GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                     "_Cancel", GTK_RESPONSE_CANCEL, "_Export", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(chooser), TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(chooser), "patients_export.csv");
+    GtkWidget *options_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 4);
+    GtkWidget *gzip_check = gtk_check_button_new_with_label("Compress with gzip (.gz)");
+    gtk_widget_set_tooltip_text(gzip_check, "A file named .gz is compressed either way");
+    GtkWidget *changes_check = gtk_check_button_new_with_label("Only what changed since the last export to this file");
+    gtk_widget_set_tooltip_text(changes_check, "Name the file .jsonl for JSON Lines instead of CSV");
+    // The daemon keeps the change history; its mirror here starts afresh
+    if (widgets->client) {
+        gtk_widget_set_sensitive(changes_check, FALSE);
+        gtk_widget_set_tooltip_text(changes_check, "Ask the registry daemon: hms-cli -s SOCKET changes FILE");
+    }
+    gtk_box_pack_start(GTK_BOX(options_box), gzip_check, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(options_box), changes_check, FALSE, FALSE, 0);
+    gtk_widget_show_all(options_box);
+    gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(chooser), options_box);
+    char *path = NULL;
+    gboolean gzip = FALSE;
+    gboolean changes_only = FALSE;
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+        path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+        gzip = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gzip_check));
+        changes_only = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(changes_check));
+    }
+    gtk_widget_destroy(chooser);
+    if (!path) return;
+    // As with hms-cli, a name ending in .gz is compressed, ticked or not
+    if (g_str_has_suffix(path, ".gz")) {
+        gzip = TRUE;
+    } else if (gzip) {
+        char *gz_path = g_strdup_printf("%s.gz", path);
+        g_free(path);
+        path = gz_path;
+    }
+
+    PatientSnapshot *snapshot = NULL;
+    PatientChanges *changes = NULL;
+    if (changes_only) {
+        uint64_t since = patient_export_watermark(path);
+        // Starting over exports everyone, archived patients included
+        if (!patient_store_changes_kept(widgets->patients, since)) {
+            show_archived_patients(widgets, INT64_MIN, INT64_MAX);
+        }
+        changes = patient_store_changes(widgets->patients, since);
+    } else {
+        show_archived_patients(widgets, INT64_MIN, INT64_MAX);
+        snapshot = patient_store_snapshot(widgets->patients);
+    }
+    if (!snapshot && !changes) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Export Error", "Could not start the export.");
+        g_free(path);
         return;
     }
-    fprintf(file, "Name,Age,Gender,Added\n");
-    GtkTreeIter iter;
-    if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(widgets->store), &iter)) {
-        do {
-            char *name, *gender, *timestamp; guint age;
-            gtk_tree_model_get(GTK_TREE_MODEL(widgets->store), &iter, COL_NAME, &name, COL_AGE, &age, COL_GENDER, &gender, COL_TIMESTAMP, &timestamp, -1);
-            fprintf(file, "\"%s\",%u,\"%s\",\"%s\"\n", name, age, gender, timestamp);
-            g_free(name); g_free(gender); g_free(timestamp);
-        } while (gtk_tree_model_iter_next(GTK_TREE_MODEL(widgets->store), &iter));
+    const char *name_end = path + strlen(path) - (gzip ? 3 : 0);
+    ExportTask *task = g_new0(ExportTask, 1);
+    task->widgets = widgets;
+    task->snapshot = snapshot;
+    task->changes = changes;
+    task->path = path;
+    task->gzip = gzip;
+    task->json_lines = name_end - path > 6 && strncmp(name_end - 6, ".jsonl", 6) == 0;
+    atomic_init(&task->cancel, false);
+    atomic_init(&task->finished, false);
+    atomic_init(&task->rows_done, 0);
+
+    task->dialog = gtk_dialog_new_with_buttons("Exporting Patients", parent_window, GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "_Cancel", GTK_RESPONSE_CANCEL, NULL);
+    g_signal_connect(task->dialog, "destroy", G_CALLBACK(gtk_widget_destroyed), &task->dialog);
+    task->progress_bar = gtk_progress_bar_new();
+    g_signal_connect(task->progress_bar, "destroy", G_CALLBACK(gtk_widget_destroyed), &task->progress_bar);
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(task->progress_bar), TRUE);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(task->dialog));
+    gtk_container_set_border_width(GTK_CONTAINER(content), 12);
+    gtk_box_pack_start(GTK_BOX(content), task->progress_bar, TRUE, TRUE, 0);
+    g_signal_connect(task->dialog, "response", G_CALLBACK(on_export_dialog_response), task);
+    gtk_widget_show_all(task->dialog);
+
+    widgets->export = task;
+    gtk_widget_set_sensitive(widgets->export_button, FALSE);
+    task->thread = g_thread_new("csv-export", export_worker, task);
+    task->poll_timeout = g_timeout_add(EXPORT_POLL_MS, poll_export, task);
+}
+
+enum { DUP_NAME, DUP_AGE, DUP_GENDER, DUP_OTHER_NAME, DUP_OTHER_AGE, DUP_OTHER_GENDER, DUP_EDITS, DUP_COLS };
+
+static void duplicate_progress(size_t blocks_done, size_t blocks_total, void *user_data) {
+    DuplicateTask *task = user_data;
+    atomic_store(&task->blocks_total, blocks_total);
+    atomic_store(&task->blocks_done, blocks_done);
+}
+
+static gpointer duplicate_worker(gpointer data) {
+    DuplicateTask *task = data;
+    PatientDuplicateOptions options = { .cancel = &task->cancel, .progress = duplicate_progress, .user_data = task };
+    task->count = patient_duplicates_scan(task->snapshot, &options, &task->pairs, &task->stats);
+    task->error = errno;
+    atomic_store(&task->finished, true);
+    return NULL;
+}
+
+static void duplicate_task_free(DuplicateTask *task) {
+    if (task->poll_timeout) g_source_remove(task->poll_timeout);
+    if (task->dialog) gtk_widget_destroy(task->dialog);
+    patient_snapshot_free(task->snapshot);
+    free(task->pairs);
+    g_free(task);
+}
+
+// Lists the pairs whose patients are both still there, as the store has them now
+static void show_duplicates(DuplicateTask *task, GtkWindow *parent_window) {
+    PatientStore *patients = task->widgets->patients;
+    GtkListStore *list = gtk_list_store_new(DUP_COLS, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_STRING,
+                                            G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT);
+    long listed = 0;
+    for (long i = 0; i < task->count && listed < DUPLICATES_SHOWN; i++) {
+        long first = patient_store_find(patients, task->pairs[i].first);
+        long second = patient_store_find(patients, task->pairs[i].second);
+        if (first < 0 || second < 0) continue;
+        PatientRecord a, b;
+        patient_store_get(patients, first, &a);
+        patient_store_get(patients, second, &b);
+        gtk_list_store_insert_with_values(list, NULL, -1, DUP_NAME, a.name, DUP_AGE, a.age, DUP_GENDER, a.gender,
+                                          DUP_OTHER_NAME, b.name, DUP_OTHER_AGE, b.age, DUP_OTHER_GENDER, b.gender,
+                                          DUP_EDITS, task->pairs[i].distance, -1);
+        listed++;
+    }
+    GtkWidget *view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(list));
+    g_object_unref(list);
+    const char *titles[] = {"Patient", "Age", "Gender", "Possible duplicate", "Age", "Gender", "Edits"};
+    for (int i = 0; i < DUP_COLS; i++) {
+        GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(titles[i], renderer, "text", i, NULL);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(view), column);
     }
-    fclose(file);
-    show_message(parent_window, GTK_MESSAGE_INFO, "Export Success", "Patient data exported to patients_export.csv");
+
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Possible Duplicates", parent_window, GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                    "_Close", GTK_RESPONSE_CLOSE, NULL);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 760, 480);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    gtk_container_set_border_width(GTK_CONTAINER(content), 12);
+    char *summary = g_strdup_printf("%ld likely duplicate pairs among %zu patients, found in %.1f s.%s", task->count,
+                                    task->stats.patients, task->stats.seconds,
+                                    task->count > listed ? " The first ones still registered are listed." : "");
+    GtkWidget *label = gtk_label_new(summary);
+    g_free(summary);
+    gtk_label_set_xalign(GTK_LABEL(label), 0);
+    gtk_box_pack_start(GTK_BOX(content), label, FALSE, FALSE, 6);
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), view);
+    gtk_widget_set_vexpand(scrolled_window, TRUE);
+    gtk_box_pack_start(GTK_BOX(content), scrolled_window, TRUE, TRUE, 0);
+    gtk_widget_show_all(dialog);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
 }
 
-static gboolean filter_patients(GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
-    GtkSearchEntry *search_entry = GTK_SEARCH_ENTRY(data);
-    const char *search_text = gtk_entry_get_text(GTK_ENTRY(search_entry));
-    if (search_text == NULL || *search_text == '\0') return TRUE;
-    char *name;
-    gtk_tree_model_get(model, iter, COL_NAME, &name, -1);
-    gchar *search_lower = g_utf8_strdown(search_text, -1);
-    gchar *name_lower = g_utf8_strdown(name, -1);
-    gboolean found = (strstr(name_lower, search_lower) != NULL);
-    g_free(name); g_free(search_lower); g_free(name_lower);
-    return found;
+static gboolean poll_duplicates(gpointer data) {
+    DuplicateTask *task = data;
+    size_t done = atomic_load(&task->blocks_done), total = atomic_load(&task->blocks_total);
+    if (task->progress_bar) {
+        if (total) gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(task->progress_bar), (double)done / total);
+        else gtk_progress_bar_pulse(GTK_PROGRESS_BAR(task->progress_bar));
+    }
+    if (!atomic_load(&task->finished)) return G_SOURCE_CONTINUE;
+
+    g_thread_join(task->thread);
+    task->poll_timeout = 0;
+    PatientWidgets *widgets = task->widgets;
+    widgets->duplicates = NULL;
+    gtk_widget_set_sensitive(widgets->duplicates_button, TRUE);
+    if (task->dialog) gtk_widget_destroy(task->dialog);
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(widgets->duplicates_button));
+    if (task->count >= 0) {
+        show_duplicates(task, parent_window);
+    } else if (task->error != ECANCELED) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Duplicate Search Error", g_strerror(task->error));
+    }
+    duplicate_task_free(task);
+    return G_SOURCE_REMOVE;
 }
 
-static void on_search_changed(GtkSearchEntry *entry, PatientWidgets *widgets) {
-    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(widgets->filter_model));
+static void on_duplicates_dialog_response(GtkDialog *dialog, gint response_id, DuplicateTask *task) {
+    atomic_store(&task->cancel, true);
+    gtk_dialog_set_response_sensitive(dialog, GTK_RESPONSE_CANCEL, FALSE);
 }
 
+// Compares the whole registry on worker threads, from a snapshot so that
+// editing can go on meanwhile
+static void on_find_duplicates(GtkButton *button, PatientWidgets *widgets) {
+    GtkWindow *parent_window = GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button)));
+    if (widgets->duplicates) return;
+    show_archived_patients(widgets, INT64_MIN, INT64_MAX);
+    PatientSnapshot *snapshot = patient_store_snapshot(widgets->patients);
+    if (!snapshot) {
+        show_message(parent_window, GTK_MESSAGE_ERROR, "Duplicate Search Error", "Not enough memory to start the search.");
+        return;
+    }
+    DuplicateTask *task = g_new0(DuplicateTask, 1);
+    task->widgets = widgets;
+    task->snapshot = snapshot;
+    atomic_init(&task->cancel, false);
+    atomic_init(&task->finished, false);
+    atomic_init(&task->blocks_done, 0);
+    atomic_init(&task->blocks_total, 0);
+
+    task->dialog = gtk_dialog_new_with_buttons("Finding Duplicates", parent_window, GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "_Cancel", GTK_RESPONSE_CANCEL, NULL);
+    g_signal_connect(task->dialog, "destroy", G_CALLBACK(gtk_widget_destroyed), &task->dialog);
+    task->progress_bar = gtk_progress_bar_new();
+    g_signal_connect(task->progress_bar, "destroy", G_CALLBACK(gtk_widget_destroyed), &task->progress_bar);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(task->dialog));
+    gtk_container_set_border_width(GTK_CONTAINER(content), 12);
+    gtk_box_pack_start(GTK_BOX(content), task->progress_bar, TRUE, TRUE, 0);
+    g_signal_connect(task->dialog, "response", G_CALLBACK(on_duplicates_dialog_response), task);
+    gtk_widget_show_all(task->dialog);
+
+    widgets->duplicates = task;
+    gtk_widget_set_sensitive(widgets->duplicates_button, FALSE);
+    task->thread = g_thread_new("duplicates", duplicate_worker, task);
+    task->poll_timeout = g_timeout_add(EXPORT_POLL_MS, poll_duplicates, task);
+}
 
-// --- Main Application Implementations ---
+// Parses the query (see patient_query.h) and swaps the visible rows in one
+// go. The view is detached meanwhile so it rebuilds once instead of handling
+// a signal per row that comes or goes. A query that doesn't parse leaves the
+// rows as they were and explains itself in the entry's tooltip.
+static gboolean run_search(gpointer data) {
+    PatientWidgets *widgets = data;
+    widgets->search_timeout = 0;
+    PatientQuery query;
+    char error[128];
+    if (patient_query_parse(gtk_entry_get_text(GTK_ENTRY(widgets->search_entry)), patient_time_now(), &query,
+                            error, sizeof(error)) != 0) {
+        gtk_widget_set_tooltip_text(widgets->search_entry, errno == EINVAL ? error : g_strerror(errno));
+        patient_query_clear(&query);
+        return G_SOURCE_REMOVE;
+    }
+    gtk_widget_set_tooltip_text(widgets->search_entry, SEARCH_HINT);
+    // A search reaches as far back as its admission window does, unless the
+    // MRN it names is already loaded
+    bool found = query.id && patient_store_find_id(widgets->patients, query.id) != PATIENT_NO_HANDLE;
+    if (!patient_query_is_empty(&query) && !found) show_archived_patients(widgets, query.added_min, query.added_max);
+    GtkTreeView *view = GTK_TREE_VIEW(widgets->tree_view);
+    LatencyProbe probe = latency_begin(LATENCY_REFILTER);
+    gtk_tree_view_set_model(view, NULL);
+    patient_model_set_filter(widgets->model, &query);
+    gtk_tree_view_set_model(view, GTK_TREE_MODEL(widgets->model));
+    latency_end(probe);
+    patient_query_clear(&query);
+    return G_SOURCE_REMOVE;
+}
 
-int main(int argc, char *argv[]) {
-    gtk_init(&argc, &argv);
-    load_css();
+// Debounced: every keystroke restarts the timer, cancelling the query still pending
+static void on_search_changed(GtkEditable *editable, PatientWidgets *widgets) {
+    if (widgets->search_timeout) g_source_remove(widgets->search_timeout);
+    widgets->search_timeout = g_timeout_add(SEARCH_DEBOUNCE_MS, run_search, widgets);
+}
+
+
+// --- Statistics Tab Implementations ---
+
+enum { STATS_GENDER_NAME, STATS_GENDER_COUNT, STATS_GENDER_SHARE, STATS_GENDER_COLS };
 
-    // --- Splash Screen Phase ---
-    GtkWidget *splash_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_decorated(GTK_WINDOW(splash_window), FALSE);
-    gtk_window_set_position(GTK_WINDOW(splash_window), GTK_WIN_POS_CENTER);
-    gtk_window_set_default_size(GTK_WINDOW(splash_window), 450, 120);
-    gtk_widget_set_name(splash_window, "splashWindow");
+// Bars are scaled to the largest count in the chart
+static void set_statistics_bars(StatisticsBar *bars, const size_t *counts, int n) {
+    size_t most = 0;
+    for (int i = 0; i < n; i++) most = MAX(most, counts[i]);
+    for (int i = 0; i < n; i++) {
+        char text[32];
+        g_snprintf(text, sizeof(text), "%zu", counts[i]);
+        gtk_level_bar_set_value(GTK_LEVEL_BAR(bars[i].bar), most ? (double)counts[i] / most : 0);
+        gtk_label_set_text(GTK_LABEL(bars[i].count), text);
+    }
+}
+
+// Reads a few hundred counters, however many patients there are or arrive
+static gboolean refresh_statistics(gpointer data) {
+    StatisticsWidgets *widgets = data;
+    PatientStore *patients = widgets->startup->widgets ? widgets->startup->widgets->patients : NULL;
+    // Counted at startup; counted again only if that ever ran out of memory
+    if (!patients || (!patient_store_stats(patients) && patient_store_track_stats(patients) != 0)) {
+        gtk_label_set_text(GTK_LABEL(widgets->summary_label), patients ? "Statistics are unavailable." : "Loading patients...");
+        return G_SOURCE_CONTINUE;
+    }
+    const PatientStats *stats = patient_store_stats(patients);
+    size_t total = patient_stats_total(stats);
+    int64_t horizon = patient_store_archive_horizon(patients);
+    char archived[PATIENT_ADDED_LEN];
+    patient_time_format(horizon, archived);
+    char *summary = g_strdup_printf("%zu patients, %zu without a known admission time%s%.7s%s", total,
+                                    patient_stats_undated(stats),
+                                    horizon == PATIENT_TIME_UNKNOWN ? "" : "; admissions before ",
+                                    horizon == PATIENT_TIME_UNKNOWN ? "" : archived,
+                                    horizon == PATIENT_TIME_UNKNOWN ? "" : " are archived and counted once loaded");
+    gtk_label_set_text(GTK_LABEL(widgets->summary_label), summary);
+    g_free(summary);
+
+    PatientGenderCount genders[PATIENT_STATS_GENDERS + 1];
+    size_t n_genders = patient_stats_genders(stats, genders);
+    gtk_list_store_clear(widgets->genders);
+    for (size_t i = 0; i < n_genders; i++) {
+        char count[32], share[32];
+        g_snprintf(count, sizeof(count), "%zu", genders[i].count);
+        g_snprintf(share, sizeof(share), "%.1f%%", total ? 100.0 * genders[i].count / total : 0.0);
+        gtk_list_store_insert_with_values(widgets->genders, NULL, -1,
+                                          STATS_GENDER_NAME, genders[i].gender ? genders[i].gender : "(others)",
+                                          STATS_GENDER_COUNT, count, STATS_GENDER_SHARE, share, -1);
+    }
+
+    size_t ages[PATIENT_STATS_AGES], bands[STATISTICS_AGE_BANDS] = {0};
+    patient_stats_ages(stats, ages);
+    for (int age = 0; age < PATIENT_STATS_AGES; age++) bands[age / STATISTICS_AGE_BAND] += ages[age];
+    set_statistics_bars(widgets->ages, bands, STATISTICS_AGE_BANDS);
+
+    size_t hours[24];
+    patient_stats_hours_of_day(stats, hours);
+    set_statistics_bars(widgets->hours, hours, 24);
+
+    // The last days on record, which are today's while patients are coming in
+    size_t days[STATISTICS_DAYS] = {0};
+    int64_t first, last;
+    if (patient_stats_range(stats, &first, &last) == 0) {
+        int64_t from = last - (last % 86400 + 86400) % 86400 - (int64_t)(STATISTICS_DAYS - 1) * 86400;
+        patient_stats_admissions(stats, PATIENT_STATS_DAILY, from, STATISTICS_DAYS, days);
+        for (int day = 0; day < STATISTICS_DAYS; day++) {
+            char added[PATIENT_ADDED_LEN];
+            patient_time_format(from + (int64_t)day * 86400, added);
+            added[10] = '\0';
+            gtk_label_set_text(GTK_LABEL(widgets->days[day].label), added);
+        }
+    }
+    set_statistics_bars(widgets->days, days, STATISTICS_DAYS);
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_statistics_map(GtkWidget *widget, StatisticsWidgets *widgets) {
+    refresh_statistics(widgets);
+    if (!widgets->refresh_timeout) widgets->refresh_timeout = g_timeout_add(STATISTICS_REFRESH_MS, refresh_statistics, widgets);
+}
+
+static void on_statistics_unmap(GtkWidget *widget, StatisticsWidgets *widgets) {
+    if (widgets->refresh_timeout) g_source_remove(widgets->refresh_timeout);
+    widgets->refresh_timeout = 0;
+}
+
+static void on_statistics_destroy(GtkWidget *widget, StatisticsWidgets *widgets) {
+    on_statistics_unmap(widget, widgets);
+    g_object_unref(widgets->genders);
+    g_slice_free(StatisticsWidgets, widgets);
+}
+
+// A framed column of labelled bars; without labels, they are set on refresh
+static GtkWidget* statistics_chart(const char *title, StatisticsBar *bars, int n, char labels[][16]) {
+    GtkWidget *frame = gtk_frame_new(title);
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 2);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 8);
+    gtk_container_set_border_width(GTK_CONTAINER(grid), 8);
+    gtk_container_add(GTK_CONTAINER(frame), grid);
+    for (int i = 0; i < n; i++) {
+        bars[i].label = gtk_label_new(labels ? labels[i] : "");
+        gtk_label_set_xalign(GTK_LABEL(bars[i].label), 1);
+        bars[i].bar = gtk_level_bar_new_for_interval(0, 1);
+        gtk_widget_set_hexpand(bars[i].bar, TRUE);
+        gtk_widget_set_size_request(bars[i].bar, 160, -1);
+        bars[i].count = gtk_label_new("0");
+        gtk_label_set_xalign(GTK_LABEL(bars[i].count), 0);
+        gtk_grid_attach(GTK_GRID(grid), bars[i].label, 0, i, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), bars[i].bar, 1, i, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), bars[i].count, 2, i, 1, 1);
+    }
+    return frame;
+}
+
+static GtkWidget* create_statistics_tab(StartupTask *startup) {
+    StatisticsWidgets *widgets = g_slice_new0(StatisticsWidgets);
+    widgets->startup = startup;
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    gtk_container_set_border_width(GTK_CONTAINER(vbox), 10);
+
+    widgets->summary_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(widgets->summary_label), 0);
+    gtk_box_pack_start(GTK_BOX(vbox), widgets->summary_label, FALSE, FALSE, 0);
+
+    GtkWidget *columns = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    GtkWidget *left = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    widgets->genders = gtk_list_store_new(STATS_GENDER_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    GtkWidget *gender_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(widgets->genders));
+    const char *gender_titles[] = {"Gender", "Patients", "Share"};
+    for (int i = 0; i < STATS_GENDER_COLS; i++) {
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(gender_titles[i], gtk_cell_renderer_text_new(),
+                                                                             "text", i, NULL);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(gender_view), column);
+    }
+    GtkWidget *gender_frame = gtk_frame_new("By gender");
+    gtk_container_add(GTK_CONTAINER(gender_frame), gender_view);
+    gtk_box_pack_start(GTK_BOX(left), gender_frame, FALSE, FALSE, 0);
+    char age_labels[STATISTICS_AGE_BANDS][16];
+    for (int band = 0; band < STATISTICS_AGE_BANDS; band++) {
+        int low = band * STATISTICS_AGE_BAND;
+        if (low + STATISTICS_AGE_BAND < PATIENT_STATS_AGES) g_snprintf(age_labels[band], 16, "%d-%d", low, low + STATISTICS_AGE_BAND - 1);
+        else g_snprintf(age_labels[band], 16, "%d+", low);
+    }
+    gtk_box_pack_start(GTK_BOX(left), statistics_chart("By age", widgets->ages, STATISTICS_AGE_BANDS, age_labels),
+                       FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(columns), left, TRUE, TRUE, 0);
+
+    char hour_labels[24][16];
+    for (int hour = 0; hour < 24; hour++) g_snprintf(hour_labels[hour], 16, "%02d:00", hour);
+    gtk_box_pack_start(GTK_BOX(columns), statistics_chart("Admissions by hour of day", widgets->hours, 24, hour_labels),
+                       TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(columns), statistics_chart("Admissions per day", widgets->days, STATISTICS_DAYS, NULL),
+                       TRUE, TRUE, 0);
+
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), columns);
+    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+
+    g_signal_connect(vbox, "map", G_CALLBACK(on_statistics_map), widgets);
+    g_signal_connect(vbox, "unmap", G_CALLBACK(on_statistics_unmap), widgets);
+    g_signal_connect(vbox, "destroy", G_CALLBACK(on_statistics_destroy), widgets);
+    return vbox;
+}
+
+
+// --- Diagnostics Tab Implementations ---
+
+enum { DIAG_OP_NAME, DIAG_OP_COUNT, DIAG_OP_MEAN, DIAG_OP_P50, DIAG_OP_P90, DIAG_OP_P99, DIAG_OP_MAX, DIAG_OP_COLS };
+enum { DIAG_STALL_TIME, DIAG_STALL_MS, DIAG_STALL_OP, DIAG_STALL_COLS };
+
+static void format_ms(char text[32], double ms) {
+    g_snprintf(text, 32, ms < 10 ? "%.3f" : "%.1f", ms);
+}
+
+static GtkWidget* diagnostics_view(GtkListStore *store, const char **titles, int columns) {
+    GtkWidget *view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+    for (int i = 0; i < columns; i++) {
+        GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(titles[i], renderer, "text", i, NULL);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(view), column);
+    }
+    return view;
+}
+
+static gboolean refresh_diagnostics(gpointer data) {
+    DiagnosticsWidgets *widgets = data;
+    LatencyReport *report = g_new(LatencyReport, 1);
+    latency_report(report);
+
+    gtk_list_store_clear(widgets->operations);
+    for (int op = 0; op < LATENCY_OP_COUNT; op++) {
+        const LatencySummary *summary = &report->ops[op];
+        char count[32], mean[32], p50[32], p90[32], p99[32], max[32];
+        g_snprintf(count, sizeof(count), "%" G_GUINT64_FORMAT, (guint64)summary->count);
+        format_ms(mean, summary->mean_ms);
+        format_ms(p50, summary->p50_ms);
+        format_ms(p90, summary->p90_ms);
+        format_ms(p99, summary->p99_ms);
+        format_ms(max, summary->max_ms);
+        gtk_list_store_insert_with_values(widgets->operations, NULL, -1, DIAG_OP_NAME, latency_op_name(op),
+                                          DIAG_OP_COUNT, count, DIAG_OP_MEAN, mean, DIAG_OP_P50, p50, DIAG_OP_P90, p90,
+                                          DIAG_OP_P99, p99, DIAG_OP_MAX, max, -1);
+    }
+    gtk_list_store_clear(widgets->stalls);
+    for (size_t i = 0; i < report->recent_count; i++) {
+        const LatencyStall *stall = &report->recent[i];
+        GDateTime *when = g_date_time_new_from_unix_local((gint64)stall->started);
+        char *time_text = g_date_time_format(when, "%H:%M:%S");
+        char ms[32];
+        format_ms(ms, stall->ms);
+        gtk_list_store_insert_with_values(widgets->stalls, NULL, -1, DIAG_STALL_TIME, time_text, DIAG_STALL_MS, ms,
+                                          DIAG_STALL_OP, stall->op < 0 ? "(drawing or input)" : latency_op_name(stall->op), -1);
+        g_free(time_text);
+        g_date_time_unref(when);
+    }
+    PatientStore *patients = widgets->startup->widgets ? widgets->startup->widgets->patients : NULL;
+    PatientMemory memory = {0};
+    if (patients) patient_store_memory(patients, &memory);
+    char *memory_size = g_format_size(memory.total);
+    char *summary = g_strdup_printf("Main loop stalls over %u ms: %" G_GUINT64_FORMAT " (longest %.0f ms). "
+                                    "Times are in ms. kill -USR1 %d writes all of this to " LATENCY_STATS_FILE ".\n"
+                                    "Patient records take %s in memory, %.0f bytes each.",
+                                    report->stall_threshold_ms, (guint64)report->stalls, report->stall_times.max_ms,
+                                    (int)getpid(), memory_size, memory.records ? (double)memory.total / memory.records : 0.0);
+    g_free(memory_size);
+    gtk_label_set_text(GTK_LABEL(widgets->summary_label), summary);
+    g_free(summary);
+    g_free(report);
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_diagnostics_map(GtkWidget *widget, DiagnosticsWidgets *widgets) {
+    refresh_diagnostics(widgets);
+    if (!widgets->refresh_timeout) widgets->refresh_timeout = g_timeout_add(DIAGNOSTICS_REFRESH_MS, refresh_diagnostics, widgets);
+}
+
+static void on_diagnostics_unmap(GtkWidget *widget, DiagnosticsWidgets *widgets) {
+    if (widgets->refresh_timeout) g_source_remove(widgets->refresh_timeout);
+    widgets->refresh_timeout = 0;
+}
+
+static void on_diagnostics_destroy(GtkWidget *widget, DiagnosticsWidgets *widgets) {
+    on_diagnostics_unmap(widget, widgets);
+    g_object_unref(widgets->operations);
+    g_object_unref(widgets->stalls);
+    g_slice_free(DiagnosticsWidgets, widgets);
+}
+
+static GtkWidget* create_diagnostics_tab(StartupTask *startup) {
+    DiagnosticsWidgets *widgets = g_slice_new0(DiagnosticsWidgets);
+    widgets->startup = startup;
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    gtk_container_set_border_width(GTK_CONTAINER(vbox), 10);
+
+    widgets->operations = gtk_list_store_new(DIAG_OP_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+                                             G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    const char *operation_titles[] = {"Operation", "Count", "Mean", "p50", "p90", "p99", "Max"};
+    gtk_box_pack_start(GTK_BOX(vbox), diagnostics_view(widgets->operations, operation_titles, DIAG_OP_COLS), FALSE, FALSE, 0);
+
+    widgets->summary_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(widgets->summary_label), 0);
+    gtk_box_pack_start(GTK_BOX(vbox), widgets->summary_label, FALSE, FALSE, 0);
+
+    widgets->stalls = gtk_list_store_new(DIAG_STALL_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    const char *stall_titles[] = {"Stalled at", "Duration", "Running"};
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), diagnostics_view(widgets->stalls, stall_titles, DIAG_STALL_COLS));
+    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+
+    g_signal_connect(vbox, "map", G_CALLBACK(on_diagnostics_map), widgets);
+    g_signal_connect(vbox, "unmap", G_CALLBACK(on_diagnostics_unmap), widgets);
+    g_signal_connect(vbox, "destroy", G_CALLBACK(on_diagnostics_destroy), widgets);
+    return vbox;
+}
+
+// Ctrl+Shift+D reveals the Diagnostics tab
+static gboolean on_main_window_key_press(GtkWidget *window, GdkEventKey *event, GtkWidget *diagnostics_page) {
+    GdkModifierType mods = event->state & gtk_accelerator_get_default_mod_mask();
+    if (mods != (GDK_CONTROL_MASK | GDK_SHIFT_MASK) || gdk_keyval_to_upper(event->keyval) != GDK_KEY_D) return FALSE;
+    GtkNotebook *notebook = GTK_NOTEBOOK(gtk_widget_get_parent(diagnostics_page));
+    gtk_widget_show_all(diagnostics_page);
+    gtk_notebook_set_current_page(notebook, gtk_notebook_page_num(notebook, diagnostics_page));
+    return TRUE;
+}
+
+
+// --- Startup Implementations ---
+
+static gpointer index_worker(gpointer data) {
+    StartupTask *task = data;
+    gint64 started = g_get_monotonic_time();
+    // The search box filters on every keystroke pause, so it wants the index
+    if (patient_store_index_names(task->patients) != 0) {
+        g_warning("Patient search will scan every name: %s", g_strerror(errno));
+    }
+    // The Statistics tab reads running totals, counted once here on every core
+    if (patient_store_track_stats(task->patients) != 0) {
+        g_warning("Patient statistics will be counted when first shown: %s", g_strerror(errno));
+    }
+    task->index_us = g_get_monotonic_time() - started;
+    return NULL;
+}
+
+// A daemon already serving the registry owns the files; this window then
+// works on a mirror of it instead of opening them too
+static void open_patients(StartupTask *task) {
+    task->client = registry_client_connect(REGISTRY_SOCKET);
+    if (task->client) {
+        task->path = REGISTRY_SOCKET;
+        if (registry_client_subscribe(task->client, &task->stats) == 0) {
+            task->patients = registry_client_store(task->client);
+            return;
+        }
+        int saved = errno;
+        registry_client_close(task->client);
+        task->client = NULL;
+        errno = saved;
+        return;
+    }
+    task->path = g_file_test(PATIENTS_BINARY_FILE, G_FILE_TEST_EXISTS) ? PATIENTS_BINARY_FILE : PATIENTS_FILE;
+    task->patients = patient_store_open(task->path, &task->stats);
+}
+
+static gpointer startup_worker(gpointer data) {
+    StartupTask *task = data;
+    open_patients(task);
+    // Visits are files next to the registry's, appended to by every window
+    // and hms-cli alike, so they are read directly even with a daemon
+    task->encounters = encounter_store_open(PATIENTS_FILE);
+    if (!task->encounters) g_warning("Patient visits are unavailable: %s", g_strerror(errno));
+    if (task->patients) {
+        // Both only read the store, so they can run side by side
+        atomic_store(&task->stage, STARTUP_INDEXING);
+        GThread *indexer = g_thread_new("name-index", index_worker, task);
+        gint64 started = g_get_monotonic_time();
+        task->model = patient_model_new_streaming(task->patients, COL_TIMESTAMP, GTK_SORT_ASCENDING);
+        task->sort_us = g_get_monotonic_time() - started;
+        g_thread_join(indexer);
+        // The duplicate check before every add reads the age order; usually it came with the snapshot
+        patient_store_order(task->patients, PATIENT_SORT_AGE);
+    } else {
+        task->error = errno;
+    }
+    task->loaded = g_get_monotonic_time();
+    atomic_store(&task->stage, STARTUP_DONE);
+    atomic_store(&task->finished, true);
+    return NULL;
+}
+
+static void close_splash(StartupTask *task) {
+    if (task->splash) gtk_widget_destroy(task->splash);
+    task->splash = NULL;
+    task->progress_bar = NULL;
+}
+
+// Shows which stage the workers are in; opening dominates, so it gets most of the bar
+static gboolean poll_startup(gpointer data) {
+    StartupTask *task = data;
+    static const double fractions[] = { 0.1, 0.7, 1.0 };
+    static const char *stages[] = { "Opening patient records...", "Indexing patients...", "Loading patients..." };
+    int stage = atomic_load(&task->stage);
+    if (task->progress_bar) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(task->progress_bar), fractions[stage]);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(task->progress_bar), stages[stage]);
+    }
+    // After login the patients tab carries on where the splash left off
+    if (task->widgets) gtk_label_set_text(GTK_LABEL(task->widgets->status_label), stages[stage]);
+    if (!atomic_load(&task->finished)) return G_SOURCE_CONTINUE;
+
+    g_thread_join(task->thread);
+    task->thread = NULL;
+    task->poll_timeout = 0;
+    task->ready = TRUE;
+    close_splash(task);
+    if (!task->patients) {
+        g_error("Could not open %s: %s", task->path, g_strerror(task->error));
+    }
+    PatientLoadStats *stats = &task->stats;
+    g_message("Loaded %zu patients from %s in %.3f s (%.0f rows/s, %u threads), %zu bad lines skipped, %zu journal records replayed",
+              stats->rows, task->path, stats->seconds, stats->seconds > 0 ? stats->rows / stats->seconds : 0.0,
+              stats->threads, stats->bad_lines, stats->journal_records);
+    if (task->widgets) adopt_patients(task->widgets);
+    return G_SOURCE_REMOVE;
+}
+
+static void show_splash(StartupTask *task) {
+    task->splash = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_decorated(GTK_WINDOW(task->splash), FALSE);
+    gtk_window_set_position(GTK_WINDOW(task->splash), GTK_WIN_POS_CENTER);
+    gtk_window_set_default_size(GTK_WINDOW(task->splash), 450, 120);
+    gtk_widget_set_name(task->splash, "splashWindow");
 
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
     gtk_container_set_border_width(GTK_CONTAINER(vbox), 20);
-    gtk_container_add(GTK_CONTAINER(splash_window), vbox);
+    gtk_container_add(GTK_CONTAINER(task->splash), vbox);
 
     GtkWidget *label = gtk_label_new(NULL);
     gtk_label_set_markup(GTK_LABEL(label), "<span size='x-large' weight='bold'>Hospital Management System</span>");
-    GtkWidget *progress_bar = gtk_progress_bar_new();
-    gtk_widget_set_name(progress_bar, "splashProgress");
-
+    task->progress_bar = gtk_progress_bar_new();
+    gtk_widget_set_name(task->progress_bar, "splashProgress");
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(task->progress_bar), TRUE);
 
     gtk_box_pack_start(GTK_BOX(vbox), label, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), progress_bar, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), task->progress_bar, TRUE, TRUE, 0);
+    gtk_widget_show_all(task->splash);
+}
 
-    gtk_widget_show_all(splash_window);
+// Starts loading right away; the main loop picks up the result
+static void start_startup(StartupTask *task) {
+    atomic_init(&task->stage, STARTUP_OPENING);
+    atomic_init(&task->finished, false);
+    show_splash(task);
+    task->thread = g_thread_new("startup", startup_worker, task);
+    task->poll_timeout = g_timeout_add(STARTUP_POLL_MS, poll_startup, task);
+}
 
-    // Manually run the GTK event loop for the splash screen for ~2 seconds.
-    // This keeps the UI responsive without blocking everything.
-    for (int i = 0; i <= 100; i++) {
-        // Process all pending GTK events.
-        while (gtk_events_pending()) {
-            gtk_main_iteration();
-        }
-        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), i / 100.0);
-        g_usleep(20000); // Sleep for 20ms (20ms * 100 = 2 seconds)
-    }
+// Waits out the workers and frees whatever no patients tab took over
+static void finish_startup(StartupTask *task) {
+    if (task->poll_timeout) g_source_remove(task->poll_timeout);
+    task->poll_timeout = 0;
+    if (task->thread) g_thread_join(task->thread);
+    task->thread = NULL;
+    close_splash(task);
+    g_clear_object(&task->model);
+    encounter_store_close(task->encounters);
+    task->encounters = NULL;
+    if (task->client) registry_client_close(task->client);
+    else patient_store_close(task->patients);
+    task->client = NULL;
+    task->patients = NULL;
+}
+
+
+// --- Main Application Implementations ---
+
+static gboolean send_heartbeat(gpointer data) {
+    latency_heartbeat();
+    return G_SOURCE_CONTINUE;
+}
 
-    gtk_widget_destroy(splash_window);
+int main(int argc, char *argv[]) {
+    StartupTask startup = {0};
+    startup.launched = g_get_monotonic_time();
+    gtk_init(&argc, &argv);
+    startup.gtk_ready = g_get_monotonic_time();
+    // Nested loops such as the login dialog's dispatch the heartbeat too
+    if (latency_watchdog_start(STALL_THRESHOLD_MS, LATENCY_STATS_FILE) == 0) {
+        g_timeout_add(HEARTBEAT_MS, send_heartbeat, NULL);
+    } else {
+        g_warning("Main loop stall detection is off: %s", g_strerror(errno));
+    }
+    // GTK objects belong to the main thread, so the theme is parsed here;
+    // the record loading it overlaps with is what takes the time
+    load_css();
+    startup.css_ready = g_get_monotonic_time();
 
-    // --- Login Phase ---
-    // The show_login_window function has its own internal loop (gtk_dialog_run).
-    // We pass NULL as the parent because the splash screen is already destroyed.
+    // --- Splash and Login Phase ---
+    // The splash tracks the loader threads while the login dialog runs its
+    // own loop (gtk_dialog_run), so loading overlaps with typing the password.
+    start_startup(&startup);
     if (show_login_window(NULL)) {
         // --- Main Application Phase ---
-        create_main_window();
+        startup.logged_in = g_get_monotonic_time();
+        close_splash(&startup);
+        create_main_window(&startup);
         gtk_main(); // Start the main application event loop.
     }
+    finish_startup(&startup);
+    latency_watchdog_stop();
+    if (latency_dump_json(LATENCY_STATS_FILE) != 0) {
+        g_warning("Could not write %s: %s", LATENCY_STATS_FILE, g_strerror(errno));
+    }
 
     return 0;
 }
@@ -583,7 +2069,15 @@ void load_css() {
     g_object_unref(provider);
 }
 
-void create_main_window() {
+// Builds the AI Assistant tab the first time it is opened
+static void on_notebook_switch_page(GtkNotebook *notebook, GtkWidget *page, guint page_num, GtkWidget *ai_page) {
+    if (page != ai_page) return;
+    gtk_box_pack_start(GTK_BOX(ai_page), create_ai_assistant_tab(), TRUE, TRUE, 0);
+    gtk_widget_show_all(ai_page);
+    g_signal_handlers_disconnect_by_func(notebook, on_notebook_switch_page, ai_page);
+}
+
+void create_main_window(StartupTask *startup) {
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "Hospital Management System");
     gtk_window_maximize(GTK_WINDOW(window));
@@ -597,13 +2091,22 @@ void create_main_window() {
     GtkWidget *notebook = gtk_notebook_new();
     gtk_container_add(GTK_CONTAINER(window), notebook);
 
-    GtkWidget *patients_tab = create_patients_tab();
+    GtkWidget *patients_tab = create_patients_tab(startup);
     GtkWidget *patients_label = gtk_label_new("Patients");
     gtk_notebook_append_page(GTK_NOTEBOOK(notebook), patients_tab, patients_label);
 
-    GtkWidget *ai_tab = create_ai_assistant_tab();
+    GtkWidget *ai_tab = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     GtkWidget *ai_label = gtk_label_new("AI Assistant");
     gtk_notebook_append_page(GTK_NOTEBOOK(notebook), ai_tab, ai_label);
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(on_notebook_switch_page), ai_tab);
+
+    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), create_statistics_tab(startup), gtk_label_new("Statistics"));
+
+    // Hidden pages have no tab, so it stays out of sight until asked for
+    GtkWidget *diagnostics_tab = create_diagnostics_tab(startup);
+    gtk_widget_set_no_show_all(diagnostics_tab, TRUE);
+    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), diagnostics_tab, gtk_label_new("Diagnostics"));
+    g_signal_connect(window, "key-press-event", G_CALLBACK(on_main_window_key_press), diagnostics_tab);
 
     gtk_widget_show_all(window);
 }
@@ -0,0 +1,259 @@
+#include "id_bitmap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- Constants ---
+
+#define CHUNK_WORDS 1024    // 65536 bits
+#define ARRAY_MAX 4096      // Past this many ids an array outgrows a bitset
+
+// --- Structs ---
+
+typedef struct {
+    uint16_t key;           // High 16 bits of every id in the chunk
+    uint32_t count;
+    uint16_t *values;       // Ascending low halves while count <= ARRAY_MAX
+    uint64_t *words;        // Otherwise a bitset of CHUNK_WORDS words
+} Chunk;
+
+struct IdBitmap {
+    Chunk *chunks;          // Ascending by key
+    size_t count;
+    size_t capacity;
+};
+
+// --- Chunks ---
+
+static void chunk_free(Chunk *chunk) {
+    free(chunk->values);
+    free(chunk->words);
+}
+
+static size_t popcount_words(const uint64_t *words, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) count += __builtin_popcountll(words[i]);
+    return count;
+}
+
+// Appends an empty chunk; keys must come in ascending order
+static Chunk* push_chunk(IdBitmap *bitmap, uint16_t key) {
+    if (bitmap->count == bitmap->capacity) {
+        size_t capacity = bitmap->capacity ? bitmap->capacity * 2 : 16;
+        Chunk *grown = realloc(bitmap->chunks, capacity * sizeof(Chunk));
+        if (!grown) return NULL;
+        bitmap->chunks = grown;
+        bitmap->capacity = capacity;
+    }
+    Chunk *chunk = &bitmap->chunks[bitmap->count++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->key = key;
+    return chunk;
+}
+
+// Fills chunk from a full bitset of count bits, as an array if that's smaller
+static bool chunk_set_words(Chunk *chunk, const uint64_t *words, size_t count) {
+    chunk->count = count;
+    if (count > ARRAY_MAX) {
+        chunk->words = malloc(CHUNK_WORDS * sizeof(uint64_t));
+        if (!chunk->words) return false;
+        memcpy(chunk->words, words, CHUNK_WORDS * sizeof(uint64_t));
+        return true;
+    }
+    chunk->values = malloc((count ? count : 1) * sizeof(uint16_t));
+    if (!chunk->values) return false;
+    size_t n = 0;
+    for (size_t i = 0; i < CHUNK_WORDS; i++) {
+        for (uint64_t word = words[i]; word; word &= word - 1) {
+            chunk->values[n++] = (uint16_t)(i * 64 + __builtin_ctzll(word));
+        }
+    }
+    return true;
+}
+
+// Fills chunk from count ascending ids that share its key
+static bool chunk_set_sorted(Chunk *chunk, const uint32_t *ids, size_t count) {
+    chunk->count = count;
+    if (count > ARRAY_MAX) {
+        chunk->words = calloc(CHUNK_WORDS, sizeof(uint64_t));
+        if (!chunk->words) return false;
+        for (size_t i = 0; i < count; i++) chunk->words[(ids[i] & 0xFFFF) >> 6] |= 1ull << (ids[i] & 63);
+        return true;
+    }
+    chunk->values = malloc(count * sizeof(uint16_t));
+    if (!chunk->values) return false;
+    for (size_t i = 0; i < count; i++) chunk->values[i] = ids[i] & 0xFFFF;
+    return true;
+}
+
+static bool chunk_contains(const Chunk *chunk, uint16_t low) {
+    if (chunk->words) return (chunk->words[low >> 6] >> (low & 63)) & 1;
+    size_t lo = 0, hi = chunk->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk->values[mid] < low) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < chunk->count && chunk->values[lo] == low;
+}
+
+// Intersects chunk with other in place and returns false if memory ran out
+static bool chunk_and(Chunk *chunk, const Chunk *other) {
+    if (chunk->values && other->values) {
+        size_t i = 0, j = 0, n = 0;
+        while (i < chunk->count && j < other->count) {
+            if (chunk->values[i] < other->values[j]) i++;
+            else if (chunk->values[i] > other->values[j]) j++;
+            else {
+                chunk->values[n++] = chunk->values[i++];
+                j++;
+            }
+        }
+        chunk->count = n;
+    } else if (chunk->values) {
+        size_t n = 0;
+        for (size_t i = 0; i < chunk->count; i++) {
+            if (chunk_contains(other, chunk->values[i])) chunk->values[n++] = chunk->values[i];
+        }
+        chunk->count = n;
+    } else if (other->values) {
+        uint16_t *values = malloc((other->count ? other->count : 1) * sizeof(uint16_t));
+        if (!values) return false;
+        size_t n = 0;
+        for (size_t i = 0; i < other->count; i++) {
+            if (chunk_contains(chunk, other->values[i])) values[n++] = other->values[i];
+        }
+        free(chunk->words);
+        chunk->words = NULL;
+        chunk->values = values;
+        chunk->count = n;
+    } else {
+        for (size_t i = 0; i < CHUNK_WORDS; i++) chunk->words[i] &= other->words[i];
+        size_t count = popcount_words(chunk->words, CHUNK_WORDS);
+        if (count <= ARRAY_MAX) {
+            uint64_t *words = chunk->words;
+            chunk->words = NULL;
+            bool ok = chunk_set_words(chunk, words, count);
+            free(words);
+            return ok;
+        }
+        chunk->count = count;
+    }
+    return true;
+}
+
+// --- Public API ---
+
+IdBitmap* id_bitmap_from_sorted(const uint32_t *ids, size_t count) {
+    IdBitmap *bitmap = calloc(1, sizeof(IdBitmap));
+    if (!bitmap) return NULL;
+    for (size_t start = 0; start < count;) {
+        uint16_t key = ids[start] >> 16;
+        size_t end = start;
+        while (end < count && (ids[end] >> 16) == key) end++;
+        Chunk *chunk = push_chunk(bitmap, key);
+        if (!chunk || !chunk_set_sorted(chunk, ids + start, end - start)) {
+            id_bitmap_free(bitmap);
+            errno = ENOMEM;
+            return NULL;
+        }
+        start = end;
+    }
+    return bitmap;
+}
+
+IdBitmap* id_bitmap_from_words(const uint64_t *words, size_t n_words) {
+    IdBitmap *bitmap = calloc(1, sizeof(IdBitmap));
+    if (!bitmap) return NULL;
+    uint64_t tail[CHUNK_WORDS];
+    for (size_t first = 0; first < n_words; first += CHUNK_WORDS) {
+        const uint64_t *source = words + first;
+        size_t n = n_words - first < CHUNK_WORDS ? n_words - first : CHUNK_WORDS;
+        size_t count = popcount_words(source, n);
+        if (count == 0) continue;
+        if (n < CHUNK_WORDS) {
+            // The last, partial chunk is padded out with zeros
+            memcpy(tail, source, n * sizeof(uint64_t));
+            memset(tail + n, 0, (CHUNK_WORDS - n) * sizeof(uint64_t));
+            source = tail;
+        }
+        Chunk *chunk = push_chunk(bitmap, first / CHUNK_WORDS);
+        if (!chunk || !chunk_set_words(chunk, source, count)) {
+            id_bitmap_free(bitmap);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return bitmap;
+}
+
+void id_bitmap_free(IdBitmap *bitmap) {
+    if (!bitmap) return;
+    for (size_t i = 0; i < bitmap->count; i++) chunk_free(&bitmap->chunks[i]);
+    free(bitmap->chunks);
+    free(bitmap);
+}
+
+int id_bitmap_and(IdBitmap *bitmap, const IdBitmap *other) {
+    size_t kept = 0, j = 0;
+    int result = 0;
+    for (size_t i = 0; i < bitmap->count; i++) {
+        Chunk *chunk = &bitmap->chunks[i];
+        while (j < other->count && other->chunks[j].key < chunk->key) j++;
+        bool keep = false;
+        if (result == 0 && j < other->count && other->chunks[j].key == chunk->key) {
+            if (chunk_and(chunk, &other->chunks[j])) keep = chunk->count > 0;
+            else result = -1;
+        }
+        if (keep) bitmap->chunks[kept++] = *chunk;
+        else chunk_free(chunk);
+    }
+    bitmap->count = kept;
+    if (result != 0) errno = ENOMEM;
+    return result;
+}
+
+size_t id_bitmap_count(const IdBitmap *bitmap) {
+    size_t count = 0;
+    for (size_t i = 0; i < bitmap->count; i++) count += bitmap->chunks[i].count;
+    return count;
+}
+
+bool id_bitmap_contains(const IdBitmap *bitmap, uint32_t id) {
+    uint16_t key = id >> 16;
+    size_t lo = 0, hi = bitmap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bitmap->chunks[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < bitmap->count && bitmap->chunks[lo].key == key && chunk_contains(&bitmap->chunks[lo], id & 0xFFFF);
+}
+
+size_t id_bitmap_to_array(const IdBitmap *bitmap, uint32_t *out) {
+    size_t n = 0;
+    for (size_t c = 0; c < bitmap->count; c++) {
+        const Chunk *chunk = &bitmap->chunks[c];
+        uint32_t high = (uint32_t)chunk->key << 16;
+        if (chunk->values) {
+            for (size_t i = 0; i < chunk->count; i++) out[n++] = high | chunk->values[i];
+            continue;
+        }
+        for (size_t i = 0; i < CHUNK_WORDS; i++) {
+            for (uint64_t word = chunk->words[i]; word; word &= word - 1) {
+                out[n++] = high | (uint32_t)(i * 64 + __builtin_ctzll(word));
+            }
+        }
+    }
+    return n;
+}
+
+size_t id_bitmap_bytes(const IdBitmap *bitmap) {
+    size_t bytes = sizeof(IdBitmap) + bitmap->capacity * sizeof(Chunk);
+    for (size_t i = 0; i < bitmap->count; i++) {
+        const Chunk *chunk = &bitmap->chunks[i];
+        bytes += chunk->words ? CHUNK_WORDS * sizeof(uint64_t) : chunk->count * sizeof(uint16_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,36 @@
+#ifndef ID_BITMAP_H
+#define ID_BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Compressed Id Bitmap ---
+//
+// A set of 32-bit ids split into chunks of 65536 by the high 16 bits, as in
+// Roaring bitmaps. A chunk holding at most 4096 ids is a sorted array of
+// their low halves, anything fuller is a plain 8 KB bitset, so sparse and
+// dense sets both stay small and intersect quickly: array against array
+// merges, array against bitset probes, bitset against bitset ANDs words.
+// Empty chunks are not stored.
+
+typedef struct IdBitmap IdBitmap;
+
+// Both return NULL with errno set if memory runs out. ids must be ascending;
+// words is a plain bitset where bit i of words[i / 64] stands for id i.
+IdBitmap* id_bitmap_from_sorted(const uint32_t *ids, size_t count);
+IdBitmap* id_bitmap_from_words(const uint64_t *words, size_t n_words);
+void id_bitmap_free(IdBitmap *bitmap);
+
+// Keeps only the ids also in other. Returns 0, or -1 with errno set.
+int id_bitmap_and(IdBitmap *bitmap, const IdBitmap *other);
+
+size_t id_bitmap_count(const IdBitmap *bitmap);
+bool id_bitmap_contains(const IdBitmap *bitmap, uint32_t id);
+// Writes every id in ascending order to out, which must have room for
+// id_bitmap_count() of them, and returns how many were written
+size_t id_bitmap_to_array(const IdBitmap *bitmap, uint32_t *out);
+// Heap bytes held, for sizing reports
+size_t id_bitmap_bytes(const IdBitmap *bitmap);
+
+#endif
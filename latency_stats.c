@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include "latency_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define SUB_BUCKETS 4                       // Per power of two
+#define BUCKETS (63 * SUB_BUCKETS)          // Enough for any uint64_t nanosecond count
+#define MIN_WATCHDOG_POLL_MS 5
+
+static const char *OP_NAMES[LATENCY_OP_COUNT] = {
+    "load", "edit", "edit_batch", "save", "compact", "search", "refilter", "sort", "export", "triage", "triage_batch",
+    "request", "import", "duplicate_scan", "duplicate_check", "changes", "history",
+};
+
+// --- Structs ---
+
+typedef struct {
+    atomic_uint_fast64_t counts[BUCKETS];
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+} Histogram;
+
+// One per thread that has recorded anything. Only the owning thread writes
+// the histograms, so it bumps them with plain relaxed load + store pairs;
+// slots are recycled when their thread exits and never freed.
+typedef struct ThreadStats {
+    Histogram ops[LATENCY_OP_COUNT];
+    atomic_int active;              // Outermost operation running, or -1
+    atomic_bool in_use;
+    struct ThreadStats *next;
+} ThreadStats;
+
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    pthread_mutex_t lock;           // Guards stop and the stall records
+    pthread_cond_t cond;
+    unsigned threshold_ms;
+    char *dump_path;
+    ThreadStats *watched;
+    atomic_uint_fast64_t last_beat; // Monotonic nanoseconds
+
+    uint64_t stalls;
+    uint64_t stalls_by_op[LATENCY_OP_COUNT + 1];
+    uint64_t stall_counts[BUCKETS];
+    uint64_t stall_total_ns;
+    uint64_t stall_max_ns;
+    LatencyStall recent[LATENCY_RECENT_STALLS];     // Ring, next at recent_next
+    size_t recent_next;
+    size_t recent_count;
+} Watchdog;
+
+static _Atomic(ThreadStats*) all_threads;
+static _Thread_local ThreadStats *thread_stats;
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+static Watchdog watchdog = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static atomic_int dump_requested;          // Lock-free, so the signal handler may set it
+
+// --- Histograms ---
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return (unsigned)ns;
+    unsigned msb = 63 - __builtin_clzll(ns);
+    return (msb - 1) * SUB_BUCKETS + (unsigned)((ns >> (msb - 2)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper(unsigned bucket) {
+    if (bucket + 1 >= BUCKETS) return UINT64_MAX;
+    unsigned next = bucket + 1;
+    if (next < SUB_BUCKETS) return next - 1;
+    unsigned msb = next / SUB_BUCKETS + 1;
+    return ((uint64_t)(SUB_BUCKETS + next % SUB_BUCKETS) << (msb - 2)) - 1;
+}
+
+static void bump(atomic_uint_fast64_t *counter, uint64_t by) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+static void summarize(const uint64_t *counts, uint64_t total_ns, uint64_t max_ns, LatencySummary *summary) {
+    uint64_t count = 0;
+    for (unsigned b = 0; b < BUCKETS; b++) count += counts[b];
+    *summary = (LatencySummary){ .count = count, .max_ms = max_ns / 1e6 };
+    if (count == 0) return;
+    summary->mean_ms = total_ns / 1e6 / count;
+
+    const double quantiles[] = { 0.50, 0.90, 0.99 };
+    double *targets[] = { &summary->p50_ms, &summary->p90_ms, &summary->p99_ms };
+    uint64_t seen = 0;
+    unsigned b = 0;
+    for (size_t q = 0; q < 3; q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * count + 0.999999);
+        if (rank < 1) rank = 1;
+        while (b < BUCKETS && seen + counts[b] < rank) seen += counts[b++];
+        uint64_t upper = b < BUCKETS ? bucket_upper(b) : max_ns;
+        *targets[q] = (upper < max_ns ? upper : max_ns) / 1e6;
+    }
+}
+
+// --- Per-Thread Counters ---
+
+static void release_thread_stats(void *data) {
+    ThreadStats *stats = data;
+    atomic_store(&stats->active, -1);
+    atomic_store(&stats->in_use, false);
+}
+
+static void make_release_key(void) {
+    pthread_key_create(&release_key, release_thread_stats);
+}
+
+// Reuses the slot of a thread that has exited if there is one
+static ThreadStats* claim_thread_stats(void) {
+    pthread_once(&release_key_once, make_release_key);
+    ThreadStats *stats;
+    for (stats = atomic_load(&all_threads); stats; stats = stats->next) {
+        bool unused = false;
+        if (atomic_compare_exchange_strong(&stats->in_use, &unused, true)) break;
+    }
+    if (!stats) {
+        stats = calloc(1, sizeof(ThreadStats));
+        if (!stats) return NULL;
+        atomic_init(&stats->active, -1);
+        atomic_init(&stats->in_use, true);
+        stats->next = atomic_load(&all_threads);
+        while (!atomic_compare_exchange_weak(&all_threads, &stats->next, stats)) {}
+    }
+    pthread_setspecific(release_key, stats);
+    return stats;
+}
+
+static ThreadStats* current_thread_stats(void) {
+    if (!thread_stats) thread_stats = claim_thread_stats();
+    return thread_stats;
+}
+
+LatencyProbe latency_begin(LatencyOp op) {
+    LatencyProbe probe = { op, now_ns(), -1 };
+    ThreadStats *stats = current_thread_stats();
+    if (stats) {
+        probe.outer = atomic_load_explicit(&stats->active, memory_order_relaxed);
+        if (probe.outer < 0) atomic_store_explicit(&stats->active, (int)op, memory_order_relaxed);
+    }
+    return probe;
+}
+
+void latency_end(LatencyProbe probe) {
+    uint64_t elapsed = now_ns() - probe.started;
+    ThreadStats *stats = thread_stats;
+    if (!stats) return;
+    Histogram *histogram = &stats->ops[probe.op];
+    bump(&histogram->counts[bucket_of(elapsed)], 1);
+    bump(&histogram->total_ns, elapsed);
+    if (elapsed > atomic_load_explicit(&histogram->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_ns, elapsed, memory_order_relaxed);
+    }
+    if (probe.outer < 0) atomic_store_explicit(&stats->active, -1, memory_order_relaxed);
+}
+
+const char* latency_op_name(LatencyOp op) {
+    return op < LATENCY_OP_COUNT ? OP_NAMES[op] : "none";
+}
+
+// --- Reports ---
+
+void latency_report(LatencyReport *report) {
+    memset(report, 0, sizeof(*report));
+    uint64_t counts[BUCKETS];
+    for (int op = 0; op < LATENCY_OP_COUNT; op++) {
+        memset(counts, 0, sizeof(counts));
+        uint64_t total_ns = 0, max_ns = 0;
+        for (ThreadStats *stats = atomic_load(&all_threads); stats; stats = stats->next) {
+            Histogram *histogram = &stats->ops[op];
+            for (unsigned b = 0; b < BUCKETS; b++) {
+                counts[b] += atomic_load_explicit(&histogram->counts[b], memory_order_relaxed);
+            }
+            total_ns += atomic_load_explicit(&histogram->total_ns, memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+            if (max > max_ns) max_ns = max;
+        }
+        summarize(counts, total_ns, max_ns, &report->ops[op]);
+    }
+    for (ThreadStats *stats = atomic_load(&all_threads); stats; stats = stats->next) report->threads++;
+
+    pthread_mutex_lock(&watchdog.lock);
+    report->watchdog = watchdog.running;
+    report->stall_threshold_ms = watchdog.threshold_ms;
+    report->stalls = watchdog.stalls;
+    memcpy(report->stalls_by_op, watchdog.stalls_by_op, sizeof(report->stalls_by_op));
+    summarize(watchdog.stall_counts, watchdog.stall_total_ns, watchdog.stall_max_ns, &report->stall_times);
+    report->recent_count = watchdog.recent_count;
+    for (size_t i = 0; i < watchdog.recent_count; i++) {
+        size_t slot = (watchdog.recent_next + LATENCY_RECENT_STALLS - 1 - i) % LATENCY_RECENT_STALLS;
+        report->recent[i] = watchdog.recent[slot];
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+static void write_summary(FILE *out, const LatencySummary *summary) {
+    fprintf(out, "{\"count\": %llu, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+            (unsigned long long)summary->count, summary->mean_ms, summary->p50_ms, summary->p90_ms, summary->p99_ms,
+            summary->max_ms);
+}
+
+int latency_write_json(FILE *out) {
+    LatencyReport *report = malloc(sizeof(LatencyReport));
+    if (!report) return -1;
+    latency_report(report);
+    fprintf(out, "{\n  \"threads\": %u,\n  \"operations\": {", report->threads);
+    for (int op = 0; op < LATENCY_OP_COUNT; op++) {
+        fprintf(out, "%s\n    \"%s\": ", op ? "," : "", OP_NAMES[op]);
+        write_summary(out, &report->ops[op]);
+    }
+    fprintf(out, "\n  },\n  \"watchdog\": {\n    \"running\": %s,\n    \"threshold_ms\": %u,\n    \"stalls\": %llu,\n"
+                 "    \"stalls_by_operation\": {",
+            report->watchdog ? "true" : "false", report->stall_threshold_ms, (unsigned long long)report->stalls);
+    for (int op = 0; op <= LATENCY_OP_COUNT; op++) {
+        fprintf(out, "%s\"%s\": %llu", op ? ", " : "", latency_op_name(op), (unsigned long long)report->stalls_by_op[op]);
+    }
+    fprintf(out, "},\n    \"stall_ms\": ");
+    write_summary(out, &report->stall_times);
+    fprintf(out, ",\n    \"recent\": [");
+    for (size_t i = 0; i < report->recent_count; i++) {
+        const LatencyStall *stall = &report->recent[i];
+        char when[32];
+        time_t seconds = (time_t)stall->started;
+        struct tm local;
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime_r(&seconds, &local));
+        fprintf(out, "%s\n      {\"started\": \"%s\", \"ms\": %.1f, \"operation\": \"%s\"}", i ? "," : "", when,
+                stall->ms, latency_op_name(stall->op < 0 ? LATENCY_OP_COUNT : (LatencyOp)stall->op));
+    }
+    fprintf(out, "%s]\n  }\n}\n", report->recent_count ? "\n    " : "");
+    free(report);
+    return ferror(out) ? (errno = EIO, -1) : 0;
+}
+
+int latency_dump_json(const char *path) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    if (!tmp) return -1;
+    snprintf(tmp, len, "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    int result = -1;
+    if (out) {
+        result = latency_write_json(out);
+        if (fclose(out) != 0) result = -1;
+        if (result == 0 && rename(tmp, path) != 0) result = -1;
+        if (result != 0) unlink(tmp);
+    }
+    free(tmp);
+    return result;
+}
+
+// --- Stall Watchdog ---
+
+static void on_dump_signal(int signo) {
+    atomic_store(&dump_requested, 1);
+}
+
+static void record_stall(uint64_t gap_ns, double started, int op) {
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.stalls++;
+    watchdog.stalls_by_op[op < 0 ? LATENCY_OP_COUNT : op]++;
+    watchdog.stall_counts[bucket_of(gap_ns)]++;
+    watchdog.stall_total_ns += gap_ns;
+    if (gap_ns > watchdog.stall_max_ns) watchdog.stall_max_ns = gap_ns;
+    watchdog.recent[watchdog.recent_next] = (LatencyStall){ started, gap_ns / 1e6, op };
+    watchdog.recent_next = (watchdog.recent_next + 1) % LATENCY_RECENT_STALLS;
+    if (watchdog.recent_count < LATENCY_RECENT_STALLS) watchdog.recent_count++;
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+// Samples the heartbeat a few times per threshold. A stall is recorded once
+// the beats resume, as the gap between the last beat before it and the
+// first one after; the operation is the first one seen running during it.
+static void* watchdog_thread(void *data) {
+    uint64_t threshold_ns = (uint64_t)watchdog.threshold_ms * 1000000u;
+    unsigned poll_ms = watchdog.threshold_ms / 4 > MIN_WATCHDOG_POLL_MS ? watchdog.threshold_ms / 4 : MIN_WATCHDOG_POLL_MS;
+    bool stalled = false;
+    uint64_t stall_beat = 0;
+    double stall_started = 0;
+    int stall_op = -1;
+
+    pthread_mutex_lock(&watchdog.lock);
+    while (!watchdog.stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)poll_ms * 1000000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&watchdog.cond, &watchdog.lock, &until);
+        if (watchdog.stop) break;
+        pthread_mutex_unlock(&watchdog.lock);
+
+        if (atomic_exchange(&dump_requested, 0)) {
+            if (watchdog.dump_path) latency_dump_json(watchdog.dump_path);
+        }
+        uint64_t beat = atomic_load(&watchdog.last_beat), now = now_ns();
+        int op = atomic_load_explicit(&watchdog.watched->active, memory_order_relaxed);
+        if (stalled && beat != stall_beat) {
+            record_stall(beat - stall_beat, stall_started, stall_op);
+            stalled = false;
+        } else if (stalled && stall_op < 0) {
+            stall_op = op;
+        } else if (!stalled && now - beat > threshold_ns) {
+            struct timespec wall;
+            clock_gettime(CLOCK_REALTIME, &wall);
+            stalled = true;
+            stall_beat = beat;
+            stall_started = wall.tv_sec + wall.tv_nsec / 1e9 - (now - beat) / 1e9;
+            stall_op = op;
+        }
+        pthread_mutex_lock(&watchdog.lock);
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+    return NULL;
+}
+
+int latency_watchdog_start(unsigned threshold_ms, const char *dump_path) {
+    if (watchdog.running || threshold_ms == 0) {
+        errno = watchdog.running ? EBUSY : EINVAL;
+        return -1;
+    }
+    watchdog.watched = current_thread_stats();
+    watchdog.dump_path = dump_path ? strdup(dump_path) : NULL;
+    if (!watchdog.watched || (dump_path && !watchdog.dump_path)) return -1;
+    watchdog.threshold_ms = threshold_ms;
+    watchdog.stop = false;
+    atomic_store(&watchdog.last_beat, now_ns());
+    if (pthread_create(&watchdog.thread, NULL, watchdog_thread, NULL) != 0) {
+        free(watchdog.dump_path);
+        watchdog.dump_path = NULL;
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.running = true;
+    pthread_mutex_unlock(&watchdog.lock);
+    if (dump_path) {
+        struct sigaction action = { .sa_handler = on_dump_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+    }
+    return 0;
+}
+
+void latency_heartbeat(void) {
+    atomic_store_explicit(&watchdog.last_beat, now_ns(), memory_order_relaxed);
+}
+
+void latency_watchdog_stop(void) {
+    if (!watchdog.running) return;
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.stop = true;
+    pthread_cond_signal(&watchdog.cond);
+    pthread_mutex_unlock(&watchdog.lock);
+    pthread_join(watchdog.thread, NULL);
+    if (watchdog.dump_path) signal(SIGUSR1, SIG_DFL);
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.running = false;
+    pthread_mutex_unlock(&watchdog.lock);
+    free(watchdog.dump_path);
+    watchdog.dump_path = NULL;
+}
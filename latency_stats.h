@@ -0,0 +1,99 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// --- Latency Statistics ---
+//
+// Timing probes around the data operations feed one latency histogram per
+// operation. Each thread records into its own counters, which only that
+// thread writes, so a probe costs two clock reads and a few plain stores;
+// readers merge all threads' counters whenever a report is asked for.
+//
+// The stall watchdog watches one thread (the GTK main loop) through a
+// heartbeat it is expected to send every few milliseconds. When the beats
+// stop for longer than a threshold, the stall is recorded together with the
+// operation the watched thread was running at the time.
+//
+// Histogram buckets split every power of two into four, so percentiles are
+// reported to within 25%.
+
+typedef enum {
+    LATENCY_LOAD,           // Opening a registry, journal replay included
+    LATENCY_EDIT,           // One add, update or delete
+    LATENCY_EDIT_BATCH,     // Many changes applied and journalled together
+    LATENCY_SAVE,           // Waiting for journalled edits to reach the disk
+    LATENCY_COMPACT,        // Rewriting a snapshot
+    LATENCY_SEARCH,         // Store-level name matching
+    LATENCY_REFILTER,       // Rebuilding the visible rows of a view
+    LATENCY_SORT,
+    LATENCY_EXPORT,
+    LATENCY_TRIAGE,         // One note
+    LATENCY_TRIAGE_BATCH,   // A whole notes file
+    LATENCY_REQUEST,        // One registry daemon request, up to its reply being queued
+    LATENCY_IMPORT,         // Reading, checking and deduplicating one CSV feed
+    LATENCY_DUPLICATE_SCAN, // Looking for likely duplicates across the whole registry
+    LATENCY_DUPLICATE_CHECK, // Looking for likely duplicates of one new patient
+    LATENCY_CHANGES,        // Working out what changed since an export watermark
+    LATENCY_HISTORY,        // Reading one patient's encounter history
+    LATENCY_OP_COUNT
+} LatencyOp;
+
+#define LATENCY_RECENT_STALLS 16
+
+typedef struct {
+    LatencyOp op;
+    uint64_t started;
+    int outer;              // Operation this one nests in, or -1
+} LatencyProbe;
+
+typedef struct {
+    uint64_t count;
+    double mean_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+} LatencySummary;
+
+typedef struct {
+    double started;         // Wall-clock seconds since the epoch
+    double ms;
+    int op;                 // What the watched thread was running, or -1 for none
+} LatencyStall;
+
+typedef struct {
+    LatencySummary ops[LATENCY_OP_COUNT];
+    unsigned threads;               // Threads that have ever recorded
+    bool watchdog;                  // Whether the watchdog is running
+    unsigned stall_threshold_ms;
+    uint64_t stalls;
+    uint64_t stalls_by_op[LATENCY_OP_COUNT + 1];    // The last slot counts stalls outside any operation
+    LatencySummary stall_times;
+    size_t recent_count;
+    LatencyStall recent[LATENCY_RECENT_STALLS];     // Newest first
+} LatencyReport;
+
+// Marks the start of op on the calling thread. Probes may nest; the
+// watchdog reports the outermost one.
+LatencyProbe latency_begin(LatencyOp op);
+void latency_end(LatencyProbe probe);
+
+const char* latency_op_name(LatencyOp op);
+void latency_report(LatencyReport *report);
+// Writes the report as one JSON object. Returns 0, or -1 with errno set.
+int latency_write_json(FILE *out);
+// Writes the report to path via a temporary file and a rename
+int latency_dump_json(const char *path);
+
+// Starts the watchdog thread, watching the calling thread, which must then
+// call latency_heartbeat() well within threshold_ms. If dump_path is given,
+// SIGUSR1 makes the watchdog dump the report there, so it works even while
+// the watched thread is stuck. Returns 0, or -1 with errno set.
+int latency_watchdog_start(unsigned threshold_ms, const char *dump_path);
+void latency_heartbeat(void);
+void latency_watchdog_stop(void);
+
+#endif
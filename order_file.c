@@ -0,0 +1,144 @@
+#include "order_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "order_file.c reads and writes its integers in host order, which must be little-endian"
+#endif
+
+// --- Structs ---
+
+typedef struct {
+    char magic[ORDER_FILE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t keys;
+    uint64_t lsn;
+    uint64_t rows;
+    uint64_t snapshot_size;
+    uint32_t crc_orders;
+    uint32_t crc_header;    // Over the header with this field zeroed
+} OrderHeader;
+
+// --- Helpers ---
+
+static uint32_t checksum(uint32_t crc, const void *data, size_t len) {
+    return crc32_z(crc, data, len);
+}
+
+static uint32_t header_checksum(const OrderHeader *header) {
+    OrderHeader copy = *header;
+    copy.crc_header = 0;
+    return checksum(crc32_z(0, NULL, 0), &copy, sizeof(copy));
+}
+
+// Every row exactly once
+static bool is_permutation(const uint32_t *order, uint64_t rows, uint8_t *seen) {
+    memset(seen, 0, rows / 8 + 1);
+    for (uint64_t i = 0; i < rows; i++) {
+        uint32_t row = order[i];
+        if (row >= rows || (seen[row >> 3] & (1u << (row & 7)))) return false;
+        seen[row >> 3] |= 1u << (row & 7);
+    }
+    return true;
+}
+
+// --- Reading ---
+
+int order_file_open(const char *path, uint64_t lsn, uint64_t rows, uint64_t snapshot_size, OrderFile *file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    size_t expected = sizeof(OrderHeader) + rows * ORDER_FILE_KEYS * sizeof(uint32_t);
+    if ((uint64_t)st.st_size != expected || rows > UINT32_MAX) {
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+    file->map = map;
+    file->map_size = st.st_size;
+
+    const OrderHeader *header = map;
+    const uint32_t *orders = (const uint32_t*)((const char*)map + sizeof(OrderHeader));
+    bool valid = memcmp(header->magic, ORDER_FILE_MAGIC, ORDER_FILE_MAGIC_LEN) == 0
+                 && header->version == ORDER_FILE_VERSION
+                 && header->keys == ORDER_FILE_KEYS
+                 && header->crc_header == header_checksum(header)
+                 && header->lsn == lsn && header->rows == rows && header->snapshot_size == snapshot_size
+                 && checksum(crc32_z(0, NULL, 0), orders, rows * ORDER_FILE_KEYS * sizeof(uint32_t)) == header->crc_orders;
+    uint8_t *seen = valid ? malloc(rows / 8 + 1) : NULL;
+    if (valid && !seen) {
+        order_file_close(file);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int key = 0; valid && key < ORDER_FILE_KEYS; key++) {
+        file->orders[key] = orders + key * rows;
+        valid = is_permutation(file->orders[key], rows, seen);
+    }
+    free(seen);
+    if (!valid) {
+        order_file_close(file);
+        errno = EBADMSG;
+        return -1;
+    }
+    file->rows = rows;
+    return 0;
+}
+
+void order_file_close(OrderFile *file) {
+    if (file->map) munmap(file->map, file->map_size);
+    memset(file, 0, sizeof(*file));
+}
+
+// --- Writing ---
+
+bool order_file_write(const char *path, const char *tmp_path, uint64_t lsn, uint64_t snapshot_size, uint64_t rows,
+                      uint32_t *const orders[ORDER_FILE_KEYS]) {
+    OrderHeader header = {0};
+    memcpy(header.magic, ORDER_FILE_MAGIC, ORDER_FILE_MAGIC_LEN);
+    header.version = ORDER_FILE_VERSION;
+    header.keys = ORDER_FILE_KEYS;
+    header.lsn = lsn;
+    header.rows = rows;
+    header.snapshot_size = snapshot_size;
+    uint32_t crc = crc32_z(0, NULL, 0);
+    for (int key = 0; key < ORDER_FILE_KEYS; key++) crc = checksum(crc, orders[key], rows * sizeof(uint32_t));
+    header.crc_orders = crc;
+    header.crc_header = header_checksum(&header);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int key = 0; ok && key < ORDER_FILE_KEYS; key++) {
+        ok = rows == 0 || fwrite(orders[key], sizeof(uint32_t), rows, file) == rows;
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
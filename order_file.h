@@ -0,0 +1,43 @@
+#ifndef ORDER_FILE_H
+#define ORDER_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Sort Order File ---
+//
+// Saved next to a snapshot (patients.txt -> patients.txt.order), it holds
+// the snapshot's rows sorted by name, by age and by admission time, so a
+// store can pick the orders up at load instead of sorting:
+//
+//     header | by name u32[n] | by age u32[n] | by added u32[n]
+//
+// Each section lists row numbers of the snapshot, ties in row order. The
+// header names the snapshot it belongs to by lsn, row count and file size,
+// and carries a CRC-32 over everything; a file that doesn't match its
+// snapshot is simply ignored. Integers are little-endian.
+
+#define ORDER_FILE_MAGIC "HMSORD\r\n"
+#define ORDER_FILE_MAGIC_LEN 8
+#define ORDER_FILE_VERSION 1
+#define ORDER_FILE_KEYS 3
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    uint64_t rows;
+    const uint32_t *orders[ORDER_FILE_KEYS];    // By name, by age, by added
+} OrderFile;
+
+// Maps path and checks that it belongs to a snapshot of rows rows, lsn lsn
+// and snapshot_size bytes, and that each section is a permutation. Returns
+// 0, or -1 with errno set (EBADMSG if the file is damaged or stale).
+int order_file_open(const char *path, uint64_t lsn, uint64_t rows, uint64_t snapshot_size, OrderFile *file);
+void order_file_close(OrderFile *file);
+
+// Writes tmp_path, syncs it and renames it over path
+bool order_file_write(const char *path, const char *tmp_path, uint64_t lsn, uint64_t snapshot_size, uint64_t rows,
+                      uint32_t *const orders[ORDER_FILE_KEYS]);
+
+#endif
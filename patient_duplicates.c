@@ -0,0 +1,526 @@
+#include "patient_duplicates.h"
+#include "latency_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define FOLDED_NAME_MAX 255         // Bytes of a folded name that are compared
+#define BIT_PARALLEL_MAX 64         // Longest name the bit-parallel distance takes in one word
+#define SCAN_MIN_CHUNK 4096         // Rows per thread while the keys are worked out
+#define SLICE_ROWS 256              // Rows of a big block handed out at a time
+#define PROGRESS_SLICES 64          // Slices between progress reports
+#define AGE_KEY_MAX 255
+
+// Soundex digit for a to z; 0 separates, h and w are skipped outright
+static const char SOUNDEX_CODES[26] = "01230120022455012623010202";
+
+// --- Structs ---
+
+// One patient in the scan, sorted by key so that blocks are runs
+typedef struct {
+    uint64_t key;               // Phonetic code, gender, age from the top down
+    const char *name;           // Folded
+    PatientHandle handle;
+    uint16_t len;
+} ScanEntry;
+
+// Rows [first, end) of a block, each compared with the rest of the block after it
+typedef struct {
+    uint32_t block_start;
+    uint32_t block_end;
+    uint32_t first;
+    uint32_t end;
+} ScanSlice;
+
+typedef struct {
+    const PatientSnapshot *snapshot;
+    size_t first;
+    size_t end;
+    ScanEntry *entries;         // Shared; this chunk fills [first, end)
+    char *names;                // The chunk's folded names
+    bool failed;
+} KeyChunk;
+
+typedef struct {
+    uint64_t peq[256];          // Bit i set where the pattern has that byte at i
+    const char *text;
+    size_t len;
+} NamePattern;
+
+typedef struct ScanShared ScanShared;
+
+typedef struct {
+    ScanShared *shared;
+    bool reports;               // Calls the progress callback
+    NamePattern pattern;
+    PatientDuplicate *pairs;
+    size_t count;
+    size_t cap;
+    size_t comparisons;
+    bool failed;
+} PairWorker;
+
+struct ScanShared {
+    const ScanEntry *entries;
+    const ScanSlice *slices;
+    size_t n_slices;
+    atomic_size_t next_slice;
+    atomic_size_t slices_done;
+    const PatientDuplicateOptions *options;
+};
+
+// --- Names ---
+
+static bool is_name_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Lower-cases ASCII letters, drops apostrophes and turns every other run of
+// punctuation or space into one space, so "O'Brien,  Ann" folds to
+// "obrien ann". out must hold FOLDED_NAME_MAX + 1 bytes.
+static size_t fold_name(const char *name, char *out) {
+    size_t len = 0;
+    bool space = false;
+    for (const unsigned char *p = (const unsigned char*)name; *p && len < FOLDED_NAME_MAX; p++) {
+        unsigned char c = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+        if (c == '\'') continue;
+        if (!is_name_byte(c)) {
+            space = len > 0;
+            continue;
+        }
+        if (space && len + 1 < FOLDED_NAME_MAX) out[len++] = ' ';
+        space = false;
+        out[len++] = c;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// The letter and up to three digits, packed into 14 bits; 0 for a word
+// without letters
+static uint32_t soundex(const char *word, size_t len) {
+    size_t i = 0;
+    while (i < len && !(word[i] >= 'a' && word[i] <= 'z')) i++;
+    if (i == len) return 0;
+    uint32_t code = (uint32_t)(word[i] - 'a' + 1) << 9;
+    char last = SOUNDEX_CODES[word[i] - 'a'];
+    int shift = 6;
+    for (i++; i < len && shift >= 0; i++) {
+        char c = word[i];
+        if (c < 'a' || c > 'z' || c == 'h' || c == 'w') continue;
+        char digit = SOUNDEX_CODES[c - 'a'];
+        if (digit != '0' && digit != last) {
+            code |= (uint32_t)(digit - '0') << shift;
+            shift -= 3;
+        }
+        last = digit;
+    }
+    return code;
+}
+
+// Soundex of the first word over that of the last
+static uint32_t phonetic_key(const char *folded, size_t len) {
+    const char *space = memchr(folded, ' ', len);
+    size_t first_len = space ? (size_t)(space - folded) : len;
+    const char *last = folded + len;
+    while (last > folded && last[-1] != ' ') last--;
+    return soundex(folded, first_len) << 14 | soundex(last, folded + len - last);
+}
+
+static uint64_t block_key(const char *folded, size_t len, const char *gender, unsigned age) {
+    unsigned char g = (unsigned char)gender[0];
+    if (g >= 'A' && g <= 'Z') g += 'a' - 'A';
+    return (uint64_t)phonetic_key(folded, len) << 16 | (uint64_t)g << 8 | (age < AGE_KEY_MAX ? age : AGE_KEY_MAX);
+}
+
+static unsigned key_age(uint64_t key) {
+    return key & 0xff;
+}
+
+// --- Edit Distance ---
+
+// Edits allowed between names whose longer one has len bytes
+static unsigned distance_limit(size_t len) {
+    return len < 4 ? 0 : (unsigned)((len + 4) / 8);
+}
+
+// peq must be all zero beforehand, and is again after pattern_clear
+static void pattern_set(NamePattern *pattern, const char *text, size_t len) {
+    pattern->text = text;
+    pattern->len = len;
+    if (len > BIT_PARALLEL_MAX) return;
+    for (size_t i = 0; i < len; i++) pattern->peq[(unsigned char)text[i]] |= 1ull << i;
+}
+
+static void pattern_clear(NamePattern *pattern) {
+    if (pattern->len > BIT_PARALLEL_MAX) return;
+    for (size_t i = 0; i < pattern->len; i++) pattern->peq[(unsigned char)pattern->text[i]] = 0;
+}
+
+// Row-by-row dynamic programming, for names too long for one word
+static unsigned row_distance(const char *a, size_t m, const char *b, size_t n, unsigned limit) {
+    unsigned rows[3][FOLDED_NAME_MAX + 1];
+    unsigned *before = rows[0], *above = rows[1], *row = rows[2];
+    unsigned best_above = 0;
+    for (size_t j = 0; j <= n; j++) above[j] = j;
+    for (size_t i = 1; i <= m; i++) {
+        unsigned best = i;
+        row[0] = i;
+        for (size_t j = 1; j <= n; j++) {
+            unsigned value = above[j - 1] + (a[i - 1] != b[j - 1]);
+            if (above[j] + 1 < value) value = above[j] + 1;
+            if (row[j - 1] + 1 < value) value = row[j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && before[j - 2] + 1 < value) {
+                value = before[j - 2] + 1;
+            }
+            row[j] = value;
+            if (value < best) best = value;
+        }
+        // A swap reaches back two rows, so both have to be past the limit
+        if (best > limit && best_above > limit) return limit + 1;
+        best_above = best;
+        unsigned *oldest = before;
+        before = above;
+        above = row;
+        row = oldest;
+    }
+    return above[n] <= limit ? above[n] : limit + 1;
+}
+
+// Edit distance from the pattern to text, with a swap of two neighbouring
+// bytes counting as one edit, or limit + 1 if it is more. Hyyrö's
+// bit-vector algorithm keeps a whole column of the distance table as +1/-1
+// deltas in two words and advances it a text byte at a time.
+static unsigned pattern_distance(const NamePattern *pattern, const char *text, size_t n, unsigned limit) {
+    size_t m = pattern->len;
+    if (m > BIT_PARALLEL_MAX) return row_distance(pattern->text, m, text, n, limit);
+    if (m == 0) return n <= limit ? n : limit + 1;
+    uint64_t pv = ~0ull, mv = 0, d0 = 0, previous_eq = 0, last = 1ull << (m - 1);
+    unsigned score = m;
+    for (size_t j = 0; j < n; j++) {
+        uint64_t eq = pattern->peq[(unsigned char)text[j]];
+        uint64_t swapped = ((~d0 & eq) << 1) & previous_eq;
+        d0 = (((eq & pv) + pv) ^ pv) | eq | mv | swapped;
+        uint64_t ph = mv | ~(d0 | pv);
+        uint64_t mh = pv & d0;
+        if (ph & last) score++;
+        else if (mh & last) score--;
+        ph = ph << 1 | 1;
+        mh <<= 1;
+        pv = mh | ~(d0 | ph);
+        mv = ph & d0;
+        previous_eq = eq;
+        // Each byte left can take the score down by one at most
+        if (score > limit + (n - 1 - j)) return limit + 1;
+    }
+    return score <= limit ? score : limit + 1;
+}
+
+// The distance if the names are close enough to count, else -1
+static int compare_names(const NamePattern *pattern, const char *text, size_t n, size_t *comparisons) {
+    if (pattern->len == 0 || n == 0) return -1;
+    size_t longer = pattern->len > n ? pattern->len : n;
+    size_t shorter = pattern->len > n ? n : pattern->len;
+    unsigned limit = distance_limit(longer);
+    if (longer - shorter > limit) return -1;
+    (*comparisons)++;
+    unsigned distance = pattern_distance(pattern, text, n, limit);
+    return distance <= limit ? (int)distance : -1;
+}
+
+static bool add_pair(PatientDuplicate **pairs, size_t *count, size_t *cap, PatientDuplicate pair) {
+    if (*count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 64;
+        PatientDuplicate *grown = realloc(*pairs, grown_cap * sizeof(PatientDuplicate));
+        if (!grown) return false;
+        *pairs = grown;
+        *cap = grown_cap;
+    }
+    (*pairs)[(*count)++] = pair;
+    return true;
+}
+
+// --- Scan ---
+
+static unsigned online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+static void* key_chunk(void *data) {
+    KeyChunk *chunk = data;
+    size_t bytes = 0;
+    for (size_t row = chunk->first; row < chunk->end; row++) {
+        PatientRecord record;
+        patient_snapshot_get(chunk->snapshot, row, &record);
+        size_t len = strlen(record.name);
+        bytes += (len < FOLDED_NAME_MAX ? len : FOLDED_NAME_MAX) + 1;
+    }
+    chunk->names = malloc(bytes ? bytes : 1);
+    if (!chunk->names) {
+        chunk->failed = true;
+        return NULL;
+    }
+    char *out = chunk->names, folded[FOLDED_NAME_MAX + 1];
+    for (size_t row = chunk->first; row < chunk->end; row++) {
+        PatientRecord record;
+        patient_snapshot_get(chunk->snapshot, row, &record);
+        size_t len = fold_name(record.name, folded);
+        memcpy(out, folded, len + 1);
+        chunk->entries[row] = (ScanEntry){ block_key(folded, len, record.gender, record.age), out, record.handle, len };
+        out += len + 1;
+    }
+    return NULL;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const ScanEntry *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (x->handle > y->handle) - (x->handle < y->handle);
+}
+
+// Bigger blocks first, so that no thread is left with a big one at the end
+static int compare_slices(const void *a, const void *b) {
+    const ScanSlice *x = a, *y = b;
+    uint32_t x_size = x->block_end - x->block_start, y_size = y->block_end - y->block_start;
+    return (x_size < y_size) - (x_size > y_size);
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    const PatientDuplicate *x = a, *y = b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return (x->second > y->second) - (x->second < y->second);
+}
+
+static void scan_slice(PairWorker *worker, const ScanSlice *slice) {
+    const ScanEntry *entries = worker->shared->entries;
+    for (uint32_t i = slice->first; i < slice->end && !worker->failed; i++) {
+        const ScanEntry *entry = &entries[i];
+        PatientDuplicate pair;
+        unsigned age_max = key_age(entry->key) + DUPLICATE_AGE_SLACK;
+        pattern_set(&worker->pattern, entry->name, entry->len);
+        // Entries are in age order within the block, so the window ends at the first one too old
+        for (uint32_t j = i + 1; j < slice->block_end && key_age(entries[j].key) <= age_max; j++) {
+            int distance = compare_names(&worker->pattern, entries[j].name, entries[j].len, &worker->comparisons);
+            if (distance < 0) continue;
+            pair.first = entry->handle < entries[j].handle ? entry->handle : entries[j].handle;
+            pair.second = entry->handle < entries[j].handle ? entries[j].handle : entry->handle;
+            pair.distance = distance;
+            if (!add_pair(&worker->pairs, &worker->count, &worker->cap, pair)) {
+                worker->failed = true;
+                break;
+            }
+        }
+        pattern_clear(&worker->pattern);
+    }
+}
+
+// Takes slices off the shared counter until none are left, so a thread
+// that drew small blocks simply takes more of them
+static void* pair_worker(void *data) {
+    PairWorker *worker = data;
+    ScanShared *shared = worker->shared;
+    const PatientDuplicateOptions *options = shared->options;
+    size_t since_report = 0;
+    while (!worker->failed) {
+        if (options->cancel && atomic_load_explicit(options->cancel, memory_order_relaxed)) break;
+        size_t next = atomic_fetch_add(&shared->next_slice, 1);
+        if (next >= shared->n_slices) break;
+        scan_slice(worker, &shared->slices[next]);
+        size_t done = atomic_fetch_add(&shared->slices_done, 1) + 1;
+        if (worker->reports && options->progress && ++since_report == PROGRESS_SLICES) {
+            options->progress(done, shared->n_slices, options->user_data);
+            since_report = 0;
+        }
+    }
+    return NULL;
+}
+
+// Cuts every block of two or more into slices of at most SLICE_ROWS rows
+static ScanSlice* plan_slices(const ScanEntry *entries, size_t count, size_t *n_slices, size_t *n_blocks) {
+    size_t cap = 64, n = 0;
+    ScanSlice *slices = malloc(cap * sizeof(ScanSlice));
+    *n_blocks = 0;
+    for (size_t start = 0; slices && start < count;) {
+        size_t end = start + 1;
+        while (end < count && entries[end].key >> 8 == entries[start].key >> 8) end++;
+        if (end - start > 1) (*n_blocks)++;
+        for (size_t first = start; end - start > 1 && first < end; first += SLICE_ROWS) {
+            if (n == cap) {
+                ScanSlice *grown = realloc(slices, cap * 2 * sizeof(ScanSlice));
+                if (!grown) {
+                    free(slices);
+                    return NULL;
+                }
+                slices = grown;
+                cap *= 2;
+            }
+            size_t slice_end = first + SLICE_ROWS < end ? first + SLICE_ROWS : end;
+            slices[n++] = (ScanSlice){ start, end, first, slice_end };
+        }
+        start = end;
+    }
+    if (slices) qsort(slices, n, sizeof(ScanSlice), compare_slices);
+    *n_slices = n;
+    return slices;
+}
+
+long patient_duplicates_scan(const PatientSnapshot *snapshot, const PatientDuplicateOptions *options,
+                             PatientDuplicate **pairs, PatientDuplicateStats *stats) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    *pairs = NULL;
+    PatientDuplicateOptions defaults = {0};
+    if (!options) options = &defaults;
+    size_t count = patient_snapshot_count(snapshot);
+    if (count > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    LatencyProbe probe = latency_begin(LATENCY_DUPLICATE_SCAN);
+
+    // Keys and folded names, a range of rows per core
+    unsigned n_threads = online_cpus();
+    if (n_threads > count / SCAN_MIN_CHUNK) n_threads = count / SCAN_MIN_CHUNK;
+    if (n_threads == 0) n_threads = 1;
+    ScanEntry *entries = malloc((count ? count : 1) * sizeof(ScanEntry));
+    KeyChunk *chunks = calloc(n_threads, sizeof(KeyChunk));
+    PairWorker *workers = calloc(n_threads, sizeof(PairWorker));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    bool *started_thread = calloc(n_threads, sizeof(bool));
+    int saved = entries && chunks && workers && threads && started_thread ? 0 : ENOMEM;
+    for (unsigned c = 0; !saved && c < n_threads; c++) {
+        chunks[c] = (KeyChunk){ .snapshot = snapshot, .first = count * c / n_threads,
+                                .end = count * (c + 1) / n_threads, .entries = entries };
+        if (c > 0) started_thread[c] = pthread_create(&threads[c], NULL, key_chunk, &chunks[c]) == 0;
+        if (c > 0 && !started_thread[c]) key_chunk(&chunks[c]);
+    }
+    if (!saved) key_chunk(&chunks[0]);
+    for (unsigned c = 0; !saved && c < n_threads; c++) {
+        if (started_thread[c]) pthread_join(threads[c], NULL);
+        started_thread[c] = false;
+        if (chunks[c].failed) saved = ENOMEM;
+    }
+
+    // Blocks are runs of one key once sorted, in age order within
+    size_t n_slices = 0, n_blocks = 0;
+    ScanSlice *slices = NULL;
+    if (!saved) {
+        qsort(entries, count, sizeof(ScanEntry), compare_entries);
+        slices = plan_slices(entries, count, &n_slices, &n_blocks);
+        if (!slices) saved = ENOMEM;
+    }
+    ScanShared shared = { entries, slices, n_slices, 0, 0, options };
+    for (unsigned c = 0; !saved && c < n_threads; c++) {
+        workers[c].shared = &shared;
+        workers[c].reports = c == 0;
+        if (c > 0) started_thread[c] = pthread_create(&threads[c], NULL, pair_worker, &workers[c]) == 0;
+        // A thread that can't start leaves its share to the others
+    }
+    if (!saved) pair_worker(&workers[0]);
+    size_t total = 0, comparisons = 0;
+    for (unsigned c = 0; !saved && c < n_threads; c++) {
+        if (started_thread[c]) pthread_join(threads[c], NULL);
+    }
+    for (unsigned c = 0; !saved && c < n_threads; c++) {
+        if (workers[c].failed) saved = ENOMEM;
+        total += workers[c].count;
+        comparisons += workers[c].comparisons;
+    }
+    if (!saved && options->cancel && atomic_load(options->cancel)) saved = ECANCELED;
+    if (!saved && options->progress) options->progress(n_slices, n_slices, options->user_data);
+
+    PatientDuplicate *out = saved ? NULL : malloc((total ? total : 1) * sizeof(PatientDuplicate));
+    if (!saved && !out) saved = ENOMEM;
+    if (!saved) {
+        size_t n = 0;
+        for (unsigned c = 0; c < n_threads; c++) {
+            // A worker that found nothing has no array at all
+            if (workers[c].count) memcpy(out + n, workers[c].pairs, workers[c].count * sizeof(PatientDuplicate));
+            n += workers[c].count;
+        }
+        if (total > 1) qsort(out, total, sizeof(PatientDuplicate), compare_pairs);
+    }
+    for (unsigned c = 0; chunks && c < n_threads; c++) free(chunks[c].names);
+    for (unsigned c = 0; workers && c < n_threads; c++) free(workers[c].pairs);
+    free(slices);
+    free(entries);
+    free(chunks);
+    free(workers);
+    free(threads);
+    free(started_thread);
+    latency_end(probe);
+    if (saved) {
+        errno = saved;
+        return -1;
+    }
+    if (stats) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        *stats = (PatientDuplicateStats){ .patients = count, .blocks = n_blocks, .comparisons = comparisons,
+                                          .pairs = total, .threads = n_threads };
+        stats->seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    }
+    *pairs = out;
+    return total;
+}
+
+// --- Check ---
+
+static int compare_closest(const void *a, const void *b) {
+    const PatientDuplicate *x = a, *y = b;
+    if (x->distance != y->distance) return x->distance < y->distance ? -1 : 1;
+    return (x->second > y->second) - (x->second < y->second);
+}
+
+long patient_duplicates_check(PatientStore *store, const char *name, unsigned age, const char *gender,
+                              PatientDuplicate **pairs) {
+    *pairs = NULL;
+    LatencyProbe probe = latency_begin(LATENCY_DUPLICATE_CHECK);
+    char folded[FOLDED_NAME_MAX + 1], other[FOLDED_NAME_MAX + 1];
+    size_t len = fold_name(name, folded);
+    uint64_t key = block_key(folded, len, gender, age);
+
+    // The store's indexes narrow the registry to the block's ages and gender
+    char gender_prefix[2] = { gender[0], '\0' };
+    PatientQuery query = { .gender = gender[0] ? gender_prefix : NULL,
+                           .age_min = age > DUPLICATE_AGE_SLACK ? age - DUPLICATE_AGE_SLACK : 0,
+                           .age_max = age + DUPLICATE_AGE_SLACK,
+                           .added_min = INT64_MIN, .added_max = INT64_MAX };
+    PatientHandle *handles;
+    long n = patient_store_query(store, &query, &handles);
+    NamePattern *pattern = calloc(1, sizeof(NamePattern));
+    PatientDuplicate *out = NULL;
+    size_t count = 0, cap = 0, comparisons = 0;
+    bool ok = n >= 0 && pattern;
+    if (ok) pattern_set(pattern, folded, len);
+    for (long i = 0; ok && i < n; i++) {
+        PatientRecord record;
+        patient_store_get(store, patient_store_find(store, handles[i]), &record);
+        size_t other_len = fold_name(record.name, other);
+        if ((block_key(other, other_len, record.gender, 0) ^ key) >> 8) continue;
+        int distance = compare_names(pattern, other, other_len, &comparisons);
+        if (distance < 0) continue;
+        ok = add_pair(&out, &count, &cap, (PatientDuplicate){ PATIENT_NO_HANDLE, record.handle, distance });
+    }
+    free(pattern);
+    free(handles);
+    latency_end(probe);
+    if (!ok) {
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+    // No match leaves out NULL, which qsort mustn't see
+    if (count > 1) qsort(out, count, sizeof(PatientDuplicate), compare_closest);
+    *pairs = out;
+    return count;
+}
@@ -0,0 +1,65 @@
+#ifndef PATIENT_DUPLICATES_H
+#define PATIENT_DUPLICATES_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "patient_store.h"
+
+// --- Duplicate Patients ---
+//
+// Finds patients who are probably registered twice under slightly different
+// spellings. Comparing every pair is out of the question at registry size,
+// so records are first grouped into blocks that share a blocking key:
+//
+//     phonetic   the Soundex codes of the first and the last word of the name
+//     gender     its first letter, in any case
+//     age        within DUPLICATE_AGE_SLACK years of each other
+//
+// Within a block, names are compared ignoring case and punctuation by their
+// edit distance, where swapping two neighbouring letters counts as one
+// edit. It is computed 64 characters at a time with bit-parallel arithmetic
+// and given up as soon as it exceeds the limit for the longer name: none up
+// to 3 characters, then one more for every 8.
+
+#define DUPLICATE_AGE_SLACK 2
+
+typedef struct {
+    PatientHandle first;        // The lower handle of the two
+    PatientHandle second;
+    unsigned distance;          // Character edits between the two names
+} PatientDuplicate;
+
+typedef struct {
+    const atomic_bool *cancel;      // Polled between blocks; may be NULL
+    // Called from the scanning thread now and then and at the end; big
+    // blocks count as several, since they are shared out in slices
+    void (*progress)(size_t blocks_done, size_t blocks_total, void *user_data);
+    void *user_data;
+} PatientDuplicateOptions;
+
+typedef struct {
+    size_t patients;
+    size_t blocks;              // Blocks with more than one patient in them
+    size_t comparisons;         // Name pairs whose edit distance was worked out
+    size_t pairs;
+    unsigned threads;
+    double seconds;
+} PatientDuplicateStats;
+
+// Scans a whole snapshot on every core, so it may run on a worker thread
+// while the store changes. Stores the pairs in *pairs (free() it), ordered
+// by first then second handle, and returns how many there are, or -1 with
+// errno set (ECANCELED if cancelled). options and stats may be NULL.
+long patient_duplicates_scan(const PatientSnapshot *snapshot, const PatientDuplicateOptions *options,
+                             PatientDuplicate **pairs, PatientDuplicateStats *stats);
+
+// Checks one record before it is added: stores in *pairs (free() it) the
+// patients it would duplicate in second, closest first, with
+// PATIENT_NO_HANDLE in first, and returns how many there are, or -1 if
+// memory ran out. Reads only the block the record falls in, which the
+// store's age order finds without a scan.
+long patient_duplicates_check(PatientStore *store, const char *name, unsigned age, const char *gender,
+                              PatientDuplicate **pairs);
+
+#endif
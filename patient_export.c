@@ -0,0 +1,298 @@
+#include "patient_export.h"
+#include "latency_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// --- Constants ---
+
+#define EXPORT_BUFFER_BYTES (4 << 20)
+#define EXPORT_PROGRESS_ROWS 65536
+#define EXPORT_GZIP_MODE "wb1"          // Fastest level; exports are for moving data, not archiving
+
+// --- Output Buffer ---
+
+typedef struct {
+    int fd;
+    gzFile gz;          // NULL when writing plain CSV
+    char *data;
+    size_t len;
+    bool failed;
+} ExportWriter;
+
+static void writer_flush(ExportWriter *writer) {
+    if (writer->failed || writer->len == 0) return;
+    if (writer->gz) {
+        writer->failed = gzwrite(writer->gz, writer->data, writer->len) != (int)writer->len;
+    } else {
+        for (size_t done = 0; done < writer->len && !writer->failed;) {
+            ssize_t n = write(writer->fd, writer->data + done, writer->len - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) writer->failed = true;
+            else done += n;
+        }
+    }
+    writer->len = 0;
+}
+
+static void writer_put(ExportWriter *writer, const char *text, size_t len) {
+    while (len > 0) {
+        if (writer->len == EXPORT_BUFFER_BYTES) writer_flush(writer);
+        size_t n = EXPORT_BUFFER_BYTES - writer->len;
+        if (n > len) n = len;
+        memcpy(writer->data + writer->len, text, n);
+        writer->len += n;
+        text += n;
+        len -= n;
+    }
+}
+
+// RFC 4180: the field goes in double quotes and inner quotes are doubled
+static void writer_put_quoted(ExportWriter *writer, const char *text) {
+    writer_put(writer, "\"", 1);
+    for (const char *quote; (quote = strchr(text, '"')); text = quote + 1) {
+        writer_put(writer, text, quote + 1 - text);
+        writer_put(writer, "\"", 1);
+    }
+    writer_put(writer, text, strlen(text));
+    writer_put(writer, "\"", 1);
+}
+
+// JSON string with quotes, backslashes and control characters escaped
+static void writer_put_json(ExportWriter *writer, const char *text) {
+    writer_put(writer, "\"", 1);
+    for (const char *p = text;; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        writer_put(writer, text, p - text);
+        if (c == '\0') break;
+        char escaped[8];
+        int n = c == '"' || c == '\\' ? snprintf(escaped, sizeof(escaped), "\\%c", c)
+                                        : snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        writer_put(writer, escaped, n);
+        text = p + 1;
+    }
+    writer_put(writer, "\"", 1);
+}
+
+static void writer_put_uint(ExportWriter *writer, uint64_t value) {
+    char digits[24];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    writer_put(writer, digits + i, sizeof(digits) - i);
+}
+
+// --- Export Files ---
+
+// Writes one line of the export for row
+typedef void (*ExportRowFunc)(ExportWriter *writer, size_t row, const void *source);
+
+static void put_added(ExportWriter *writer, int64_t added) {
+    char text[PATIENT_ADDED_LEN];
+    patient_time_format(added, text);
+    writer_put_quoted(writer, text);
+}
+
+static void put_record_csv(ExportWriter *writer, const PatientRecord *record) {
+    writer_put_quoted(writer, record->name);
+    writer_put(writer, ",", 1);
+    writer_put_uint(writer, record->age);
+    writer_put(writer, ",", 1);
+    writer_put_quoted(writer, record->gender);
+    writer_put(writer, ",", 1);
+    put_added(writer, record->added);
+    writer_put(writer, ",", 1);
+    // Left empty for a change recorded before there were MRNs
+    if (record->id != PATIENT_NO_ID) writer_put_uint(writer, record->id);
+    writer_put(writer, "\r\n", 2);
+}
+
+static void put_snapshot_row(ExportWriter *writer, size_t row, const void *source) {
+    PatientRecord record;
+    patient_snapshot_get(source, row, &record);
+    put_record_csv(writer, &record);
+}
+
+// Row 0 of a change set that starts over is the reset line
+static bool change_at(const PatientChanges *changes, size_t row, PatientChange *change) {
+    if (patient_changes_full(changes) && row-- == 0) return false;
+    patient_changes_get(changes, row, change);
+    return true;
+}
+
+static void put_change_csv(ExportWriter *writer, size_t row, const void *source) {
+    PatientChange change;
+    if (!change_at(source, row, &change)) {
+        writer_put(writer, "reset,", 6);
+        writer_put_uint(writer, patient_changes_watermark(source));
+        writer_put(writer, ",,,,,\r\n", 7);
+        return;
+    }
+    if (change.kind == PATIENT_CHANGE_DELETE) writer_put(writer, "delete,", 7);
+    else writer_put(writer, "upsert,", 7);
+    writer_put_uint(writer, change.seq);
+    writer_put(writer, ",", 1);
+    put_record_csv(writer, &change.record);
+}
+
+static void put_change_json(ExportWriter *writer, size_t row, const void *source) {
+    PatientChange change;
+    if (!change_at(source, row, &change)) {
+        writer_put(writer, "{\"op\":\"reset\",\"seq\":", 20);
+        writer_put_uint(writer, patient_changes_watermark(source));
+        writer_put(writer, "}\n", 2);
+        return;
+    }
+    if (change.kind == PATIENT_CHANGE_DELETE) writer_put(writer, "{\"op\":\"delete\",\"seq\":", 21);
+    else writer_put(writer, "{\"op\":\"upsert\",\"seq\":", 21);
+    writer_put_uint(writer, change.seq);
+    writer_put(writer, ",\"name\":", 8);
+    writer_put_json(writer, change.record.name);
+    writer_put(writer, ",\"age\":", 7);
+    writer_put_uint(writer, change.record.age);
+    writer_put(writer, ",\"gender\":", 10);
+    writer_put_json(writer, change.record.gender);
+    writer_put(writer, ",\"added\":", 9);
+    char added[PATIENT_ADDED_LEN];
+    patient_time_format(change.record.added, added);
+    writer_put_json(writer, added);
+    if (change.record.id != PATIENT_NO_ID) {
+        writer_put(writer, ",\"mrn\":", 7);
+        writer_put_uint(writer, change.record.id);
+    }
+    writer_put(writer, "}\n", 2);
+}
+
+// Writes header and then total rows to path via a temporary file next to it
+static int export_file(const char *path, const PatientExportOptions *options, const char *header, size_t total,
+                       ExportRowFunc put_row, const void *source) {
+    PatientExportOptions defaults = {0};
+    if (!options) options = &defaults;
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".part"));
+    ExportWriter writer = { .fd = -1, .data = malloc(EXPORT_BUFFER_BYTES) };
+    if (!tmp_path || !writer.data) {
+        free(tmp_path);
+        free(writer.data);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    strcpy(tmp_path + path_len, ".part");
+
+    writer.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer.fd < 0) {
+        int saved = errno;
+        free(tmp_path);
+        free(writer.data);
+        errno = saved;
+        return -1;
+    }
+    LatencyProbe probe = latency_begin(LATENCY_EXPORT);
+    if (options->gzip) {
+        // gzdopen takes over the descriptor; gzclose closes it
+        writer.gz = gzdopen(writer.fd, EXPORT_GZIP_MODE);
+        if (!writer.gz) writer.failed = true;
+        else gzbuffer(writer.gz, 1 << 20);
+    }
+
+    bool cancelled = false;
+    writer_put(&writer, header, strlen(header));
+    for (size_t row = 0; row < total && !writer.failed; row++) {
+        if (row % EXPORT_PROGRESS_ROWS == 0 && row > 0) {
+            if (options->cancel && atomic_load(options->cancel)) {
+                cancelled = true;
+                break;
+            }
+            if (options->progress) options->progress(row, total, options->user_data);
+        }
+        put_row(&writer, row, source);
+    }
+    if (!cancelled) writer_flush(&writer);
+
+    int saved = writer.failed ? EIO : 0;
+    if (writer.gz) {
+        if (gzclose(writer.gz) != Z_OK && !saved) saved = EIO;
+    } else if (close(writer.fd) != 0 && !saved) {
+        saved = errno;
+    }
+    if (cancelled) saved = ECANCELED;
+    if (!saved && rename(tmp_path, path) != 0) saved = errno;
+    if (saved) unlink(tmp_path);
+    else if (options->progress) options->progress(total, total, options->user_data);
+    free(tmp_path);
+    free(writer.data);
+    latency_end(probe);
+    errno = saved;
+    return saved ? -1 : 0;
+}
+
+static char* watermark_path(const char *path) {
+    char *watermark = malloc(strlen(path) + sizeof(PATIENT_WATERMARK_SUFFIX));
+    if (watermark) sprintf(watermark, "%s" PATIENT_WATERMARK_SUFFIX, path);
+    return watermark;
+}
+
+// Replaced through a rename, so a crash leaves the old watermark or the new one
+static int write_watermark(const char *path, uint64_t watermark) {
+    char *target = watermark_path(path);
+    char *tmp_path = target ? malloc(strlen(target) + sizeof(".part")) : NULL;
+    if (!tmp_path) {
+        free(target);
+        errno = ENOMEM;
+        return -1;
+    }
+    sprintf(tmp_path, "%s.part", target);
+    FILE *file = fopen(tmp_path, "w");
+    bool ok = file && fprintf(file, "%llu\n", (unsigned long long)watermark) > 0 && fflush(file) == 0
+              && fsync(fileno(file)) == 0;
+    int saved = errno;
+    if (file && fclose(file) != 0 && ok) {
+        ok = false;
+        saved = errno;
+    }
+    if (ok && rename(tmp_path, target) != 0) {
+        ok = false;
+        saved = errno;
+    }
+    if (!ok) unlink(tmp_path);
+    free(tmp_path);
+    free(target);
+    errno = saved;
+    return ok ? 0 : -1;
+}
+
+// --- Public API ---
+
+int patient_export_csv(const PatientSnapshot *snapshot, const char *path, const PatientExportOptions *options) {
+    return export_file(path, options, "Name,Age,Gender,Added,MRN\r\n", patient_snapshot_count(snapshot), put_snapshot_row,
+                       snapshot);
+}
+
+uint64_t patient_export_watermark(const char *path) {
+    char *target = watermark_path(path);
+    FILE *file = target ? fopen(target, "r") : NULL;
+    unsigned long long watermark = 0;
+    if (file && fscanf(file, "%llu", &watermark) != 1) watermark = 0;
+    if (file) fclose(file);
+    free(target);
+    return watermark;
+}
+
+int patient_export_changes(const PatientChanges *changes, const char *path, const PatientExportOptions *options) {
+    bool json = options && options->json_lines;
+    size_t total = patient_changes_count(changes) + patient_changes_full(changes);
+    if (export_file(path, options, json ? "" : "Op,Seq,Name,Age,Gender,Added,MRN\r\n", total,
+                    json ? put_change_json : put_change_csv, changes) != 0) {
+        return -1;
+    }
+    return write_watermark(path, patient_changes_watermark(changes));
+}
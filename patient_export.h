@@ -0,0 +1,52 @@
+#ifndef PATIENT_EXPORT_H
+#define PATIENT_EXPORT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+
+// --- CSV Export ---
+//
+// Streams a PatientSnapshot, or the changes since an earlier export, to an
+// RFC 4180 CSV file through one reusable output buffer, optionally
+// gzip-compressed. Safe to run on a worker thread while the store keeps
+// changing, since it only reads the snapshot or change set.
+
+#define PATIENT_WATERMARK_SUFFIX ".watermark"
+
+typedef struct {
+    bool gzip;
+    bool json_lines;                // Change exports only: one JSON object per line instead of CSV
+    const atomic_bool *cancel;      // Polled between batches of rows; may be NULL
+    // Called from the exporting thread every few thousand rows and at the end
+    void (*progress)(size_t rows_done, size_t rows_total, void *user_data);
+    void *user_data;
+} PatientExportOptions;
+
+// Writes path via a temporary file next to it, so a failed or cancelled
+// export never leaves a partial file behind. The columns are Name, Age,
+// Gender, Added and MRN. Returns 0, or -1 with errno set
+// (ECANCELED if cancelled). options may be NULL.
+int patient_export_csv(const PatientSnapshot *snapshot, const char *path, const PatientExportOptions *options);
+
+// The watermark the last change export to path left next to it (path +
+// ".watermark"), or 0 if there is none
+uint64_t patient_export_watermark(const char *path);
+// Writes changes (see patient_store_changes) to path the same way, one per
+// line in seq order, as CSV
+//
+//     Op,Seq,Name,Age,Gender,Added,MRN
+//     delete,1041,"Jane Doe",42,"Female","2026-10-10 08:30",12345
+//     upsert,1041,"Jane Doe",43,"Female","2026-10-10 08:30",12345
+//
+// or as JSON Lines, {"op":"upsert","seq":1041,"name":"Jane Doe",...,"mrn":12345}.
+// The MRN is empty (or left out) for a change made before there were MRNs. A set
+// that starts over opens with a reset line (seq is its watermark): the rows
+// of earlier exports are to be dropped. Once the file is in place, the
+// set's watermark is written next to it for the next export to go on from.
+int patient_export_changes(const PatientChanges *changes, const char *path, const PatientExportOptions *options);
+
+#endif
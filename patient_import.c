@@ -0,0 +1,613 @@
+#include "patient_import.h"
+#include "latency_stats.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// --- Constants ---
+
+#define IMPORT_MIN_CHUNK (256 * 1024)
+#define IMPORT_READ_BYTES (1 << 20)
+#define IMPORT_MAX_NAME 200         // Bytes; anything longer is a broken row, not a name
+#define IMPORT_MAX_COLUMN 1000
+#define NO_COLUMN (-1)
+
+typedef enum {
+    FIELD_NAME,
+    FIELD_AGE,
+    FIELD_GENDER,
+    FIELD_ADDED,
+    FIELD_COUNT
+} ImportField;
+
+static const char *FIELD_KEYS[FIELD_COUNT] = { "name", "age", "gender", "added" };
+// Header titles that identify each field without a mapping
+static const char *FIELD_TITLES[FIELD_COUNT][3] = {
+    { "name", "patient", NULL }, { "age", NULL }, { "gender", "sex", NULL }, { "added", "admitted", NULL },
+};
+
+// --- Structs ---
+
+typedef struct {
+    size_t first_cell;
+    uint32_t n_cells;
+    size_t line;                // Counted from the start of its chunk
+} ImportRow;
+
+typedef struct {
+    const char *reason;         // NULL if the row passed
+    PatientRecord record;
+} ImportOutcome;
+
+typedef struct {
+    char *start;
+    char *end;
+    char **cells;               // Every row's cells, one row after another
+    size_t n_cells;
+    size_t cells_cap;
+    ImportRow *rows;
+    size_t count;
+    size_t cap;
+    size_t lines;               // Line breaks in the chunk
+    bool failed;                // Memory ran out
+    const int *columns;         // For the check step
+    size_t first_row;           // Rows before it are the header
+    int64_t added;
+    ImportOutcome *outcomes;    // One per row from first_row on
+} ImportChunk;
+
+struct PatientImport {
+    char *data;                 // The whole feed; the records' strings point into it
+    PatientRecord *records;
+    size_t count;
+};
+
+// --- Reading ---
+
+// Reads the whole file, gunzipping it if it is compressed, with a spare byte
+// at the end so the last cell can be terminated in place
+static char* read_feed(const char *path, size_t *size) {
+    errno = 0;
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) {
+        if (!errno) errno = ENOMEM;
+        return NULL;
+    }
+    gzbuffer(gz, IMPORT_READ_BYTES);
+    size_t len = 0, cap = IMPORT_READ_BYTES;
+    char *data = malloc(cap + 1);
+    int saved = data ? 0 : ENOMEM;
+    while (!saved) {
+        if (len == cap) {
+            char *grown = realloc(data, cap * 2 + 1);
+            if (!grown) {
+                saved = ENOMEM;
+                break;
+            }
+            data = grown;
+            cap *= 2;
+        }
+        int n = gzread(gz, data + len, cap - len > INT_MAX ? INT_MAX : (unsigned)(cap - len));
+        if (n < 0) saved = EIO;     // Truncated or corrupt gzip data
+        if (n <= 0) break;
+        len += n;
+    }
+    gzclose(gz);
+    if (saved) {
+        free(data);
+        errno = saved;
+        return NULL;
+    }
+    *size = len;
+    return data;
+}
+
+// --- Parsing ---
+//
+// A quote anywhere toggles quoting and a doubled quote inside quotes stands
+// for one, so a chunk boundary is simply a line break after an even number
+// of quotes, and the parser and the chunking always agree on it.
+
+static bool inside_quotes(const char *from, const char *to) {
+    bool quoted = false;
+    for (const char *p = from; p < to && (p = memchr(p, '"', to - p)); p++) quoted = !quoted;
+    return quoted;
+}
+
+// Just past the first line break at or after at that isn't inside quotes
+static char* record_boundary(char *at, char *end, bool quoted) {
+    for (char *p = at; p < end; p++) {
+        if (*p == '"') quoted = !quoted;
+        else if (*p == '\n' && !quoted) return p + 1;
+    }
+    return end;
+}
+
+static bool push_cell(ImportChunk *chunk, char *cell) {
+    if (chunk->n_cells == chunk->cells_cap) {
+        size_t cap = chunk->cells_cap ? chunk->cells_cap * 2 : 4096;
+        char **cells = realloc(chunk->cells, cap * sizeof(char*));
+        if (!cells) return false;
+        chunk->cells = cells;
+        chunk->cells_cap = cap;
+    }
+    chunk->cells[chunk->n_cells++] = cell;
+    return true;
+}
+
+static bool push_row(ImportChunk *chunk, const ImportRow *row) {
+    if (chunk->count == chunk->cap) {
+        size_t cap = chunk->cap ? chunk->cap * 2 : 1024;
+        ImportRow *rows = realloc(chunk->rows, cap * sizeof(ImportRow));
+        if (!rows) return false;
+        chunk->rows = rows;
+        chunk->cap = cap;
+    }
+    chunk->rows[chunk->count++] = *row;
+    return true;
+}
+
+// Splits the chunk's records into cells in place. Unescaping a quoted cell
+// only ever shortens it, so it is done where the cell stands.
+static void* parse_chunk(void *data) {
+    ImportChunk *chunk = data;
+    char *p = chunk->start, *end = chunk->end;
+    size_t line = 0;
+    while (p < end && !chunk->failed) {
+        ImportRow row = { chunk->n_cells, 0, line };
+        bool blank = true;
+        for (bool last = false; !last;) {
+            char *cell = p, *out = p;
+            bool quoted = false;
+            while (p < end) {
+                if (*p == '"') {
+                    blank = false;
+                    if (quoted && p + 1 < end && p[1] == '"') {
+                        *out++ = '"';
+                        p += 2;
+                    } else {
+                        quoted = !quoted;
+                        p++;
+                    }
+                    continue;
+                }
+                if (!quoted && (*p == ',' || *p == '\n')) break;
+                if (*p == '\n') line++;
+                *out++ = *p++;
+            }
+            last = p == end || *p == '\n';
+            if (!last) blank = false;
+            if (last && out > cell && p[-1] == '\r') out--;
+            if (out > cell) blank = false;
+            // The separator is known by now, so the terminator may overwrite it
+            *out = '\0';
+            if (p < end) p++;
+            if (!push_cell(chunk, cell)) chunk->failed = true;
+            row.n_cells++;
+        }
+        line++;
+        if (blank) {
+            chunk->n_cells = row.first_cell;
+            continue;
+        }
+        if (!push_row(chunk, &row)) chunk->failed = true;
+    }
+    chunk->lines = line;
+    return NULL;
+}
+
+// --- Validation and Normalization ---
+
+// Trims in place and turns every run of spaces, separators and control
+// characters into one space, which also keeps the store's own separators out
+static char* normalize_text(char *text) {
+    char *out = text;
+    bool space = false;
+    for (const char *p = text; *p; p++) {
+        unsigned char c = *p;
+        if (c < ' ' || c == ',' || c == ' ' || c == 0x7f) {
+            space = out > text;
+            continue;
+        }
+        if (space) *out++ = ' ';
+        space = false;
+        *out++ = c;
+    }
+    *out = '\0';
+    return text;
+}
+
+static const char* normalize_gender(char *text) {
+    if (strcasecmp(text, "m") == 0 || strcasecmp(text, "male") == 0) return "Male";
+    if (strcasecmp(text, "f") == 0 || strcasecmp(text, "female") == 0) return "Female";
+    return text;
+}
+
+bool patient_import_parse_age(const char *text, unsigned *age) {
+    if (!*text || strlen(text) > 3) return false;
+    *age = 0;
+    for (const char *p = text; *p; p++) {
+        if (!isdigit((unsigned char)*p)) return false;
+        *age = *age * 10 + (*p - '0');
+    }
+    return *age <= PATIENT_MAX_AGE;
+}
+
+// YYYY-MM-DD, optionally followed by a space or T and HH:MM[:SS]; the date
+// alone means midnight and seconds are dropped
+static int64_t parse_added(const char *text) {
+    size_t len = strlen(text);
+    char canonical[PATIENT_ADDED_LEN];
+    if (len == 10) {
+        memcpy(canonical, text, 10);
+        strcpy(canonical + 10, " 00:00");
+    } else if ((len == 16 || (len == 19 && text[16] == ':' && isdigit((unsigned char)text[17])
+                              && isdigit((unsigned char)text[18])))
+               && (text[10] == ' ' || text[10] == 'T')) {
+        memcpy(canonical, text, 16);
+        canonical[10] = ' ';
+        canonical[16] = '\0';
+    } else {
+        return PATIENT_TIME_UNKNOWN;
+    }
+    return patient_time_parse(canonical);
+}
+
+// Returns why the row can't be imported, or NULL with record filled in
+static const char* check_row(const ImportChunk *chunk, const ImportRow *row, PatientRecord *record) {
+    char **cells = chunk->cells + row->first_cell;
+    const int *columns = chunk->columns;
+    for (int f = 0; f < FIELD_ADDED; f++) {
+        if (columns[f] >= (int)row->n_cells) return "too few columns";
+    }
+    char *name = normalize_text(cells[columns[FIELD_NAME]]);
+    if (!*name) return "no name";
+    if (strlen(name) > IMPORT_MAX_NAME) return "name longer than 200 characters";
+    unsigned age;
+    if (!patient_import_parse_age(normalize_text(cells[columns[FIELD_AGE]]), &age)) return "age is not a whole number from 0 to 150";
+    char *gender = normalize_text(cells[columns[FIELD_GENDER]]);
+    if (!*gender) return "no gender";
+    int64_t added = chunk->added;
+    int added_column = columns[FIELD_ADDED];
+    if (added_column != NO_COLUMN && added_column < (int)row->n_cells) {
+        char *text = normalize_text(cells[added_column]);
+        if (*text) added = parse_added(text);
+        if (added == PATIENT_TIME_UNKNOWN) return "admission time is not YYYY-MM-DD HH:MM";
+    }
+    *record = (PatientRecord){ .handle = PATIENT_NO_HANDLE, .name = name, .gender = normalize_gender(gender),
+                               .added = added, .age = age };
+    return NULL;
+}
+
+static void* check_chunk(void *data) {
+    ImportChunk *chunk = data;
+    size_t n = chunk->count - chunk->first_row;
+    chunk->outcomes = malloc((n ? n : 1) * sizeof(ImportOutcome));
+    if (!chunk->outcomes) {
+        chunk->failed = true;
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        ImportOutcome *outcome = &chunk->outcomes[i];
+        outcome->reason = check_row(chunk, &chunk->rows[chunk->first_row + i], &outcome->record);
+    }
+    return NULL;
+}
+
+// --- Column Mapping ---
+
+static char* trim(char *text) {
+    while (isspace((unsigned char)*text)) text++;
+    size_t len = strlen(text);
+    while (len > 0 && isspace((unsigned char)text[len - 1])) text[--len] = '\0';
+    return text;
+}
+
+static int find_title(char **cells, uint32_t n_cells, const char *title) {
+    for (uint32_t i = 0; i < n_cells; i++) {
+        const char *cell = cells[i];
+        while (isspace((unsigned char)*cell)) cell++;
+        size_t len = strlen(cell);
+        while (len > 0 && isspace((unsigned char)cell[len - 1])) len--;
+        if (len == strlen(title) && strncasecmp(cell, title, len) == 0) return i;
+    }
+    return NO_COLUMN;
+}
+
+// Resolves every field to a column from spec and the first row, and says
+// whether that row is a header. Returns false with a message in error.
+static bool map_columns(const char *spec, char **first, uint32_t n_first, int columns[FIELD_COUNT], bool *header,
+                        char *error, size_t error_len) {
+    *header = false;
+    for (int f = 0; f < FIELD_COUNT; f++) columns[f] = NO_COLUMN;
+    char *copy = strdup(spec ? spec : "");
+    if (!copy) {
+        snprintf(error, error_len, "%s", strerror(ENOMEM));
+        return false;
+    }
+    bool ok = true;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); ok && item; item = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(item, '=');
+        if (!equals) {
+            snprintf(error, error_len, "expected field=COLUMN in the column mapping, got \"%s\"", trim(item));
+            ok = false;
+            break;
+        }
+        *equals = '\0';
+        char *key = trim(item), *value = trim(equals + 1);
+        int field = 0;
+        while (field < FIELD_COUNT && strcasecmp(key, FIELD_KEYS[field]) != 0) field++;
+        if (field == FIELD_COUNT) {
+            snprintf(error, error_len, "unknown field \"%s\" in the column mapping; use name, age, gender or added", key);
+            ok = false;
+        } else if (*value && strspn(value, "0123456789") == strlen(value)) {
+            long number = strtol(value, NULL, 10);
+            ok = number >= 1 && number <= IMPORT_MAX_COLUMN;
+            if (ok) columns[field] = number - 1;
+            else snprintf(error, error_len, "columns are numbered from 1 to %d", IMPORT_MAX_COLUMN);
+        } else {
+            columns[field] = find_title(first, n_first, value);
+            ok = columns[field] != NO_COLUMN;
+            if (ok) *header = true;
+            else snprintf(error, error_len, "no column titled \"%s\"", value);
+        }
+    }
+    free(copy);
+    if (!ok) return false;
+
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        for (int t = 0; columns[f] == NO_COLUMN && FIELD_TITLES[f][t]; t++) {
+            columns[f] = find_title(first, n_first, FIELD_TITLES[f][t]);
+            if (columns[f] != NO_COLUMN) *header = true;
+        }
+    }
+    if (!*header) {
+        // The registry's own layout; a first row whose age isn't one is a
+        // header nobody could read. Whether a row has its added is up to the row.
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            if (columns[f] == NO_COLUMN) columns[f] = f;
+        }
+        unsigned age;
+        char *age_cell = columns[FIELD_AGE] < (int)n_first ? first[columns[FIELD_AGE]] : "";
+        *header = !patient_import_parse_age(trim(age_cell), &age);
+    }
+    // Every required column must be in the first row, or no row would import
+    char missing[64] = "";
+    for (int f = 0; f < FIELD_ADDED; f++) {
+        if (columns[f] != NO_COLUMN && columns[f] < (int)n_first) continue;
+        if (*missing) strcat(missing, ", ");
+        strcat(missing, FIELD_KEYS[f]);
+    }
+    if (*missing) {
+        snprintf(error, error_len, "the first row has %u columns, none of them for %s; map with field=COLUMN",
+                 n_first, missing);
+        return false;
+    }
+    return true;
+}
+
+// --- Deduplication ---
+
+typedef struct {
+    uint64_t hash;
+    uint32_t ref;               // A store row, or store_rows + an index into records
+} DedupeSlot;
+
+typedef struct {
+    DedupeSlot *slots;
+    size_t mask;
+    const PatientStore *store;
+    size_t store_rows;
+    const PatientRecord *records;
+} DedupeSet;
+
+#define EMPTY_SLOT UINT32_MAX
+
+static uint64_t hash_folded(uint64_t hash, const char *text) {
+    for (const unsigned char *p = (const unsigned char*)text; *p; p++) {
+        hash = (hash ^ tolower(*p)) * 1099511628211ULL;
+    }
+    return (hash ^ 0xff) * 1099511628211ULL;
+}
+
+// Same patient, same admission: name and gender ignore ASCII case
+static uint64_t record_hash(const PatientRecord *record) {
+    uint64_t hash = hash_folded(hash_folded(1469598103934665603ULL, record->name), record->gender);
+    hash ^= (uint64_t)record->added * 0x9e3779b97f4a7c15ULL + record->age;
+    return hash ^ (hash >> 29);
+}
+
+static void dedupe_get(const DedupeSet *set, uint32_t ref, PatientRecord *record) {
+    if (ref < set->store_rows) patient_store_get(set->store, ref, record);
+    else *record = set->records[ref - set->store_rows];
+}
+
+// The ref of an equal record already in the set, or EMPTY_SLOT after adding ref
+static uint32_t dedupe_add(DedupeSet *set, const PatientRecord *record, uint32_t ref) {
+    uint64_t hash = record_hash(record);
+    size_t i = hash & set->mask;
+    for (; set->slots[i].ref != EMPTY_SLOT; i = (i + 1) & set->mask) {
+        if (set->slots[i].hash != hash) continue;
+        PatientRecord other;
+        dedupe_get(set, set->slots[i].ref, &other);
+        if (other.age == record->age && other.added == record->added && strcasecmp(other.name, record->name) == 0
+            && strcasecmp(other.gender, record->gender) == 0) {
+            return set->slots[i].ref;
+        }
+    }
+    set->slots[i] = (DedupeSlot){ hash, ref };
+    return EMPTY_SLOT;
+}
+
+// --- Public API ---
+
+PatientImport* patient_import_read(const char *path, const PatientStore *store, const PatientImportOptions *options,
+                                   PatientImportStats *stats, char *error, size_t error_len) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    PatientImportOptions defaults = {0};
+    if (!options) options = &defaults;
+    if (error_len > 0) error[0] = '\0';
+    size_t size;
+    char *data = read_feed(path, &size);
+    PatientImport *import = data ? calloc(1, sizeof(PatientImport)) : NULL;
+    if (!import) {
+        int saved = data ? ENOMEM : errno;
+        free(data);
+        errno = saved;
+        return NULL;
+    }
+    import->data = data;
+    LatencyProbe probe = latency_begin(LATENCY_IMPORT);
+
+    // Spreadsheets like to start with a byte order mark
+    char *start = data;
+    if (size >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) start += 3;
+    char *end = data + size;
+    size_t body = end - start;
+    unsigned n_chunks = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (unsigned)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (n_chunks > body / IMPORT_MIN_CHUNK) n_chunks = body / IMPORT_MIN_CHUNK;
+    if (n_chunks == 0) n_chunks = 1;
+    ImportChunk *chunks = calloc(n_chunks, sizeof(ImportChunk));
+    pthread_t *workers = calloc(n_chunks, sizeof(pthread_t));
+    bool *started_worker = calloc(n_chunks, sizeof(bool));
+    int saved = chunks && workers && started_worker ? 0 : ENOMEM;
+
+    // Parse: record-aligned chunks, one per core
+    char *cursor = start;
+    for (unsigned c = 0; !saved && c < n_chunks; c++) {
+        char *cut = (c == n_chunks - 1) ? end : start + body * (c + 1) / n_chunks;
+        if (cut < cursor) cut = cursor;
+        if (cut < end) cut = record_boundary(cut, end, inside_quotes(cursor, cut));
+        chunks[c].start = cursor;
+        chunks[c].end = cut;
+        cursor = cut;
+        if (c > 0) started_worker[c] = pthread_create(&workers[c], NULL, parse_chunk, &chunks[c]) == 0;
+        if (c > 0 && !started_worker[c]) parse_chunk(&chunks[c]);
+    }
+    if (!saved) parse_chunk(&chunks[0]);
+    for (unsigned c = 0; !saved && c < n_chunks; c++) {
+        if (started_worker[c]) pthread_join(workers[c], NULL);
+        started_worker[c] = false;
+        if (chunks[c].failed) saved = ENOMEM;
+    }
+
+    // Map the columns from the first row, then validate and normalize on every core
+    int columns[FIELD_COUNT];
+    bool header = false;
+    unsigned head = 0;
+    while (!saved && head < n_chunks && chunks[head].count == 0) head++;
+    const ImportChunk *first = saved || head == n_chunks ? NULL : &chunks[head];
+    if (first && !map_columns(options->columns, first->cells, first->rows[0].n_cells, columns, &header, error,
+                              error_len)) {
+        saved = EINVAL;
+    }
+    int64_t added = options->added ? options->added : patient_time_now();
+    for (unsigned c = 0; !saved && c < n_chunks; c++) {
+        chunks[c].columns = columns;
+        chunks[c].added = added;
+        chunks[c].first_row = c == head && header ? 1 : 0;
+        if (c > 0) started_worker[c] = pthread_create(&workers[c], NULL, check_chunk, &chunks[c]) == 0;
+        if (c > 0 && !started_worker[c]) check_chunk(&chunks[c]);
+    }
+    if (!saved) check_chunk(&chunks[0]);
+    size_t candidates = 0;
+    for (unsigned c = 0; !saved && c < n_chunks; c++) {
+        if (started_worker[c]) pthread_join(workers[c], NULL);
+        if (chunks[c].failed) saved = ENOMEM;
+        candidates += chunks[c].count - chunks[c].first_row;
+    }
+
+    // Dedupe and report, in file order, against the registry and the rows kept so far
+    DedupeSet set = { .store = store, .store_rows = store ? patient_store_count(store) : 0 };
+    size_t slots = 16;
+    while (!saved && slots < 2 * (set.store_rows + candidates)) slots *= 2;
+    set.mask = slots - 1;
+    set.slots = saved ? NULL : malloc(slots * sizeof(DedupeSlot));
+    import->records = saved ? NULL : malloc((candidates ? candidates : 1) * sizeof(PatientRecord));
+    size_t *record_lines = saved ? NULL : malloc((candidates ? candidates : 1) * sizeof(size_t));
+    if (!saved && (!set.slots || !import->records || !record_lines)) saved = ENOMEM;
+    PatientImportStats counts = { .threads = n_chunks };
+    if (!saved) {
+        set.records = import->records;
+        for (size_t i = 0; i < slots; i++) set.slots[i].ref = EMPTY_SLOT;
+        for (size_t row = 0; row < set.store_rows; row++) {
+            PatientRecord record;
+            patient_store_get(store, row, &record);
+            dedupe_add(&set, &record, row);
+        }
+        size_t base_line = 1;
+        for (unsigned c = 0; c < n_chunks; c++) {
+            ImportChunk *chunk = &chunks[c];
+            for (size_t i = chunk->first_row; i < chunk->count; i++) {
+                const ImportOutcome *outcome = &chunk->outcomes[i - chunk->first_row];
+                size_t line = base_line + chunk->rows[i].line;
+                char reason[64];
+                counts.rows++;
+                if (outcome->reason) {
+                    counts.rejected++;
+                    if (options->reject) options->reject(line, outcome->reason, options->user_data);
+                    continue;
+                }
+                uint32_t same = dedupe_add(&set, &outcome->record, set.store_rows + import->count);
+                if (same == EMPTY_SLOT) {
+                    record_lines[import->count] = line;
+                    import->records[import->count++] = outcome->record;
+                    continue;
+                }
+                counts.duplicates++;
+                if (same < set.store_rows) snprintf(reason, sizeof(reason), "already in the registry");
+                else snprintf(reason, sizeof(reason), "duplicate of line %zu", record_lines[same - set.store_rows]);
+                if (options->reject) options->reject(line, reason, options->user_data);
+            }
+            base_line += chunk->lines;
+        }
+    }
+    free(record_lines);
+    free(set.slots);
+    for (unsigned c = 0; chunks && c < n_chunks; c++) {
+        free(chunks[c].cells);
+        free(chunks[c].rows);
+        free(chunks[c].outcomes);
+    }
+    free(chunks);
+    free(workers);
+    free(started_worker);
+    latency_end(probe);
+    if (saved) {
+        if (saved == ENOMEM && error_len > 0) snprintf(error, error_len, "%s", strerror(ENOMEM));
+        patient_import_free(import);
+        errno = saved;
+        return NULL;
+    }
+    if (stats) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        *stats = counts;
+        stats->seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    }
+    return import;
+}
+
+const PatientRecord* patient_import_records(const PatientImport *import, size_t *count) {
+    *count = import->count;
+    return import->records;
+}
+
+void patient_import_free(PatientImport *import) {
+    if (!import) return;
+    free(import->records);
+    free(import->data);
+    free(import);
+}
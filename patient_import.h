@@ -0,0 +1,59 @@
+#ifndef PATIENT_IMPORT_H
+#define PATIENT_IMPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+
+// --- CSV Import ---
+//
+// Reads a CSV feed from another system (plain or gzipped, RFC 4180 quoting)
+// into records ready for patient_store_add_batch, in four steps:
+//
+//     parse      the file is cut into record-aligned chunks, one per core
+//     validate   each row needs a name, a gender and an age from 0 to 150
+//     normalize  spaces are trimmed and collapsed, M/F spelled Male/Female
+//     dedupe     rows already in the registry, or earlier in the file, go
+//
+// Rows failing a step are reported with their line number and left out;
+// the rest are kept in file order. Columns are found by their titles in the
+// header (Name, Age, Gender or Sex, Added or Admitted, in any case), or
+// mapped explicitly as "name=Patient Name,age=3,gender=Sex" with titles or
+// column numbers counted from 1. A file without a header is read as
+// name,age,gender[,added], the registry's own layout.
+
+typedef struct PatientImport PatientImport;
+
+typedef struct {
+    const char *columns;        // Column mapping as above; NULL or "" to go by the titles
+    int64_t added;              // For rows without an admission time; 0 means the time of the import
+    // Called on the reading thread for each row left out, in line order
+    void (*reject)(size_t line, const char *reason, void *user_data);
+    void *user_data;
+} PatientImportOptions;
+
+typedef struct {
+    size_t rows;                // Data rows in the file, header excluded
+    size_t rejected;            // Rows that failed validation
+    size_t duplicates;          // Rows that were already in the registry or earlier in the file
+    unsigned threads;
+    double seconds;
+} PatientImportStats;
+
+// Reads path, deduplicating against store (which may be NULL). Returns NULL
+// with errno set if the file can't be read, or EINVAL with the reason in
+// error if the columns can't be mapped. options may be NULL.
+PatientImport* patient_import_read(const char *path, const PatientStore *store, const PatientImportOptions *options,
+                                   PatientImportStats *stats, char *error, size_t error_len);
+// The rows that passed, in file order, with PATIENT_NO_HANDLE as handle;
+// valid until the import is freed
+const PatientRecord* patient_import_records(const PatientImport *import, size_t *count);
+void patient_import_free(PatientImport *import);
+
+// Reads an age as the import validates it: digits only, 0 to
+// PATIENT_MAX_AGE. hms-cli takes ages by the same rule.
+bool patient_import_parse_age(const char *text, unsigned *age);
+
+#endif
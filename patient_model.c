@@ -0,0 +1,579 @@
+#include "patient_model.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- Structs ---
+
+typedef struct {
+    PatientHandle *handles;
+    guint count;
+    guint capacity;
+} HandleArray;
+
+struct _PatientModel {
+    GObject parent_instance;
+    PatientStore *store;
+    gint stamp;             // Bumped whenever rows move, invalidating old iters
+    HandleArray all;        // Every record, in sort order, unless the store's order is borrowed
+    gboolean borrowed;      // Sorted by a key the store keeps an order of (see model_all)
+    HandleArray visible;    // The records passing the filter, in the same order
+    guint streamed;         // While streaming, how much of all is visible so far
+    gboolean streaming;
+    PatientQuery query;
+    gboolean filtered;      // FALSE while every record is visible
+    gint sort_column;
+    GtkSortType sort_order;
+};
+
+static void patient_model_tree_model_init(GtkTreeModelIface *iface);
+static void patient_model_sortable_init(GtkTreeSortableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(PatientModel, patient_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, patient_model_tree_model_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_SORTABLE, patient_model_sortable_init))
+
+// --- Handle Arrays ---
+
+static void handles_reserve(HandleArray *array, guint count) {
+    if (count <= array->capacity) return;
+    guint capacity = array->capacity ? array->capacity : 1024;
+    while (capacity < count) capacity *= 2;
+    array->handles = g_renew(PatientHandle, array->handles, capacity);
+    array->capacity = capacity;
+}
+
+static void handles_insert(HandleArray *array, guint at, PatientHandle handle) {
+    handles_reserve(array, array->count + 1);
+    memmove(array->handles + at + 1, array->handles + at, (array->count - at) * sizeof(PatientHandle));
+    array->handles[at] = handle;
+    array->count++;
+}
+
+static void handles_remove(HandleArray *array, guint at) {
+    memmove(array->handles + at, array->handles + at + 1, (array->count - at - 1) * sizeof(PatientHandle));
+    array->count--;
+}
+
+static void handles_copy(HandleArray *to, const HandleArray *from) {
+    handles_reserve(to, from->count);
+    memcpy(to->handles, from->handles, from->count * sizeof(PatientHandle));
+    to->count = from->count;
+}
+
+// Position of handle, or -1; rows are found by scanning since a changed
+// record may no longer sit where its new sort key would put it
+static gint handles_find(const HandleArray *array, PatientHandle handle) {
+    for (guint i = 0; i < array->count; i++) {
+        if (array->handles[i] == handle) return i;
+    }
+    return -1;
+}
+
+// --- Ordering ---
+
+static int compare_handles(const void *a, const void *b) {
+    PatientHandle x = *(const PatientHandle*)a, y = *(const PatientHandle*)b;
+    return (x > y) - (x < y);
+}
+
+// Store sort key of a column, or -1 for plain handle (insertion) order
+static gint sort_key_of_column(gint column) {
+    switch (column) {
+        case COL_NAME: return PATIENT_SORT_NAME;
+        case COL_AGE: return PATIENT_SORT_AGE;
+        case COL_GENDER: return PATIENT_SORT_GENDER;
+        case COL_TIMESTAMP: return PATIENT_SORT_ADDED;
+        default: return -1;
+    }
+}
+
+static gint model_compare(PatientModel *model, PatientHandle a, PatientHandle b) {
+    gint key = sort_key_of_column(model->sort_column);
+    gint order = key < 0 ? (a > b) - (a < b) : patient_store_compare(model->store, key, a, b);
+    return model->sort_order == GTK_SORT_DESCENDING ? -order : order;
+}
+
+static void model_sort(PatientModel *model, HandleArray *array) {
+    gint key = sort_key_of_column(model->sort_column);
+    if (key < 0) {
+        qsort(array->handles, array->count, sizeof(PatientHandle), compare_handles);
+    } else if (patient_store_sort(model->store, key, array->handles, array->count) != 0) {
+        g_warning("Could not sort patients: %s", g_strerror(errno));
+        return;
+    }
+    if (model->sort_order == GTK_SORT_DESCENDING) {
+        for (guint i = 0, j = array->count; i + 1 < j; i++, j--) {
+            PatientHandle swap = array->handles[i];
+            array->handles[i] = array->handles[j - 1];
+            array->handles[j - 1] = swap;
+        }
+    }
+}
+
+// Where handle belongs in a sorted array; binary search, since the order is total
+static guint model_insert_position(PatientModel *model, const HandleArray *array, PatientHandle handle) {
+    guint lo = 0, hi = array->count;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (model_compare(model, array->handles[mid], handle) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Every record in sort order. For the keys the store keeps sorted, its
+// order is used in place (read backwards when descending) instead of a copy,
+// so re-sorting by those columns costs no sort at all.
+static const PatientHandle* model_all(PatientModel *model, guint *count, gboolean *reversed) {
+    *reversed = FALSE;
+    if (!model->borrowed) {
+        *count = model->all.count;
+        return model->all.handles;
+    }
+    const PatientHandle *order = patient_store_order(model->store, sort_key_of_column(model->sort_column));
+    if (!order) {
+        g_warning("Could not sort patients: %s", g_strerror(errno));
+        *count = 0;
+        return NULL;
+    }
+    *count = patient_store_count(model->store);
+    *reversed = model->sort_order == GTK_SORT_DESCENDING;
+    return order;
+}
+
+static PatientHandle model_all_at(const PatientHandle *all, guint count, gboolean reversed, guint i) {
+    return all[reversed ? count - 1 - i : i];
+}
+
+static void model_copy_all(PatientModel *model, HandleArray *to) {
+    guint count;
+    gboolean reversed;
+    const PatientHandle *all = model_all(model, &count, &reversed);
+    handles_reserve(to, count);
+    for (guint i = 0; i < count; i++) to->handles[i] = model_all_at(all, count, reversed, i);
+    to->count = count;
+}
+
+// Borrows the store's order for the sort column if it keeps one, and
+// otherwise collects and sorts every record
+static void model_order_all(PatientModel *model) {
+    gint key = sort_key_of_column(model->sort_column);
+    model->borrowed = key >= 0 && patient_store_order(model->store, key) != NULL;
+    model->all.count = 0;
+    if (model->borrowed) return;
+    size_t count = patient_store_count(model->store);
+    handles_reserve(&model->all, count);
+    for (size_t row = 0; row < count; row++) {
+        PatientRecord record;
+        patient_store_get(model->store, row, &record);
+        model->all.handles[row] = record.handle;
+    }
+    model->all.count = count;
+    model_sort(model, &model->all);
+}
+
+static gboolean model_wants(PatientModel *model, PatientHandle handle) {
+    return !model->filtered || patient_store_query_matches(model->store, &model->query, handle);
+}
+
+// --- GtkTreeModel ---
+
+static void set_iter(PatientModel *model, GtkTreeIter *iter, guint position) {
+    iter->stamp = model->stamp;
+    iter->user_data = GUINT_TO_POINTER(position);
+    iter->user_data2 = NULL;
+    iter->user_data3 = NULL;
+}
+
+static GtkTreeModelFlags patient_model_get_flags(GtkTreeModel *tree_model) {
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint patient_model_get_n_columns(GtkTreeModel *tree_model) {
+    return NUM_COLS;
+}
+
+static GType patient_model_get_column_type(GtkTreeModel *tree_model, gint column) {
+    return (column == COL_AGE || column == COL_MRN || column == COL_HANDLE) ? G_TYPE_UINT : G_TYPE_STRING;
+}
+
+static gboolean patient_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    PatientModel *model = PATIENT_MODEL(tree_model);
+    if (gtk_tree_path_get_depth(path) != 1) return FALSE;
+    gint position = gtk_tree_path_get_indices(path)[0];
+    if (position < 0 || (guint)position >= model->visible.count) return FALSE;
+    set_iter(model, iter, position);
+    return TRUE;
+}
+
+static GtkTreePath* patient_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return gtk_tree_path_new_from_indices(GPOINTER_TO_UINT(iter->user_data), -1);
+}
+
+static void patient_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    PatientModel *model = PATIENT_MODEL(tree_model);
+    g_value_init(value, patient_model_get_column_type(tree_model, column));
+    guint position = GPOINTER_TO_UINT(iter->user_data);
+    if (iter->stamp != model->stamp || position >= model->visible.count) return;
+    PatientHandle handle = model->visible.handles[position];
+    long row = patient_store_find(model->store, handle);
+    if (row < 0) return;
+    PatientRecord record;
+    patient_store_get(model->store, row, &record);
+    // Store strings live until the store is closed, so they needn't be copied
+    switch (column) {
+        case COL_NAME: g_value_set_static_string(value, record.name); break;
+        case COL_AGE: g_value_set_uint(value, record.age); break;
+        case COL_GENDER: g_value_set_static_string(value, record.gender); break;
+        case COL_TIMESTAMP: {
+            char added[PATIENT_ADDED_LEN];
+            patient_time_format(record.added, added);
+            g_value_set_string(value, added);
+            break;
+        }
+        case COL_MRN: g_value_set_uint(value, record.id); break;
+        case COL_HANDLE: g_value_set_uint(value, handle); break;
+    }
+}
+
+static gboolean patient_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    PatientModel *model = PATIENT_MODEL(tree_model);
+    guint next = GPOINTER_TO_UINT(iter->user_data) + 1;
+    if (next >= model->visible.count) return FALSE;
+    set_iter(model, iter, next);
+    return TRUE;
+}
+
+static gboolean patient_model_iter_previous(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    guint position = GPOINTER_TO_UINT(iter->user_data);
+    if (position == 0) return FALSE;
+    set_iter(PATIENT_MODEL(tree_model), iter, position - 1);
+    return TRUE;
+}
+
+static gboolean patient_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n) {
+    PatientModel *model = PATIENT_MODEL(tree_model);
+    if (parent || n < 0 || (guint)n >= model->visible.count) return FALSE;
+    set_iter(model, iter, n);
+    return TRUE;
+}
+
+static gboolean patient_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    return patient_model_iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gboolean patient_model_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return FALSE;
+}
+
+static gint patient_model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return iter ? 0 : (gint)PATIENT_MODEL(tree_model)->visible.count;
+}
+
+static gboolean patient_model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+    return FALSE;
+}
+
+static void patient_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = patient_model_get_flags;
+    iface->get_n_columns = patient_model_get_n_columns;
+    iface->get_column_type = patient_model_get_column_type;
+    iface->get_iter = patient_model_get_iter;
+    iface->get_path = patient_model_get_path;
+    iface->get_value = patient_model_get_value;
+    iface->iter_next = patient_model_iter_next;
+    iface->iter_previous = patient_model_iter_previous;
+    iface->iter_children = patient_model_iter_children;
+    iface->iter_has_child = patient_model_iter_has_child;
+    iface->iter_n_children = patient_model_iter_n_children;
+    iface->iter_nth_child = patient_model_iter_nth_child;
+    iface->iter_parent = patient_model_iter_parent;
+}
+
+// --- GtkTreeSortable ---
+
+static gboolean patient_model_get_sort_column_id(GtkTreeSortable *sortable, gint *column, GtkSortType *order) {
+    PatientModel *model = PATIENT_MODEL(sortable);
+    if (column) *column = model->sort_column;
+    if (order) *order = model->sort_order;
+    return model->sort_column != GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID
+           && model->sort_column != GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+}
+
+static void patient_model_set_sort_column_id(GtkTreeSortable *sortable, gint column, GtkSortType order) {
+    PatientModel *model = PATIENT_MODEL(sortable);
+    if (model->sort_column == column && model->sort_order == order) return;
+    model->sort_column = column;
+    model->sort_order = order;
+
+    HandleArray before = {0};
+    handles_copy(&before, &model->visible);
+    model_order_all(model);
+    if (model->filtered) model_sort(model, &model->visible);
+    else model_copy_all(model, &model->visible);
+    model->stamp++;
+    gtk_tree_sortable_sort_column_changed(sortable);
+
+    // One rows-reordered signal mapping each new position to its old one
+    guint n = model->visible.count;
+    if (n > 0) {
+        PatientHandle max_handle = 0;
+        for (guint i = 0; i < n; i++) max_handle = MAX(max_handle, before.handles[i]);
+        guint *old_position = g_new(guint, (gsize)max_handle + 1);
+        for (guint i = 0; i < n; i++) old_position[before.handles[i]] = i;
+        gint *new_order = g_new(gint, n);
+        for (guint i = 0; i < n; i++) new_order[i] = old_position[model->visible.handles[i]];
+        GtkTreePath *path = gtk_tree_path_new();
+        gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model), path, NULL, new_order);
+        gtk_tree_path_free(path);
+        g_free(new_order);
+        g_free(old_position);
+    }
+    g_free(before.handles);
+}
+
+static void patient_model_set_sort_func(GtkTreeSortable *sortable, gint column, GtkTreeIterCompareFunc func,
+                                        gpointer data, GDestroyNotify destroy) {
+    g_warning("%s: PatientModel only sorts by its own columns", G_STRFUNC);
+}
+
+static void patient_model_set_default_sort_func(GtkTreeSortable *sortable, GtkTreeIterCompareFunc func,
+                                                gpointer data, GDestroyNotify destroy) {
+    g_warning("%s: PatientModel only sorts by its own columns", G_STRFUNC);
+}
+
+static gboolean patient_model_has_default_sort_func(GtkTreeSortable *sortable) {
+    return FALSE;
+}
+
+static void patient_model_sortable_init(GtkTreeSortableIface *iface) {
+    iface->get_sort_column_id = patient_model_get_sort_column_id;
+    iface->set_sort_column_id = patient_model_set_sort_column_id;
+    iface->set_sort_func = patient_model_set_sort_func;
+    iface->set_default_sort_func = patient_model_set_default_sort_func;
+    iface->has_default_sort_func = patient_model_has_default_sort_func;
+}
+
+// --- GObject ---
+
+static void patient_model_finalize(GObject *object) {
+    PatientModel *model = PATIENT_MODEL(object);
+    g_free(model->all.handles);
+    g_free(model->visible.handles);
+    patient_query_clear(&model->query);
+    G_OBJECT_CLASS(patient_model_parent_class)->finalize(object);
+}
+
+static void patient_model_class_init(PatientModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = patient_model_finalize;
+}
+
+static void patient_model_init(PatientModel *model) {
+    model->stamp = g_random_int();
+    model->sort_column = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+    model->sort_order = GTK_SORT_ASCENDING;
+}
+
+// --- Public API ---
+
+static PatientModel* model_new(PatientStore *store, gint sort_column, GtkSortType order) {
+    PatientModel *model = g_object_new(PATIENT_TYPE_MODEL, NULL);
+    model->store = store;
+    model->sort_column = sort_column;
+    model->sort_order = order;
+    model_order_all(model);
+    return model;
+}
+
+PatientModel* patient_model_new(PatientStore *store) {
+    PatientModel *model = model_new(store, GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, GTK_SORT_ASCENDING);
+    model_copy_all(model, &model->visible);
+    return model;
+}
+
+PatientModel* patient_model_new_streaming(PatientStore *store, gint sort_column, GtkSortType order) {
+    PatientModel *model = model_new(store, sort_column, order);
+    model->streaming = TRUE;
+    handles_reserve(&model->visible, patient_store_count(store));
+    return model;
+}
+
+gboolean patient_model_stream_rows(PatientModel *model, guint max_rows) {
+    if (!model->streaming) return FALSE;
+    guint count;
+    gboolean reversed;
+    const PatientHandle *all = model_all(model, &count, &reversed);
+    guint end = MIN(count, model->streamed + max_rows);
+    GtkTreePath *path = gtk_tree_path_new_from_indices(0, -1);
+    for (; model->streamed < end; model->streamed++) {
+        // Appending leaves existing iters valid, so the stamp stays put
+        guint position = model->visible.count;
+        model->visible.handles[model->visible.count++] = model_all_at(all, count, reversed, model->streamed);
+        GtkTreeIter iter;
+        set_iter(model, &iter, position);
+        gtk_tree_path_get_indices(path)[0] = position;
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+    }
+    gtk_tree_path_free(path);
+    model->streaming = model->streamed < count;
+    return model->streaming;
+}
+
+guint patient_model_total_count(PatientModel *model) {
+    return model->borrowed ? patient_store_count(model->store) : model->all.count;
+}
+
+// Rebuilds the visible rows from every record and the current filter
+static void model_refilter(PatientModel *model) {
+    // Filtering answers from every record, so whatever was still streaming arrives at once
+    model->streaming = FALSE;
+    model->stamp++;
+    PatientHandle *matches = NULL;
+    long n = model->filtered ? patient_store_query(model->store, &model->query, &matches) : -1;
+    if (n < 0) {
+        if (model->filtered) g_warning("Search failed: %s", g_strerror(errno));
+        model_copy_all(model, &model->visible);
+        return;
+    }
+
+    // Keep the sort order by walking every row against a bitmap of the matches
+    PatientHandle limit = n > 0 ? matches[n - 1] + 1 : 0;
+    guint8 *wanted = g_malloc0(limit / 8 + 1);
+    for (long i = 0; i < n; i++) wanted[matches[i] >> 3] |= 1u << (matches[i] & 7);
+    free(matches);
+    guint count;
+    gboolean reversed;
+    const PatientHandle *all = model_all(model, &count, &reversed);
+    handles_reserve(&model->visible, n);
+    model->visible.count = 0;
+    for (guint i = 0; i < count && model->visible.count < (guint)n; i++) {
+        PatientHandle handle = model_all_at(all, count, reversed, i);
+        if (handle < limit && (wanted[handle >> 3] & (1u << (handle & 7)))) {
+            model->visible.handles[model->visible.count++] = handle;
+        }
+    }
+    g_free(wanted);
+}
+
+void patient_model_set_filter(PatientModel *model, const PatientQuery *query) {
+    patient_query_clear(&model->query);
+    model->filtered = query && !patient_query_is_empty(query) && patient_query_copy(query, &model->query) == 0;
+    model_refilter(model);
+}
+
+guint patient_model_visible_count(PatientModel *model) {
+    return model->visible.count;
+}
+
+void patient_model_record_added(PatientModel *model, PatientHandle handle) {
+    if (patient_store_find(model->store, handle) < 0) return;
+    if (!model->borrowed) handles_insert(&model->all, model_insert_position(model, &model->all, handle), handle);
+    if (!model_wants(model, handle)) return;
+    guint position = model_insert_position(model, &model->visible, handle);
+    handles_insert(&model->visible, position, handle);
+    model->stamp++;
+    GtkTreeIter iter;
+    set_iter(model, &iter, position);
+    GtkTreePath *path = gtk_tree_path_new_from_indices(position, -1);
+    gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+    gtk_tree_path_free(path);
+}
+
+// Sorts the live ones of handles alone, then merges them into every record
+// from the back so each row moves once
+static void model_merge_all(PatientModel *model, const PatientHandle *handles, guint count) {
+    HandleArray added = {0};
+    handles_reserve(&added, count);
+    for (guint i = 0; i < count; i++) {
+        if (patient_store_find(model->store, handles[i]) >= 0) added.handles[added.count++] = handles[i];
+    }
+    model_sort(model, &added);
+    handles_reserve(&model->all, model->all.count + added.count);
+    guint old = model->all.count, out = old + added.count;
+    for (guint next = added.count; next > 0;) {
+        if (old > 0 && model_compare(model, model->all.handles[old - 1], added.handles[next - 1]) > 0) {
+            model->all.handles[--out] = model->all.handles[--old];
+        } else {
+            model->all.handles[--out] = added.handles[--next];
+        }
+    }
+    model->all.count += added.count;
+    g_free(added.handles);
+}
+
+void patient_model_records_added(PatientModel *model, const PatientHandle *handles, guint count) {
+    if (!model->borrowed) model_merge_all(model, handles, count);
+    model_refilter(model);
+}
+
+void patient_model_records_changed(PatientModel *model, const PatientHandle *handles, guint count) {
+    if (!model->borrowed) {
+        // Take every one of them out in one pass, then merge back those still live
+        PatientHandle limit = 0;
+        for (guint i = 0; i < count; i++) limit = MAX(limit, handles[i] + 1);
+        guint8 *touched = g_malloc0(limit / 8 + 1);
+        for (guint i = 0; i < count; i++) touched[handles[i] >> 3] |= 1u << (handles[i] & 7);
+        guint kept = 0;
+        for (guint i = 0; i < model->all.count; i++) {
+            PatientHandle handle = model->all.handles[i];
+            if (handle >= limit || !(touched[handle >> 3] & (1u << (handle & 7)))) model->all.handles[kept++] = handle;
+        }
+        model->all.count = kept;
+        g_free(touched);
+        model_merge_all(model, handles, count);
+    }
+    model_refilter(model);
+}
+
+void patient_model_record_changed(PatientModel *model, PatientHandle handle) {
+    if (patient_store_find(model->store, handle) < 0) return;
+    if (!model->borrowed) {
+        gint old_all = handles_find(&model->all, handle);
+        if (old_all < 0) return;
+        handles_remove(&model->all, old_all);
+        handles_insert(&model->all, model_insert_position(model, &model->all, handle), handle);
+    }
+
+    gint old_position = handles_find(&model->visible, handle);
+    gboolean wanted = model_wants(model, handle);
+    if (old_position >= 0) handles_remove(&model->visible, old_position);
+    guint position = wanted ? model_insert_position(model, &model->visible, handle) : 0;
+    GtkTreeIter iter;
+    GtkTreePath *path;
+    if (old_position >= 0 && wanted && position == (guint)old_position) {
+        // Still in place, just redraw it
+        handles_insert(&model->visible, position, handle);
+        set_iter(model, &iter, position);
+        path = gtk_tree_path_new_from_indices(position, -1);
+        gtk_tree_model_row_changed(GTK_TREE_MODEL(model), path, &iter);
+        gtk_tree_path_free(path);
+        return;
+    }
+    model->stamp++;
+    if (old_position >= 0) {
+        path = gtk_tree_path_new_from_indices(old_position, -1);
+        gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+        gtk_tree_path_free(path);
+    }
+    if (wanted) {
+        handles_insert(&model->visible, position, handle);
+        set_iter(model, &iter, position);
+        path = gtk_tree_path_new_from_indices(position, -1);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+        gtk_tree_path_free(path);
+    }
+}
+
+void patient_model_record_deleted(PatientModel *model, PatientHandle handle) {
+    gint position = model->borrowed ? -1 : handles_find(&model->all, handle);
+    if (position >= 0) handles_remove(&model->all, position);
+    position = handles_find(&model->visible, handle);
+    if (position < 0) return;
+    handles_remove(&model->visible, position);
+    model->stamp++;
+    GtkTreePath *path = gtk_tree_path_new_from_indices(position, -1);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+    gtk_tree_path_free(path);
+}
@@ -0,0 +1,65 @@
+#ifndef PATIENT_MODEL_H
+#define PATIENT_MODEL_H
+
+#include <gtk/gtk.h>
+
+#include "patient_store.h"
+
+// --- Patient Tree Model ---
+//
+// Flat GtkTreeModel that serves the patients tab straight out of a
+// PatientStore. Nothing is copied per row: the model keeps two handle
+// arrays, every record in sort order and the visible subset of it, and the
+// view fetches cells on demand for the rows it actually draws. Sorting
+// (GtkTreeSortable) and filtering rearrange those arrays instead of stacking
+// GtkTreeModelSort/GtkTreeModelFilter on top. When sorted by name, age or
+// admission time, the first array is the store's own order for that key.
+
+enum {
+    COL_NAME,
+    COL_AGE,
+    COL_GENDER,
+    COL_TIMESTAMP,
+    COL_MRN,        // Not sortable
+    COL_HANDLE,     // Hidden: PatientStore handle of the row
+    NUM_COLS
+};
+#define NUM_VISIBLE_COLS COL_HANDLE
+
+#define PATIENT_TYPE_MODEL (patient_model_get_type())
+G_DECLARE_FINAL_TYPE(PatientModel, patient_model, PATIENT, MODEL, GObject)
+
+// Serves every record of store, which must outlive the model
+PatientModel* patient_model_new(PatientStore *store);
+// Sorts every record up front but starts with no visible rows, so a large
+// store can be revealed a batch at a time with patient_model_stream_rows.
+// Emits no signals, so it may run on a worker thread while nothing else
+// touches store.
+PatientModel* patient_model_new_streaming(PatientStore *store, gint sort_column, GtkSortType order);
+// Appends up to max_rows more rows to the view, in sort order, and returns
+// whether any are still to come. Until it returns FALSE, don't filter, sort
+// or report record changes to the model.
+gboolean patient_model_stream_rows(PatientModel *model, guint max_rows);
+// Every record the model serves, visible or not
+guint patient_model_total_count(PatientModel *model);
+
+// Shows only the records query matches (NULL or an empty query shows them
+// all); the model keeps its own copy. The visible rows are replaced
+// wholesale without per-row signals, so detach the model from its view
+// around the call.
+void patient_model_set_filter(PatientModel *model, const PatientQuery *query);
+guint patient_model_visible_count(PatientModel *model);
+
+// Keep the model in step after a single record changed in the store. Rows
+// are re-placed in sort order and re-checked against the filter.
+void patient_model_record_added(PatientModel *model, PatientHandle handle);
+void patient_model_record_changed(PatientModel *model, PatientHandle handle);
+void patient_model_record_deleted(PatientModel *model, PatientHandle handle);
+// The same after many records were added at once, e.g. by an import. Like
+// patient_model_set_filter, it replaces the visible rows wholesale, so
+// detach the model from its view around the call.
+void patient_model_records_added(PatientModel *model, const PatientHandle *handles, guint count);
+// The same after many records were changed or deleted at once
+void patient_model_records_changed(PatientModel *model, const PatientHandle *handles, guint count);
+
+#endif
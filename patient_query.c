@@ -0,0 +1,253 @@
+#include "patient_query.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "patient_store.h"
+
+// --- Constants ---
+
+#define AGE_LIMIT UINT16_MAX        // The store keeps ages in 16 bits
+#define ADDED_FIRST (INT64_MIN + 1) // Windows open to the past still skip unknown times
+#define ADDED_LAST INT64_MAX
+
+// --- Bounds ---
+
+// Parses one bound of a range into the interval it stands for: an age is
+// itself, a date its whole day, a date and time its minute
+typedef bool (*BoundParser)(const char *text, size_t len, int64_t *first, int64_t *last);
+
+static bool parse_age(const char *text, size_t len, int64_t *first, int64_t *last) {
+    if (len == 0 || len > 5) return false;
+    int64_t age = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)text[i])) return false;
+        age = age * 10 + (text[i] - '0');
+    }
+    if (age > AGE_LIMIT) age = AGE_LIMIT;
+    *first = *last = age;
+    return true;
+}
+
+static bool parse_date(const char *text, size_t len, int64_t *first, int64_t *last) {
+    // Reuse the stored "YYYY-MM-DD HH:MM" parser for both forms
+    char stamp[PATIENT_ADDED_LEN];
+    int64_t span;
+    if (len == 10) {
+        memcpy(stamp, text, 10);
+        memcpy(stamp + 10, " 00:00", 7);
+        span = 86400;
+    } else if (len == 16 && (text[10] == 'T' || text[10] == 't')) {
+        memcpy(stamp, text, 16);
+        stamp[10] = ' ';
+        stamp[16] = '\0';
+        span = 60;
+    } else {
+        return false;
+    }
+    int64_t start = patient_time_parse(stamp);
+    if (start == PATIENT_TIME_UNKNOWN) return false;
+    *first = start;
+    *last = start + span - 1;
+    return true;
+}
+
+// "7d" or "12h": from that long before now on
+static bool parse_recent(const char *text, size_t len, int64_t now, int64_t *first) {
+    if (len < 2 || len > 6 || (text[len - 1] != 'd' && text[len - 1] != 'h')) return false;
+    int64_t amount = 0;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (!isdigit((unsigned char)text[i])) return false;
+        amount = amount * 10 + (text[i] - '0');
+    }
+    *first = now - amount * (text[len - 1] == 'd' ? 86400 : 3600);
+    return true;
+}
+
+// Parses "A..B", "A..", "..B", ">A", ">=A", "<A", "<=A" or "A" into an
+// inclusive range within [lowest, highest]
+static bool parse_range(const char *text, BoundParser parse, int64_t lowest, int64_t highest,
+                        int64_t *min, int64_t *max) {
+    int64_t first, last;
+    size_t len = strlen(text);
+    const char *dots = strstr(text, "..");
+    if (dots) {
+        size_t left = dots - text, right = len - left - 2;
+        int64_t ignored;
+        *min = lowest;
+        *max = highest;
+        if (left > 0 && !parse(text, left, min, &ignored)) return false;
+        if (right > 0 && !parse(dots + 2, right, &ignored, max)) return false;
+        return left > 0 || right > 0;
+    }
+    bool or_equal = len >= 2 && text[1] == '=';
+    size_t skip = or_equal ? 2 : 1;
+    if (text[0] == '>' || text[0] == '<') {
+        if (!parse(text + skip, len - skip, &first, &last)) return false;
+        if (text[0] == '>') {
+            *min = or_equal ? first : last + 1;
+            *max = highest;
+        } else {
+            *min = lowest;
+            *max = or_equal ? last : first - 1;
+        }
+        return true;
+    }
+    if (!parse(text, len, &first, &last)) return false;
+    *min = first;
+    *max = last;
+    return true;
+}
+
+// --- Terms ---
+
+// Appends word to the name needle, space-separated
+static bool append_name(PatientQuery *query, const char *word) {
+    size_t old_len = query->name ? strlen(query->name) : 0;
+    char *name = realloc(query->name, old_len + strlen(word) + 2);
+    if (!name) return false;
+    if (old_len) name[old_len++] = ' ';
+    strcpy(name + old_len, word);
+    query->name = name;
+    return true;
+}
+
+// Applies one age, added or gender term; false with error filled in if it
+// doesn't parse, or left empty if memory ran out
+static bool apply_term(PatientQuery *query, const char *key, const char *value, int64_t now,
+                       char *error, size_t error_len) {
+    int64_t min, max;
+    if (strcasecmp(key, "age") == 0) {
+        if (!parse_range(value, parse_age, 0, AGE_LIMIT, &min, &max)) {
+            snprintf(error, error_len, "age:%s: expected an age or a range such as 60..80 or >=65", value);
+            return false;
+        }
+        if (min > query->age_min) query->age_min = min < 0 ? 0 : (unsigned)min;
+        if (max < query->age_max) query->age_max = max < 0 ? 0 : (unsigned)max;
+        if (max < 0) query->age_min = 1;   // An empty range, such as <0
+        return true;
+    }
+    if (strcasecmp(key, "added") == 0) {
+        if (parse_recent(value, strlen(value), now, &min)) {
+            max = ADDED_LAST;
+        } else if (!parse_range(value, parse_date, ADDED_FIRST, ADDED_LAST, &min, &max)) {
+            snprintf(error, error_len, "added:%s: expected a date such as 2026-10-10, a range of them, or 7d", value);
+            return false;
+        }
+        if (min > query->added_min) query->added_min = min;
+        if (max < query->added_max) query->added_max = max;
+        return true;
+    }
+    // gender
+    if (!*value) {
+        snprintf(error, error_len, "gender: expected a gender such as F");
+        return false;
+    }
+    if (query->gender && strncasecmp(query->gender, value, strlen(value)) != 0
+        && strncasecmp(query->gender, value, strlen(query->gender)) != 0) {
+        snprintf(error, error_len, "gender:%s: conflicts with gender:%s", value, query->gender);
+        return false;
+    }
+    // Of two compatible prefixes, the longer one decides
+    if (query->gender && strlen(query->gender) >= strlen(value)) return true;
+    char *gender = strdup(value);
+    if (!gender) return false;
+    free(query->gender);
+    query->gender = gender;
+    return true;
+}
+
+// A word such as #12345 names an MRN; false if word isn't one
+static bool parse_id_term(const char *word, uint32_t *id) {
+    if (word[0] != '#' || !isdigit((unsigned char)word[1])) return false;
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(word + 1, &end, 10);
+    if (*end || errno || value == 0 || value > UINT32_MAX) return false;
+    *id = (uint32_t)value;
+    return true;
+}
+
+// --- Public API ---
+
+int patient_query_parse(const char *text, int64_t now, PatientQuery *query, char *error, size_t error_len) {
+    memset(query, 0, sizeof(*query));
+    query->age_max = UINT_MAX;
+    query->added_min = INT64_MIN;
+    query->added_max = INT64_MAX;
+    char *copy = strdup(text ? text : "");
+    if (!copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    bool ok = true;
+    char *saveptr;
+    for (char *word = strtok_r(copy, " \t\r\n", &saveptr); ok && word; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        uint32_t id;
+        if (parse_id_term(word, &id)) {
+            if (query->id && query->id != id) {
+                snprintf(error, error_len, "#%u: conflicts with #%u", id, query->id);
+                ok = false;
+            }
+            query->id = id;
+            continue;
+        }
+        char *colon = strchr(word, ':');
+        if (!colon || colon == word) {
+            ok = append_name(query, word);
+            continue;
+        }
+        *colon = '\0';
+        bool known = strcasecmp(word, "age") == 0 || strcasecmp(word, "added") == 0 || strcasecmp(word, "gender") == 0;
+        if (!known) {
+            // Not a term after all, such as a name with a colon in it
+            *colon = ':';
+            ok = append_name(query, word);
+            continue;
+        }
+        if (error_len) error[0] = '\0';
+        ok = apply_term(query, word, colon + 1, now, error, error_len);
+    }
+    free(copy);
+    if (!ok) {
+        errno = error_len && error[0] ? EINVAL : ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+void patient_query_clear(PatientQuery *query) {
+    free(query->name);
+    free(query->gender);
+    query->name = query->gender = NULL;
+}
+
+int patient_query_copy(const PatientQuery *query, PatientQuery *copy) {
+    *copy = *query;
+    copy->name = query->name ? strdup(query->name) : NULL;
+    copy->gender = query->gender ? strdup(query->gender) : NULL;
+    if ((query->name && !copy->name) || (query->gender && !copy->gender)) {
+        patient_query_clear(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+bool patient_query_has_age(const PatientQuery *query) {
+    return query->age_min > 0 || query->age_max < AGE_LIMIT;
+}
+
+bool patient_query_has_added(const PatientQuery *query) {
+    return query->added_min != INT64_MIN || query->added_max != INT64_MAX;
+}
+
+bool patient_query_is_empty(const PatientQuery *query) {
+    return !query->name && !query->gender && !query->id && !patient_query_has_age(query)
+           && !patient_query_has_added(query);
+}
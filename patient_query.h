@@ -0,0 +1,47 @@
+#ifndef PATIENT_QUERY_H
+#define PATIENT_QUERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Patient Query ---
+//
+// The search box language. A query is a list of terms, all of which must
+// hold:
+//
+//     age:60..80  age:>=65  age:<18  age:42       inclusive age ranges
+//     gender:F                                    gender starts with F, any case
+//     added:2026-10-10  added:>2026-10-10         admission day or time windows
+//     added:2026-10-01..2026-10-07  added:7d      ...or the last 7 days (also h)
+//     #12345                                      the patient with this MRN
+//     sha                                         anything else: name contains it
+//
+// Dates may carry a time as 2026-10-10T08:30. A date stands for its whole
+// day, so added:>2026-10-10 starts the next morning and added:<=2026-10-10
+// takes in its evening. The words that aren't terms are joined with single
+// spaces into one name needle, so a plain name searches as it always did.
+
+typedef struct {
+    char *name;                 // Name contains this, ignoring ASCII case; NULL for any
+    char *gender;               // Gender starts with this, ignoring ASCII case; NULL for any
+    unsigned age_min, age_max;  // Inclusive
+    int64_t added_min;          // Inclusive, in patient_time_parse seconds
+    int64_t added_max;
+    uint32_t id;                // The patient with this MRN; 0 for any
+} PatientQuery;
+
+// Parses text, resolving relative windows such as 7d against now (see
+// patient_time_now). Returns 0, or -1 with errno set to EINVAL and a
+// message in error, or ENOMEM. The query must be cleared after either.
+int patient_query_parse(const char *text, int64_t now, PatientQuery *query, char *error, size_t error_len);
+void patient_query_clear(PatientQuery *query);
+// Copies query into copy, which must be cleared later. Returns 0 or -1.
+int patient_query_copy(const PatientQuery *query, PatientQuery *copy);
+
+// Whether a query constrains each column, and at all
+bool patient_query_has_age(const PatientQuery *query);
+bool patient_query_has_added(const PatientQuery *query);
+bool patient_query_is_empty(const PatientQuery *query);
+
+#endif
@@ -0,0 +1,332 @@
+#include "patient_stats.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define FIRST_DAY (-25567)          // 1900-01-01, in days since 1970-01-01
+#define DATED_DAYS 182621           // Up to 2400-01-01
+#define DATED_HOURS ((int64_t)DATED_DAYS * 24)
+#define TIMELINE_SLACK 1024         // Buckets a timeline grows by at least
+#define BUILD_MIN_CHUNK 65536       // Rows per thread while building
+
+// --- Structs ---
+
+// Counters for a run of consecutive hours or days, grown on either side as
+// admissions fall outside it. Buckets count from FIRST_DAY.
+typedef struct {
+    uint32_t *counts;
+    int64_t first;              // Bucket of counts[0]
+    size_t len;
+} Timeline;
+
+typedef struct {
+    char key[PATIENT_STATS_GENDER_LEN];     // Trimmed and folded
+    char shown[PATIENT_STATS_GENDER_LEN];   // Trimmed, as first seen
+    size_t count;
+} GenderCount;
+
+struct PatientStats {
+    size_t total;
+    size_t undated;
+    size_t ages[PATIENT_STATS_AGES];
+    size_t hour_of_day[24];
+    GenderCount genders[PATIENT_STATS_GENDERS];
+    unsigned gender_count;
+    size_t other_genders;
+    Timeline hours;
+    Timeline days;              // Rolled up from the hours, one bucket per change
+};
+
+typedef struct {
+    const PatientSnapshot *snapshot;
+    size_t first;
+    size_t end;
+    PatientStats *stats;        // This chunk's rows only
+    bool failed;
+} BuildChunk;
+
+// --- Timelines ---
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return a % b != 0 && a < 0 ? q - 1 : q;
+}
+
+// Hours since 1900-01-01 00:00, or -1 for an undated admission
+static int64_t hour_bucket(int64_t added) {
+    if (added == PATIENT_TIME_UNKNOWN) return -1;
+    int64_t hour = floor_div(added, 3600) - (int64_t)FIRST_DAY * 24;
+    return hour >= 0 && hour < DATED_HOURS ? hour : -1;
+}
+
+// The counter for bucket, which must be below limit; NULL if growing the
+// timeline to reach it ran out of memory. Growing by at least the current
+// length keeps a timeline that spreads out one bucket at a time cheap.
+static uint32_t* timeline_slot(Timeline *timeline, int64_t bucket, int64_t limit) {
+    int64_t first = timeline->first, end = timeline->first + (int64_t)timeline->len;
+    if (bucket >= first && bucket < end) return &timeline->counts[bucket - first];
+    int64_t slack = timeline->len > TIMELINE_SLACK ? (int64_t)timeline->len : TIMELINE_SLACK;
+    if (timeline->len == 0) first = end = bucket;
+    if (bucket < first) first = bucket > slack ? bucket - slack : 0;
+    if (bucket >= end) end = limit - bucket > slack ? bucket + 1 + slack : limit;
+    uint32_t *counts = calloc(end - first, sizeof(uint32_t));
+    if (!counts) return NULL;
+    if (timeline->len) memcpy(counts + (timeline->first - first), timeline->counts, timeline->len * sizeof(uint32_t));
+    free(timeline->counts);
+    timeline->counts = counts;
+    timeline->first = first;
+    timeline->len = end - first;
+    return &counts[bucket - first];
+}
+
+static uint32_t timeline_get(const Timeline *timeline, int64_t bucket) {
+    if (bucket < timeline->first || bucket >= timeline->first + (int64_t)timeline->len) return 0;
+    return timeline->counts[bucket - timeline->first];
+}
+
+// Adds every bucket of from into into
+static int timeline_merge(Timeline *into, const Timeline *from, int64_t limit) {
+    if (from->len == 0) return 0;
+    if (!timeline_slot(into, from->first, limit) || !timeline_slot(into, from->first + from->len - 1, limit)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    uint32_t *counts = into->counts + (from->first - into->first);
+    for (size_t i = 0; i < from->len; i++) counts[i] += from->counts[i];
+    return 0;
+}
+
+// --- Genders ---
+
+// Trims gender into shown and folds it into key; false if it doesn't fit
+static bool gender_key(const char *gender, char key[PATIENT_STATS_GENDER_LEN], char shown[PATIENT_STATS_GENDER_LEN]) {
+    while (isspace((unsigned char)*gender)) gender++;
+    size_t len = strlen(gender);
+    while (len > 0 && isspace((unsigned char)gender[len - 1])) len--;
+    if (len >= PATIENT_STATS_GENDER_LEN) return false;
+    for (size_t i = 0; i < len; i++) {
+        shown[i] = gender[i];
+        key[i] = tolower((unsigned char)gender[i]);
+    }
+    shown[len] = key[len] = '\0';
+    return true;
+}
+
+// The counter gender goes into; a gender not seen before takes a free slot
+// if create is set, and shares the last bucket once they are all taken
+static size_t* gender_counter(PatientStats *stats, const char *gender, bool create) {
+    char key[PATIENT_STATS_GENDER_LEN], shown[PATIENT_STATS_GENDER_LEN];
+    if (!gender_key(gender, key, shown)) return &stats->other_genders;
+    for (unsigned i = 0; i < stats->gender_count; i++) {
+        if (strcmp(stats->genders[i].key, key) == 0) return &stats->genders[i].count;
+    }
+    if (!create || stats->gender_count == PATIENT_STATS_GENDERS) return &stats->other_genders;
+    GenderCount *slot = &stats->genders[stats->gender_count++];
+    memcpy(slot->key, key, sizeof(key));
+    memcpy(slot->shown, shown, sizeof(shown));
+    return &slot->count;
+}
+
+// --- Building ---
+
+static unsigned online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+static void* build_chunk(void *data) {
+    BuildChunk *chunk = data;
+    chunk->stats = patient_stats_new();
+    for (size_t row = chunk->first; chunk->stats && row < chunk->end; row++) {
+        PatientRecord record;
+        patient_snapshot_get(chunk->snapshot, row, &record);
+        if (patient_stats_add(chunk->stats, record.age, record.gender, record.added) != 0) break;
+    }
+    if (!chunk->stats || chunk->stats->total < chunk->end - chunk->first) chunk->failed = true;
+    return NULL;
+}
+
+// Adds a later chunk's counts into stats. Its genders are taken in the order
+// it first saw them, which is the order a single pass would have met them
+// in, unless it ran out of slots: then its rows are counted again one by one.
+static int merge_chunk(PatientStats *stats, const BuildChunk *chunk) {
+    const PatientStats *from = chunk->stats;
+    if (timeline_merge(&stats->hours, &from->hours, DATED_HOURS) != 0
+        || timeline_merge(&stats->days, &from->days, DATED_DAYS) != 0) {
+        return -1;
+    }
+    stats->total += from->total;
+    stats->undated += from->undated;
+    for (int i = 0; i < PATIENT_STATS_AGES; i++) stats->ages[i] += from->ages[i];
+    for (int i = 0; i < 24; i++) stats->hour_of_day[i] += from->hour_of_day[i];
+    if (from->other_genders == 0) {
+        for (unsigned i = 0; i < from->gender_count; i++) {
+            *gender_counter(stats, from->genders[i].shown, true) += from->genders[i].count;
+        }
+        return 0;
+    }
+    for (size_t row = chunk->first; row < chunk->end; row++) {
+        PatientRecord record;
+        patient_snapshot_get(chunk->snapshot, row, &record);
+        (*gender_counter(stats, record.gender, true))++;
+    }
+    return 0;
+}
+
+// --- Public API ---
+
+PatientStats* patient_stats_new(void) {
+    PatientStats *stats = calloc(1, sizeof(PatientStats));
+    if (!stats) errno = ENOMEM;
+    return stats;
+}
+
+PatientStats* patient_stats_build(const PatientSnapshot *snapshot) {
+    size_t count = patient_snapshot_count(snapshot);
+    unsigned n_threads = online_cpus();
+    if (n_threads > count / BUILD_MIN_CHUNK) n_threads = count / BUILD_MIN_CHUNK;
+    if (n_threads == 0) n_threads = 1;
+    BuildChunk *chunks = calloc(n_threads, sizeof(BuildChunk));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    bool *started_thread = calloc(n_threads, sizeof(bool));
+    bool failed = !chunks || !threads || !started_thread;
+    for (unsigned c = 0; !failed && c < n_threads; c++) {
+        chunks[c] = (BuildChunk){ .snapshot = snapshot, .first = count * c / n_threads,
+                                  .end = count * (c + 1) / n_threads };
+        if (c > 0) started_thread[c] = pthread_create(&threads[c], NULL, build_chunk, &chunks[c]) == 0;
+        if (c > 0 && !started_thread[c]) build_chunk(&chunks[c]);
+    }
+    if (!failed) build_chunk(&chunks[0]);
+    for (unsigned c = 0; !failed && c < n_threads; c++) {
+        if (started_thread[c]) pthread_join(threads[c], NULL);
+    }
+    for (unsigned c = 0; !failed && c < n_threads; c++) failed = chunks[c].failed;
+
+    // The first chunk's counts are the start of a single pass already
+    PatientStats *stats = NULL;
+    if (!failed) {
+        stats = chunks[0].stats;
+        chunks[0].stats = NULL;
+    }
+    for (unsigned c = 1; !failed && c < n_threads; c++) failed = merge_chunk(stats, &chunks[c]) != 0;
+    for (unsigned c = 0; chunks && c < n_threads; c++) patient_stats_free(chunks[c].stats);
+    free(chunks);
+    free(threads);
+    free(started_thread);
+    if (failed) {
+        patient_stats_free(stats);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return stats;
+}
+
+void patient_stats_free(PatientStats *stats) {
+    if (!stats) return;
+    free(stats->hours.counts);
+    free(stats->days.counts);
+    free(stats);
+}
+
+int patient_stats_add(PatientStats *stats, unsigned age, const char *gender, int64_t added) {
+    int64_t hour = hour_bucket(added);
+    if (hour >= 0) {
+        uint32_t *in_hour = timeline_slot(&stats->hours, hour, DATED_HOURS);
+        uint32_t *in_day = in_hour ? timeline_slot(&stats->days, hour / 24, DATED_DAYS) : NULL;
+        if (!in_day) {
+            errno = ENOMEM;
+            return -1;
+        }
+        (*in_hour)++;
+        (*in_day)++;
+        stats->hour_of_day[hour % 24]++;
+    } else {
+        stats->undated++;
+    }
+    stats->ages[age < PATIENT_STATS_AGES ? age : PATIENT_STATS_AGES - 1]++;
+    (*gender_counter(stats, gender, true))++;
+    stats->total++;
+    return 0;
+}
+
+void patient_stats_remove(PatientStats *stats, unsigned age, const char *gender, int64_t added) {
+    int64_t hour = hour_bucket(added);
+    // Counted once, so its buckets exist
+    if (hour >= 0) {
+        (*timeline_slot(&stats->hours, hour, DATED_HOURS))--;
+        (*timeline_slot(&stats->days, hour / 24, DATED_DAYS))--;
+        stats->hour_of_day[hour % 24]--;
+    } else {
+        stats->undated--;
+    }
+    stats->ages[age < PATIENT_STATS_AGES ? age : PATIENT_STATS_AGES - 1]--;
+    (*gender_counter(stats, gender, false))--;
+    stats->total--;
+}
+
+size_t patient_stats_total(const PatientStats *stats) {
+    return stats->total;
+}
+
+size_t patient_stats_undated(const PatientStats *stats) {
+    return stats->undated;
+}
+
+size_t patient_stats_genders(const PatientStats *stats, PatientGenderCount counts[PATIENT_STATS_GENDERS + 1]) {
+    size_t n = 0;
+    for (unsigned i = 0; i < stats->gender_count; i++) {
+        if (!stats->genders[i].count) continue;
+        // Most patients first, then by name; there are too few genders to bother with qsort
+        const GenderCount *gender = &stats->genders[i];
+        size_t at = n++;
+        while (at > 0 && (counts[at - 1].count < gender->count
+                          || (counts[at - 1].count == gender->count && strcmp(counts[at - 1].gender, gender->shown) > 0))) {
+            counts[at] = counts[at - 1];
+            at--;
+        }
+        counts[at] = (PatientGenderCount){ gender->shown, gender->count };
+    }
+    if (stats->other_genders) counts[n++] = (PatientGenderCount){ NULL, stats->other_genders };
+    return n;
+}
+
+void patient_stats_ages(const PatientStats *stats, size_t counts[PATIENT_STATS_AGES]) {
+    memcpy(counts, stats->ages, sizeof(stats->ages));
+}
+
+void patient_stats_hours_of_day(const PatientStats *stats, size_t counts[24]) {
+    memcpy(counts, stats->hour_of_day, sizeof(stats->hour_of_day));
+}
+
+void patient_stats_admissions(const PatientStats *stats, PatientStatsSpan span, int64_t from, size_t n,
+                              size_t *counts) {
+    bool daily = span == PATIENT_STATS_DAILY;
+    const Timeline *timeline = daily ? &stats->days : &stats->hours;
+    int64_t first = daily ? floor_div(from, 86400) - FIRST_DAY : floor_div(from, 3600) - (int64_t)FIRST_DAY * 24;
+    for (size_t i = 0; i < n; i++) counts[i] = timeline_get(timeline, first + (int64_t)i);
+}
+
+int patient_stats_range(const PatientStats *stats, int64_t *first, int64_t *last) {
+    // Days first, so only two days' hours are looked at
+    const Timeline *days = &stats->days;
+    size_t lo = 0, hi = days->len;
+    while (lo < hi && !days->counts[lo]) lo++;
+    while (hi > lo && !days->counts[hi - 1]) hi--;
+    if (lo == hi) {
+        errno = ENOENT;
+        return -1;
+    }
+    int64_t first_hour = (days->first + (int64_t)lo) * 24, last_hour = (days->first + (int64_t)hi) * 24 - 1;
+    while (!timeline_get(&stats->hours, first_hour)) first_hour++;
+    while (!timeline_get(&stats->hours, last_hour)) last_hour--;
+    *first = (first_hour + (int64_t)FIRST_DAY * 24) * 3600;
+    *last = (last_hour + (int64_t)FIRST_DAY * 24) * 3600;
+    return 0;
+}
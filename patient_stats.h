@@ -0,0 +1,65 @@
+#ifndef PATIENT_STATS_H
+#define PATIENT_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+
+// --- Patient Statistics ---
+//
+// Running totals over a registry: patients by gender, by year of age, and
+// admissions by hour of the day and per calendar hour and day. Adding or
+// removing a record touches one counter of each kind, so a store keeps its
+// statistics up to date through every change for the price of a few
+// increments (see patient_store_track_stats), and a dashboard can read them
+// as often as it redraws. Only the first build looks at every record, and
+// it does so on every core.
+//
+// Genders are told apart ignoring ASCII case and surrounding spaces. Hours
+// and days are those of the wall clock the admission times are kept in
+// (see patient_time_parse); admissions before 1900 or after 2399, and
+// unknown ones, count as undated.
+
+#define PATIENT_STATS_AGES 121          // One bucket per year of age; the last also holds everyone older
+#define PATIENT_STATS_GENDERS 16        // Distinct genders counted apart; any more share one bucket
+#define PATIENT_STATS_GENDER_LEN 32     // Longer genders share that bucket too
+
+typedef enum {
+    PATIENT_STATS_HOURLY,
+    PATIENT_STATS_DAILY
+} PatientStatsSpan;
+
+typedef struct {
+    const char *gender;     // As first seen, trimmed; NULL for the bucket of all the rest
+    size_t count;
+} PatientGenderCount;
+
+PatientStats* patient_stats_new(void);
+// Counts every record in snapshot, a range of rows per core
+PatientStats* patient_stats_build(const PatientSnapshot *snapshot);
+void patient_stats_free(PatientStats *stats);
+
+// Return 0, or -1 with errno set if memory ran out (the statistics are
+// then unchanged). Removing a record counted earlier never fails.
+int patient_stats_add(PatientStats *stats, unsigned age, const char *gender, int64_t added);
+void patient_stats_remove(PatientStats *stats, unsigned age, const char *gender, int64_t added);
+
+size_t patient_stats_total(const PatientStats *stats);
+size_t patient_stats_undated(const PatientStats *stats);
+// Fills counts with every gender that has patients, most patients first,
+// and the shared bucket last; returns how many it filled. The strings live
+// as long as the statistics.
+size_t patient_stats_genders(const PatientStats *stats, PatientGenderCount counts[PATIENT_STATS_GENDERS + 1]);
+void patient_stats_ages(const PatientStats *stats, size_t counts[PATIENT_STATS_AGES]);
+// Dated admissions by hour of the day, 0 to 23
+void patient_stats_hours_of_day(const PatientStats *stats, size_t counts[24]);
+// Admissions in each of n consecutive hours or days, the first being the
+// one that holds the time from
+void patient_stats_admissions(const PatientStats *stats, PatientStatsSpan span, int64_t from, size_t n,
+                              size_t *counts);
+// The start of the first and last hour with any dated admission; -1 with
+// errno ENOENT if there are none
+int patient_stats_range(const PatientStats *stats, int64_t *first, int64_t *last);
+
+#endif
@@ -0,0 +1,3934 @@
+#define _GNU_SOURCE
+#include "patient_store.h"
+#include "columnar_file.h"
+#include "id_bitmap.h"
+#include "latency_stats.h"
+#include "order_file.h"
+#include "patient_stats.h"
+#include "trigram_index.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --- Constants ---
+
+#define SNAPSHOT_HEADER "#hms-snapshot lsn=" // No commas: older builds skip this line
+#define SNAPSHOT_NEXT_ID " next_id="         // Follows the lsn; older builds stop reading at the space
+#define JOURNAL_COMPACT_BYTES (4 * 1024 * 1024)
+#define LOADER_MIN_CHUNK (1 << 20)
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_PAD 16                    // Readable slack after each block for 16-byte name loads
+#define INTERN_MAX_VALUES UINT16_MAX    // Distinct values a 16-bit code can name
+#define ID_INDEX_MIN_SLOTS 1024
+#define ORDER_SUFFIX ".order"
+#define QUERY_PROBE_SHARE 4             // Checking a candidate row costs about four bitmap bits
+#define QUERY_GENDER_SAMPLES 1024       // Rows sampled to guess how many a gender term keeps
+#define SCAN_MIN_ROWS (1 << 15)         // Fewer rows per worker than this aren't worth a thread
+#define ORDER_MERGE_SCAN_SHARE 16       // A delta this share of an order or more is merged in one pass
+#define NAME_INDEX_SWEEP_SHARE 8192     // Deleting this share of the records or more sweeps the name index once
+#define ARCHIVE_SUFFIX ".archive"
+#define ARCHIVE_PART_SUFFIX ".txt.gz"
+#define ARCHIVE_GZIP_MODE "wb6"         // Written once, read many times: worth squeezing
+#define ARCHIVE_READ_BYTES (1 << 20)
+#define CHANGES_SUFFIX ".changes"
+#define CHANGES_HEADER "#hms-changes floor="
+#define CHANGES_KEEP_BYTES (64 * 1024 * 1024)  // A longer change history drops its older half
+#define CHANGES_TAIL_BYTES 4096                 // Read from the end of the history to find its last record
+
+// Journal record kinds
+enum {
+    JOURNAL_ADD = 'A',
+    JOURNAL_UPDATE = 'U',
+    JOURNAL_DELETE = 'D'
+};
+
+// --- Structs ---
+
+// Growable byte buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// Open-addressing map from row text to a list of slots (or, for miss
+// counts, just a count held in len). Keys are never removed; an entry whose
+// len drops to zero simply stays empty.
+typedef struct {
+    char *key;
+    uint64_t hash;
+    uint32_t *items;
+    uint32_t len;
+    uint32_t cap;
+} StrMapEntry;
+
+typedef struct {
+    StrMapEntry *entries;
+    size_t capacity;
+    size_t used;
+    size_t total;       // Sum of len over all entries
+} StrMap;
+
+// Rows by value, used to replay the journal and to compact it into a snapshot.
+// Every row but those of older builds ends in its MRN, so rows are unique.
+typedef struct {
+    char **rows;        // "name,age,gender,added,id" in file order, NULL once deleted
+    size_t count;
+    size_t cap;
+    StrMap slots;       // Row text -> slots holding that row
+    StrMap misses;      // Row text -> deletes that found no such row here
+    uint64_t lsn;       // Highest journal record folded into this set
+    PatientId next_id;  // Above every MRN the snapshot or any record replayed has named
+    size_t applied;     // Journal records applied
+} RowSet;
+
+// One stored line split in place; the strings point into the line itself
+typedef struct {
+    char *name;
+    char *gender;
+    char *added;
+    unsigned age;
+    PatientId id;       // PATIENT_NO_ID in a row written by an older build
+} PatientFields;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Buffer pending;         // Records waiting for the next group commit
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    int fd;
+    size_t size;            // Bytes in the live journal segment
+    bool compacting;
+    bool stopping;
+    bool failed;
+    bool running;
+    pthread_t writer;
+} PatientJournal;
+
+// Append-only storage for record strings. Blocks never move, so the
+// pointers handed out stay valid until the arena is compacted into fresh
+// blocks; the old ones go once no snapshot holds them either.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    atomic_uint refs;       // The store's, plus one per snapshot
+    ArenaBlock *blocks;     // Newest first; only the head takes new strings
+} ArenaBlocks;
+
+typedef struct {
+    ArenaBlocks *held;      // NULL until the first string
+    size_t bytes;           // Reserved from the system
+    size_t dead;            // Taken by strings no record uses any more
+} StringArena;
+
+// The distinct values of a low-cardinality column, each kept once in the
+// arena; rows hold a 16-bit code instead of a pointer. Values are never
+// dropped while the store is open.
+typedef struct {
+    const char **values;    // By code
+    size_t count;
+    size_t cap;
+    uint16_t *slots;        // Open addressing on the value's hash: code + 1, or 0 when empty
+    size_t n_slots;         // Power of two, over twice count
+} InternTable;
+
+// Open addressing from MRN to handle with linear probing. A removed slot is
+// refilled by shifting the rest of its run back, so there are no tombstones
+// and a lookup stops at the first empty slot.
+typedef struct {
+    PatientId id;           // PATIENT_NO_ID when empty
+    PatientHandle handle;
+} IdSlot;
+
+typedef struct {
+    IdSlot *slots;
+    size_t n_slots;         // Power of two, kept at least a quarter empty
+    unsigned shift;         // 64 - log2(n_slots), for the Fibonacci hash
+    size_t count;
+} IdIndex;
+
+// One part file of the archive: admissions of one month, moved there by one
+// patient_store_archive
+typedef struct {
+    int64_t month;          // Start of the month
+    char *path;
+    bool loaded;
+} ArchivePart;
+
+struct PatientStore {
+    char *path;
+    char *tmp_path;
+    char *journal_path;
+    char *compacting_path;
+    char *order_path;
+    char *changes_path;
+
+    // One column per field, indexed by row
+    const char **names;
+    uint16_t *gender_codes;     // Into genders
+    uint16_t *ages;
+    int64_t *added;
+    PatientId *ids;
+    PatientHandle *handles;
+    size_t count;
+    size_t capacity;
+    StringArena strings;
+    InternTable genders;
+    PatientHandle *orders[PATIENT_SORT_ADDED + 1];  // Live handles by key, capacity long; NULL until loaded or asked for
+
+    uint32_t *row_of_handle;    // Indexed by handle; PATIENT_NO_HANDLE once deleted
+    size_t handle_capacity;
+    PatientHandle next_handle;
+    IdIndex id_index;           // MRN -> handle of every live record
+    PatientId next_id;          // Next MRN to give out; above every one given so far
+
+    char *archive_path;         // Directory of the archive parts
+    ArchivePart *parts;         // By month
+    size_t n_parts;
+    uint64_t *archived;         // Bit per handle: the record came from the archive, so it is read-only
+    size_t archived_count;      // Records in the store with that bit set
+
+    uint64_t changes_floor;     // The change history holds every change after this lsn...
+    uint64_t changes_lsn;       // ...up to this one; the journal holds the rest
+
+    TrigramIndex *name_index;   // Case-folded name trigrams -> handles; NULL until built
+    PatientStats *stats;        // Running totals; NULL until tracked
+    ColumnarFile columnar;      // Mapped binary snapshot whose strings rows point into
+    PatientFileFormat format;   // Format the snapshot is rewritten in
+
+    PatientJournal journal;
+};
+
+// Frozen copy of the row columns; the strings are shared with the store,
+// whose arena blocks the snapshot holds on to
+struct PatientSnapshot {
+    const char **names;
+    uint16_t *gender_codes;
+    const char **gender_values;
+    uint16_t *ages;
+    int64_t *added;
+    PatientId *ids;
+    PatientHandle *handles;
+    size_t count;
+    ArenaBlocks *strings;
+};
+
+// --- Buffer Helpers ---
+
+static bool buffer_reserve(Buffer *buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->cap) return true;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra + 1) cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data) return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+static bool buffer_printf(Buffer *buf, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (n < 0 || !buffer_reserve(buf, n)) return false;
+    va_start(args, format);
+    vsnprintf(buf->data + buf->len, n + 1, format, args);
+    va_end(args);
+    buf->len += n;
+    return true;
+}
+
+static void buffer_free(Buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+// Reads a whole file into a NUL-terminated heap buffer
+static char* read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    Buffer buf = {0};
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (!buffer_reserve(&buf, n)) {
+            buffer_free(&buf);
+            fclose(file);
+            return NULL;
+        }
+        memcpy(buf.data + buf.len, chunk, n);
+        buf.len += n;
+    }
+    fclose(file);
+    if (!buffer_reserve(&buf, 0)) return NULL;
+    buf.data[buf.len] = '\0';
+    *length = buf.len;
+    return buf.data;
+}
+
+static bool fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Makes a rename or creation in path's directory durable
+static void fsync_parent(const char *path) {
+    char *dir = strdup(path);
+    char *slash = dir ? strrchr(dir, '/') : NULL;
+    if (slash) *slash = '\0';
+    fsync_path(slash ? dir : ".");
+    free(dir);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// The last newline in [text, text + len), or NULL; memrchr is GNU-only
+static char* last_newline(char *text, size_t len) {
+    while (len > 0) {
+        if (text[--len] == '\n') return text + len;
+    }
+    return NULL;
+}
+
+static bool file_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static char* derive_path(const char *path, const char *suffix, bool strip_extension) {
+    size_t base = strlen(path);
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (strip_extension && dot && (!slash || dot > slash)) base = dot - path;
+    char *derived = malloc(base + strlen(suffix) + 1);
+    if (!derived) return NULL;
+    memcpy(derived, path, base);
+    strcpy(derived + base, suffix);
+    return derived;
+}
+
+// --- String Map ---
+
+static uint64_t hash_string(const char *s) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *s; s++) {
+        hash ^= (unsigned char)*s;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool strmap_grow(StrMap *map) {
+    size_t capacity = map->capacity ? map->capacity * 2 : 64;
+    StrMapEntry *entries = calloc(capacity, sizeof(StrMapEntry));
+    if (!entries) return false;
+    for (size_t i = 0; i < map->capacity; i++) {
+        StrMapEntry *old = &map->entries[i];
+        if (!old->key) continue;
+        size_t j = old->hash & (capacity - 1);
+        while (entries[j].key) j = (j + 1) & (capacity - 1);
+        entries[j] = *old;
+    }
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+    return true;
+}
+
+static StrMapEntry* strmap_lookup(StrMap *map, const char *key, bool create) {
+    if (create && (map->used + 1) * 4 > map->capacity * 3 && !strmap_grow(map)) return NULL;
+    if (map->capacity == 0) return NULL;
+    uint64_t hash = hash_string(key);
+    size_t i = hash & (map->capacity - 1);
+    while (map->entries[i].key) {
+        if (map->entries[i].hash == hash && strcmp(map->entries[i].key, key) == 0) return &map->entries[i];
+        i = (i + 1) & (map->capacity - 1);
+    }
+    if (!create) return NULL;
+    char *copy = strdup(key);
+    if (!copy) return NULL;
+    map->entries[i].key = copy;
+    map->entries[i].hash = hash;
+    map->used++;
+    return &map->entries[i];
+}
+
+static bool strmap_push(StrMap *map, const char *key, uint32_t item) {
+    StrMapEntry *entry = strmap_lookup(map, key, true);
+    if (!entry) return false;
+    if (entry->len == entry->cap) {
+        uint32_t cap = entry->cap ? entry->cap * 2 : 1;
+        uint32_t *items = realloc(entry->items, cap * sizeof(uint32_t));
+        if (!items) return false;
+        entry->items = items;
+        entry->cap = cap;
+    }
+    entry->items[entry->len++] = item;
+    map->total++;
+    return true;
+}
+
+// Bumps a count without keeping items
+static bool strmap_count(StrMap *map, const char *key) {
+    StrMapEntry *entry = strmap_lookup(map, key, true);
+    if (!entry) return false;
+    entry->len++;
+    map->total++;
+    return true;
+}
+
+static void strmap_free(StrMap *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->entries[i].key);
+        free(map->entries[i].items);
+    }
+    free(map->entries);
+    memset(map, 0, sizeof(*map));
+}
+
+// --- Row Text ---
+
+// Appends the canonical "name,age,gender,added,id" line stored on disk. A
+// row without an MRN, as older builds wrote it, keeps its old text so their
+// journal records still name it.
+static bool format_patient_row(Buffer *buf, const char *name, unsigned age, const char *gender, int64_t added,
+                               PatientId id) {
+    char text[PATIENT_ADDED_LEN];
+    patient_time_format(added, text);
+    if (id == PATIENT_NO_ID) return buffer_printf(buf, "%s,%u,%s,%s", name, age, gender, text);
+    return buffer_printf(buf, "%s,%u,%s,%s,%u", name, age, gender, text, id);
+}
+
+// Reads an MRN field; anything that isn't one counts as none
+static PatientId parse_id(const char *text) {
+    char *end;
+    unsigned long id = text ? strtoul(text, &end, 10) : 0;
+    return text && end != text && id <= UINT32_MAX ? (PatientId)id : PATIENT_NO_ID;
+}
+
+// The MRN at the end of a row's text, without splitting it
+static PatientId row_id(const char *row) {
+    for (int commas = 0; (row = strchr(row, ',')); row++) {
+        if (++commas == 4) return parse_id(row + 1);
+    }
+    return PATIENT_NO_ID;
+}
+
+// Reads the lsn and the next MRN from a snapshot header line; next_id is
+// left alone in a header written before there were MRNs
+static void parse_snapshot_header(const char *line, uint64_t *lsn, PatientId *next_id) {
+    char *end;
+    *lsn = strtoull(line + strlen(SNAPSHOT_HEADER), &end, 10);
+    if (strncmp(end, SNAPSHOT_NEXT_ID, strlen(SNAPSHOT_NEXT_ID)) == 0) {
+        *next_id = parse_id(end + strlen(SNAPSHOT_NEXT_ID));
+    }
+}
+
+// Returns the next comma-separated token of [*cursor, end), skipping empty
+// ones the way strtok does, and NUL-terminates it in place
+static char* next_patient_field(char **cursor, char *end) {
+    char *p = *cursor;
+    while (p < end && *p == ',') p++;
+    if (p >= end) return NULL;
+    char *comma = memchr(p, ',', end - p);
+    char *stop = comma ? comma : end;
+    *stop = '\0';
+    *cursor = comma ? comma + 1 : end;
+    return p;
+}
+
+// Splits the stored line [line, end) in place without allocating; *end must
+// be writable. The MRN is a fifth field, which older builds ignore; anything
+// after it is ignored too.
+static bool split_patient_line(char *line, char *end, PatientFields *fields) {
+    while (end > line && (end[-1] == '\r' || end[-1] == '\n')) end--;
+    *end = '\0';
+    char *cursor = line;
+    fields->name = next_patient_field(&cursor, end);
+    char *age_str = next_patient_field(&cursor, end);
+    fields->gender = next_patient_field(&cursor, end);
+    fields->added = next_patient_field(&cursor, end);
+    fields->id = parse_id(next_patient_field(&cursor, end));
+    if (!fields->name || !fields->gender || !fields->added || !age_str) return false;
+    long age = atol(age_str);
+    fields->age = age < 0 ? 0 : age > UINT16_MAX ? UINT16_MAX : (unsigned)age;
+    return true;
+}
+
+// Names may not carry the on-disk field and record separators
+static char* sanitize_field(const char *text) {
+    char *copy = strdup(text);
+    if (!copy) return NULL;
+    for (char *p = copy; *p; p++) {
+        if (*p == ',' || *p == '\t' || *p == '\r' || *p == '\n') *p = ' ';
+    }
+    return copy;
+}
+
+// --- Row Set ---
+
+static void row_set_free(RowSet *set) {
+    for (size_t i = 0; i < set->count; i++) free(set->rows[i]);
+    free(set->rows);
+    strmap_free(&set->slots);
+    strmap_free(&set->misses);
+    memset(set, 0, sizeof(*set));
+}
+
+// Takes ownership of row
+static bool row_set_add(RowSet *set, char *row) {
+    if (set->count == set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 1024;
+        char **rows = realloc(set->rows, cap * sizeof(char*));
+        if (!rows) {
+            free(row);
+            return false;
+        }
+        set->rows = rows;
+        set->cap = cap;
+    }
+    if (!strmap_push(&set->slots, row, set->count)) {
+        free(row);
+        return false;
+    }
+    set->rows[set->count++] = row;
+    return true;
+}
+
+// Frees one copy of row and returns the slot it occupied, or -1 if absent.
+// Misses are counted so a set replayed without its snapshot knows which
+// snapshot rows the journal removed.
+static long row_set_release(RowSet *set, const char *row) {
+    StrMapEntry *entry = strmap_lookup(&set->slots, row, false);
+    if (!entry || entry->len == 0) {
+        strmap_count(&set->misses, row);
+        return -1;
+    }
+    uint32_t slot = entry->items[--entry->len];
+    set->slots.total--;
+    free(set->rows[slot]);
+    set->rows[slot] = NULL;
+    return slot;
+}
+
+// Loads a snapshot in either format into set, picking up its lsn and next MRN
+static void row_set_load_snapshot(RowSet *set, const char *path) {
+    if (columnar_file_detect(path)) {
+        ColumnarFile file;
+        if (columnar_file_open(path, &file) != 0) return;
+        set->lsn = file.lsn;
+        set->next_id = file.next_id;
+        Buffer row = {0};
+        for (size_t i = 0; i < file.count; i++) {
+            row.len = 0;
+            if (format_patient_row(&row, columnar_file_name(&file, i), file.ages[i], columnar_file_gender(&file, i),
+                                   file.added[i], file.ids ? file.ids[i] : PATIENT_NO_ID)) {
+                row_set_add(set, strdup(row.data));
+            }
+        }
+        buffer_free(&row);
+        columnar_file_close(&file);
+        return;
+    }
+    size_t length;
+    char *contents = read_file(path, &length);
+    if (!contents) return;
+    Buffer row = {0};
+    char *line = contents;
+    while (line < contents + length) {
+        char *end = memchr(line, '\n', contents + length - line);
+        if (!end) end = contents + length;
+        if (strncmp(line, SNAPSHOT_HEADER, strlen(SNAPSHOT_HEADER)) == 0) {
+            parse_snapshot_header(line, &set->lsn, &set->next_id);
+        } else {
+            // Normalise so journal records written by this build match byte for byte
+            PatientFields f;
+            if (split_patient_line(line, end, &f)) {
+                row.len = 0;
+                if (format_patient_row(&row, f.name, f.age, f.gender, patient_time_parse(f.added), f.id)) {
+                    row_set_add(set, strdup(row.data));
+                }
+            }
+        }
+        line = end + 1;
+    }
+    buffer_free(&row);
+    free(contents);
+}
+
+// Splits a journal record in place into lsn, op, row and new row; returns
+// how many fields it has, or 0 if it isn't a record
+static int split_journal_record(char *line, char *fields[4]) {
+    int n = 0;
+    for (char *field = line; field && n < 4; n++) {
+        fields[n] = field;
+        field = (n < 3) ? strchr(field, '\t') : NULL;
+        if (field) *field++ = '\0';
+    }
+    return n >= 3 && strlen(fields[1]) == 1 ? n : 0;
+}
+
+// Applies the records of one journal segment that are newer than set->lsn.
+// Every record counts towards set->next_id, so the MRN of a patient added
+// and deleted since the snapshot isn't given out again. Returns the length
+// of the intact prefix so a torn tail can be cut off.
+static size_t row_set_replay_journal(RowSet *set, const char *path, uint64_t *max_lsn) {
+    size_t length = 0, intact = 0;
+    char *contents = read_file(path, &length);
+    if (!contents) return 0;
+    uint64_t base_lsn = set->lsn;
+    char *line = contents;
+    while (line < contents + length) {
+        char *end = memchr(line, '\n', contents + length - line);
+        if (!end) break; // Torn final record from a crash mid-write
+        *end = '\0';
+        intact = end + 1 - contents;
+
+        char *fields[4];
+        int n = split_journal_record(line, fields);
+        if (n >= 3) {
+            uint64_t lsn = strtoull(fields[0], NULL, 10);
+            if (lsn > *max_lsn) *max_lsn = lsn;
+            for (int i = 2; i < n; i++) {
+                PatientId id = row_id(fields[i]);
+                if (id >= set->next_id) set->next_id = id + 1;
+            }
+            if (lsn > base_lsn) {
+                switch (fields[1][0]) {
+                case JOURNAL_ADD:
+                    row_set_add(set, strdup(fields[2]));
+                    break;
+                case JOURNAL_DELETE:
+                    row_set_release(set, fields[2]);
+                    break;
+                case JOURNAL_UPDATE:
+                    if (n == 4) {
+                        long slot = row_set_release(set, fields[2]);
+                        if (slot < 0) {
+                            row_set_add(set, strdup(fields[3]));
+                        } else {
+                            set->rows[slot] = strdup(fields[3]);
+                            if (set->rows[slot]) strmap_push(&set->slots, fields[3], slot);
+                        }
+                    }
+                    break;
+                }
+                if (lsn > set->lsn) set->lsn = lsn;
+                set->applied++;
+            }
+        }
+        line = end + 1;
+    }
+    free(contents);
+    return intact;
+}
+
+static bool write_text_snapshot(const char *path, const char *tmp_path, uint64_t lsn, PatientId next_id,
+                                bool (*next_row)(void *state, Buffer *row), void *state) {
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return false;
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    fprintf(file, SNAPSHOT_HEADER "%llu" SNAPSHOT_NEXT_ID "%u\n", (unsigned long long)lsn, next_id);
+    Buffer row = {0};
+    while (next_row(state, &row)) {
+        fwrite(row.data, 1, row.len, file);
+        fputc('\n', file);
+        row.len = 0;
+    }
+    buffer_free(&row);
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_binary_snapshot(const char *path, const char *tmp_path, uint64_t lsn, PatientId next_id,
+                                  bool (*next_row)(void *state, Buffer *row), void *state) {
+    ColumnarWriter *writer = columnar_writer_new();
+    if (!writer) return false;
+    Buffer row = {0};
+    bool ok = true;
+    while (ok && next_row(state, &row)) {
+        PatientFields f;
+        if (split_patient_line(row.data, row.data + row.len, &f)) {
+            ok = columnar_writer_add(writer, f.name, f.age, f.gender, patient_time_parse(f.added), f.id);
+        }
+        row.len = 0;
+    }
+    buffer_free(&row);
+    ok = ok && columnar_writer_finish(writer, path, tmp_path, lsn, next_id);
+    columnar_writer_free(writer);
+    return ok;
+}
+
+// Writes rows to tmp_path in the given format, syncs them and renames the
+// file over path
+static bool write_snapshot(const char *path, const char *tmp_path, uint64_t lsn, PatientId next_id,
+                           PatientFileFormat format, bool (*next_row)(void *state, Buffer *row), void *state) {
+    bool ok = format == PATIENT_FORMAT_BINARY ? write_binary_snapshot(path, tmp_path, lsn, next_id, next_row, state)
+                                              : write_text_snapshot(path, tmp_path, lsn, next_id, next_row, state);
+    if (!ok) return false;
+    fsync_parent(path);
+    return true;
+}
+
+typedef struct {
+    RowSet *set;
+    size_t next;
+} RowSetCursor;
+
+static bool row_set_next_row(void *state, Buffer *row) {
+    RowSetCursor *cursor = state;
+    while (cursor->next < cursor->set->count) {
+        const char *text = cursor->set->rows[cursor->next++];
+        if (text) return buffer_printf(row, "%s", text);
+    }
+    return false;
+}
+
+// Genders are interned; rows hold their code
+static inline const char* store_gender(const PatientStore *store, size_t row) {
+    return store->genders.values[store->gender_codes[row]];
+}
+
+// --- Archive Bits ---
+//
+// Records loaded from the archive keep a bit by handle: they are read-only,
+// and snapshots leave them out since their part files hold them already.
+
+// Whether handle came from the archive
+static bool store_is_archived(const PatientStore *store, PatientHandle handle) {
+    return store->archived && (store->archived[handle / 64] >> (handle % 64) & 1);
+}
+
+static void store_set_archived(PatientStore *store, PatientHandle handle, bool archived) {
+    uint64_t bit = (uint64_t)1 << (handle % 64);
+    if (archived) {
+        store->archived[handle / 64] |= bit;
+        store->archived_count++;
+    } else {
+        store->archived[handle / 64] &= ~bit;
+        store->archived_count--;
+    }
+}
+
+// The bits are only allocated once a record is first archived or loaded
+static bool store_track_archived(PatientStore *store) {
+    if (store->archived) return true;
+    size_t words = (store->handle_capacity ? store->handle_capacity : 64) / 64;
+    store->archived = calloc(words, sizeof(uint64_t));
+    return store->archived != NULL;
+}
+
+// --- Sort Orders ---
+//
+// The store keeps every live handle sorted by name, by age and by admission
+// time, so a view can show any of those sorts without sorting. An add or
+// delete binary-searches its place and shifts the rest of the array along;
+// an update moves a record only in the orders whose key it changed. Each
+// snapshot the store writes gets the orders saved next to it (see
+// order_file.h), and a load maps them back onto handles.
+
+// Sort key of one record, flattened so comparisons don't chase rows
+typedef struct {
+    const char *text;
+    int64_t number;
+    PatientHandle handle;   // Or a row number, when sorting rows read back from a file
+} SortEntry;
+
+// Position of each key's section in an order file
+static const PatientSortKey ORDER_FILE_SORT_KEYS[ORDER_FILE_KEYS] = {
+    PATIENT_SORT_NAME, PATIENT_SORT_AGE, PATIENT_SORT_ADDED
+};
+
+static int compare_sort_text(const void *a, const void *b) {
+    const SortEntry *x = a, *y = b;
+    int order = strcasecmp(x->text, y->text);
+    if (!order) order = strcmp(x->text, y->text);
+    return order ? order : (x->handle > y->handle) - (x->handle < y->handle);
+}
+
+static int compare_sort_number(const void *a, const void *b) {
+    const SortEntry *x = a, *y = b;
+    if (x->number != y->number) return x->number < y->number ? -1 : 1;
+    return (x->handle > y->handle) - (x->handle < y->handle);
+}
+
+static int (*sort_compare(PatientSortKey key))(const void*, const void*) {
+    return key == PATIENT_SORT_AGE || key == PATIENT_SORT_ADDED ? compare_sort_number : compare_sort_text;
+}
+
+static void sort_entry(const PatientStore *store, PatientSortKey key, PatientHandle handle, SortEntry *entry) {
+    size_t row = store->row_of_handle[handle];
+    entry->handle = handle;
+    entry->number = key == PATIENT_SORT_ADDED ? store->added[row] : store->ages[row];
+    entry->text = key == PATIENT_SORT_GENDER ? store_gender(store, row) : store->names[row];
+}
+
+// First position in order[0..count) that doesn't sort before handle
+static size_t order_position(const PatientStore *store, PatientSortKey key, const PatientHandle *order, size_t count,
+                             PatientHandle handle) {
+    int (*compare)(const void*, const void*) = sort_compare(key);
+    SortEntry target, probe;
+    sort_entry(store, key, handle, &target);
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        sort_entry(store, key, order[mid], &probe);
+        if (compare(&probe, &target) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static void order_drop(PatientStore *store, PatientSortKey key) {
+    free(store->orders[key]);
+    store->orders[key] = NULL;
+}
+
+// Inserts a record whose columns are already filled into an order of count handles
+static void order_insert(PatientStore *store, PatientSortKey key, size_t count, PatientHandle handle) {
+    PatientHandle *order = store->orders[key];
+    size_t at = order_position(store, key, order, count, handle);
+    memmove(order + at + 1, order + at, (count - at) * sizeof(PatientHandle));
+    order[at] = handle;
+}
+
+// Removes a record while its columns still hold the key it was inserted with
+static void order_remove(PatientStore *store, PatientSortKey key, size_t count, PatientHandle handle) {
+    PatientHandle *order = store->orders[key];
+    size_t at = order_position(store, key, order, count, handle);
+    if (at == count || order[at] != handle) {
+        // Out of step; patient_store_order sorts afresh
+        order_drop(store, key);
+        return;
+    }
+    memmove(order + at, order + at + 1, (count - at - 1) * sizeof(PatientHandle));
+}
+
+// Merges delta, sorted by key, into an order of count handles with room for
+// it. Slotting in from the back moves each row once; a small delta finds its
+// places by binary search, a large one by comparing its way along.
+static void order_merge(const PatientStore *store, PatientSortKey key, PatientHandle *order, size_t count,
+                        const PatientHandle *delta, size_t n_delta) {
+    if (n_delta * ORDER_MERGE_SCAN_SHARE >= count) {
+        int (*compare)(const void*, const void*) = sort_compare(key);
+        SortEntry kept, added;
+        size_t i = count, out = count + n_delta;
+        for (size_t d = n_delta; d > 0;) {
+            if (i > 0) {
+                sort_entry(store, key, order[i - 1], &kept);
+                sort_entry(store, key, delta[d - 1], &added);
+            }
+            if (i > 0 && compare(&kept, &added) > 0) order[--out] = order[--i];
+            else order[--out] = delta[--d];
+        }
+        return;
+    }
+    size_t end = count;
+    for (size_t d = n_delta; d-- > 0;) {
+        size_t at = order_position(store, key, order, end, delta[d]);
+        memmove(order + at + d + 1, order + at, (end - at) * sizeof(PatientHandle));
+        order[at + d] = delta[d];
+        end = at;
+    }
+}
+
+// Every live handle sorted by key, in an array of capacity entries
+static PatientHandle* order_build(const PatientStore *store, PatientSortKey key) {
+    PatientHandle *order = malloc((store->capacity ? store->capacity : 1) * sizeof(PatientHandle));
+    if (!order) return NULL;
+    memcpy(order, store->handles, store->count * sizeof(PatientHandle));
+    if (patient_store_sort(store, key, order, store->count) != 0) {
+        free(order);
+        return NULL;
+    }
+    return order;
+}
+
+// Takes up the orders saved with the snapshot just loaded. handle_of_row
+// gives the handle each snapshot row became (PATIENT_NO_HANDLE if the journal
+// removed it); the handles from first_delta on came from the journal and are
+// merged in.
+static void store_adopt_orders(PatientStore *store, const OrderFile *file, const PatientHandle *handle_of_row,
+                               PatientHandle first_delta) {
+    size_t n_delta = 0;
+    PatientHandle *delta = malloc((store->next_handle - first_delta + 1) * sizeof(PatientHandle));
+    if (!delta) return;
+    for (PatientHandle handle = first_delta; handle < store->next_handle; handle++) {
+        if (store->row_of_handle[handle] != PATIENT_NO_HANDLE) delta[n_delta++] = handle;
+    }
+    for (int k = 0; k < ORDER_FILE_KEYS; k++) {
+        PatientSortKey key = ORDER_FILE_SORT_KEYS[k];
+        PatientHandle *order = malloc((store->capacity ? store->capacity : 1) * sizeof(PatientHandle));
+        if (!order || patient_store_sort(store, key, delta, n_delta) != 0) {
+            free(order);
+            break;
+        }
+        size_t count = 0;
+        for (uint64_t i = 0; i < file->rows && count < store->count; i++) {
+            PatientHandle handle = handle_of_row[file->orders[k][i]];
+            if (handle != PATIENT_NO_HANDLE) order[count++] = handle;
+        }
+        if (count + n_delta == store->count) order_merge(store, key, order, count, delta, n_delta);
+        count += n_delta;
+        if (count == store->count) {
+            store->orders[key] = order;
+        } else {
+            free(order);
+        }
+    }
+    free(delta);
+}
+
+// Saves the orders of the snapshot just written to path, whose rows went out
+// in handle order, archived ones left out
+static void store_write_orders(PatientStore *store, const char *path, uint64_t lsn) {
+    char *order_path = derive_path(path, ORDER_SUFFIX, false);
+    char *tmp_path = order_path ? derive_path(order_path, ".tmp", false) : NULL;
+    uint32_t *file_row = malloc((store->next_handle ? store->next_handle : 1) * sizeof(uint32_t));
+    uint32_t *orders[ORDER_FILE_KEYS] = {0};
+    size_t rows = store->count - store->archived_count;
+    bool ok = tmp_path && file_row;
+    for (int k = 0; ok && k < ORDER_FILE_KEYS; k++) {
+        ok = patient_store_order(store, ORDER_FILE_SORT_KEYS[k]) != NULL
+             && (orders[k] = malloc((rows ? rows : 1) * sizeof(uint32_t))) != NULL;
+    }
+    struct stat st;
+    ok = ok && stat(path, &st) == 0;
+    if (ok) {
+        uint32_t rank = 0;
+        for (PatientHandle handle = 0; handle < store->next_handle; handle++) {
+            if (store->row_of_handle[handle] != PATIENT_NO_HANDLE && !store_is_archived(store, handle)) {
+                file_row[handle] = rank++;
+            }
+        }
+        for (int k = 0; k < ORDER_FILE_KEYS; k++) {
+            const PatientHandle *order = store->orders[ORDER_FILE_SORT_KEYS[k]];
+            size_t n = 0;
+            for (size_t i = 0; i < store->count; i++) {
+                if (!store_is_archived(store, order[i])) orders[k][n++] = file_row[order[i]];
+            }
+        }
+        ok = order_file_write(order_path, tmp_path, lsn, st.st_size, rows, orders);
+    }
+    // A stale order file is ignored at load, but there's no need to keep one
+    if (!ok && order_path) unlink(order_path);
+    for (int k = 0; k < ORDER_FILE_KEYS; k++) free(orders[k]);
+    free(file_row);
+    free(tmp_path);
+    free(order_path);
+}
+
+// Saves the orders of the snapshot a compaction just wrote from set. The
+// rows are split in place, so the set is only good for freeing afterwards.
+static void row_set_write_orders(RowSet *set, const char *path, const char *order_path) {
+    size_t n = 0;
+    for (size_t i = 0; i < set->count; i++) n += set->rows[i] != NULL;
+    char *tmp_path = derive_path(order_path, ".tmp", false);
+    SortEntry *entries = malloc((n ? n : 1) * sizeof(SortEntry));
+    PatientFields *fields = malloc((n ? n : 1) * sizeof(PatientFields));
+    uint32_t *orders[ORDER_FILE_KEYS] = {0};
+    bool ok = tmp_path && entries && fields;
+    for (int k = 0; ok && k < ORDER_FILE_KEYS; k++) ok = (orders[k] = malloc((n ? n : 1) * sizeof(uint32_t))) != NULL;
+    for (size_t i = 0, row = 0; ok && i < set->count; i++) {
+        char *text = set->rows[i];
+        if (text) ok = split_patient_line(text, text + strlen(text), &fields[row++]);
+    }
+    struct stat st;
+    ok = ok && stat(path, &st) == 0;
+    for (int k = 0; ok && k < ORDER_FILE_KEYS; k++) {
+        PatientSortKey key = ORDER_FILE_SORT_KEYS[k];
+        for (size_t row = 0; row < n; row++) {
+            entries[row].handle = row;
+            entries[row].text = fields[row].name;
+            entries[row].number = key == PATIENT_SORT_ADDED ? patient_time_parse(fields[row].added) : fields[row].age;
+        }
+        qsort(entries, n, sizeof(SortEntry), sort_compare(key));
+        for (size_t i = 0; i < n; i++) orders[k][i] = entries[i].handle;
+    }
+    ok = ok && order_file_write(order_path, tmp_path, set->lsn, st.st_size, n, orders);
+    if (!ok) unlink(order_path);
+    for (int k = 0; k < ORDER_FILE_KEYS; k++) free(orders[k]);
+    free(fields);
+    free(entries);
+    free(tmp_path);
+}
+
+// --- Change History ---
+//
+// A journal segment folded into a snapshot isn't thrown away: its records
+// are first appended to the change history (patients.journal ->
+// patients.changes), behind a header naming the floor, the lsn after which
+// the history misses nothing. The history and the journal together then
+// hold every change since the floor, which is what change exports are
+// worked out from (see patient_store_changes). Records the history already
+// holds are skipped, so a segment folded twice after a crash goes in once.
+// Past CHANGES_KEEP_BYTES the older half is dropped and the floor moves up.
+// Only compactions touch the history, so it needs no lock of its own.
+
+// The lsn of the journal record in [line, end), or 0 if it isn't one
+static uint64_t record_lsn(const char *line, const char *end) {
+    uint64_t lsn = 0;
+    const char *p = line;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) lsn = lsn * 10 + (*p - '0');
+    return p > line && p < end && *p == '\t' ? lsn : 0;
+}
+
+// Offset of the first record after lsn in a history of size bytes, found
+// by bisection since its records are in lsn order
+static size_t history_seek(const char *data, size_t size, uint64_t lsn) {
+    // low and high are line starts with the answer between them
+    size_t low = 0, high = size;
+    while (low < high) {
+        // The first line starting from the middle on, or else low's
+        size_t mid = low + (high - low) / 2, line = mid;
+        if (mid > low && data[mid - 1] != '\n') {
+            const char *newline = memchr(data + mid, '\n', high - mid);
+            line = newline ? (size_t)(newline + 1 - data) : high;
+        }
+        if (line >= high) line = low;
+        const char *end = memchr(data + line, '\n', size - line);
+        if (!end) end = data + size;
+        if (record_lsn(data + line, end) > lsn) high = line;
+        else low = end < data + size ? (size_t)(end + 1 - data) : size;
+    }
+    return low;
+}
+
+// Picks up the floor and the last record of the history, cutting off a torn
+// final line. Without a history, every change since the snapshot is still
+// in the journal.
+static void history_open(PatientStore *store, uint64_t snapshot_lsn) {
+    store->changes_floor = store->changes_lsn = snapshot_lsn;
+    int fd = open(store->changes_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    char head[64] = {0};
+    size_t header_len = strlen(CHANGES_HEADER);
+    bool valid = fstat(fd, &st) == 0 && pread(fd, head, sizeof(head) - 1, 0) > (ssize_t)header_len
+                 && memcmp(head, CHANGES_HEADER, header_len) == 0 && strchr(head, '\n');
+    uint64_t floor = valid ? strtoull(head + header_len, NULL, 10) : 0, last = 0;
+    size_t size = valid ? st.st_size : 0, kept = 0;
+    char *tail = NULL;
+    for (size_t window = CHANGES_TAIL_BYTES; valid; window *= 4) {
+        if (window > size) window = size;
+        char *grown = realloc(tail, window);
+        if (!grown) break;
+        tail = grown;
+        if (pread(fd, tail, window, size - window) != (ssize_t)window) break;
+        char *stop = last_newline(tail, window);
+        char *start = stop ? last_newline(tail, stop - tail) : NULL;
+        if (start || window == size) {
+            kept = stop ? size - window + (stop + 1 - tail) : 0;
+            if (stop) last = record_lsn(start ? start + 1 : tail, stop);
+            break;
+        }
+    }
+    free(tail);
+    if (kept == 0) {
+        // Not a history this build wrote, or beheaded: start a new one
+        close(fd);
+        unlink(store->changes_path);
+        return;
+    }
+    if (kept < size && ftruncate(fd, kept) != 0) fprintf(stderr, "Could not trim the torn tail of %s\n", store->changes_path);
+    close(fd);
+    store->changes_floor = floor;
+    store->changes_lsn = last > floor ? last : floor;
+}
+
+// Drops the older half of the history, moving the floor up to the last
+// record dropped
+static void history_prune(PatientStore *store) {
+    size_t length;
+    char *contents = read_file(store->changes_path, &length);
+    char *tmp_path = derive_path(store->changes_path, ".tmp", false);
+    char *cut = contents ? memchr(contents + length / 2, '\n', length - length / 2) : NULL;
+    char *line = cut ? last_newline(contents, cut - contents) : NULL;
+    uint64_t floor = line ? record_lsn(line + 1, cut) : 0;
+    if (tmp_path && floor > store->changes_floor) {
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        Buffer header = {0};
+        bool ok = fd >= 0 && buffer_printf(&header, CHANGES_HEADER "%llu\n", (unsigned long long)floor)
+                  && write_all(fd, header.data, header.len)
+                  && write_all(fd, cut + 1, contents + length - (cut + 1)) && fsync(fd) == 0;
+        if (fd >= 0 && close(fd) != 0) ok = false;
+        if (ok && rename(tmp_path, store->changes_path) == 0) {
+            fsync_parent(store->changes_path);
+            store->changes_floor = floor;
+        } else {
+            unlink(tmp_path);
+        }
+        buffer_free(&header);
+    }
+    free(tmp_path);
+    free(contents);
+}
+
+// Appends records, the last of which is last, to the history (creating it
+// with the current floor), and syncs it. A failed write is cut back off.
+static bool history_append(PatientStore *store, const char *records, size_t len, uint64_t last) {
+    int fd = open(store->changes_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    Buffer header = {0};
+    if (ok && st.st_size == 0) {
+        ok = buffer_printf(&header, CHANGES_HEADER "%llu\n", (unsigned long long)store->changes_floor)
+             && write_all(fd, header.data, header.len);
+    }
+    ok = ok && write_all(fd, records, len) && fsync(fd) == 0;
+    if (!ok && ftruncate(fd, st.st_size) != 0) unlink(store->changes_path);
+    close(fd);
+    size_t size = st.st_size + header.len + len;
+    buffer_free(&header);
+    if (!ok) return false;
+    if (st.st_size == 0) fsync_parent(store->changes_path);
+    store->changes_lsn = last;
+    if (size > CHANGES_KEEP_BYTES) history_prune(store);
+    return true;
+}
+
+// Appends the records of a journal segment that the history lacks, before
+// the segment is dropped; false if they couldn't be kept
+static bool history_fold(PatientStore *store, const char *segment) {
+    size_t length = 0;
+    char *contents = read_file(segment, &length);
+    if (!contents) return !file_exists(segment);
+    // A segment holds its records in lsn order; a torn final one is left out
+    char *start = NULL, *end = contents;
+    uint64_t last = store->changes_lsn;
+    for (char *line = contents; line < contents + length;) {
+        char *newline = memchr(line, '\n', contents + length - line);
+        if (!newline) break;
+        uint64_t lsn = record_lsn(line, newline);
+        if (lsn > last) {
+            if (!start) start = line;
+            last = lsn;
+            end = newline + 1;
+        }
+        line = newline + 1;
+    }
+    bool ok = !start || history_append(store, start, end - start, last);
+    free(contents);
+    return ok;
+}
+
+// --- Patient Journal ---
+//
+// Every add, edit and delete appends one record to the journal instead of
+// rewriting the snapshot, so a save costs the same no matter how many
+// patients there are. Records look like
+//
+//     <lsn> TAB <op> TAB <row> [TAB <new row>] NEWLINE
+//
+// A writer thread takes everything queued behind the previous fsync and
+// commits it with a single write + fsync (group commit). Once the journal
+// passes JOURNAL_COMPACT_BYTES it is renamed aside and a background thread
+// folds it into a new snapshot that replaces the old one through an atomic
+// rename. The snapshot's first line records the last lsn it contains, so
+// replaying a journal that was already folded in is harmless.
+
+static void* journal_compact_thread(void *data) {
+    PatientStore *store = data;
+    RowSet set = {0};
+    uint64_t max_lsn = 0;
+    LatencyProbe probe = latency_begin(LATENCY_COMPACT);
+    row_set_load_snapshot(&set, store->path);
+    row_set_replay_journal(&set, store->compacting_path, &max_lsn);
+    RowSetCursor cursor = { &set, 0 };
+    if (write_snapshot(store->path, store->tmp_path, set.lsn, set.next_id, store->format, row_set_next_row, &cursor)) {
+        row_set_write_orders(&set, store->path, store->order_path);
+        if (history_fold(store, store->compacting_path)) unlink(store->compacting_path);
+        else fprintf(stderr, "Could not add %s to the change history; kept for the next attempt\n", store->compacting_path);
+    } else {
+        fprintf(stderr, "Journal compaction failed; %s kept for the next attempt\n", store->compacting_path);
+    }
+    row_set_free(&set);
+    latency_end(probe);
+
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_lock(&journal->lock);
+    journal->compacting = false;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+// Called on the writer thread with the journal lock held, between two commits
+static void journal_start_compaction(PatientStore *store) {
+    PatientJournal *journal = &store->journal;
+    if (journal->compacting) return;
+    if (!file_exists(store->compacting_path)) {
+        close(journal->fd);
+        bool rotated = rename(store->journal_path, store->compacting_path) == 0;
+        journal->fd = open(store->journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (journal->fd < 0) journal->failed = true;
+        if (!rotated) return;
+        journal->size = 0;
+    }
+    pthread_t compactor;
+    journal->compacting = true;
+    if (pthread_create(&compactor, NULL, journal_compact_thread, store) != 0) {
+        journal->compacting = false;
+        return;
+    }
+    pthread_detach(compactor);
+}
+
+static void* journal_writer_thread(void *data) {
+    PatientStore *store = data;
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_lock(&journal->lock);
+    for (;;) {
+        while (journal->pending.len == 0 && !journal->stopping) {
+            pthread_cond_wait(&journal->cond, &journal->lock);
+        }
+        if (journal->pending.len == 0) break;
+
+        // Everything queued so far rides on this one write + fsync
+        Buffer batch = journal->pending;
+        uint64_t batch_lsn = journal->next_lsn - 1;
+        memset(&journal->pending, 0, sizeof(Buffer));
+        int fd = journal->fd;
+        pthread_mutex_unlock(&journal->lock);
+
+        bool ok = fd >= 0;
+        for (size_t done = 0; ok && done < batch.len;) {
+            ssize_t n = write(fd, batch.data + done, batch.len - done);
+            if (n < 0 && errno == EINTR) continue;
+            ok = n > 0;
+            if (ok) done += n;
+        }
+        ok = ok && fsync(fd) == 0;
+
+        pthread_mutex_lock(&journal->lock);
+        if (ok) {
+            journal->durable_lsn = batch_lsn;
+            journal->size += batch.len;
+        } else {
+            journal->failed = true;
+        }
+        buffer_free(&batch);
+        pthread_cond_broadcast(&journal->cond);
+        if (ok && journal->size >= JOURNAL_COMPACT_BYTES) journal_start_compaction(store);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+static void journal_open(PatientStore *store, uint64_t next_lsn) {
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    journal->next_lsn = next_lsn;
+    journal->durable_lsn = next_lsn - 1;
+    journal->fd = open(store->journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    journal->failed = journal->fd < 0;
+    struct stat st;
+    if (journal->fd >= 0 && fstat(journal->fd, &st) == 0) journal->size = st.st_size;
+    journal->running = pthread_create(&journal->writer, NULL, journal_writer_thread, store) == 0;
+}
+
+// Queues one mutation for the next group commit
+static int journal_append(PatientStore *store, char op, const char *row, const char *new_row) {
+    PatientJournal *journal = &store->journal;
+    if (!store->path) return 0;     // A store in memory only keeps no journal
+    pthread_mutex_lock(&journal->lock);
+    bool ok = !journal->failed && journal->running;
+    if (ok) {
+        size_t mark = journal->pending.len;
+        ok = buffer_printf(&journal->pending, "%llu\t%c\t%s", (unsigned long long)journal->next_lsn, op, row)
+             && (!new_row || buffer_printf(&journal->pending, "\t%s", new_row))
+             && buffer_printf(&journal->pending, "\n");
+        if (ok) {
+            journal->next_lsn++;
+            pthread_cond_signal(&journal->cond);
+        } else {
+            journal->pending.len = mark;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+// Queues count records at once, so they share one group commit. rows holds
+// their row texts, each ending in a newline.
+static int journal_append_batch(PatientStore *store, char op, const Buffer *rows, size_t count) {
+    PatientJournal *journal = &store->journal;
+    if (!store->path || count == 0) return 0;
+    pthread_mutex_lock(&journal->lock);
+    bool ok = !journal->failed && journal->running;
+    if (ok) {
+        size_t mark = journal->pending.len;
+        uint64_t lsn = journal->next_lsn;
+        for (const char *row = rows->data; ok && row < rows->data + rows->len; lsn++) {
+            const char *newline = strchr(row, '\n');
+            ok = buffer_printf(&journal->pending, "%llu\t%c\t%.*s\n", (unsigned long long)lsn, op,
+                               (int)(newline - row), row);
+            row = newline + 1;
+        }
+        if (ok) {
+            journal->next_lsn = lsn;
+            pthread_cond_signal(&journal->cond);
+        } else {
+            journal->pending.len = mark;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+// Flushes outstanding records and waits for a running compaction to finish
+static void journal_close(PatientStore *store) {
+    PatientJournal *journal = &store->journal;
+    if (journal->running) {
+        pthread_mutex_lock(&journal->lock);
+        journal->stopping = true;
+        pthread_cond_broadcast(&journal->cond);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->writer, NULL);
+        journal->running = false;
+    }
+    pthread_mutex_lock(&journal->lock);
+    while (journal->compacting) pthread_cond_wait(&journal->cond, &journal->lock);
+    pthread_mutex_unlock(&journal->lock);
+    if (journal->fd >= 0) close(journal->fd);
+    journal->fd = -1;
+    buffer_free(&journal->pending);
+    pthread_cond_destroy(&journal->cond);
+    pthread_mutex_destroy(&journal->lock);
+}
+
+// --- Parallel Snapshot Loader ---
+//
+// The snapshot is mapped copy-on-write and cut into line-aligned chunks,
+// one per core. Each worker splits its lines in place (NUL-terminating the
+// fields inside the mapping), so parsing allocates nothing per field; the
+// store copies the strings when the rows are inserted.
+
+typedef struct {
+    char *start;
+    char *end;
+    PatientFields *rows;    // Pointing into the mapping
+    size_t count;
+    size_t cap;
+    char *tail;             // Copy of a final line with no newline, which can't be terminated in place
+    size_t bad_lines;
+    uint64_t lsn;           // Set by the chunk that holds the snapshot header...
+    PatientId next_id;      // ...with the next MRN, if it names one
+    PatientId max_id;       // Highest MRN on the chunk's rows
+} LoaderChunk;
+
+static void* loader_parse_chunk(void *data) {
+    LoaderChunk *chunk = data;
+    chunk->cap = (chunk->end - chunk->start) / 32 + 1;
+    chunk->rows = malloc(chunk->cap * sizeof(PatientFields));
+    if (!chunk->rows) chunk->cap = 0;
+    char *line = chunk->start;
+    size_t header_len = strlen(SNAPSHOT_HEADER);
+    while (line < chunk->end) {
+        char *newline = memchr(line, '\n', chunk->end - line);
+        char *end = newline ? newline : chunk->end;
+        if (!newline) {
+            chunk->tail = strndup(line, end - line);
+            if (!chunk->tail) break;
+            line = chunk->tail;
+            end = line + strlen(line);
+        }
+        if ((size_t)(end - line) >= header_len && memcmp(line, SNAPSHOT_HEADER, header_len) == 0) {
+            *end = '\0';
+            parse_snapshot_header(line, &chunk->lsn, &chunk->next_id);
+        } else if (end > line && !(end - line == 1 && *line == '\r')) {
+            PatientFields fields;
+            if (!split_patient_line(line, end, &fields)) {
+                chunk->bad_lines++;
+            } else {
+                if (chunk->count == chunk->cap) {
+                    size_t cap = chunk->cap ? chunk->cap * 2 : 1024;
+                    PatientFields *rows = realloc(chunk->rows, cap * sizeof(PatientFields));
+                    if (!rows) break;
+                    chunk->rows = rows;
+                    chunk->cap = cap;
+                }
+                chunk->rows[chunk->count++] = fields;
+                if (fields.id > chunk->max_id) chunk->max_id = fields.id;
+            }
+        }
+        if (!newline) break;
+        line = end + 1;
+    }
+    return NULL;
+}
+
+static unsigned online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+// Maps the text snapshot and parses it on one thread per chunk
+static bool load_text_snapshot(const char *path, char **map, size_t *size, LoaderChunk **chunks_out,
+                               unsigned *n_chunks_out) {
+    *map = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (*map == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            *map = NULL;
+            errno = saved;
+            return false;
+        }
+        madvise(*map, *size, MADV_SEQUENTIAL);
+    }
+    if (fd >= 0) close(fd);
+
+    // Chunk boundaries are nudged forward to the next newline
+    unsigned n_chunks = online_cpus();
+    if (n_chunks > *size / LOADER_MIN_CHUNK) n_chunks = *size / LOADER_MIN_CHUNK;
+    if (n_chunks == 0) n_chunks = 1;
+    LoaderChunk *chunks = calloc(n_chunks, sizeof(LoaderChunk));
+    pthread_t *workers = calloc(n_chunks, sizeof(pthread_t));
+    bool *started_worker = calloc(n_chunks, sizeof(bool));
+    if (!chunks || !workers || !started_worker) {
+        free(chunks); free(workers); free(started_worker);
+        if (*map) munmap(*map, *size);
+        *map = NULL;
+        errno = ENOMEM;
+        return false;
+    }
+    char *cursor = *map;
+    for (unsigned c = 0; c < n_chunks; c++) {
+        char *end = (c == n_chunks - 1) ? *map + *size : *map + *size * (c + 1) / n_chunks;
+        if (end < cursor) end = cursor;
+        if (end < *map + *size) {
+            char *newline = memchr(end, '\n', *map + *size - end);
+            end = newline ? newline + 1 : *map + *size;
+        }
+        chunks[c].start = cursor;
+        chunks[c].end = end;
+        cursor = end;
+        if (c > 0) started_worker[c] = pthread_create(&workers[c], NULL, loader_parse_chunk, &chunks[c]) == 0;
+        if (c > 0 && !started_worker[c]) loader_parse_chunk(&chunks[c]);
+    }
+    loader_parse_chunk(&chunks[0]);
+    for (unsigned c = 0; c < n_chunks; c++) {
+        if (started_worker[c]) pthread_join(workers[c], NULL);
+    }
+    free(workers);
+    free(started_worker);
+    *chunks_out = chunks;
+    *n_chunks_out = n_chunks;
+    return true;
+}
+
+// Whether a snapshot row is one the journal deleted or replaced; if so the
+// miss is used up
+static bool take_miss(RowSet *delta, Buffer *row, const char *name, unsigned age, const char *gender,
+                      int64_t added, PatientId id) {
+    if (delta->misses.total == 0) return false;
+    row->len = 0;
+    format_patient_row(row, name, age, gender, added, id);
+    StrMapEntry *miss = strmap_lookup(&delta->misses, row->data, false);
+    if (!miss || miss->len == 0) return false;
+    miss->len--;
+    delta->misses.total--;
+    return true;
+}
+
+// --- String Arena ---
+
+// Puts a block of at least size bytes in front of the arena's blocks, or
+// behind the head when it is only for one oversized string
+static ArenaBlock* arena_add_block(StringArena *arena, size_t size, bool behind_head) {
+    if (!arena->held) {
+        if (!(arena->held = calloc(1, sizeof(ArenaBlocks)))) return NULL;
+        atomic_init(&arena->held->refs, 1);
+    }
+    ArenaBlock *head = arena->held->blocks;
+    ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + size + ARENA_PAD);
+    if (!fresh) return NULL;
+    fresh->used = 0;
+    fresh->size = size;
+    arena->bytes += size;
+    if (behind_head && head) {
+        fresh->next = head->next;
+        head->next = fresh;
+    } else {
+        fresh->next = head;
+        arena->held->blocks = fresh;
+    }
+    return fresh;
+}
+
+static const char* arena_strdup(StringArena *arena, const char *text) {
+    size_t len = strlen(text) + 1;
+    ArenaBlock *block = arena->held ? arena->held->blocks : NULL;
+    if (!block || block->size - block->used < len) {
+        // Oversized strings get a block of their own behind the current one
+        bool oversized = len > ARENA_BLOCK_SIZE / 4;
+        block = arena_add_block(arena, oversized ? len : ARENA_BLOCK_SIZE, oversized);
+        if (!block) return NULL;
+    }
+    char *copy = block->data + block->used;
+    memcpy(copy, text, len);
+    block->used += len;
+    return copy;
+}
+
+static void arena_release(StringArena *arena, const char *text) {
+    arena->dead += strlen(text) + 1;
+}
+
+// Another holder of the arena's current blocks, or NULL if it has none
+static ArenaBlocks* arena_hold(const StringArena *arena) {
+    if (arena->held) atomic_fetch_add(&arena->held->refs, 1);
+    return arena->held;
+}
+
+// Frees the blocks once their last holder lets go; any thread may call this
+static void arena_drop(ArenaBlocks *held) {
+    if (!held || atomic_fetch_sub(&held->refs, 1) != 1) return;
+    while (held->blocks) {
+        ArenaBlock *next = held->blocks->next;
+        free(held->blocks);
+        held->blocks = next;
+    }
+    free(held);
+}
+
+static void arena_free(StringArena *arena) {
+    arena_drop(arena->held);
+    arena->held = NULL;
+    arena->bytes = arena->dead = 0;
+}
+
+// --- Interned Strings ---
+
+static bool intern_grow(InternTable *table) {
+    if (table->count == table->cap) {
+        size_t cap = table->cap ? table->cap * 2 : 8;
+        const char **values = realloc(table->values, cap * sizeof(*values));
+        if (!values) return false;
+        table->values = values;
+        table->cap = cap;
+    }
+    if ((table->count + 1) * 2 <= table->n_slots) return true;
+    size_t n_slots = table->n_slots ? table->n_slots * 2 : 16;
+    uint16_t *slots = calloc(n_slots, sizeof(uint16_t));
+    if (!slots) return false;
+    for (size_t code = 0; code < table->count; code++) {
+        size_t i = hash_string(table->values[code]) & (n_slots - 1);
+        while (slots[i]) i = (i + 1) & (n_slots - 1);
+        slots[i] = code + 1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->n_slots = n_slots;
+    return true;
+}
+
+// The code of text, which is copied into arena the first time it is seen.
+// False with errno set if memory ran out, or EOVERFLOW once every code is
+// taken.
+static bool intern_code(InternTable *table, StringArena *arena, const char *text, uint16_t *code) {
+    uint64_t hash = hash_string(text);
+    if (table->n_slots) {
+        for (size_t i = hash & (table->n_slots - 1); table->slots[i]; i = (i + 1) & (table->n_slots - 1)) {
+            if (strcmp(table->values[table->slots[i] - 1], text) == 0) {
+                *code = table->slots[i] - 1;
+                return true;
+            }
+        }
+    }
+    if (table->count == INTERN_MAX_VALUES) {
+        errno = EOVERFLOW;
+        return false;
+    }
+    const char *copy;
+    if (!intern_grow(table) || !(copy = arena_strdup(arena, text))) {
+        errno = ENOMEM;
+        return false;
+    }
+    size_t i = hash & (table->n_slots - 1);
+    while (table->slots[i]) i = (i + 1) & (table->n_slots - 1);
+    table->slots[i] = table->count + 1;
+    table->values[table->count] = copy;
+    *code = table->count++;
+    return true;
+}
+
+static void intern_free(InternTable *table) {
+    free(table->values);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// --- MRN Index ---
+
+static inline size_t id_home(const IdIndex *index, PatientId id) {
+    return (size_t)((id * 0x9E3779B97F4A7C15ull) >> index->shift);
+}
+
+static void id_index_put(IdIndex *index, PatientId id, PatientHandle handle) {
+    size_t mask = index->n_slots - 1;
+    size_t i = id_home(index, id);
+    while (index->slots[i].id != PATIENT_NO_ID && index->slots[i].id != id) i = (i + 1) & mask;
+    if (index->slots[i].id == PATIENT_NO_ID) index->count++;
+    index->slots[i] = (IdSlot){ id, handle };
+}
+
+// Makes room for count entries, so the puts that follow can't fail
+static bool id_index_reserve(IdIndex *index, size_t count) {
+    if (count * 4 <= index->n_slots * 3) return true;
+    size_t n_slots = index->n_slots ? index->n_slots : ID_INDEX_MIN_SLOTS;
+    unsigned bits = __builtin_ctzll(n_slots);
+    while (count * 4 > n_slots * 3) {
+        n_slots *= 2;
+        bits++;
+    }
+    IdSlot *slots = calloc(n_slots, sizeof(IdSlot));
+    if (!slots) return false;
+    IdIndex grown = { slots, n_slots, 64 - bits, 0 };
+    for (size_t i = 0; i < index->n_slots; i++) {
+        if (index->slots[i].id != PATIENT_NO_ID) id_index_put(&grown, index->slots[i].id, index->slots[i].handle);
+    }
+    free(index->slots);
+    *index = grown;
+    return true;
+}
+
+static PatientHandle id_index_get(const IdIndex *index, PatientId id) {
+    if (id == PATIENT_NO_ID || index->count == 0) return PATIENT_NO_HANDLE;
+    size_t mask = index->n_slots - 1;
+    for (size_t i = id_home(index, id); index->slots[i].id != PATIENT_NO_ID; i = (i + 1) & mask) {
+        if (index->slots[i].id == id) return index->slots[i].handle;
+    }
+    return PATIENT_NO_HANDLE;
+}
+
+// Backward-shift deletion: each later entry of the run whose home slot is
+// not between the hole and itself moves into the hole
+static void id_index_remove(IdIndex *index, PatientId id) {
+    if (id == PATIENT_NO_ID || index->count == 0) return;
+    size_t mask = index->n_slots - 1;
+    size_t hole = id_home(index, id);
+    while (index->slots[hole].id != id) {
+        if (index->slots[hole].id == PATIENT_NO_ID) return;
+        hole = (hole + 1) & mask;
+    }
+    for (size_t next = (hole + 1) & mask; index->slots[next].id != PATIENT_NO_ID; next = (next + 1) & mask) {
+        size_t home = id_home(index, index->slots[next].id);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole].id = PATIENT_NO_ID;
+    index->count--;
+}
+
+// --- Store Internals ---
+
+#define GROW_COLUMN(column, capacity) do { \
+        void *grown = realloc((column), (capacity) * sizeof(*(column))); \
+        if (!grown) return false; \
+        (column) = grown; \
+    } while (0)
+
+// Makes room in row_of_handle for handles below count
+static bool store_reserve_handles(PatientStore *store, size_t count) {
+    if (count <= store->handle_capacity) return true;
+    size_t capacity = store->handle_capacity ? store->handle_capacity : 1024;
+    while (capacity < count) capacity *= 2;
+    uint32_t *rows = realloc(store->row_of_handle, capacity * sizeof(uint32_t));
+    if (!rows) return false;
+    store->row_of_handle = rows;
+    if (store->archived) {
+        uint64_t *archived = realloc(store->archived, capacity / 64 * sizeof(uint64_t));
+        if (!archived) return false;
+        memset(archived + store->handle_capacity / 64, 0, (capacity - store->handle_capacity) / 64 * sizeof(uint64_t));
+        store->archived = archived;
+    }
+    store->handle_capacity = capacity;
+    return true;
+}
+
+static bool store_reserve(PatientStore *store, size_t extra) {
+    if (store->count + extra > store->capacity) {
+        size_t capacity = store->capacity ? store->capacity : 1024;
+        while (capacity < store->count + extra) capacity *= 2;
+        GROW_COLUMN(store->names, capacity);
+        GROW_COLUMN(store->gender_codes, capacity);
+        GROW_COLUMN(store->ages, capacity);
+        GROW_COLUMN(store->added, capacity);
+        GROW_COLUMN(store->ids, capacity);
+        GROW_COLUMN(store->handles, capacity);
+        for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+            if (store->orders[key]) GROW_COLUMN(store->orders[key], capacity);
+        }
+        store->capacity = capacity;
+    }
+    return id_index_reserve(&store->id_index, store->count + extra)
+           && store_reserve_handles(store, store->next_handle + extra);
+}
+
+// The MRN a new record gets: its own if it has one no live record holds,
+// otherwise the next unused one
+static PatientId store_take_id(PatientStore *store, PatientId id) {
+    if (store->next_id == PATIENT_NO_ID) store->next_id = 1;
+    if (id == PATIENT_NO_ID || id_index_get(&store->id_index, id) != PATIENT_NO_HANDLE) return store->next_id++;
+    if (id >= store->next_id) store->next_id = id + 1;
+    return id;
+}
+
+// Without an index, searches fall back to scanning the names
+static void store_drop_name_index(PatientStore *store) {
+    trigram_index_free(store->name_index);
+    store->name_index = NULL;
+}
+
+// Without statistics, they are built again when next asked for
+static void store_drop_stats(PatientStore *store) {
+    patient_stats_free(store->stats);
+    store->stats = NULL;
+}
+
+// Whether text is a string the arena holds, rather than one in the mapped
+// snapshot
+static bool store_owns(const PatientStore *store, const char *text) {
+    const char *map = store->columnar.map;
+    return !map || text < map || text >= map + store->columnar.map_size;
+}
+
+// Appends a record whose name already lives as long as the store (an arena
+// copy or the mapped snapshot) under handle, which is next_handle or, in a
+// mirror, any handle not in use; room must have been reserved. id is the
+// MRN asked for, and may be replaced as store_take_id says.
+static PatientHandle store_append(PatientStore *store, PatientHandle new_handle, PatientId id, const char *name,
+                                  unsigned age, uint16_t gender, int64_t added) {
+    size_t row = store->count;
+    store->names[row] = name;
+    store->gender_codes[row] = gender;
+    store->ages[row] = age > UINT16_MAX ? UINT16_MAX : age;
+    store->added[row] = added;
+    store->ids[row] = store_take_id(store, id);
+    while (store->next_handle <= new_handle) store->row_of_handle[store->next_handle++] = PATIENT_NO_HANDLE;
+    store->handles[row] = new_handle;
+    store->row_of_handle[new_handle] = row;
+    id_index_put(&store->id_index, store->ids[row], new_handle);
+    store->count++;
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        if (store->orders[key]) order_insert(store, key, store->count - 1, new_handle);
+    }
+    if (store->stats && patient_stats_add(store->stats, store->ages[row], store_gender(store, row), added) != 0) {
+        store_drop_stats(store);
+    }
+    return new_handle;
+}
+
+// Appends a record; the name is copied into the arena and the gender
+// interned. False with errno set on failure.
+static bool store_insert(PatientStore *store, PatientHandle as, PatientId id, const char *name, unsigned age,
+                         const char *gender, int64_t added, PatientHandle *handle) {
+    if (!store_reserve(store, 1) || !store_reserve_handles(store, (size_t)as + 1)) {
+        errno = ENOMEM;
+        return false;
+    }
+    uint16_t gender_code;
+    if (!intern_code(&store->genders, &store->strings, gender, &gender_code)) return false;
+    const char *name_copy = arena_strdup(&store->strings, name);
+    if (!name_copy) {
+        errno = ENOMEM;
+        return false;
+    }
+    PatientHandle new_handle = store_append(store, as, id, name_copy, age, gender_code, added);
+    if (store->name_index && trigram_index_add(store->name_index, new_handle, name_copy) != 0) store_drop_name_index(store);
+    if (handle) *handle = new_handle;
+    return true;
+}
+
+// Removes a row by moving the last row into its place
+static void store_remove(PatientStore *store, size_t row) {
+    PatientHandle handle = store->handles[row];
+    if (store->name_index && trigram_index_remove(store->name_index, handle, store->names[row]) != 0) {
+        store_drop_name_index(store);
+    }
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        if (store->orders[key]) order_remove(store, key, store->count, handle);
+    }
+    if (store->stats) patient_stats_remove(store->stats, store->ages[row], store_gender(store, row), store->added[row]);
+    if (store_owns(store, store->names[row])) arena_release(&store->strings, store->names[row]);
+    id_index_remove(&store->id_index, store->ids[row]);
+    store->row_of_handle[handle] = PATIENT_NO_HANDLE;
+    size_t last = --store->count;
+    if (row != last) {
+        store->names[row] = store->names[last];
+        store->gender_codes[row] = store->gender_codes[last];
+        store->ages[row] = store->ages[last];
+        store->added[row] = store->added[last];
+        store->ids[row] = store->ids[last];
+        store->handles[row] = store->handles[last];
+        store->row_of_handle[store->handles[row]] = row;
+    }
+}
+
+// Once most of the arena is dead, copies the strings the rows still use into
+// one fresh block and lets go of the old blocks, which are freed once no
+// snapshot holds them either. Only run between changes: it moves every name.
+static void store_compact_strings(PatientStore *store) {
+    StringArena *arena = &store->strings;
+    if (arena->dead < ARENA_BLOCK_SIZE || arena->dead * 2 < arena->bytes) return;
+    size_t live = 0;
+    for (size_t row = 0; row < store->count; row++) {
+        if (store_owns(store, store->names[row])) live += strlen(store->names[row]) + 1;
+    }
+    for (size_t code = 0; code < store->genders.count; code++) live += strlen(store->genders.values[code]) + 1;
+    // Everything fits in the one block, so no copy below can fail
+    StringArena fresh = {0};
+    if (!arena_add_block(&fresh, live, false)) {
+        arena_free(&fresh);
+        return;
+    }
+    for (size_t row = 0; row < store->count; row++) {
+        if (store_owns(store, store->names[row])) store->names[row] = arena_strdup(&fresh, store->names[row]);
+    }
+    for (size_t code = 0; code < store->genders.count; code++) {
+        store->genders.values[code] = arena_strdup(&fresh, store->genders.values[code]);
+    }
+    arena_free(arena);
+    *arena = fresh;
+}
+
+static bool store_row_text(const PatientStore *store, size_t row, Buffer *buf) {
+    return format_patient_row(buf, store->names[row], store->ages[row], store_gender(store, row), store->added[row],
+                              store->ids[row]);
+}
+
+// Inserts a journal row given as text. True if it went in under an MRN
+// other than the one the text names, or none.
+static bool store_insert_text(PatientStore *store, const char *text) {
+    char *line = strdup(text);
+    PatientFields f;
+    bool renumbered = line && split_patient_line(line, line + strlen(line), &f)
+                      && store_insert(store, store->next_handle, f.id, f.name, f.age, f.gender,
+                                      patient_time_parse(f.added), NULL)
+                      && store->ids[store->count - 1] != f.id;
+    free(line);
+    return renumbered;
+}
+
+// Sets the sorted orders aside while many records go in at once, so they
+// don't each shift the whole order
+static void store_detach_orders(PatientStore *store, PatientHandle *orders[PATIENT_SORT_ADDED + 1]) {
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        orders[key] = store->orders[key];
+        store->orders[key] = NULL;
+    }
+}
+
+// Puts the orders back, merging in the added handles from start on; old_count
+// is the number of records before they went in
+static void store_attach_orders(PatientStore *store, PatientHandle *orders[PATIENT_SORT_ADDED + 1], size_t old_count,
+                                PatientHandle start) {
+    size_t added = store->count - old_count;
+    PatientHandle *delta = malloc((added ? added : 1) * sizeof(PatientHandle));
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        store->orders[key] = orders[key];
+        if (!orders[key]) continue;
+        if (!delta) {
+            order_drop(store, key);
+            continue;
+        }
+        for (size_t i = 0; i < added; i++) delta[i] = start + i;
+        if (patient_store_sort(store, key, delta, added) == 0) order_merge(store, key, orders[key], old_count, delta, added);
+        else order_drop(store, key);
+    }
+    free(delta);
+}
+
+// Puts the orders back after a batch of edits or deletes: the count handles
+// marked in touched come out in one pass, and those still live go back in at
+// their new places. old_count is the number of records before the batch.
+static void store_reattach_orders(PatientStore *store, PatientHandle *orders[PATIENT_SORT_ADDED + 1], size_t old_count,
+                                  const uint64_t *touched, const PatientHandle *handles, size_t count) {
+    size_t live = 0;
+    PatientHandle *delta = malloc((count ? count : 1) * sizeof(PatientHandle));
+    for (size_t i = 0; delta && i < count; i++) {
+        if (store->row_of_handle[handles[i]] != PATIENT_NO_HANDLE) delta[live++] = handles[i];
+    }
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        PatientHandle *order = orders[key];
+        store->orders[key] = order;
+        if (!order) continue;
+        if (!delta) {
+            order_drop(store, key);
+            continue;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < old_count; i++) {
+            if (!(touched[order[i] / 64] >> (order[i] % 64) & 1)) order[kept++] = order[i];
+        }
+        if (patient_store_sort(store, key, delta, live) == 0) order_merge(store, key, order, kept, delta, live);
+        else order_drop(store, key);
+    }
+    free(delta);
+}
+
+static void store_free(PatientStore *store) {
+    free(store->names);
+    free(store->gender_codes);
+    free(store->ages);
+    free(store->added);
+    free(store->ids);
+    free(store->handles);
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) free(store->orders[key]);
+    free(store->id_index.slots);
+    intern_free(&store->genders);
+    arena_free(&store->strings);
+    free(store->row_of_handle);
+    free(store->archived);
+    for (size_t i = 0; i < store->n_parts; i++) free(store->parts[i].path);
+    free(store->parts);
+    free(store->archive_path);
+    trigram_index_free(store->name_index);
+    patient_stats_free(store->stats);
+    columnar_file_close(&store->columnar);
+    free(store->path);
+    free(store->tmp_path);
+    free(store->journal_path);
+    free(store->compacting_path);
+    free(store->order_path);
+    free(store->changes_path);
+    free(store);
+}
+
+// --- Archive Parts ---
+//
+// Each part is a gzipped text snapshot of one month's admissions, stamped
+// with the lsn of the patient_store_archive that wrote it. That run then
+// rewrites the snapshot without those records, stamped with the same lsn,
+// so a part stamped later than the snapshot was left by a run cut short,
+// and its records are still in the snapshot.
+
+// Start of the month that holds t, or PATIENT_TIME_UNKNOWN if t has no date
+static int64_t month_start(int64_t t) {
+    char text[PATIENT_ADDED_LEN];
+    patient_time_format(t, text);
+    if (text[0] == '?') return PATIENT_TIME_UNKNOWN;
+    memcpy(text + 7, "-01 00:00", sizeof("-01 00:00"));
+    return patient_time_parse(text);
+}
+
+// Start of the month after the one starting at month
+static int64_t month_end(int64_t month) {
+    return month_start(month + 32 * 24 * 3600);
+}
+
+static char* archive_part_path(const char *dir, int64_t month, uint64_t lsn) {
+    char text[PATIENT_ADDED_LEN];
+    patient_time_format(month, text);
+    size_t len = strlen(dir) + 48;
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s/%.7s.%llu" ARCHIVE_PART_SUFFIX, dir, text, (unsigned long long)lsn);
+    return path;
+}
+
+static int compare_parts(const void *a, const void *b) {
+    const ArchivePart *x = a, *y = b;
+    if (x->month != y->month) return x->month < y->month ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static bool store_add_part(PatientStore *store, int64_t month, char *path, bool loaded) {
+    ArchivePart *parts = realloc(store->parts, (store->n_parts + 1) * sizeof(ArchivePart));
+    if (!parts) return false;
+    store->parts = parts;
+    store->parts[store->n_parts++] = (ArchivePart){ month, path, loaded };
+    return true;
+}
+
+// Lists the parts that belong with a snapshot stamped snapshot_lsn, and
+// removes those left by an archive run cut short, along with their
+// temporary files
+static void store_scan_archive(PatientStore *store, uint64_t snapshot_lsn) {
+    DIR *dir = opendir(store->archive_path);
+    if (!dir) {
+        if (errno != ENOENT) fprintf(stderr, "Could not read the archive %s\n", store->archive_path);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        unsigned year, month;
+        unsigned long long lsn;
+        int end = 0;
+        if (sscanf(entry->d_name, "%4u-%2u.%llu%n", &year, &month, &lsn, &end) != 3 || end == 0) continue;
+        const char *suffix = entry->d_name + end;
+        bool part = strcmp(suffix, ARCHIVE_PART_SUFFIX) == 0;
+        if (!part && strcmp(suffix, ARCHIVE_PART_SUFFIX ".tmp") != 0) continue;
+        char start[PATIENT_ADDED_LEN];
+        snprintf(start, sizeof(start), "%04u-%02u-01 00:00", year, month);
+        int64_t month_time = patient_time_parse(start);
+        if (month_time == PATIENT_TIME_UNKNOWN) continue;
+        size_t len = strlen(store->archive_path) + strlen(entry->d_name) + 2;
+        char *path = malloc(len);
+        if (!path) break;
+        snprintf(path, len, "%s/%s", store->archive_path, entry->d_name);
+        if (!part || lsn > snapshot_lsn) {
+            unlink(path);
+            free(path);
+            continue;
+        }
+        if (!store_add_part(store, month_time, path, false)) {
+            free(path);
+            break;
+        }
+    }
+    closedir(dir);
+    if (store->n_parts) qsort(store->parts, store->n_parts, sizeof(ArchivePart), compare_parts);
+}
+
+// --- Column Scan ---
+//
+// Whole-column searches split the rows into slices of whole 64-row words,
+// one per core, and each worker sets the bits of its matching rows in a
+// shared bitmap by row; no two workers touch the same word. One pass on
+// the calling thread then turns rows into handles.
+
+typedef enum {
+    SCAN_NAME,
+    SCAN_GENDER,
+    SCAN_AGE,
+    SCAN_ADDED
+} ScanColumn;
+
+typedef struct {
+    const PatientStore *store;
+    ScanColumn column;
+    const char *folded_name;        // SCAN_NAME: lowercase needle
+    size_t name_len;
+    const uint64_t *gender_hits;    // SCAN_GENDER: bit per matching gender code
+    int64_t min, max;               // SCAN_AGE, SCAN_ADDED: inclusive range
+    size_t first, last;             // This slice's rows
+    uint64_t *row_words;
+} ScanSlice;
+
+// Whether haystack starts with needle once its ASCII case is folded
+static bool starts_folded(const char *haystack, const char *needle, size_t needle_len) {
+    size_t i = 0;
+    while (i < needle_len && haystack[i] && tolower((unsigned char)haystack[i]) == (unsigned char)needle[i]) i++;
+    return i == needle_len;
+}
+
+#ifdef __SSE2__
+// 16 bytes from text with ASCII upper case folded to lower
+static inline __m128i fold16(const char *text) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)text);
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// strstr that folds ASCII case in haystack; needle must already be lowercase.
+// With SSE2, sixteen positions at a time are checked for the needle's first
+// two bytes before any is compared in full. Those loads read up to 16 bytes
+// past the haystack's NUL, but never into the next page; arena blocks keep
+// ARENA_PAD bytes of slack for them.
+static bool contains_folded(const char *haystack, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return true;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]), second = _mm_set1_epi8(needle[1]), zero = _mm_setzero_si128();
+    while (((uintptr_t)haystack & 4095) <= 4096 - 17) {
+        __m128i block = fold16(haystack);
+        unsigned ends = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        unsigned hits = _mm_movemask_epi8(_mm_cmpeq_epi8(block, first));
+        if (needle_len > 1) hits &= _mm_movemask_epi8(_mm_cmpeq_epi8(fold16(haystack + 1), second));
+        if (ends) hits &= (ends & -ends) - 1;   // Only positions before the NUL
+        for (; hits; hits &= hits - 1) {
+            if (starts_folded(haystack + __builtin_ctz(hits), needle, needle_len)) return true;
+        }
+        if (ends) return false;
+        haystack += 16;
+    }
+    // Close to a page end the rest goes byte by byte
+#endif
+    for (; *haystack; haystack++) {
+        if (tolower((unsigned char)*haystack) == (unsigned char)needle[0] && starts_folded(haystack, needle, needle_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* scan_slice(void *data) {
+    const ScanSlice *slice = data;
+    const PatientStore *store = slice->store;
+    for (size_t row = slice->first; row < slice->last; row++) {
+        bool match;
+        switch (slice->column) {
+            case SCAN_NAME:
+                match = contains_folded(store->names[row], slice->folded_name, slice->name_len);
+                break;
+            case SCAN_GENDER:
+                match = slice->gender_hits[store->gender_codes[row] >> 6] >> (store->gender_codes[row] & 63) & 1;
+                break;
+            case SCAN_AGE:
+                match = store->ages[row] >= slice->min && store->ages[row] <= slice->max;
+                break;
+            default:
+                match = store->added[row] >= slice->min && store->added[row] <= slice->max;
+                break;
+        }
+        if (match) slice->row_words[row >> 6] |= 1ull << (row & 63);
+    }
+    return NULL;
+}
+
+// Sets the bit of every handle whose row passes scan in words, on every
+// core when the store is large enough; scan's own rows are ignored
+static bool scan_column(const ScanSlice *scan, uint64_t *words) {
+    const PatientStore *store = scan->store;
+    size_t n_row_words = (store->count + 63) / 64;
+    unsigned n_slices = online_cpus();
+    if (n_slices > store->count / SCAN_MIN_ROWS) n_slices = store->count / SCAN_MIN_ROWS;
+    if (n_slices == 0) n_slices = 1;
+    uint64_t *row_words = calloc(n_row_words ? n_row_words : 1, sizeof(uint64_t));
+    ScanSlice *slices = calloc(n_slices, sizeof(ScanSlice));
+    pthread_t *workers = calloc(n_slices, sizeof(pthread_t));
+    bool *started_worker = calloc(n_slices, sizeof(bool));
+    if (!row_words || !slices || !workers || !started_worker) {
+        free(row_words); free(slices); free(workers); free(started_worker);
+        errno = ENOMEM;
+        return false;
+    }
+    for (unsigned s = 0; s < n_slices; s++) {
+        slices[s] = *scan;
+        slices[s].first = n_row_words * s / n_slices * 64;
+        slices[s].last = s == n_slices - 1 ? store->count : n_row_words * (s + 1) / n_slices * 64;
+        slices[s].row_words = row_words;
+        if (s > 0) started_worker[s] = pthread_create(&workers[s], NULL, scan_slice, &slices[s]) == 0;
+        if (s > 0 && !started_worker[s]) scan_slice(&slices[s]);
+    }
+    scan_slice(&slices[0]);
+    for (unsigned s = 0; s < n_slices; s++) {
+        if (started_worker[s]) pthread_join(workers[s], NULL);
+    }
+
+    for (size_t w = 0; w < n_row_words; w++) {
+        for (uint64_t bits = row_words[w]; bits; bits &= bits - 1) {
+            PatientHandle handle = store->handles[w * 64 + __builtin_ctzll(bits)];
+            words[handle >> 6] |= 1ull << (handle & 63);
+        }
+    }
+    free(row_words); free(slices); free(workers); free(started_worker);
+    return true;
+}
+
+// --- Public API ---
+
+static PatientStore* open_store(const char *path, PatientLoadStats *stats) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    PatientStore *store = calloc(1, sizeof(PatientStore));
+    if (!store) return NULL;
+    store->path = strdup(path);
+    store->tmp_path = derive_path(path, ".tmp", false);
+    store->journal_path = derive_path(path, ".journal", true);
+    store->compacting_path = derive_path(path, ".journal.old", true);
+    store->order_path = derive_path(path, ORDER_SUFFIX, false);
+    store->archive_path = derive_path(path, ARCHIVE_SUFFIX, true);
+    store->changes_path = derive_path(path, CHANGES_SUFFIX, true);
+    store->journal.fd = -1;
+    if (!store->path || !store->tmp_path || !store->journal_path || !store->compacting_path || !store->order_path
+        || !store->archive_path || !store->changes_path) {
+        store_free(store);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // A binary snapshot is used in place; a text one is parsed in parallel
+    char *map = NULL;
+    size_t size = 0;
+    LoaderChunk *chunks = NULL;
+    unsigned n_chunks = 0;
+    uint64_t snapshot_lsn = 0;
+    PatientId next_id = 1;
+    size_t parsed = 0, bad_lines = 0;
+    if (columnar_file_detect(path)) {
+        store->format = PATIENT_FORMAT_BINARY;
+        if (columnar_file_open(path, &store->columnar) != 0) {
+            int saved = errno;
+            store_free(store);
+            errno = saved;
+            return NULL;
+        }
+        snapshot_lsn = store->columnar.lsn;
+        if (store->columnar.next_id > next_id) next_id = store->columnar.next_id;
+        parsed = store->columnar.count;
+    } else {
+        if (!load_text_snapshot(path, &map, &size, &chunks, &n_chunks)) {
+            int saved = errno;
+            store_free(store);
+            errno = saved;
+            return NULL;
+        }
+        for (unsigned c = 0; c < n_chunks; c++) {
+            if (chunks[c].lsn > snapshot_lsn) snapshot_lsn = chunks[c].lsn;
+            if (chunks[c].next_id > next_id) next_id = chunks[c].next_id;
+            if (chunks[c].max_id >= next_id) next_id = chunks[c].max_id + 1;
+            parsed += chunks[c].count;
+            bad_lines += chunks[c].bad_lines;
+        }
+    }
+
+    // Without its snapshot, the archive can't tell which of its parts are finished
+    if (store->format == PATIENT_FORMAT_BINARY || file_exists(path)) store_scan_archive(store, snapshot_lsn);
+    history_open(store, snapshot_lsn);
+
+    // Replay the journal into a delta: new rows, plus misses naming the
+    // snapshot rows it deleted or replaced
+    RowSet delta = {0};
+    delta.lsn = snapshot_lsn;
+    uint64_t max_lsn = snapshot_lsn;
+    row_set_replay_journal(&delta, store->compacting_path, &max_lsn);
+    size_t intact = row_set_replay_journal(&delta, store->journal_path, &max_lsn);
+    if (file_exists(store->journal_path) && truncate(store->journal_path, intact) != 0) {
+        fprintf(stderr, "Could not trim the torn tail of %s\n", store->journal_path);
+    }
+    // Rows without an MRN of their own are numbered after every one in use
+    store->next_id = delta.next_id > next_id ? delta.next_id : next_id;
+    size_t renumbered = 0;
+
+    store_reserve(store, parsed + delta.count);
+    // Where each snapshot row went, if there are saved orders to map onto handles
+    PatientHandle *handle_of_row = file_exists(store->order_path) ? malloc((parsed ? parsed : 1) * sizeof(PatientHandle))
+                                                                  : NULL;
+    size_t next_row = 0;
+    Buffer row = {0};
+    if (store->format == PATIENT_FORMAT_BINARY) {
+        // Names point straight into the mapping; the file keeps each gender
+        // once, so interning it is looked up only when the offset changes
+        const ColumnarFile *file = &store->columnar;
+        const char *last_gender = NULL;
+        uint16_t gender_code = 0;
+        for (size_t i = 0; i < file->count; i++) {
+            const char *name = columnar_file_name(file, i), *gender = columnar_file_gender(file, i);
+            PatientId id = file->ids ? file->ids[i] : PATIENT_NO_ID;
+            PatientHandle handle = PATIENT_NO_HANDLE;
+            if (gender != last_gender) {
+                last_gender = intern_code(&store->genders, &store->strings, gender, &gender_code) ? gender : NULL;
+            }
+            if (last_gender && !take_miss(&delta, &row, name, file->ages[i], gender, file->added[i], id)
+                && store_reserve(store, 1)) {
+                handle = store_append(store, store->next_handle, id, name, file->ages[i], gender_code, file->added[i]);
+                renumbered += store->ids[store->count - 1] != id;
+            }
+            if (handle_of_row) handle_of_row[next_row++] = handle;
+        }
+    }
+    for (unsigned c = 0; c < n_chunks; c++) {
+        for (size_t i = 0; i < chunks[c].count; i++) {
+            PatientFields *f = &chunks[c].rows[i];
+            int64_t added = patient_time_parse(f->added);
+            PatientHandle handle = PATIENT_NO_HANDLE;
+            if (!take_miss(&delta, &row, f->name, f->age, f->gender, added, f->id)
+                && store_insert(store, store->next_handle, f->id, f->name, f->age, f->gender, added, &handle)) {
+                renumbered += store->ids[store->count - 1] != f->id;
+            }
+            if (handle_of_row) handle_of_row[next_row++] = handle;
+        }
+        free(chunks[c].rows);
+        free(chunks[c].tail);
+    }
+    PatientHandle first_delta = store->next_handle;
+    for (size_t i = 0; i < delta.count; i++) {
+        if (delta.rows[i]) renumbered += store_insert_text(store, delta.rows[i]);
+    }
+    OrderFile orders;
+    uint64_t snapshot_size = store->format == PATIENT_FORMAT_BINARY ? store->columnar.map_size : size;
+    if (handle_of_row && order_file_open(store->order_path, snapshot_lsn, parsed, snapshot_size, &orders) == 0) {
+        store_adopt_orders(store, &orders, handle_of_row, first_delta);
+        order_file_close(&orders);
+    }
+    free(handle_of_row);
+    buffer_free(&row);
+    free(chunks);
+    if (map) munmap(map, size);
+
+    journal_open(store, max_lsn + 1);
+    // A snapshot from before MRNs is saved with the ones just given out, so
+    // they are the same at the next start and journal records can name them
+    if (renumbered > 0 && patient_store_compact(store) != 0) {
+        fprintf(stderr, "Could not save the MRNs given to %zu patients in %s\n", renumbered, path);
+    }
+
+    if (stats) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        stats->rows = store->count;
+        stats->bad_lines = bad_lines;
+        stats->journal_records = delta.applied;
+        stats->threads = n_chunks ? n_chunks : 1;
+        stats->seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    }
+    row_set_free(&delta);
+    return store;
+}
+
+PatientStore* patient_store_open(const char *path, PatientLoadStats *stats) {
+    LatencyProbe probe = latency_begin(LATENCY_LOAD);
+    PatientStore *store = open_store(path, stats);
+    latency_end(probe);
+    return store;
+}
+
+PatientStore* patient_store_new(void) {
+    PatientStore *store = calloc(1, sizeof(PatientStore));
+    if (!store) return NULL;
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    journal->next_lsn = 1;
+    journal->fd = -1;
+    return store;
+}
+
+void patient_store_close(PatientStore *store) {
+    if (!store) return;
+    journal_close(store);
+    store_free(store);
+}
+
+size_t patient_store_count(const PatientStore *store) {
+    return store->count;
+}
+
+void patient_store_memory(const PatientStore *store, PatientMemory *memory) {
+    size_t row_bytes = sizeof(*store->names) + sizeof(*store->gender_codes) + sizeof(*store->ages)
+                       + sizeof(*store->added) + sizeof(*store->ids) + sizeof(*store->handles);
+    *memory = (PatientMemory){ .records = store->count };
+    memory->columns = store->capacity * row_bytes + store->handle_capacity * sizeof(*store->row_of_handle)
+                      + store->id_index.n_slots * sizeof(IdSlot)
+                      + (store->archived ? store->handle_capacity / 8 : 0)
+                      + store->genders.cap * sizeof(*store->genders.values)
+                      + store->genders.n_slots * sizeof(*store->genders.slots);
+    memory->strings = store->strings.bytes;
+    memory->dead_strings = store->strings.dead;
+    for (int key = 0; key <= PATIENT_SORT_ADDED; key++) {
+        if (store->orders[key]) memory->orders += store->capacity * sizeof(PatientHandle);
+    }
+    memory->name_index = store->name_index ? trigram_index_bytes(store->name_index) : 0;
+    memory->total = memory->columns + memory->strings + memory->orders + memory->name_index;
+}
+
+void patient_store_get(const PatientStore *store, size_t row, PatientRecord *record) {
+    record->handle = store->handles[row];
+    record->id = store->ids[row];
+    record->name = store->names[row];
+    record->gender = store_gender(store, row);
+    record->added = store->added[row];
+    record->age = store->ages[row];
+}
+
+long patient_store_find(const PatientStore *store, PatientHandle handle) {
+    if (handle >= store->next_handle) return -1;
+    uint32_t row = store->row_of_handle[handle];
+    return row == PATIENT_NO_HANDLE ? -1 : (long)row;
+}
+
+PatientHandle patient_store_find_id(const PatientStore *store, PatientId id) {
+    return id_index_get(&store->id_index, id);
+}
+
+// What every add and update must carry, however it arrives
+static bool valid_fields(const char *name, unsigned age, const char *gender) {
+    return name && *name && gender && *gender && age <= PATIENT_MAX_AGE;
+}
+
+static int add_patient(PatientStore *store, PatientHandle as, PatientId id, const char *name, unsigned age,
+                       const char *gender, int64_t added, PatientHandle *handle) {
+    if (!valid_fields(name, age, gender)) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *clean_name = sanitize_field(name);
+    char *clean_gender = sanitize_field(gender);
+    bool ok = clean_name && clean_gender && store_insert(store, as, id, clean_name, age, clean_gender, added, handle);
+    if (!clean_name || !clean_gender) errno = ENOMEM;
+    free(clean_name); free(clean_gender);
+    if (!ok) return -1;
+    Buffer row = {0};
+    int result = store_row_text(store, store->count - 1, &row) ? journal_append(store, JOURNAL_ADD, row.data, NULL) : -1;
+    buffer_free(&row);
+    return result;
+}
+
+// Appends every record and journals them together, with the sorted orders
+// set aside meanwhile
+static int add_patients(PatientStore *store, const PatientRecord *records, size_t count, PatientHandle *first) {
+    for (size_t i = 0; i < count; i++) {
+        if (!valid_fields(records[i].name, records[i].age, records[i].gender)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (first) *first = store->next_handle;
+    if (count == 0) return 0;
+    if (!store_reserve(store, count)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    PatientHandle *orders[PATIENT_SORT_ADDED + 1];
+    store_detach_orders(store, orders);
+    size_t old_count = store->count;
+    PatientHandle start = store->next_handle;
+    Buffer rows = {0};
+    bool ok = true;
+    int error = ENOMEM;
+    for (size_t i = 0; ok && i < count; i++) {
+        const PatientRecord *record = &records[i];
+        char *clean_name = sanitize_field(record->name);
+        char *clean_gender = sanitize_field(record->gender);
+        ok = clean_name && clean_gender
+             && store_insert(store, store->next_handle, PATIENT_NO_ID, clean_name, record->age, clean_gender,
+                             record->added, NULL);
+        if (!ok && clean_name && clean_gender) error = errno;
+        ok = ok && store_row_text(store, store->count - 1, &rows) && buffer_printf(&rows, "\n");
+        free(clean_name); free(clean_gender);
+    }
+    // Whatever went in is kept, journalled and sorted, even if memory ran out
+    store_attach_orders(store, orders, old_count, start);
+    // A row whose text didn't fit in rows is the last one in; its journal line is all that's lost
+    int result = journal_append_batch(store, JOURNAL_ADD, &rows, store->count - old_count);
+    buffer_free(&rows);
+    if (!ok) {
+        errno = error;
+        return -1;
+    }
+    return result;
+}
+
+// Why a record can't be changed or deleted: ENOENT, EROFS, or 0 if it can
+static int check_editable(const PatientStore *store, PatientHandle handle) {
+    if (patient_store_find(store, handle) < 0) return ENOENT;
+    return store_is_archived(store, handle) ? EROFS : 0;
+}
+
+// Changes the record at row and appends "old row<TAB>new row\n" to changes
+// if that changed its text. False with errno set on failure.
+static bool store_update_row(PatientStore *store, size_t row, const char *name, unsigned age, const char *gender,
+                             Buffer *changes) {
+    PatientHandle handle = store->handles[row];
+    char *clean_name = sanitize_field(name);
+    char *clean_gender = sanitize_field(gender);
+    Buffer old_row = {0}, new_row = {0};
+    if (!clean_name || !clean_gender || !store_row_text(store, row, &old_row)) {
+        free(clean_name); free(clean_gender);
+        buffer_free(&old_row);
+        errno = ENOMEM;
+        return false;
+    }
+    // An unchanged name keeps its arena copy
+    uint16_t gender_code;
+    bool interned = intern_code(&store->genders, &store->strings, clean_gender, &gender_code);
+    const char *name_copy = !interned || strcmp(store->names[row], clean_name) == 0
+                            ? store->names[row] : arena_strdup(&store->strings, clean_name);
+    free(clean_name); free(clean_gender);
+    if (!interned || !name_copy) {
+        buffer_free(&old_row);
+        if (interned) errno = ENOMEM;
+        return false;
+    }
+    if (name_copy != store->names[row]) {
+        if (store->name_index && (trigram_index_remove(store->name_index, handle, store->names[row]) != 0
+                                  || trigram_index_add(store->name_index, handle, name_copy) != 0)) {
+            store_drop_name_index(store);
+        }
+        if (store->orders[PATIENT_SORT_NAME]) order_remove(store, PATIENT_SORT_NAME, store->count, handle);
+        if (store_owns(store, store->names[row])) arena_release(&store->strings, store->names[row]);
+        store->names[row] = name_copy;
+        if (store->orders[PATIENT_SORT_NAME]) order_insert(store, PATIENT_SORT_NAME, store->count - 1, handle);
+    }
+    uint16_t new_age = age > UINT16_MAX ? UINT16_MAX : age;
+    // Same admission time, so this lands in buckets that exist
+    if (store->stats && (gender_code != store->gender_codes[row] || new_age != store->ages[row])) {
+        patient_stats_remove(store->stats, store->ages[row], store_gender(store, row), store->added[row]);
+        if (patient_stats_add(store->stats, new_age, store->genders.values[gender_code], store->added[row]) != 0) {
+            store_drop_stats(store);
+        }
+    }
+    store->gender_codes[row] = gender_code;
+    if (new_age != store->ages[row]) {
+        if (store->orders[PATIENT_SORT_AGE]) order_remove(store, PATIENT_SORT_AGE, store->count, handle);
+        store->ages[row] = new_age;
+        if (store->orders[PATIENT_SORT_AGE]) order_insert(store, PATIENT_SORT_AGE, store->count - 1, handle);
+    }
+
+    bool ok = store_row_text(store, row, &new_row)
+              && (strcmp(old_row.data, new_row.data) == 0
+                  || buffer_printf(changes, "%s\t%s\n", old_row.data, new_row.data));
+    buffer_free(&old_row);
+    buffer_free(&new_row);
+    if (!ok) errno = ENOMEM;
+    return ok;
+}
+
+static int update_patient(PatientStore *store, PatientHandle handle, const char *name, unsigned age,
+                          const char *gender) {
+    int error = check_editable(store, handle);
+    if (!error && !valid_fields(name, age, gender)) error = EINVAL;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    Buffer changes = {0};
+    int result = store_update_row(store, patient_store_find(store, handle), name, age, gender, &changes)
+                 ? journal_append_batch(store, JOURNAL_UPDATE, &changes, 1) : -1;
+    buffer_free(&changes);
+    return result;
+}
+
+// Marks count handles in a fresh bitmap, checking that each names an
+// editable record once. NULL with errno set if one doesn't.
+static uint64_t* mark_editable(const PatientStore *store, const PatientHandle *handles, size_t count) {
+    uint64_t *marked = calloc(store->next_handle / 64 + 1, sizeof(uint64_t));
+    if (!marked) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        PatientHandle handle = handles[i];
+        int error = check_editable(store, handle);
+        if (!error && (marked[handle / 64] >> (handle % 64) & 1)) error = EINVAL;
+        if (error) {
+            free(marked);
+            errno = error;
+            return NULL;
+        }
+        marked[handle / 64] |= UINT64_C(1) << (handle % 64);
+    }
+    return marked;
+}
+
+// Changes every record and journals them together, with the sorted orders
+// set aside meanwhile. All are checked before any changes.
+static int update_patients(PatientStore *store, const PatientRecord *records, size_t count) {
+    PatientHandle *handles = calloc(count ? count : 1, sizeof(PatientHandle));
+    if (!handles) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) handles[i] = records[i].handle;
+    uint64_t *touched = mark_editable(store, handles, count);
+    for (size_t i = 0; touched && i < count; i++) {
+        if (!valid_fields(records[i].name, records[i].age, records[i].gender)) {
+            free(touched);
+            touched = NULL;
+            errno = EINVAL;
+        }
+    }
+    if (!touched) {
+        free(handles);
+        return -1;
+    }
+    PatientHandle *orders[PATIENT_SORT_ADDED + 1];
+    store_detach_orders(store, orders);
+    Buffer changes = {0};
+    size_t done = 0;
+    while (done < count && store_update_row(store, store->row_of_handle[handles[done]], records[done].name,
+                                            records[done].age, records[done].gender, &changes)) {
+        done++;
+    }
+    int error = errno;
+    // Whatever changed is kept, journalled and sorted, even if memory ran out
+    store_reattach_orders(store, orders, store->count, touched, handles, count);
+    int result = journal_append_batch(store, JOURNAL_UPDATE, &changes, done);
+    buffer_free(&changes);
+    free(touched);
+    free(handles);
+    if (done < count) {
+        errno = error;
+        return -1;
+    }
+    return result;
+}
+
+// Removes every record and journals them together. The sorted orders and,
+// for a large batch, the name index are set aside meanwhile and swept once.
+// All are checked, and their rows written out, before any goes.
+static int delete_patients(PatientStore *store, const PatientHandle *handles, size_t count) {
+    uint64_t *touched = mark_editable(store, handles, count);
+    if (!touched) return -1;
+    Buffer rows = {0};
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = store_row_text(store, store->row_of_handle[handles[i]], &rows) && buffer_printf(&rows, "\n");
+    }
+    if (!ok) {
+        buffer_free(&rows);
+        free(touched);
+        errno = ENOMEM;
+        return -1;
+    }
+    PatientHandle *orders[PATIENT_SORT_ADDED + 1];
+    store_detach_orders(store, orders);
+    TrigramIndex *name_index = NULL;
+    if (count * NAME_INDEX_SWEEP_SHARE >= store->count) {
+        name_index = store->name_index;
+        store->name_index = NULL;
+    }
+    size_t old_count = store->count;
+    for (size_t i = 0; i < count; i++) store_remove(store, store->row_of_handle[handles[i]]);
+    if (name_index) {
+        trigram_index_remove_marked(name_index, touched, store->next_handle);
+        store->name_index = name_index;
+    }
+    store_reattach_orders(store, orders, old_count, touched, handles, count);
+    int result = journal_append_batch(store, JOURNAL_DELETE, &rows, count);
+    buffer_free(&rows);
+    free(touched);
+    return result;
+}
+
+static int delete_patient(PatientStore *store, PatientHandle handle) {
+    long row = patient_store_find(store, handle);
+    int error = check_editable(store, handle);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    Buffer text = {0};
+    if (!store_row_text(store, row, &text)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    store_remove(store, row);
+    int result = journal_append(store, JOURNAL_DELETE, text.data, NULL);
+    buffer_free(&text);
+    return result;
+}
+
+int patient_store_add(PatientStore *store, const char *name, unsigned age, const char *gender,
+                      int64_t added, PatientHandle *handle) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT);
+    int result = add_patient(store, store->next_handle, PATIENT_NO_ID, name, age, gender, added, handle);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_add_batch(PatientStore *store, const PatientRecord *records, size_t count, PatientHandle *first) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT_BATCH);
+    int result = add_patients(store, records, count, first);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_update(PatientStore *store, PatientHandle handle, const char *name, unsigned age,
+                         const char *gender) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT);
+    int result = update_patient(store, handle, name, age, gender);
+    store_compact_strings(store);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_update_batch(PatientStore *store, const PatientRecord *records, size_t count) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT_BATCH);
+    int result = update_patients(store, records, count);
+    store_compact_strings(store);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_delete(PatientStore *store, PatientHandle handle) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT);
+    int result = delete_patient(store, handle);
+    store_compact_strings(store);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_delete_batch(PatientStore *store, const PatientHandle *handles, size_t count) {
+    LatencyProbe probe = latency_begin(LATENCY_EDIT_BATCH);
+    int result = delete_patients(store, handles, count);
+    store_compact_strings(store);
+    latency_end(probe);
+    return result;
+}
+
+int patient_store_put(PatientStore *store, const PatientRecord *record) {
+    if (record->handle == PATIENT_NO_HANDLE) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Not timed as an edit: mirrors take whole registries this way. A
+    // record's MRN never changes, so an update leaves it be.
+    if (patient_store_find(store, record->handle) < 0) {
+        return add_patient(store, record->handle, record->id, record->name, record->age, record->gender, record->added,
+                           NULL);
+    }
+    int result = update_patient(store, record->handle, record->name, record->age, record->gender);
+    store_compact_strings(store);
+    return result;
+}
+
+static char* fold_needle(const char *needle) {
+    char *folded = strdup(needle ? needle : "");
+    if (!folded) return NULL;
+    for (char *p = folded; *p; p++) *p = tolower((unsigned char)*p);
+    return folded;
+}
+
+int patient_store_index_names(PatientStore *store) {
+    if (store->name_index) return 0;
+    store->name_index = trigram_index_new();
+    for (size_t row = 0; store->name_index && row < store->count; row++) {
+        if (trigram_index_add(store->name_index, store->handles[row], store->names[row]) != 0) store_drop_name_index(store);
+    }
+    if (!store->name_index) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // Built in one go, so the lists won't grow much for a while
+    trigram_index_shrink(store->name_index);
+    return 0;
+}
+
+int patient_store_track_stats(PatientStore *store) {
+    if (store->stats) return 0;
+    PatientSnapshot *snapshot = patient_store_snapshot(store);
+    store->stats = snapshot ? patient_stats_build(snapshot) : NULL;
+    patient_snapshot_free(snapshot);
+    if (!store->stats) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+const PatientStats* patient_store_stats(const PatientStore *store) {
+    return store->stats;
+}
+
+long patient_store_match(const PatientStore *store, const char *needle, PatientHandle **handles) {
+    *handles = NULL;
+    char *folded = fold_needle(needle);
+    if (!folded) return -1;
+    LatencyProbe probe = latency_begin(LATENCY_SEARCH);
+    size_t needle_len = strlen(folded), count = 0;
+
+    // Trigram candidates when the needle is long enough, otherwise every live handle
+    uint32_t *candidates = NULL;
+    long n = store->name_index ? trigram_index_candidates(store->name_index, folded, &candidates) : -1;
+    PatientHandle *out = NULL;
+    if (n >= 0) {
+        out = candidates;
+        for (long i = 0; i < n; i++) {
+            long row = patient_store_find(store, candidates[i]);
+            if (row >= 0 && contains_folded(store->names[row], folded, needle_len)) out[count++] = candidates[i];
+        }
+    } else {
+        ScanSlice scan = {.store = store, .column = SCAN_NAME, .folded_name = folded, .name_len = needle_len};
+        size_t n_words = (store->next_handle + 63) / 64;
+        uint64_t *words = calloc(n_words ? n_words : 1, sizeof(uint64_t));
+        out = malloc((store->count ? store->count : 1) * sizeof(PatientHandle));
+        if (!words || !out || !scan_column(&scan, words)) {
+            free(words);
+            free(out);
+            free(folded);
+            latency_end(probe);
+            return -1;
+        }
+        for (size_t w = 0; w < n_words; w++) {
+            for (uint64_t bits = words[w]; bits; bits &= bits - 1) out[count++] = w * 64 + __builtin_ctzll(bits);
+        }
+        free(words);
+    }
+    free(folded);
+    *handles = out;
+    latency_end(probe);
+    return count;
+}
+
+int patient_store_name_matches(const PatientStore *store, PatientHandle handle, const char *needle) {
+    long row = patient_store_find(store, handle);
+    if (row < 0) return 0;
+    char *folded = fold_needle(needle);
+    int found = folded && contains_folded(store->names[row], folded, strlen(folded));
+    free(folded);
+    return found;
+}
+
+int patient_store_compare(const PatientStore *store, PatientSortKey key, PatientHandle a, PatientHandle b) {
+    SortEntry x, y;
+    sort_entry(store, key, a, &x);
+    sort_entry(store, key, b, &y);
+    return sort_compare(key)(&x, &y);
+}
+
+const PatientHandle* patient_store_order(PatientStore *store, PatientSortKey key) {
+    if (key == PATIENT_SORT_GENDER) return NULL;
+    if (!store->orders[key]) store->orders[key] = order_build(store, key);
+    return store->orders[key];
+}
+
+int patient_store_sort(const PatientStore *store, PatientSortKey key, PatientHandle *handles, size_t count) {
+    SortEntry *entries = malloc((count ? count : 1) * sizeof(SortEntry));
+    if (!entries) {
+        errno = ENOMEM;
+        return -1;
+    }
+    LatencyProbe probe = latency_begin(LATENCY_SORT);
+    for (size_t i = 0; i < count; i++) sort_entry(store, key, handles[i], &entries[i]);
+    qsort(entries, count, sizeof(SortEntry), sort_compare(key));
+    for (size_t i = 0; i < count; i++) handles[i] = entries[i].handle;
+    free(entries);
+    latency_end(probe);
+    return 0;
+}
+
+// --- Structured Queries ---
+//
+// Each term of a query is evaluated a whole column at a time into a
+// compressed bitmap of handles, and the bitmaps are intersected. Terms go
+// in order of how many rows they are expected to keep, which costs little
+// to know: an age or admission range is a slice of the store's sorted order
+// found by two binary searches, the name term's matches come from the
+// trigram index, and a gender's share is sampled. Once the survivors are
+// few, the remaining terms are checked against them row by row instead.
+
+typedef enum {
+    TERM_NAME,
+    TERM_GENDER,
+    TERM_AGE,
+    TERM_ADDED
+} QueryTermKind;
+
+typedef struct {
+    QueryTermKind kind;
+    size_t estimate;            // Rows expected to pass
+    const PatientHandle *order; // Range terms: the key's sorted order, whose slice [first, last) passes
+    size_t first, last;
+    PatientHandle *matches;     // Name term: the ascending matches, or NULL for a needle too short to index
+    size_t n_matches;
+} QueryTerm;
+
+static int64_t range_key(const PatientStore *store, QueryTermKind kind, size_t row) {
+    return kind == TERM_AGE ? store->ages[row] : store->added[row];
+}
+
+// First position in a sorted order whose key is at least value
+static size_t order_lower_bound(const PatientStore *store, QueryTermKind kind, const PatientHandle *order,
+                                int64_t value) {
+    size_t low = 0, high = store->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (range_key(store, kind, store->row_of_handle[order[mid]]) < value) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static bool gender_matches(const char *gender, const char *prefix, size_t prefix_len) {
+    // Most rows differ in the first letter, so check it before calling out
+    return tolower((unsigned char)gender[0]) == tolower((unsigned char)prefix[0])
+           && strncasecmp(gender, prefix, prefix_len) == 0;
+}
+
+static bool handle_in(const PatientHandle *sorted, size_t count, PatientHandle handle) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (sorted[mid] < handle) low = mid + 1;
+        else high = mid;
+    }
+    return low < count && sorted[low] == handle;
+}
+
+static bool term_holds(const PatientStore *store, const PatientQuery *query, const QueryTerm *term,
+                       const char *folded_name, PatientHandle handle) {
+    size_t row = store->row_of_handle[handle];
+    switch (term->kind) {
+        case TERM_NAME:
+            return term->matches ? handle_in(term->matches, term->n_matches, handle)
+                                 : contains_folded(store->names[row], folded_name, strlen(folded_name));
+        case TERM_GENDER: return gender_matches(store_gender(store, row), query->gender, strlen(query->gender));
+        case TERM_AGE: return store->ages[row] >= query->age_min && store->ages[row] <= query->age_max;
+        case TERM_ADDED: return store->added[row] >= query->added_min && store->added[row] <= query->added_max;
+    }
+    return false;
+}
+
+// Sets the bit of every handle term keeps in words, a column at a time
+static bool term_fill_words(const PatientStore *store, const PatientQuery *query, const QueryTerm *term,
+                            const char *folded_name, uint64_t *words) {
+    if (term->order) {
+        for (size_t i = term->first; i < term->last; i++) words[term->order[i] >> 6] |= 1ull << (term->order[i] & 63);
+        return true;
+    }
+    // Otherwise the column is scanned. Each distinct gender is matched once,
+    // and rows only look up their code.
+    ScanSlice scan = {.store = store};
+    uint64_t gender_hits[INTERN_MAX_VALUES / 64 + 1];
+    switch (term->kind) {
+        case TERM_NAME:
+            scan.column = SCAN_NAME;
+            scan.folded_name = folded_name;
+            scan.name_len = strlen(folded_name);
+            break;
+        case TERM_GENDER: {
+            size_t prefix_len = strlen(query->gender);
+            memset(gender_hits, 0, (store->genders.count + 63) / 64 * sizeof(uint64_t));
+            for (size_t code = 0; code < store->genders.count; code++) {
+                if (gender_matches(store->genders.values[code], query->gender, prefix_len)) {
+                    gender_hits[code >> 6] |= 1ull << (code & 63);
+                }
+            }
+            scan.column = SCAN_GENDER;
+            scan.gender_hits = gender_hits;
+            break;
+        }
+        case TERM_AGE:
+            scan.column = SCAN_AGE;
+            scan.min = query->age_min;
+            scan.max = query->age_max;
+            break;
+        case TERM_ADDED:
+            scan.column = SCAN_ADDED;
+            scan.min = query->added_min;
+            scan.max = query->added_max;
+            break;
+    }
+    return scan_column(&scan, words);
+}
+
+// Plans one range term over the key's maintained order, if there is one
+static void plan_range(PatientStore *store, QueryTerm *term, PatientSortKey key, int64_t min, int64_t max) {
+    term->order = patient_store_order(store, key);
+    if (!term->order) {
+        term->estimate = store->count;
+        return;
+    }
+    term->first = order_lower_bound(store, term->kind, term->order, min);
+    term->last = max == INT64_MAX ? store->count : order_lower_bound(store, term->kind, term->order, max + 1);
+    if (term->last < term->first) term->last = term->first;
+    term->estimate = term->last - term->first;
+}
+
+static size_t sample_gender(const PatientStore *store, const char *prefix) {
+    if (store->count == 0) return 0;
+    size_t step = store->count > QUERY_GENDER_SAMPLES ? store->count / QUERY_GENDER_SAMPLES : 1;
+    size_t sampled = 0, hits = 0, prefix_len = strlen(prefix);
+    for (size_t row = 0; row < store->count; row += step, sampled++) hits += gender_matches(store_gender(store, row), prefix, prefix_len);
+    return hits * store->count / sampled;
+}
+
+static bool term_needs_scan(const QueryTerm *term) {
+    return !term->order && !term->matches;
+}
+
+// Terms read off an index first, smallest first; a scan costs every row
+// whatever it keeps, so it goes last, where it may be left to row checks
+static int compare_terms(const void *a, const void *b) {
+    const QueryTerm *x = a, *y = b;
+    if (term_needs_scan(x) != term_needs_scan(y)) return term_needs_scan(x) ? 1 : -1;
+    return (x->estimate > y->estimate) - (x->estimate < y->estimate);
+}
+
+// Evaluates the terms, cheapest first, into the ascending handles that pass them all
+static long run_query(const PatientStore *store, const PatientQuery *query, QueryTerm *terms, size_t n_terms,
+                      const char *folded_name, PatientHandle **handles) {
+    qsort(terms, n_terms, sizeof(QueryTerm), compare_terms);
+    size_t n_words = (store->next_handle + 63) / 64;
+    uint64_t *words = calloc(n_words ? n_words : 1, sizeof(uint64_t));
+    if (!words) return -1;
+
+    IdBitmap *result = NULL;
+    bool probe[4] = {false};
+    for (size_t t = 0; t < n_terms; t++) {
+        const QueryTerm *term = &terms[t];
+        if (result) {
+            size_t candidates = id_bitmap_count(result);
+            size_t cost = term_needs_scan(term) ? store->count : term->estimate;
+            if (candidates * QUERY_PROBE_SHARE <= cost) {
+                probe[t] = true;
+                continue;
+            }
+        }
+        IdBitmap *bitmap;
+        if (term->matches) {
+            bitmap = id_bitmap_from_sorted(term->matches, term->n_matches);
+        } else {
+            memset(words, 0, n_words * sizeof(uint64_t));
+            bitmap = term_fill_words(store, query, term, folded_name, words) ? id_bitmap_from_words(words, n_words)
+                                                                             : NULL;
+        }
+        if (!bitmap || (result && id_bitmap_and(result, bitmap) != 0)) {
+            id_bitmap_free(bitmap);
+            id_bitmap_free(result);
+            free(words);
+            return -1;
+        }
+        if (result) id_bitmap_free(bitmap);
+        else result = bitmap;
+    }
+    free(words);
+
+    size_t count = id_bitmap_count(result);
+    PatientHandle *out = malloc((count ? count : 1) * sizeof(PatientHandle));
+    if (!out) {
+        id_bitmap_free(result);
+        return -1;
+    }
+    id_bitmap_to_array(result, out);
+    id_bitmap_free(result);
+    // The few survivors are checked against the rest directly
+    for (size_t t = 0; t < n_terms; t++) {
+        if (!probe[t]) continue;
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (term_holds(store, query, &terms[t], folded_name, out[i])) out[kept++] = out[i];
+        }
+        count = kept;
+    }
+    *handles = out;
+    return count;
+}
+
+long patient_store_query(PatientStore *store, const PatientQuery *query, PatientHandle **handles) {
+    *handles = NULL;
+    if (query->id) {
+        // At most one patient has the MRN; the other terms need only check it
+        LatencyProbe probe = latency_begin(LATENCY_SEARCH);
+        PatientHandle handle = patient_store_find_id(store, query->id);
+        PatientHandle *out = malloc(sizeof(PatientHandle));
+        long count = out ? 0 : -1;
+        if (out && handle != PATIENT_NO_HANDLE && patient_store_query_matches(store, query, handle)) out[count++] = handle;
+        *handles = out;
+        latency_end(probe);
+        if (count < 0) errno = ENOMEM;
+        return count;
+    }
+    LatencyProbe probe = latency_begin(LATENCY_SEARCH);
+    QueryTerm terms[4];
+    size_t n_terms = 0;
+    memset(terms, 0, sizeof(terms));
+    char *folded_name = query->name ? fold_needle(query->name) : NULL;
+    bool ok = !query->name || folded_name;
+    if (ok && query->name) {
+        QueryTerm *term = &terms[n_terms++];
+        term->kind = TERM_NAME;
+        term->estimate = store->count;
+        if (store->name_index && strlen(folded_name) >= 3) {
+            // The index answers at once, and the answer is the best estimate
+            long n = patient_store_match(store, folded_name, &term->matches);
+            ok = n >= 0;
+            term->n_matches = term->estimate = ok ? n : 0;
+        }
+    }
+    if (query->gender) {
+        terms[n_terms].kind = TERM_GENDER;
+        terms[n_terms++].estimate = sample_gender(store, query->gender);
+    }
+    if (patient_query_has_age(query)) {
+        terms[n_terms].kind = TERM_AGE;
+        plan_range(store, &terms[n_terms++], PATIENT_SORT_AGE, query->age_min, query->age_max);
+    }
+    if (patient_query_has_added(query)) {
+        terms[n_terms].kind = TERM_ADDED;
+        plan_range(store, &terms[n_terms++], PATIENT_SORT_ADDED, query->added_min, query->added_max);
+    }
+
+    long count = -1;
+    if (!ok) {
+        // Out of memory
+    } else if (n_terms == 0) {
+        // Everyone, in handle order
+        PatientHandle *out = malloc((store->count ? store->count : 1) * sizeof(PatientHandle));
+        count = out ? 0 : -1;
+        for (PatientHandle handle = 0; out && handle < store->next_handle; handle++) {
+            if (store->row_of_handle[handle] != PATIENT_NO_HANDLE) out[count++] = handle;
+        }
+        *handles = out;
+    } else {
+        count = run_query(store, query, terms, n_terms, folded_name, handles);
+    }
+    for (size_t i = 0; i < n_terms; i++) free(terms[i].matches);
+    free(folded_name);
+    latency_end(probe);
+    if (count < 0) errno = ENOMEM;
+    return count;
+}
+
+int patient_store_query_matches(const PatientStore *store, const PatientQuery *query, PatientHandle handle) {
+    long row = patient_store_find(store, handle);
+    if (row < 0) return 0;
+    if (query->id && store->ids[row] != query->id) return 0;
+    if (query->gender && !gender_matches(store_gender(store, row), query->gender, strlen(query->gender))) return 0;
+    if (store->ages[row] < query->age_min || store->ages[row] > query->age_max) return 0;
+    if (store->added[row] < query->added_min || store->added[row] > query->added_max) return 0;
+    return !query->name || patient_store_name_matches(store, handle, query->name);
+}
+
+size_t patient_store_search(PatientStore *store, const PatientQuery *query, PatientVisitFunc visit, void *user_data) {
+    PatientHandle *handles;
+    long count = patient_store_query(store, query, &handles);
+    for (long i = 0; visit && i < count; i++) {
+        long row = patient_store_find(store, handles[i]);
+        PatientRecord record;
+        patient_store_get(store, row, &record);
+        visit(&record, row, user_data);
+    }
+    free(handles);
+    return count > 0 ? count : 0;
+}
+
+int patient_store_sync(PatientStore *store) {
+    PatientJournal *journal = &store->journal;
+    LatencyProbe probe = latency_begin(LATENCY_SAVE);
+    pthread_mutex_lock(&journal->lock);
+    uint64_t target = journal->next_lsn - 1;
+    while (journal->durable_lsn < target && !journal->failed && journal->running) {
+        pthread_cond_wait(&journal->cond, &journal->lock);
+    }
+    bool ok = journal->durable_lsn >= target;
+    pthread_mutex_unlock(&journal->lock);
+    latency_end(probe);
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    const PatientStore *store;
+    PatientHandle next;
+} StoreCursor;
+
+// Rows go out in handle order, so the saved sort orders can name them by
+// rank; archived ones stay in the archive
+static bool store_next_row(void *state, Buffer *row) {
+    StoreCursor *cursor = state;
+    while (cursor->next < cursor->store->next_handle) {
+        PatientHandle handle = cursor->next++;
+        uint32_t row_index = cursor->store->row_of_handle[handle];
+        if (row_index != PATIENT_NO_HANDLE && !store_is_archived(cursor->store, handle)) {
+            return store_row_text(cursor->store, row_index, row);
+        }
+    }
+    return false;
+}
+
+// Writes the rows in memory to path, stamped with the durable lsn. Background
+// compaction is held off until store_end_rewrite, so the caller can act on
+// the result first.
+static bool store_rewrite(PatientStore *store, const char *path, const char *tmp_path, PatientFileFormat format,
+                          uint64_t *lsn) {
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_lock(&journal->lock);
+    while (journal->compacting) pthread_cond_wait(&journal->cond, &journal->lock);
+    journal->compacting = true;
+    *lsn = journal->durable_lsn;
+    pthread_mutex_unlock(&journal->lock);
+
+    StoreCursor cursor = { store, 0 };
+    LatencyProbe probe = latency_begin(LATENCY_COMPACT);
+    bool ok = write_snapshot(path, tmp_path, *lsn, store->next_id, format, store_next_row, &cursor);
+    if (ok) store_write_orders(store, path, *lsn);
+    latency_end(probe);
+    return ok;
+}
+
+// Called with the journal lock held
+static void store_end_rewrite(PatientStore *store) {
+    store->journal.compacting = false;
+    pthread_cond_broadcast(&store->journal.cond);
+}
+
+int patient_store_compact(PatientStore *store) {
+    if (!store->path) return 0;     // Nothing on disk to fold
+    if (patient_store_sync(store) != 0) return -1;
+    PatientJournal *journal = &store->journal;
+    uint64_t lsn;
+    bool ok = store_rewrite(store, store->path, store->tmp_path, store->format, &lsn);
+    bool folded = ok && history_fold(store, store->compacting_path) && history_fold(store, store->journal_path);
+
+    pthread_mutex_lock(&journal->lock);
+    if (folded) {
+        // Every journalled record is now in the snapshot and the change history
+        unlink(store->compacting_path);
+        if (journal->fd >= 0 && journal->durable_lsn == lsn && journal->pending.len == 0 && ftruncate(journal->fd, 0) == 0) {
+            journal->size = 0;
+        }
+    }
+    store_end_rewrite(store);
+    pthread_mutex_unlock(&journal->lock);
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+int patient_store_write_snapshot(PatientStore *store, const char *path, PatientFileFormat format) {
+    if (patient_store_sync(store) != 0) return -1;
+    char *tmp_path = derive_path(path, ".tmp", false);
+    if (!tmp_path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    uint64_t lsn;
+    bool ok = store_rewrite(store, path, tmp_path, format, &lsn);
+    pthread_mutex_lock(&store->journal.lock);
+    store_end_rewrite(store);
+    pthread_mutex_unlock(&store->journal.lock);
+    free(tmp_path);
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
+
+// --- Cold Archive ---
+
+// Writes the records under handles, all of one month, to a new part file
+static bool write_archive_part(const PatientStore *store, const char *path, uint64_t lsn, const PatientHandle *handles,
+                               size_t count) {
+    char *tmp_path = derive_path(path, ".tmp", false);
+    gzFile gz = tmp_path ? gzopen(tmp_path, ARCHIVE_GZIP_MODE) : NULL;
+    bool ok = gz != NULL;
+    if (ok) gzbuffer(gz, ARCHIVE_READ_BYTES);
+    ok = ok && gzprintf(gz, SNAPSHOT_HEADER "%llu\n", (unsigned long long)lsn) > 0;
+    Buffer row = {0};
+    for (size_t i = 0; ok && i < count; i++) {
+        row.len = 0;
+        ok = store_row_text(store, store->row_of_handle[handles[i]], &row) && buffer_printf(&row, "\n")
+             && gzwrite(gz, row.data, row.len) == (int)row.len;
+    }
+    buffer_free(&row);
+    if (gz && gzclose(gz) != Z_OK) ok = false;
+    ok = ok && fsync_path(tmp_path) && rename(tmp_path, path) == 0;
+    if (!ok && tmp_path) unlink(tmp_path);
+    free(tmp_path);
+    return ok;
+}
+
+// Writes the part files first and the snapshot without their records last,
+// so a crash in between leaves parts that the next open removes
+static long archive_records(PatientStore *store, int64_t before) {
+    int64_t cutoff = month_start(before);
+    if (cutoff == PATIENT_TIME_UNKNOWN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (patient_store_sync(store) != 0) return -1;
+    const PatientHandle *order = patient_store_order(store, PATIENT_SORT_ADDED);
+    PatientHandle *picked = order ? malloc((store->count ? store->count : 1) * sizeof(PatientHandle)) : NULL;
+    if (!picked || !store_track_archived(store)) {
+        free(picked);
+        errno = ENOMEM;
+        return -1;
+    }
+    // Undated records sort first and stay
+    size_t n = 0;
+    for (size_t i = 0; i < store->count; i++) {
+        PatientHandle handle = order[i];
+        int64_t added = store->added[store->row_of_handle[handle]];
+        if (added >= cutoff) break;
+        if (!store_is_archived(store, handle) && month_start(added) != PATIENT_TIME_UNKNOWN) picked[n++] = handle;
+    }
+    if (n == 0) {
+        free(picked);
+        return 0;
+    }
+    if (mkdir(store->archive_path, 0755) != 0 && errno != EEXIST) {
+        free(picked);
+        return -1;
+    }
+
+    // This run gets an lsn of its own, which no journal record carries, so its
+    // parts can be told apart from those of every other run
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_lock(&journal->lock);
+    while (journal->compacting) pthread_cond_wait(&journal->cond, &journal->lock);
+    journal->compacting = true;
+    uint64_t lsn = journal->next_lsn++;
+    journal->durable_lsn = lsn;
+    pthread_mutex_unlock(&journal->lock);
+
+    size_t first_part = store->n_parts;
+    bool ok = true;
+    for (size_t i = 0; ok && i < n;) {
+        int64_t month = month_start(store->added[store->row_of_handle[picked[i]]]);
+        int64_t next = month_end(month);
+        size_t end = i + 1;
+        while (end < n && store->added[store->row_of_handle[picked[end]]] < next) end++;
+        char *path = archive_part_path(store->archive_path, month, lsn);
+        ok = path && store_add_part(store, month, path, true);
+        if (!ok) free(path);
+        ok = ok && write_archive_part(store, path, lsn, picked + i, end - i);
+        i = end;
+    }
+    ok = ok && fsync_path(store->archive_path);
+    if (ok) {
+        for (size_t i = 0; i < n; i++) store_set_archived(store, picked[i], true);
+        StoreCursor cursor = { store, 0 };
+        ok = write_snapshot(store->path, store->tmp_path, lsn, store->next_id, store->format, store_next_row, &cursor);
+        if (ok) store_write_orders(store, store->path, lsn);
+        if (!ok) {
+            for (size_t i = 0; i < n; i++) store_set_archived(store, picked[i], false);
+        }
+    }
+    free(picked);
+    bool folded = ok && history_fold(store, store->compacting_path) && history_fold(store, store->journal_path);
+
+    pthread_mutex_lock(&journal->lock);
+    if (folded) {
+        // As after a compaction, the snapshot holds every journalled record
+        unlink(store->compacting_path);
+        if (journal->fd >= 0 && journal->durable_lsn == lsn && journal->pending.len == 0 && ftruncate(journal->fd, 0) == 0) {
+            journal->size = 0;
+        }
+    }
+    store_end_rewrite(store);
+    pthread_mutex_unlock(&journal->lock);
+    if (!ok) {
+        for (size_t i = first_part; i < store->n_parts; i++) {
+            unlink(store->parts[i].path);
+            free(store->parts[i].path);
+        }
+        store->n_parts = first_part;
+        errno = EIO;
+        return -1;
+    }
+    qsort(store->parts, store->n_parts, sizeof(ArchivePart), compare_parts);
+    return (long)n;
+}
+
+long patient_store_archive(PatientStore *store, int64_t before) {
+    if (!store->path) return 0;     // Nothing on disk to archive into
+    LatencyProbe probe = latency_begin(LATENCY_COMPACT);
+    long result = archive_records(store, before);
+    latency_end(probe);
+    return result;
+}
+
+typedef struct {
+    ArchivePart *part;
+    char *data;             // The whole part, gunzipped; the chunk splits it in place
+    LoaderChunk chunk;
+    int error;
+    PatientHandle first;    // The records went in under handles first on...
+    bool renumbered;        // ...and some under an MRN the part doesn't name
+} ArchiveLoad;
+
+typedef struct {
+    ArchiveLoad *loads;
+    size_t count;
+    size_t first;           // Takes every step-th load from first on
+    size_t step;
+} ArchiveWorker;
+
+// Reads a whole gzipped part into memory and parses it
+static void archive_read_part(ArchiveLoad *load) {
+    gzFile gz = gzopen(load->part->path, "rb");
+    if (!gz) {
+        load->error = errno ? errno : ENOMEM;
+        return;
+    }
+    gzbuffer(gz, ARCHIVE_READ_BYTES);
+    size_t len = 0, cap = ARCHIVE_READ_BYTES;
+    char *data = malloc(cap);
+    if (!data) load->error = ENOMEM;
+    while (!load->error) {
+        if (len == cap) {
+            char *grown = realloc(data, cap * 2);
+            if (!grown) {
+                load->error = ENOMEM;
+                break;
+            }
+            data = grown;
+            cap *= 2;
+        }
+        int n = gzread(gz, data + len, cap - len > INT_MAX ? INT_MAX : (unsigned)(cap - len));
+        if (n < 0) load->error = EIO;   // Truncated or corrupt
+        if (n <= 0) break;
+        len += n;
+    }
+    gzclose(gz);
+    if (load->error) {
+        free(data);
+        return;
+    }
+    load->data = data;
+    load->chunk.start = data;
+    load->chunk.end = data + len;
+    loader_parse_chunk(&load->chunk);
+}
+
+static void* archive_load_worker(void *data) {
+    ArchiveWorker *worker = data;
+    for (size_t i = worker->first; i < worker->count; i += worker->step) archive_read_part(&worker->loads[i]);
+    return NULL;
+}
+
+// Writes the MRNs given to the records of parts from before MRNs back into
+// those parts, under the same names. The snapshot is saved first, so that
+// its next MRN is past them before any part names them; a crash in between
+// only leaves a gap in the numbering.
+static void renumber_archive_parts(PatientStore *store, const ArchiveLoad *loads, size_t n) {
+    bool any = false;
+    for (size_t l = 0; l < n; l++) any = any || loads[l].renumbered;
+    if (!any || patient_store_compact(store) != 0) return;
+    for (size_t l = 0; l < n; l++) {
+        const ArchiveLoad *load = &loads[l];
+        if (!load->renumbered) continue;
+        PatientHandle *handles = malloc(load->chunk.count * sizeof(PatientHandle));
+        for (size_t i = 0; handles && i < load->chunk.count; i++) handles[i] = load->first + i;
+        if (!handles || !write_archive_part(store, load->part->path, load->chunk.lsn, handles, load->chunk.count)) {
+            fprintf(stderr, "Could not save the MRNs given to the patients in %s\n", load->part->path);
+        }
+        free(handles);
+    }
+}
+
+// Parts are read and parsed one per worker at a time; the records go into
+// the store on this thread, in month order, with the orders set aside
+static long load_archive(PatientStore *store, int64_t from, int64_t to, PatientHandle *first) {
+    if (first) *first = store->next_handle;
+    size_t n = 0;
+    for (size_t i = 0; i < store->n_parts; i++) {
+        const ArchivePart *part = &store->parts[i];
+        n += !part->loaded && part->month <= to && month_end(part->month) > from;
+    }
+    if (n == 0) return 0;
+    unsigned n_workers = online_cpus();
+    if (n_workers > n) n_workers = n;
+    ArchiveLoad *loads = calloc(n, sizeof(ArchiveLoad));
+    ArchiveWorker *workers = calloc(n_workers, sizeof(ArchiveWorker));
+    pthread_t *threads = calloc(n_workers, sizeof(pthread_t));
+    bool *started = calloc(n_workers, sizeof(bool));
+    if (!loads || !workers || !threads || !started) {
+        free(loads); free(workers); free(threads); free(started);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0, l = 0; i < store->n_parts; i++) {
+        ArchivePart *part = &store->parts[i];
+        if (!part->loaded && part->month <= to && month_end(part->month) > from) loads[l++].part = part;
+    }
+    for (unsigned w = 0; w < n_workers; w++) {
+        workers[w] = (ArchiveWorker){ loads, n, w, n_workers };
+        if (w > 0) started[w] = pthread_create(&threads[w], NULL, archive_load_worker, &workers[w]) == 0;
+        if (w > 0 && !started[w]) archive_load_worker(&workers[w]);
+    }
+    archive_load_worker(&workers[0]);
+    for (unsigned w = 0; w < n_workers; w++) {
+        if (started[w]) pthread_join(threads[w], NULL);
+    }
+    free(workers);
+    free(threads);
+    free(started);
+
+    size_t rows = 0;
+    for (size_t l = 0; l < n; l++) rows += loads[l].chunk.count;
+    bool room = store_track_archived(store) && store_reserve(store, rows);
+    int error = room ? 0 : ENOMEM;
+    PatientHandle *orders[PATIENT_SORT_ADDED + 1];
+    store_detach_orders(store, orders);
+    size_t old_count = store->count;
+    PatientHandle start = store->next_handle;
+    for (size_t l = 0; l < n; l++) {
+        ArchiveLoad *load = &loads[l];
+        if (load->error) {
+            error = load->error;
+        } else if (room) {
+            load->first = store->next_handle;
+            for (size_t i = 0; i < load->chunk.count; i++) {
+                PatientFields *f = &load->chunk.rows[i];
+                PatientHandle handle;
+                room = store_insert(store, store->next_handle, f->id, f->name, f->age, f->gender,
+                                    patient_time_parse(f->added), &handle);
+                if (!room) {
+                    error = ENOMEM;
+                    break;
+                }
+                store_set_archived(store, handle, true);
+                if (store->ids[store->count - 1] != f->id) load->renumbered = true;
+            }
+            load->renumbered = load->renumbered && room;
+            // Even cut short, so that no record can come in twice
+            load->part->loaded = true;
+        }
+        free(load->chunk.rows);
+        free(load->chunk.tail);
+        free(load->data);
+    }
+    store_attach_orders(store, orders, old_count, start);
+    renumber_archive_parts(store, loads, n);
+    free(loads);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return (long)(store->count - old_count);
+}
+
+long patient_store_load_archive(PatientStore *store, int64_t from, int64_t to, PatientHandle *first) {
+    LatencyProbe probe = latency_begin(LATENCY_LOAD);
+    long result = load_archive(store, from, to, first);
+    latency_end(probe);
+    return result;
+}
+
+int64_t patient_store_archive_horizon(const PatientStore *store) {
+    for (size_t i = store->n_parts; i-- > 0;) {
+        if (!store->parts[i].loaded) return month_end(store->parts[i].month);
+    }
+    return PATIENT_TIME_UNKNOWN;
+}
+
+// --- Change Tracking ---
+//
+// The net change between the registry at a watermark and now, worked out
+// from the change history and the journal as a difference of rows: a row
+// written since and still there is an upsert, a row there at the watermark
+// and gone since is a delete (an edit is both). A row added and removed in
+// between cancels out, as does one removed and put back, so a change set
+// grows with how many rows changed, not with how often or how many there are.
+
+struct PatientChanges {
+    StrMap upserts;         // Row text -> rows written after the watermark and live now; items index lsns
+    StrMap deletes;         // Row text -> rows live at the watermark and gone now
+    uint64_t *lsns;         // The record that wrote or removed each of those rows
+    size_t n_lsns;
+    size_t cap_lsns;
+    uint64_t lsn;           // Highest record applied
+    bool failed;            // Memory ran out
+    PatientChange *changes; // In seq order, strings pointing into the map keys
+    size_t count;
+    PatientSnapshot *full;  // Set instead when the changes since the watermark aren't all known
+    uint64_t watermark;
+};
+
+static void change_note(PatientChanges *set, StrMap *map, const char *row, uint64_t lsn) {
+    if (set->n_lsns == set->cap_lsns) {
+        size_t cap = set->cap_lsns ? set->cap_lsns * 2 : 1024;
+        uint64_t *lsns = realloc(set->lsns, cap * sizeof(uint64_t));
+        if (!lsns) {
+            set->failed = true;
+            return;
+        }
+        set->lsns = lsns;
+        set->cap_lsns = cap;
+    }
+    if (!strmap_push(map, row, set->n_lsns)) {
+        set->failed = true;
+        return;
+    }
+    set->lsns[set->n_lsns++] = lsn;
+}
+
+// Uses up one row of row in map, if it has any
+static bool change_cancel(StrMap *map, const char *row) {
+    StrMapEntry *entry = strmap_lookup(map, row, false);
+    if (!entry || entry->len == 0) return false;
+    entry->len--;
+    map->total--;
+    return true;
+}
+
+static void change_write(PatientChanges *set, const char *row, uint64_t lsn) {
+    if (!change_cancel(&set->deletes, row)) change_note(set, &set->upserts, row, lsn);
+}
+
+static void change_remove(PatientChanges *set, const char *row, uint64_t lsn) {
+    if (!change_cancel(&set->upserts, row)) change_note(set, &set->deletes, row, lsn);
+}
+
+// Applies the whole records in [data, data + length) newer than set->lsn,
+// splitting them in place
+static void changes_replay(PatientChanges *set, char *data, size_t length) {
+    for (char *line = data; line < data + length && !set->failed;) {
+        char *end = memchr(line, '\n', data + length - line);
+        if (!end) break;
+        *end = '\0';
+        char *fields[4];
+        int n = split_journal_record(line, fields);
+        uint64_t lsn = n ? strtoull(fields[0], NULL, 10) : 0;
+        if (lsn > set->lsn) {
+            switch (fields[1][0]) {
+            case JOURNAL_ADD:
+                change_write(set, fields[2], lsn);
+                break;
+            case JOURNAL_DELETE:
+                change_remove(set, fields[2], lsn);
+                break;
+            case JOURNAL_UPDATE:
+                if (n == 4) {
+                    change_remove(set, fields[2], lsn);
+                    change_write(set, fields[3], lsn);
+                }
+                break;
+            }
+            set->lsn = lsn;
+        }
+        line = end + 1;
+    }
+}
+
+// Replays the history from the first record after set->lsn, mapped
+// copy-on-write so only the pages replayed are copied
+static bool changes_replay_history(PatientChanges *set, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT;
+    struct stat st;
+    char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    if (!map) return true;
+    size_t start = history_seek(map, st.st_size, set->lsn);
+    changes_replay(set, map + start, st.st_size - start);
+    munmap(map, st.st_size);
+    return true;
+}
+
+static void changes_replay_journal(PatientChanges *set, const char *path) {
+    size_t length = 0;
+    char *contents = read_file(path, &length);
+    if (contents) changes_replay(set, contents, length);
+    free(contents);
+}
+
+static int compare_changes(const void *a, const void *b) {
+    const PatientChange *x = a, *y = b;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return (x->kind > y->kind) - (x->kind < y->kind);
+}
+
+// Turns what is left in the maps into the list of changes
+static bool changes_collect(PatientChanges *set) {
+    size_t n = set->upserts.total + set->deletes.total;
+    set->changes = malloc((n ? n : 1) * sizeof(PatientChange));
+    if (!set->changes) return false;
+    StrMap *maps[2] = { &set->upserts, &set->deletes };
+    for (int m = 0; m < 2; m++) {
+        for (size_t i = 0; i < maps[m]->capacity; i++) {
+            StrMapEntry *entry = &maps[m]->entries[i];
+            PatientFields f;
+            if (!entry->key || entry->len == 0) continue;
+            if (!split_patient_line(entry->key, entry->key + strlen(entry->key), &f)) continue;
+            PatientRecord record = { PATIENT_NO_HANDLE, f.id, f.name, f.gender, patient_time_parse(f.added), f.age };
+            for (uint32_t j = 0; j < entry->len; j++) {
+                PatientChangeKind kind = m == 0 ? PATIENT_CHANGE_UPSERT : PATIENT_CHANGE_DELETE;
+                set->changes[set->count++] = (PatientChange){ kind, set->lsns[entry->items[j]], record };
+            }
+        }
+    }
+    qsort(set->changes, set->count, sizeof(PatientChange), compare_changes);
+    return true;
+}
+
+static PatientChanges* store_changes(PatientStore *store, uint64_t since) {
+    PatientChanges *set = calloc(1, sizeof(PatientChanges));
+    if (!set) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!store->path) {
+        // A store in memory only has no history to tell changes from
+        set->full = patient_store_snapshot(store);
+        if (!set->full) {
+            free(set);
+            return NULL;
+        }
+        return set;
+    }
+    if (patient_store_sync(store) != 0) {
+        free(set);
+        return NULL;
+    }
+    // No compaction may move records between the journal and the history meanwhile
+    PatientJournal *journal = &store->journal;
+    pthread_mutex_lock(&journal->lock);
+    while (journal->compacting) pthread_cond_wait(&journal->cond, &journal->lock);
+    journal->compacting = true;
+    set->watermark = journal->durable_lsn;
+    pthread_mutex_unlock(&journal->lock);
+
+    bool ok;
+    if (!patient_store_changes_kept(store, since)) {
+        set->full = patient_store_snapshot(store);
+        ok = set->full != NULL;
+    } else {
+        set->lsn = since;
+        ok = changes_replay_history(set, store->changes_path);
+        changes_replay_journal(set, store->compacting_path);
+        changes_replay_journal(set, store->journal_path);
+        ok = ok && !set->failed && changes_collect(set);
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    store_end_rewrite(store);
+    pthread_mutex_unlock(&journal->lock);
+    if (!ok) {
+        patient_changes_free(set);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return set;
+}
+
+bool patient_store_changes_kept(const PatientStore *store, uint64_t since) {
+    return store->path && since > 0 && since >= store->changes_floor && since < store->journal.next_lsn;
+}
+
+PatientChanges* patient_store_changes(PatientStore *store, uint64_t since) {
+    LatencyProbe probe = latency_begin(LATENCY_CHANGES);
+    PatientChanges *set = store_changes(store, since);
+    latency_end(probe);
+    return set;
+}
+
+bool patient_changes_full(const PatientChanges *changes) {
+    return changes->full != NULL;
+}
+
+uint64_t patient_changes_watermark(const PatientChanges *changes) {
+    return changes->watermark;
+}
+
+size_t patient_changes_count(const PatientChanges *changes) {
+    return changes->full ? patient_snapshot_count(changes->full) : changes->count;
+}
+
+void patient_changes_get(const PatientChanges *changes, size_t i, PatientChange *change) {
+    if (changes->full) {
+        change->kind = PATIENT_CHANGE_UPSERT;
+        change->seq = changes->watermark;
+        patient_snapshot_get(changes->full, i, &change->record);
+    } else {
+        *change = changes->changes[i];
+    }
+}
+
+void patient_changes_free(PatientChanges *changes) {
+    if (!changes) return;
+    strmap_free(&changes->upserts);
+    strmap_free(&changes->deletes);
+    free(changes->lsns);
+    free(changes->changes);
+    patient_snapshot_free(changes->full);
+    free(changes);
+}
+
+// A snapshot with room for count rows, holding the store's strings
+static PatientSnapshot* snapshot_new(const PatientStore *store, size_t count) {
+    PatientSnapshot *snapshot = calloc(1, sizeof(PatientSnapshot));
+    size_t n = count ? count : 1;
+    size_t n_genders = store->genders.count ? store->genders.count : 1;
+    if (snapshot) {
+        snapshot->names = malloc(n * sizeof(*snapshot->names));
+        snapshot->gender_codes = malloc(n * sizeof(*snapshot->gender_codes));
+        snapshot->gender_values = malloc(n_genders * sizeof(*snapshot->gender_values));
+        snapshot->ages = malloc(n * sizeof(*snapshot->ages));
+        snapshot->added = malloc(n * sizeof(*snapshot->added));
+        snapshot->ids = malloc(n * sizeof(*snapshot->ids));
+        snapshot->handles = malloc(n * sizeof(*snapshot->handles));
+    }
+    if (!snapshot || !snapshot->names || !snapshot->gender_codes || !snapshot->gender_values || !snapshot->ages
+        || !snapshot->added || !snapshot->ids || !snapshot->handles) {
+        patient_snapshot_free(snapshot);
+        errno = ENOMEM;
+        return NULL;
+    }
+    // The strings stay where they are: the snapshot keeps the arena blocks
+    // alive through any later compaction
+    memcpy(snapshot->gender_values, store->genders.values, store->genders.count * sizeof(*snapshot->gender_values));
+    snapshot->strings = arena_hold(&store->strings);
+    snapshot->count = count;
+    return snapshot;
+}
+
+PatientSnapshot* patient_store_snapshot(const PatientStore *store) {
+    PatientSnapshot *snapshot = snapshot_new(store, store->count);
+    if (!snapshot) return NULL;
+    memcpy(snapshot->names, store->names, store->count * sizeof(*snapshot->names));
+    memcpy(snapshot->gender_codes, store->gender_codes, store->count * sizeof(*snapshot->gender_codes));
+    memcpy(snapshot->ages, store->ages, store->count * sizeof(*snapshot->ages));
+    memcpy(snapshot->added, store->added, store->count * sizeof(*snapshot->added));
+    memcpy(snapshot->ids, store->ids, store->count * sizeof(*snapshot->ids));
+    memcpy(snapshot->handles, store->handles, store->count * sizeof(*snapshot->handles));
+    return snapshot;
+}
+
+PatientSnapshot* patient_store_snapshot_of(const PatientStore *store, const PatientHandle *handles, size_t count) {
+    PatientSnapshot *snapshot = snapshot_new(store, count);
+    if (!snapshot) return NULL;
+    for (size_t i = 0; i < count; i++) {
+        size_t row = store->row_of_handle[handles[i]];
+        snapshot->names[i] = store->names[row];
+        snapshot->gender_codes[i] = store->gender_codes[row];
+        snapshot->ages[i] = store->ages[row];
+        snapshot->added[i] = store->added[row];
+        snapshot->ids[i] = store->ids[row];
+        snapshot->handles[i] = handles[i];
+    }
+    return snapshot;
+}
+
+size_t patient_snapshot_count(const PatientSnapshot *snapshot) {
+    return snapshot->count;
+}
+
+void patient_snapshot_get(const PatientSnapshot *snapshot, size_t row, PatientRecord *record) {
+    record->handle = snapshot->handles[row];
+    record->id = snapshot->ids[row];
+    record->name = snapshot->names[row];
+    record->gender = snapshot->gender_values[snapshot->gender_codes[row]];
+    record->added = snapshot->added[row];
+    record->age = snapshot->ages[row];
+}
+
+void patient_snapshot_free(PatientSnapshot *snapshot) {
+    if (!snapshot) return;
+    free(snapshot->names);
+    free(snapshot->gender_codes);
+    free(snapshot->gender_values);
+    free(snapshot->ages);
+    free(snapshot->added);
+    free(snapshot->ids);
+    free(snapshot->handles);
+    arena_drop(snapshot->strings);
+    free(snapshot);
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar (H. Hinnant's
+// days_from_civil and civil_from_days)
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+static void civil_from_days(int64_t z, int64_t *y, unsigned *m, unsigned *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+int64_t patient_time_now(void) {
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    int64_t days = days_from_civil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    return days * 86400 + local.tm_hour * 3600 + local.tm_min * 60;
+}
+
+static bool parse_digits(const char *text, int n, unsigned *value) {
+    *value = 0;
+    for (int i = 0; i < n; i++) {
+        if (text[i] < '0' || text[i] > '9') return false;
+        *value = *value * 10 + (text[i] - '0');
+    }
+    return true;
+}
+
+int64_t patient_time_parse(const char *text) {
+    unsigned year, month, day, hour, minute;
+    if (strlen(text) != PATIENT_ADDED_LEN - 1 || text[4] != '-' || text[7] != '-' || text[10] != ' '
+        || text[13] != ':' || !parse_digits(text, 4, &year) || !parse_digits(text + 5, 2, &month)
+        || !parse_digits(text + 8, 2, &day) || !parse_digits(text + 11, 2, &hour)
+        || !parse_digits(text + 14, 2, &minute)) {
+        return PATIENT_TIME_UNKNOWN;
+    }
+    int64_t epoch = (days_from_civil(year, month, day) * 24 + hour) * 3600 + minute * 60;
+    // Out-of-range fields (2026-02-30, 25:00) would come back different
+    char check[PATIENT_ADDED_LEN];
+    patient_time_format(epoch, check);
+    return strcmp(check, text) == 0 ? epoch : PATIENT_TIME_UNKNOWN;
+}
+
+static void put_digits(char *out, unsigned value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        out[i] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+void patient_time_format(int64_t epoch, char added[PATIENT_ADDED_LEN]) {
+    if (epoch == PATIENT_TIME_UNKNOWN) {
+        strcpy(added, "?");
+        return;
+    }
+    int64_t days = epoch >= 0 ? epoch / 86400 : -((-epoch + 86399) / 86400);
+    int64_t year;
+    unsigned month, day;
+    civil_from_days(days, &year, &month, &day);
+    if (year < 0 || year > 9999) {
+        strcpy(added, "?");
+        return;
+    }
+    unsigned seconds = (unsigned)(epoch - days * 86400);
+    memcpy(added, "0000-00-00 00:00", PATIENT_ADDED_LEN);
+    put_digits(added, (unsigned)year, 4);
+    put_digits(added + 5, month, 2);
+    put_digits(added + 8, day, 2);
+    put_digits(added + 11, seconds / 3600, 2);
+    put_digits(added + 14, seconds / 60 % 60, 2);
+}
@@ -0,0 +1,278 @@
+#ifndef PATIENT_STORE_H
+#define PATIENT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_query.h"
+
+// --- Patient Record Store ---
+//
+// GTK-free core that owns the patient registry: the in-memory records, the
+// patients.txt snapshot and its journal, search and read snapshots. The GUI and
+// hms-cli both sit on top of this API. A store is not thread-safe; one thread
+// reads and mutates it, while journal writes and compaction run on the
+// store's own background threads.
+//
+// Functions returning int give 0 on success and -1 with errno set on failure.
+
+#define PATIENT_ADDED_LEN 17        // "YYYY-MM-DD HH:MM" plus NUL
+#define PATIENT_NO_HANDLE UINT32_MAX
+#define PATIENT_TIME_UNKNOWN INT64_MIN  // An "added" text that isn't a timestamp
+#define PATIENT_NO_ID 0
+#define PATIENT_MAX_AGE 150
+
+typedef struct PatientStore PatientStore;
+typedef struct PatientSnapshot PatientSnapshot;
+typedef struct PatientStats PatientStats;    // See patient_stats.h
+typedef struct PatientChanges PatientChanges;
+
+// Identifies a record for the lifetime of the open store; rows move on delete, handles don't
+typedef uint32_t PatientHandle;
+// A patient's medical record number (MRN): given once, counting up from 1,
+// when the record is first added, and kept with it on disk through every
+// edit, compaction, archive and conversion. A deleted patient's number is
+// never given out again.
+typedef uint32_t PatientId;
+
+// Borrowed view of one record. The strings stay valid until the next update
+// or delete, which may move every string to give dead ones back; take a
+// snapshot to keep them longer. The record itself may move rows.
+typedef struct {
+    PatientHandle handle;
+    PatientId id;
+    const char *name;
+    const char *gender;
+    int64_t added;          // Admission time; see patient_time_format
+    unsigned age;
+} PatientRecord;
+
+typedef struct {
+    size_t rows;                // Rows in the store after replay
+    size_t bad_lines;           // Snapshot lines that were skipped
+    size_t journal_records;     // Journal records applied on top of the snapshot
+    unsigned threads;           // Parser threads used for the snapshot
+    double seconds;
+} PatientLoadStats;
+
+typedef enum {
+    PATIENT_FORMAT_TEXT,        // name,age,gender,added lines
+    PATIENT_FORMAT_BINARY       // Columnar file that is mapped instead of parsed (see columnar_file.h)
+} PatientFileFormat;
+
+typedef enum {
+    PATIENT_SORT_NAME,
+    PATIENT_SORT_AGE,
+    PATIENT_SORT_GENDER,
+    PATIENT_SORT_ADDED
+} PatientSortKey;
+
+typedef void (*PatientVisitFunc)(const PatientRecord *record, size_t row, void *user_data);
+
+// Opens the registry stored at path (a missing file is an empty registry),
+// in whichever format the file is in. The journal lives next to it, e.g.
+// patients.txt -> patients.journal, and so does the archive of older
+// admissions (patients.archive), which is left on disk until asked for.
+PatientStore* patient_store_open(const char *path, PatientLoadStats *stats);
+// An empty registry that lives in memory only: nothing is read or written,
+// syncing and compacting succeed at once. Used to mirror another store.
+PatientStore* patient_store_new(void);
+// Flushes the journal, waits for a running compaction and frees the store
+void patient_store_close(PatientStore *store);
+
+size_t patient_store_count(const PatientStore *store);
+void patient_store_get(const PatientStore *store, size_t row, PatientRecord *record);
+// Returns the current row of handle, or -1 if it was deleted
+long patient_store_find(const PatientStore *store, PatientHandle handle);
+// The handle of the live record with the given MRN, or PATIENT_NO_HANDLE.
+// A hash lookup, as cheap with ten million records as with ten.
+PatientHandle patient_store_find_id(const PatientStore *store, PatientId id);
+
+// added is the admission time, e.g. patient_time_now(). An empty name or
+// gender, or an age over PATIENT_MAX_AGE, fails with EINVAL; so it does for
+// every add and update below. The in-memory change stands even if the
+// journal write fails; the failure is reported as EIO.
+int patient_store_add(PatientStore *store, const char *name, unsigned age, const char *gender,
+                      int64_t added, PatientHandle *handle);
+// Adds count records (their handles and MRNs are ignored; each gets a new
+// MRN) as one change: they take consecutive handles from *first (may be
+// NULL) and share one journal write. Cheaper than as many single adds, which
+// each shift the sorted orders.
+int patient_store_add_batch(PatientStore *store, const PatientRecord *records, size_t count, PatientHandle *first);
+// Records loaded from the archive are read-only: changing or deleting one
+// fails with EROFS.
+int patient_store_update(PatientStore *store, PatientHandle handle, const char *name, unsigned age,
+                         const char *gender);
+int patient_store_delete(PatientStore *store, PatientHandle handle);
+// Gives each record under records[i].handle the name, age and gender of
+// records[i] (its MRN and admission time stay), as one change with one
+// journal write. Every handle must be live, editable and listed once
+// (else ENOENT, EROFS or EINVAL, and nothing changes). Cheaper than as many
+// single updates, which each shift the sorted orders.
+int patient_store_update_batch(PatientStore *store, const PatientRecord *records, size_t count);
+// Deletes count records as one change with one journal write, all of them
+// or, failing the same checks as patient_store_update_batch, none
+int patient_store_delete_batch(PatientStore *store, const PatientHandle *handles, size_t count);
+// For mirrors of another store: replaces the record under record->handle,
+// or adds it under that very handle and MRN if none is live there (added is
+// only used then)
+int patient_store_put(PatientStore *store, const PatientRecord *record);
+
+// Builds the trigram index over names that patient_store_match uses for
+// needles of three or more bytes, and keeps it up to date from then on.
+// Until then (or if it ever runs out of memory) matching scans every name.
+int patient_store_index_names(PatientStore *store);
+
+// Counts the registry by gender, age and admission time on every core (see
+// patient_stats.h), and keeps the counts up to date through every change
+// from then on, a few increments each. If that ever runs out of memory they
+// are dropped until asked for again.
+int patient_store_track_stats(PatientStore *store);
+// The counts patient_store_track_stats keeps, or NULL if there are none
+const PatientStats* patient_store_stats(const PatientStore *store);
+
+// Stores in *handles (free() it) the ascending handles of every record whose
+// name contains needle, ignoring ASCII case, and returns how many there are,
+// or -1 if memory ran out
+long patient_store_match(const PatientStore *store, const char *needle, PatientHandle **handles);
+
+// Whether the name of a live record contains needle, ignoring ASCII case
+int patient_store_name_matches(const PatientStore *store, PatientHandle handle, const char *needle);
+
+// Orders two live records by key (text ignoring ASCII case first), breaking
+// ties by handle so the order is total
+int patient_store_compare(const PatientStore *store, PatientSortKey key, PatientHandle a, PatientHandle b);
+// Sorts live handles into ascending patient_store_compare order
+int patient_store_sort(const PatientStore *store, PatientSortKey key, PatientHandle *handles, size_t count);
+// Every live handle in ascending key order, for name, age and admission
+// time; NULL for gender, or if memory runs out. The store keeps these orders
+// up to date through every change (and saves them next to its snapshot, so
+// they are usually ready at load), so the pointer is only good until the
+// next add, update or delete. The first call for a key not loaded sorts.
+const PatientHandle* patient_store_order(PatientStore *store, PatientSortKey key);
+
+// Stores in *handles (free() it) the ascending handles of every record that
+// satisfies query (see patient_query.h), and returns how many there are, or
+// -1 if memory ran out. Age and admission ranges use the sorted orders, so
+// the first query that needs one may sort; a query naming an MRN is a single
+// hash lookup.
+long patient_store_query(PatientStore *store, const PatientQuery *query, PatientHandle **handles);
+// Whether a live record satisfies query
+int patient_store_query_matches(const PatientStore *store, const PatientQuery *query, PatientHandle handle);
+
+// Calls visit for every record patient_store_query finds, in handle order,
+// and returns the number of matches
+size_t patient_store_search(PatientStore *store, const PatientQuery *query, PatientVisitFunc visit, void *user_data);
+
+// Blocks until every mutation so far is on disk
+int patient_store_sync(PatientStore *store);
+// Folds the journal into a fresh snapshot right away
+int patient_store_compact(PatientStore *store);
+// Writes every record outside the archive to path in the given format, e.g.
+// to convert a registry. The file records the journal position, so it can
+// be opened in place of the original next to the same journal and archive.
+// Snapshots are written in handle order, with the sort orders alongside
+// (path + ".order").
+int patient_store_write_snapshot(PatientStore *store, const char *path, PatientFileFormat format);
+
+// What the records take in memory. Names live in an arena that is compacted
+// once deletes and edits have left it mostly dead. Each distinct gender is
+// kept once and rows hold a 16-bit code for it, so a store takes at most
+// 65535 distinct genders (more fail with EOVERFLOW). Names in a mapped
+// binary snapshot are file-backed and not counted.
+typedef struct {
+    size_t records;
+    size_t columns;         // Per-record fields, the handle lookup and the MRN index, as allocated
+    size_t strings;         // Arena reserved for names and distinct genders...
+    size_t dead_strings;    // ...of which strings no record uses any more
+    size_t orders;          // Sorted orders by name, age and admission time
+    size_t name_index;      // Trigram index over names
+    size_t total;
+} PatientMemory;
+
+void patient_store_memory(const PatientStore *store, PatientMemory *memory);
+
+// --- Cold Archive ---
+//
+// Admissions of past months can be moved out of the snapshot into gzipped,
+// read-only part files, one or more per calendar month, in a directory next
+// to it (patients.txt -> patients.archive/2025-03.<lsn>.txt.gz). The
+// snapshot, and so every load, compaction and save, then only holds the
+// recent months; the archive is read when something reaches back into it.
+
+// Moves every record admitted before the month that holds before into the
+// archive and rewrites the snapshot without them. They stay in memory,
+// read-only. Returns how many records moved, or -1 with errno set, in which
+// case nothing changed. Undated records always stay in the snapshot.
+long patient_store_archive(PatientStore *store, int64_t before);
+// Loads the archived months not yet loaded that overlap from..to
+// (inclusive), decompressing and parsing them on every core. The records
+// take consecutive handles from *first (may be NULL); returns how many came
+// in, or -1 with errno set if a part could not be read (the others still
+// load).
+long patient_store_load_archive(PatientStore *store, int64_t from, int64_t to, PatientHandle *first);
+// The end of the latest archived month still on disk only: records admitted
+// before it may be missing from the store. PATIENT_TIME_UNKNOWN once
+// everything is loaded.
+int64_t patient_store_archive_horizon(const PatientStore *store);
+
+// --- Change Tracking ---
+//
+// Every add, edit and delete is journalled under a change sequence number
+// (its lsn), and an edit or delete names the row it did away with. Journal
+// records folded into a snapshot are kept in a change history next to the
+// journal (patients.journal -> patients.changes), the oldest dropped once it
+// passes 64 MB, so the changes since a recent enough watermark can be told
+// without looking at the registry itself.
+
+typedef enum {
+    PATIENT_CHANGE_DELETE,      // A row as it was at the watermark, gone since
+    PATIENT_CHANGE_UPSERT       // A row written since, as it is now
+} PatientChangeKind;
+
+typedef struct {
+    PatientChangeKind kind;
+    uint64_t seq;               // The change that wrote or removed the row
+    PatientRecord record;       // Without a handle
+} PatientChange;
+
+// Whether every change after the watermark since is still known. Never for
+// 0, no watermark at all: a first export starts over.
+bool patient_store_changes_kept(const PatientStore *store, uint64_t since);
+// The rows written and removed between the watermark since and now: an
+// edit is the old row's delete and the new row's upsert under one seq, in
+// that order. If the changes since aren't all known any more, the set
+// starts over instead: every record loaded, as upserts (load the archive
+// first). Like a snapshot, it stays valid while the store is open, whatever
+// is edited meanwhile. Returns NULL with errno set on failure.
+PatientChanges* patient_store_changes(PatientStore *store, uint64_t since);
+// Whether the set starts over, rather than going on from the watermark asked for
+bool patient_changes_full(const PatientChanges *changes);
+// The watermark to ask from next time
+uint64_t patient_changes_watermark(const PatientChanges *changes);
+size_t patient_changes_count(const PatientChanges *changes);
+// The changes in seq order
+void patient_changes_get(const PatientChanges *changes, size_t i, PatientChange *change);
+void patient_changes_free(PatientChanges *changes);
+
+// Freezes the current rows for readers on other threads, e.g. a background
+// export. Taking one copies the row columns but no strings, whose storage it
+// holds on to instead; it stays valid while the store is open, whatever is
+// edited meanwhile.
+PatientSnapshot* patient_store_snapshot(const PatientStore *store);
+// The same for just the given live records, in that order
+PatientSnapshot* patient_store_snapshot_of(const PatientStore *store, const PatientHandle *handles, size_t count);
+size_t patient_snapshot_count(const PatientSnapshot *snapshot);
+void patient_snapshot_get(const PatientSnapshot *snapshot, size_t row, PatientRecord *record);
+void patient_snapshot_free(PatientSnapshot *snapshot);
+
+// The current local wall-clock time, to the minute
+int64_t patient_time_now(void);
+// "YYYY-MM-DD HH:MM" wall-clock text <-> seconds since 1970-01-01 00:00 of
+// the same wall clock (no time zone applied); unparsable text maps to
+// PATIENT_TIME_UNKNOWN, which formats as "?"
+int64_t patient_time_parse(const char *text);
+void patient_time_format(int64_t epoch, char added[PATIENT_ADDED_LEN]);
+
+#endif
@@ -0,0 +1,404 @@
+#include "registry_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define REPLY_TIMEOUT_MS 10000      // Longest silence while waiting for a reply
+#define SEND_FLUSH_BYTES (64 * 1024)
+#define EVENT_BATCH_MAX 4096        // Change events applied to the mirror together
+#define BATCH_WINDOW 4096           // Requests in flight at once in a batch; the daemon applies a queued run of
+                                    // updates or deletes together
+
+// --- Structs ---
+
+struct RegistryClient {
+    int fd;
+    RegistryBuffer in;
+    RegistryBuffer out;
+    RegistryBuffer events;      // Events that arrived while waiting for a reply, for dispatch
+    size_t pending;
+    bool closed;                // The daemon hung up; what's in the buffers still counts
+    PatientStore *mirror;
+    char error[256];
+    char note[64];
+};
+
+// --- Socket ---
+
+// Waits until fd is readable, sending queued requests meanwhile
+static int wait_readable(RegistryClient *client) {
+    struct pollfd pfd = { .fd = client->fd };
+    for (;;) {
+        if (registry_buffer_write(&client->out, client->fd) < 0) return -1;
+        pfd.events = POLLIN | (registry_buffer_pending(&client->out) ? POLLOUT : 0);
+        int ready = poll(&pfd, 1, REPLY_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return -1;
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) return 0;
+    }
+}
+
+// Reads whatever has arrived without blocking
+static int read_available(RegistryClient *client) {
+    if (client->closed) return 0;
+    if (registry_buffer_read(&client->in, client->fd) >= 0) return 0;
+    if (errno != EPIPE) return -1;
+    client->closed = true;
+    return 0;
+}
+
+// Decodes the next frame, reading more until it has fully arrived if block
+// is set. Returns its size, 0 if none is there yet, or -1 with errno set.
+static long next_frame(RegistryClient *client, RegistryFrame *frame, bool block) {
+    for (;;) {
+        long size = registry_frame_decode(&client->in, frame);
+        if (size != 0) return size;
+        if (client->closed) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (!block) return 0;
+        if (wait_readable(client) != 0 || read_available(client) != 0) return -1;
+    }
+}
+
+static bool is_event(RegistryFrameType type) {
+    return type == REGISTRY_PUT || type == REGISTRY_REMOVE;
+}
+
+// --- Requests ---
+
+RegistryClient* registry_client_connect(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+    RegistryClient *client = calloc(1, sizeof(RegistryClient));
+    if (!client) return NULL;
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->fd < 0 || fcntl(client->fd, F_SETFD, FD_CLOEXEC) != 0
+        || connect(client->fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK) != 0) {
+        int saved = errno;
+        if (client->fd >= 0) close(client->fd);
+        free(client);
+        errno = saved;
+        return NULL;
+    }
+    return client;
+}
+
+void registry_client_close(RegistryClient *client) {
+    if (!client) return;
+    close(client->fd);
+    registry_buffer_free(&client->in);
+    registry_buffer_free(&client->out);
+    registry_buffer_free(&client->events);
+    patient_store_close(client->mirror);
+    free(client);
+}
+
+int registry_client_send(RegistryClient *client, const RegistryFrame *request) {
+    if (request->type >= REGISTRY_DONE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (registry_frame_encode(&client->out, request) != 0) return -1;
+    client->pending++;
+    // Big pipelines go out as they build up rather than all at the end
+    bool flush = registry_buffer_pending(&client->out) >= SEND_FLUSH_BYTES;
+    return flush && registry_buffer_write(&client->out, client->fd) < 0 ? -1 : 0;
+}
+
+int registry_client_receive(RegistryClient *client, PatientVisitFunc visit, void *user_data, uint32_t *value) {
+    if (client->pending == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t records = 0;
+    client->error[0] = '\0';
+    client->note[0] = '\0';
+    for (;;) {
+        RegistryFrame frame;
+        long size = next_frame(client, &frame, true);
+        if (size < 0) return -1;
+        int result = 1;
+        if (is_event(frame.type)) {
+            // Kept in order for the next dispatch
+            if (!registry_buffer_reserve(&client->events, size)) {
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(client->events.data + client->events.len, client->in.data + client->in.head, size);
+            client->events.len += size;
+        } else if (frame.type == REGISTRY_RECORD) {
+            if (visit) visit(&frame.record, records, user_data);
+            records++;
+        } else if (frame.type == REGISTRY_DONE || frame.type == REGISTRY_CHANGES_DONE) {
+            if (value) *value = frame.value;
+            if (frame.type == REGISTRY_CHANGES_DONE) snprintf(client->note, sizeof(client->note), "%s", frame.text);
+            result = 0;
+        } else if (frame.type == REGISTRY_ERROR) {
+            snprintf(client->error, sizeof(client->error), "%s", frame.text);
+            errno = frame.value ? (int)frame.value : EIO;
+            result = -1;
+        } else {
+            errno = EPROTO;
+            return -1;
+        }
+        registry_buffer_consume(&client->in, size);
+        if (result <= 0) {
+            client->pending--;
+            return result;
+        }
+    }
+}
+
+size_t registry_client_pending(const RegistryClient *client) {
+    return client->pending;
+}
+
+const char* registry_client_error(const RegistryClient *client) {
+    return client->error;
+}
+
+const char* registry_client_note(const RegistryClient *client) {
+    return client->note;
+}
+
+static int call(RegistryClient *client, const RegistryFrame *request, uint32_t *value) {
+    if (registry_client_send(client, request) != 0) return -1;
+    return registry_client_receive(client, NULL, NULL, value);
+}
+
+int registry_client_add(RegistryClient *client, const char *name, unsigned age, const char *gender, int64_t added,
+                        PatientHandle *handle) {
+    RegistryFrame request = { .type = REGISTRY_ADD,
+                              .record = { .name = name, .gender = gender, .age = age, .added = added } };
+    uint32_t value;
+    int result = call(client, &request, &value);
+    if (result == 0 && handle) *handle = value;
+    return result;
+}
+
+// Sends a request of type for each of records, pipelined
+static int send_batch(RegistryClient *client, RegistryFrameType type, const PatientRecord *records, size_t count,
+                      size_t *done) {
+    size_t sent = 0, received = 0, accepted = 0;
+    int saved = 0;
+    for (;;) {
+        // Keep a window of requests in flight rather than one round trip each
+        while (sent < count && !saved && sent - received < BATCH_WINDOW) {
+            RegistryFrame request = { .type = type, .record = records[sent] };
+            if (registry_client_send(client, &request) == 0) sent++;
+            else saved = errno;
+        }
+        if (received == sent) break;
+        received++;
+        if (registry_client_receive(client, NULL, NULL, NULL) == 0) {
+            accepted++;
+            continue;
+        }
+        // The first failure is the one reported; nothing more will come from a daemon that's gone
+        if (!saved) saved = errno;
+        if (errno == EPIPE || errno == ETIMEDOUT) break;
+    }
+    if (done) *done = accepted;
+    errno = saved;
+    return saved ? -1 : 0;
+}
+
+int registry_client_add_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *added) {
+    return send_batch(client, REGISTRY_ADD, records, count, added);
+}
+
+int registry_client_update_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *updated) {
+    return send_batch(client, REGISTRY_UPDATE, records, count, updated);
+}
+
+int registry_client_delete_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *deleted) {
+    return send_batch(client, REGISTRY_DELETE, records, count, deleted);
+}
+
+int registry_client_update(RegistryClient *client, PatientHandle handle, const char *name, unsigned age,
+                           const char *gender) {
+    RegistryFrame request = { .type = REGISTRY_UPDATE,
+                              .record = { .handle = handle, .name = name, .gender = gender, .age = age } };
+    return call(client, &request, NULL);
+}
+
+int registry_client_delete(RegistryClient *client, PatientHandle handle) {
+    RegistryFrame request = { .type = REGISTRY_DELETE, .record.handle = handle };
+    return call(client, &request, NULL);
+}
+
+// --- Mirror ---
+
+typedef struct {
+    PatientStore *store;
+    int result;
+} MirrorLoad;
+
+static void mirror_record(const PatientRecord *record, size_t row, void *user_data) {
+    MirrorLoad *load = user_data;
+    if (load->result == 0) {
+        load->result = patient_store_put(load->store, record);
+    }
+}
+
+static int apply_event(RegistryClient *client, const RegistryFrame *frame, RegistryChangeFunc changed,
+                       void *user_data) {
+    const PatientRecord *record = &frame->record;
+    if (frame->type == REGISTRY_REMOVE) {
+        if (patient_store_delete(client->mirror, record->handle) != 0) return errno == ENOENT ? 0 : -1;
+        if (changed) changed(REGISTRY_CHANGE_DELETED, record->handle, user_data);
+        return 0;
+    }
+    bool known = patient_store_find(client->mirror, record->handle) >= 0;
+    if (patient_store_put(client->mirror, record) != 0) return -1;
+    if (changed) changed(known ? REGISTRY_CHANGE_UPDATED : REGISTRY_CHANGE_ADDED, record->handle, user_data);
+    return 0;
+}
+
+// Whether event replaces a record the mirror has, or removes one, as
+// opposed to adding one; a run of either kind goes into the mirror together
+static int event_kind(RegistryClient *client, const RegistryFrame *event) {
+    if (event->type == REGISTRY_REMOVE) return REGISTRY_CHANGE_DELETED;
+    return patient_store_find(client->mirror, event->record.handle) >= 0 ? REGISTRY_CHANGE_UPDATED
+                                                                         : REGISTRY_CHANGE_ADDED;
+}
+
+// Applies count events of one kind, removals or replacements, to the mirror
+// as one batch. If the batch is refused, e.g. as it names a record twice,
+// they go in one by one.
+static int apply_events(RegistryClient *client, const RegistryFrame *events, size_t count, RegistryChangeFunc changed,
+                        void *user_data) {
+    RegistryChange change = event_kind(client, &events[0]);
+    PatientRecord *records = malloc(count * sizeof(PatientRecord));
+    PatientHandle *handles = malloc(count * sizeof(PatientHandle));
+    size_t n = 0;
+    for (size_t i = 0; records && handles && i < count; i++) {
+        // A removal the mirror has already seen to is no change
+        if (change == REGISTRY_CHANGE_DELETED && patient_store_find(client->mirror, events[i].record.handle) < 0) continue;
+        records[n] = events[i].record;
+        handles[n++] = events[i].record.handle;
+    }
+    int result = records && handles ? 0 : -1;
+    if (result == 0) {
+        result = change == REGISTRY_CHANGE_DELETED ? patient_store_delete_batch(client->mirror, handles, n)
+                                                   : patient_store_update_batch(client->mirror, records, n);
+    }
+    for (size_t i = 0; result == 0 && changed && i < n; i++) changed(change, handles[i], user_data);
+    free(records);
+    free(handles);
+    for (size_t i = 0; result != 0 && i < count; i++) {
+        if (apply_event(client, &events[i], changed, user_data) != 0) return -1;
+    }
+    return 0;
+}
+
+// Applies the events at the head of buf that have fully arrived, in order.
+// Returns 0, or -1 with errno set.
+static int apply_buffered(RegistryClient *client, RegistryBuffer *buf, RegistryChangeFunc changed, void *user_data) {
+    RegistryFrame *run = NULL;
+    int result = 0;
+    for (;;) {
+        RegistryFrame frame;
+        long size = registry_frame_decode(buf, &frame);
+        if (size <= 0) {
+            result = size;
+            break;
+        }
+        if (!is_event(frame.type)) {
+            errno = EPROTO;
+            result = -1;
+            break;
+        }
+        size_t count = 1;
+        int kind = event_kind(client, &frame);
+        if (kind != REGISTRY_CHANGE_ADDED && (run || (run = malloc(EVENT_BATCH_MAX * sizeof(RegistryFrame))))) {
+            run[0] = frame;
+            for (long next; count < EVENT_BATCH_MAX && (next = registry_frame_decode_at(buf, size, &run[count])) > 0
+                            && is_event(run[count].type) && event_kind(client, &run[count]) == kind;) {
+                size += next;
+                count++;
+            }
+        }
+        result = count > 1 ? apply_events(client, run, count, changed, user_data)
+                           : apply_event(client, &frame, changed, user_data);
+        registry_buffer_consume(buf, size);
+        if (result != 0) break;
+    }
+    free(run);
+    return result;
+}
+
+int registry_client_subscribe(RegistryClient *client, PatientLoadStats *stats) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (client->mirror) {
+        errno = EALREADY;
+        return -1;
+    }
+    MirrorLoad load = { patient_store_new(), 0 };
+    RegistryFrame request = { .type = REGISTRY_SUBSCRIBE };
+    if (!load.store || registry_client_send(client, &request) != 0
+        || registry_client_receive(client, mirror_record, &load, NULL) != 0 || load.result != 0) {
+        int saved = load.store ? errno : ENOMEM;
+        patient_store_close(load.store);
+        errno = saved;
+        return -1;
+    }
+    client->mirror = load.store;
+    if (stats) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        memset(stats, 0, sizeof(*stats));
+        stats->rows = patient_store_count(client->mirror);
+        stats->threads = 1;
+        stats->seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    }
+    return 0;
+}
+
+PatientStore* registry_client_store(RegistryClient *client) {
+    return client->mirror;
+}
+
+int registry_client_fd(const RegistryClient *client) {
+    return client->fd;
+}
+
+int registry_client_dispatch(RegistryClient *client, RegistryChangeFunc changed, void *user_data) {
+    if (!client->mirror) {
+        errno = EINVAL;
+        return -1;
+    }
+    // First whatever arrived while a reply was awaited, which came earlier
+    if (apply_buffered(client, &client->events, changed, user_data) != 0 || read_available(client) != 0
+        || apply_buffered(client, &client->in, changed, user_data) != 0) {
+        return -1;
+    }
+    // Whatever is left once the daemon hung up is a frame that will never be whole
+    if (client->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef REGISTRY_CLIENT_H
+#define REGISTRY_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+#include "registry_protocol.h"
+
+// --- Registry Client ---
+//
+// Talks to the registry daemon (see registry_server.h). Requests can be
+// pipelined: send any number, then receive their replies in the same order.
+// A subscribed client also keeps a mirror of the whole registry in an
+// in-memory PatientStore, under the daemon's own handles, and applies the
+// daemon's change events to it, its own changes included, as it dispatches
+// them. Not thread-safe.
+
+typedef struct RegistryClient RegistryClient;
+
+typedef enum {
+    REGISTRY_CHANGE_ADDED,
+    REGISTRY_CHANGE_UPDATED,
+    REGISTRY_CHANGE_DELETED
+} RegistryChange;
+
+// Called once the mirror reflects the change
+typedef void (*RegistryChangeFunc)(RegistryChange change, PatientHandle handle, void *user_data);
+
+// Returns NULL with errno set if nothing listens at socket_path
+RegistryClient* registry_client_connect(const char *socket_path);
+// Also frees the mirror
+void registry_client_close(RegistryClient *client);
+
+// Queues request (a frame of one of the request types) for the daemon
+int registry_client_send(RegistryClient *client, const RegistryFrame *request);
+// Waits for the reply to the oldest request sent and not yet received,
+// passing each record it lists to visit (which may be NULL), numbered from
+// 0. Returns 0 with the reply's value in *value (may be NULL), or -1 with
+// errno set: the daemon's errno if it refused the request (see
+// registry_client_error), ETIMEDOUT if it didn't answer in time, EPIPE if
+// it went away.
+int registry_client_receive(RegistryClient *client, PatientVisitFunc visit, void *user_data, uint32_t *value);
+// Requests sent whose replies haven't been received
+size_t registry_client_pending(const RegistryClient *client);
+// The daemon's explanation if it refused the last request received, else ""
+const char* registry_client_error(const RegistryClient *client);
+// What the daemon said about the last reply received besides its value, e.g.
+// "up to 1041" for a change export, else ""
+const char* registry_client_note(const RegistryClient *client);
+
+// One request and its reply, with nothing else outstanding. The handles are
+// the daemon's, which a subscribed client's mirror shares.
+int registry_client_add(RegistryClient *client, const char *name, unsigned age, const char *gender, int64_t added,
+                        PatientHandle *handle);
+int registry_client_update(RegistryClient *client, PatientHandle handle, const char *name, unsigned age,
+                           const char *gender);
+// Adds count records with the requests pipelined. Stops sending at the first
+// refusal, which is what it returns; *added (may be NULL) counts the records
+// the daemon took. The daemon applies a run of them that has arrived as one
+// store batch, with one journal write.
+int registry_client_add_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *added);
+int registry_client_delete(RegistryClient *client, PatientHandle handle);
+// Update and delete count records, each named by its handle or, if set, its
+// MRN, with the requests pipelined and applied as for
+// registry_client_add_batch.
+int registry_client_update_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *updated);
+int registry_client_delete_batch(RegistryClient *client, const PatientRecord *records, size_t count, size_t *deleted);
+
+// Downloads the whole registry into the mirror and asks for every change
+// from then on. Returns 0, or -1 with errno set.
+int registry_client_subscribe(RegistryClient *client, PatientLoadStats *stats);
+// The mirror, once subscribed: read it like any store, but change the
+// registry through the client. Owned by the client.
+PatientStore* registry_client_store(RegistryClient *client);
+// The socket, to watch for readability; then call registry_client_dispatch
+int registry_client_fd(const RegistryClient *client);
+// Applies every change event that has arrived to the mirror, in order,
+// calling changed after each. Doesn't block. Returns 0, or -1 with errno
+// set (EPIPE once the daemon has gone and its last events are applied).
+int registry_client_dispatch(RegistryClient *client, RegistryChangeFunc changed, void *user_data);
+
+#endif
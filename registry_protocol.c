@@ -0,0 +1,249 @@
+#include "registry_protocol.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define HEADER_SIZE 5           // u32 length, u8 type
+#define READ_CHUNK (64 * 1024)
+
+// Which fields each frame type carries
+enum {
+    FIELD_HANDLE = 1 << 0,
+    FIELD_AGE = 1 << 1,
+    FIELD_ADDED = 1 << 2,
+    FIELD_NAME = 1 << 3,        // Name and gender
+    FIELD_VALUE = 1 << 4,
+    FIELD_TEXT = 1 << 5,
+    FIELD_ID = 1 << 6
+};
+
+#define FIELDS_RECORD (FIELD_HANDLE | FIELD_ID | FIELD_AGE | FIELD_ADDED | FIELD_NAME)
+
+// --- Field Layout ---
+
+static int frame_fields(RegistryFrameType type) {
+    switch (type) {
+        case REGISTRY_COUNT:
+        case REGISTRY_LIST:
+        case REGISTRY_SUBSCRIBE: return 0;
+        case REGISTRY_QUERY: return FIELD_TEXT;
+        case REGISTRY_ADD: return FIELD_AGE | FIELD_ADDED | FIELD_NAME;
+        case REGISTRY_UPDATE: return FIELD_HANDLE | FIELD_ID | FIELD_AGE | FIELD_NAME;
+        case REGISTRY_DELETE: return FIELD_HANDLE | FIELD_ID;
+        case REGISTRY_REMOVE: return FIELD_HANDLE;
+        case REGISTRY_EXPORT:
+        case REGISTRY_EXPORT_CHANGES:
+        case REGISTRY_ERROR:
+        case REGISTRY_CHANGES_DONE: return FIELD_VALUE | FIELD_TEXT;
+        case REGISTRY_DONE: return FIELD_VALUE;
+        case REGISTRY_RECORD:
+        case REGISTRY_PUT: return FIELDS_RECORD;
+    }
+    return -1;
+}
+
+static void put_bytes(RegistryBuffer *buf, const void *data, size_t len) {
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void put_string(RegistryBuffer *buf, const char *text, size_t len) {
+    uint32_t n = len;
+    put_bytes(buf, &n, sizeof(n));
+    put_bytes(buf, text, len + 1);
+}
+
+// Reads fixed-size fields and strings off a frame body, failing once it runs out
+typedef struct {
+    const char *at;
+    const char *end;
+    bool ok;
+} FieldReader;
+
+static void get_bytes(FieldReader *reader, void *out, size_t len) {
+    if (!reader->ok || (size_t)(reader->end - reader->at) < len) {
+        reader->ok = false;
+        return;
+    }
+    memcpy(out, reader->at, len);
+    reader->at += len;
+}
+
+static const char* get_string(FieldReader *reader) {
+    uint32_t len = 0;
+    get_bytes(reader, &len, sizeof(len));
+    if (!reader->ok || (size_t)(reader->end - reader->at) <= len || reader->at[len] != '\0') {
+        reader->ok = false;
+        return NULL;
+    }
+    const char *text = reader->at;
+    reader->at += len + 1;
+    return text;
+}
+
+// --- Frames ---
+
+int registry_frame_encode(RegistryBuffer *buf, const RegistryFrame *frame) {
+    int fields = frame_fields(frame->type);
+    if (fields < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    const PatientRecord *record = &frame->record;
+    size_t name_len = fields & FIELD_NAME ? strlen(record->name) : 0;
+    size_t gender_len = fields & FIELD_NAME ? strlen(record->gender) : 0;
+    size_t text_len = fields & FIELD_TEXT ? strlen(frame->text) : 0;
+    size_t size = HEADER_SIZE
+                  + (fields & FIELD_HANDLE ? sizeof(uint32_t) : 0)
+                  + (fields & FIELD_ID ? sizeof(uint32_t) : 0)
+                  + (fields & FIELD_AGE ? sizeof(uint32_t) : 0)
+                  + (fields & FIELD_ADDED ? sizeof(int64_t) : 0)
+                  + (fields & FIELD_NAME ? 2 * sizeof(uint32_t) + name_len + gender_len + 2 : 0)
+                  + (fields & FIELD_VALUE ? sizeof(uint32_t) : 0)
+                  + (fields & FIELD_TEXT ? sizeof(uint32_t) + text_len + 1 : 0);
+    if (size > REGISTRY_MAX_FRAME) {
+        errno = E2BIG;
+        return -1;
+    }
+    if (!registry_buffer_reserve(buf, size)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    uint32_t length = size - sizeof(uint32_t);
+    uint8_t type = frame->type;
+    put_bytes(buf, &length, sizeof(length));
+    put_bytes(buf, &type, sizeof(type));
+    if (fields & FIELD_HANDLE) put_bytes(buf, &record->handle, sizeof(uint32_t));
+    if (fields & FIELD_ID) put_bytes(buf, &record->id, sizeof(uint32_t));
+    if (fields & FIELD_AGE) {
+        uint32_t age = record->age;
+        put_bytes(buf, &age, sizeof(age));
+    }
+    if (fields & FIELD_ADDED) put_bytes(buf, &record->added, sizeof(int64_t));
+    if (fields & FIELD_NAME) {
+        put_string(buf, record->name, name_len);
+        put_string(buf, record->gender, gender_len);
+    }
+    if (fields & FIELD_VALUE) put_bytes(buf, &frame->value, sizeof(uint32_t));
+    if (fields & FIELD_TEXT) put_string(buf, frame->text, text_len);
+    return 0;
+}
+
+long registry_frame_decode(const RegistryBuffer *buf, RegistryFrame *frame) {
+    return registry_frame_decode_at(buf, 0, frame);
+}
+
+long registry_frame_decode_at(const RegistryBuffer *buf, size_t offset, RegistryFrame *frame) {
+    size_t available = buf->len - buf->head - offset;
+    const char *data = buf->data + buf->head + offset;
+    if (available < HEADER_SIZE) return 0;
+    uint32_t length;
+    memcpy(&length, data, sizeof(length));
+    if (length < HEADER_SIZE - sizeof(uint32_t) || length > REGISTRY_MAX_FRAME) {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t size = sizeof(uint32_t) + length;
+    if (available < size) return 0;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->type = (uint8_t)data[sizeof(uint32_t)];
+    int fields = frame_fields(frame->type);
+    FieldReader reader = { data + HEADER_SIZE, data + size, fields >= 0 };
+    PatientRecord *record = &frame->record;
+    record->handle = PATIENT_NO_HANDLE;
+    if (fields & FIELD_HANDLE) get_bytes(&reader, &record->handle, sizeof(uint32_t));
+    if (fields & FIELD_ID) get_bytes(&reader, &record->id, sizeof(uint32_t));
+    if (fields & FIELD_AGE) {
+        uint32_t age = 0;
+        get_bytes(&reader, &age, sizeof(age));
+        record->age = age;
+    }
+    if (fields & FIELD_ADDED) get_bytes(&reader, &record->added, sizeof(int64_t));
+    if (fields & FIELD_NAME) {
+        record->name = get_string(&reader);
+        record->gender = get_string(&reader);
+    }
+    if (fields & FIELD_VALUE) get_bytes(&reader, &frame->value, sizeof(uint32_t));
+    if (fields & FIELD_TEXT) frame->text = get_string(&reader);
+    if (!reader.ok || reader.at != reader.end) {
+        errno = EPROTO;
+        return -1;
+    }
+    return size;
+}
+
+// --- Buffers ---
+
+bool registry_buffer_reserve(RegistryBuffer *buf, size_t extra) {
+    if (buf->head > 0 && buf->len + extra > buf->cap) {
+        // Reclaim what was consumed before growing
+        memmove(buf->data, buf->data + buf->head, buf->len - buf->head);
+        buf->len -= buf->head;
+        buf->head = 0;
+    }
+    if (buf->len + extra <= buf->cap) return true;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra) cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data) return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+void registry_buffer_consume(RegistryBuffer *buf, size_t bytes) {
+    buf->head += bytes;
+    if (buf->head == buf->len) buf->head = buf->len = 0;
+}
+
+size_t registry_buffer_pending(const RegistryBuffer *buf) {
+    return buf->len - buf->head;
+}
+
+void registry_buffer_free(RegistryBuffer *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+long registry_buffer_write(RegistryBuffer *buf, int fd) {
+    size_t done = 0;
+    while (buf->head < buf->len) {
+        // A peer that went away is an error here, not a SIGPIPE
+        ssize_t n = send(fd, buf->data + buf->head, buf->len - buf->head, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) return -1;
+        registry_buffer_consume(buf, n);
+        done += n;
+    }
+    return done;
+}
+
+long registry_buffer_read(RegistryBuffer *buf, int fd) {
+    size_t done = 0;
+    for (;;) {
+        if (!registry_buffer_reserve(buf, READ_CHUNK)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t n = read(fd, buf->data + buf->len, buf->cap - buf->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) return -1;
+        if (n == 0) {
+            if (done > 0) break;    // Report the end on the next call, after these bytes
+            errno = EPIPE;
+            return -1;
+        }
+        buf->len += n;
+        done += n;
+        if (buf->len < buf->cap) break;     // Drained for now
+    }
+    return done;
+}
@@ -0,0 +1,91 @@
+#ifndef REGISTRY_PROTOCOL_H
+#define REGISTRY_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patient_store.h"
+
+// --- Registry Wire Protocol ---
+//
+// Frames exchanged over the registry daemon's Unix socket (see
+// registry_server.h and registry_client.h). Every frame is
+//
+//     u32 length of the rest | u8 type | fields of the type
+//
+// with integers in host order, as both ends share the host, and strings as
+// a u32 length, the bytes and a NUL, so a decoded frame can hand them out
+// in place. A client may send any number of requests without waiting; the
+// daemon answers each connection's requests in order, so replies need no
+// ids. A request that lists records (LIST, QUERY, SUBSCRIBE) is answered by
+// one RECORD per record and then DONE with their count; any other request
+// by DONE or ERROR. Subscribers also receive PUT and DELETE events for every
+// change, their own included, in the order the daemon made them.
+
+#define REGISTRY_SOCKET "hms-registry.sock"     // Default socket path, next to patients.txt
+#define REGISTRY_MAX_FRAME (1 << 20)
+
+typedef enum {
+    // Requests                 Fields
+    REGISTRY_COUNT = 1,         // -
+    REGISTRY_LIST,              // -
+    REGISTRY_QUERY,             // text (see patient_query.h)
+    REGISTRY_ADD,               // record without handle
+    REGISTRY_UPDATE,            // record without added; by MRN unless that is 0, else by handle
+    REGISTRY_DELETE,            // handle and MRN, used as for UPDATE
+    REGISTRY_EXPORT,            // value (REGISTRY_EXPORT_GZIP or 0), text (path on the daemon's host)
+    REGISTRY_SUBSCRIBE,         // -
+    REGISTRY_EXPORT_CHANGES,    // value (REGISTRY_EXPORT_ flags), text (path on the daemon's host)
+    // Replies
+    REGISTRY_DONE = 64,         // value: the new handle, or how many records
+    REGISTRY_ERROR,             // value (errno), text
+    REGISTRY_RECORD,            // record
+    REGISTRY_CHANGES_DONE,      // value (how many changes), text (up to what watermark, and whether starting over)
+    // Events
+    REGISTRY_PUT = 128,         // record: added, or replaced if the handle is live
+    REGISTRY_REMOVE             // handle
+} RegistryFrameType;
+
+// Flags in the value of EXPORT and EXPORT_CHANGES
+#define REGISTRY_EXPORT_GZIP 1
+#define REGISTRY_EXPORT_JSON_LINES 2    // EXPORT_CHANGES only
+
+typedef struct {
+    RegistryFrameType type;
+    PatientRecord record;       // Strings point into the decoded bytes
+    const char *text;
+    uint32_t value;
+} RegistryFrame;
+
+// Growable byte queue: frames are appended at the end and consumed from head
+typedef struct {
+    char *data;
+    size_t head;
+    size_t len;
+    size_t cap;
+} RegistryBuffer;
+
+// Appends frame to buf. Returns 0, or -1 with errno set (E2BIG if it would
+// exceed REGISTRY_MAX_FRAME).
+int registry_frame_encode(RegistryBuffer *buf, const RegistryFrame *frame);
+// Decodes the frame at the head of buf without consuming it. Returns its
+// size in bytes, 0 if it hasn't fully arrived, or -1 with errno set to
+// EPROTO if the bytes aren't a valid frame.
+long registry_frame_decode(const RegistryBuffer *buf, RegistryFrame *frame);
+// The same for the frame offset bytes past the head, e.g. to look ahead
+// at the frames queued behind it. offset must end a frame.
+long registry_frame_decode_at(const RegistryBuffer *buf, size_t offset, RegistryFrame *frame);
+
+bool registry_buffer_reserve(RegistryBuffer *buf, size_t extra);
+void registry_buffer_consume(RegistryBuffer *buf, size_t bytes);
+size_t registry_buffer_pending(const RegistryBuffer *buf);
+void registry_buffer_free(RegistryBuffer *buf);
+
+// Moves as much of buf as socket fd takes, or as it has into buf. Both return the
+// bytes moved (0 if fd would block), or -1 with errno set; a read at end of
+// file fails with EPIPE.
+long registry_buffer_write(RegistryBuffer *buf, int fd);
+long registry_buffer_read(RegistryBuffer *buf, int fd);
+
+#endif
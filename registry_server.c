@@ -0,0 +1,594 @@
+#include "registry_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "latency_stats.h"
+#include "patient_export.h"
+#include "registry_protocol.h"
+
+// --- Constants ---
+
+#define STREAM_BATCH 4096                   // Records queued per connection per pass of the loop
+#define STREAM_LOW_WATER (256 * 1024)       // Queue more records once less than this is unsent
+#define MAX_BACKLOG (64 * 1024 * 1024)      // A client this far behind is disconnected
+#define LISTEN_BACKLOG 64
+#define EDIT_BATCH_MAX 4096                 // Queued adds, updates or deletes of one connection applied together
+
+// --- Structs ---
+
+typedef struct Connection Connection;
+typedef struct ExportJob ExportJob;
+
+struct Connection {
+    int fd;
+    RegistryBuffer in;
+    RegistryBuffer out;
+    RegistryBuffer held;        // Events raised while records stream; sent after them
+    bool subscribed;
+    bool dead;
+    // Records of the reply being streamed: everyone for LIST and SUBSCRIBE,
+    // the matches for QUERY, as they were when it ran
+    PatientSnapshot *snapshot;
+    size_t stream_count;
+    size_t stream_next;
+    bool streaming;
+    ExportJob *export;          // Running export whose reply this connection waits for
+};
+
+struct ExportJob {
+    RegistryServer *server;
+    Connection *connection;     // NULL once the client has gone
+    PatientSnapshot *snapshot;  // What a full export writes...
+    PatientChanges *changes;    // ...or a change export
+    char *path;
+    PatientExportOptions options;
+    pthread_t thread;
+    atomic_bool cancel;
+    atomic_bool finished;
+    int result;
+    int error;
+    ExportJob *next;
+};
+
+struct RegistryServer {
+    PatientStore *store;
+    char *socket_path;
+    int listen_fd;
+    int wake[2];                // Written to by registry_server_stop and finished exports
+    volatile sig_atomic_t stopping;
+    Connection **connections;
+    size_t count;
+    size_t capacity;
+    ExportJob *exports;
+};
+
+// --- Helpers ---
+
+// Non-blocking and closed on exec, set after the fact as SOCK_CLOEXEC and
+// accept4 are Linux-only
+static bool set_fd_flags(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+static void wake_up(RegistryServer *server) {
+    char byte = 1;
+    // A full pipe already has the loop's attention
+    ssize_t ignored = write(server->wake[1], &byte, 1);
+    (void)ignored;
+}
+
+// Binds socket_path, replacing a stale socket file but not a live daemon's
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, LISTEN_BACKLOG) != 0
+        || !set_fd_flags(fd)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// --- Connections ---
+
+static void stream_end(Connection *connection) {
+    patient_snapshot_free(connection->snapshot);
+    connection->snapshot = NULL;
+    connection->streaming = false;
+}
+
+static void connection_free(Connection *connection) {
+    if (connection->export) {
+        // The job finishes on its own and is reaped without a reply
+        connection->export->connection = NULL;
+        atomic_store(&connection->export->cancel, true);
+    }
+    stream_end(connection);
+    close(connection->fd);
+    registry_buffer_free(&connection->in);
+    registry_buffer_free(&connection->out);
+    registry_buffer_free(&connection->held);
+    free(connection);
+}
+
+// Queues frame for connection, or marks it dead if it can't take it
+static void send_frame(Connection *connection, const RegistryFrame *frame) {
+    if (connection->dead) return;
+    if (registry_frame_encode(&connection->out, frame) != 0) connection->dead = true;
+}
+
+static void send_done(Connection *connection, uint32_t value) {
+    RegistryFrame frame = { .type = REGISTRY_DONE, .value = value };
+    send_frame(connection, &frame);
+}
+
+// Tells the client what a change export wrote, as hms-cli reports it
+static void send_changes_done(Connection *connection, const PatientChanges *changes) {
+    char text[64];
+    snprintf(text, sizeof(text), "up to %llu%s", (unsigned long long)patient_changes_watermark(changes),
+             patient_changes_full(changes) ? ", starting over" : "");
+    RegistryFrame frame = { .type = REGISTRY_CHANGES_DONE, .value = patient_changes_count(changes), .text = text };
+    send_frame(connection, &frame);
+}
+
+static void send_error(Connection *connection, int error, const char *message) {
+    RegistryFrame frame = { .type = REGISTRY_ERROR, .value = error, .text = message ? message : strerror(error) };
+    send_frame(connection, &frame);
+}
+
+// Tells every subscriber about a change; a subscriber still receiving its
+// initial records gets it after them
+static void broadcast(RegistryServer *server, const RegistryFrame *frame) {
+    for (size_t i = 0; i < server->count; i++) {
+        Connection *connection = server->connections[i];
+        if (!connection->subscribed || connection->dead) continue;
+        RegistryBuffer *queue = connection->streaming ? &connection->held : &connection->out;
+        if (registry_frame_encode(queue, frame) != 0
+            || registry_buffer_pending(&connection->out) + registry_buffer_pending(&connection->held) > MAX_BACKLOG) {
+            connection->dead = true;
+        }
+    }
+}
+
+static void broadcast_record(RegistryServer *server, PatientHandle handle) {
+    long row = patient_store_find(server->store, handle);
+    if (row < 0) return;
+    RegistryFrame frame = { .type = REGISTRY_PUT };
+    patient_store_get(server->store, row, &frame.record);
+    broadcast(server, &frame);
+}
+
+static void broadcast_removal(RegistryServer *server, PatientHandle handle) {
+    RegistryFrame frame = { .type = REGISTRY_REMOVE, .record.handle = handle };
+    broadcast(server, &frame);
+}
+
+// --- Streaming Replies ---
+
+static void stream_start(Connection *connection, PatientSnapshot *snapshot) {
+    connection->snapshot = snapshot;
+    connection->stream_count = patient_snapshot_count(snapshot);
+    connection->stream_next = 0;
+    connection->streaming = true;
+}
+
+// Queues the next batch of records while little is unsent, and the closing
+// DONE and any held events after the last one
+static void stream_more(Connection *connection) {
+    if (!connection->streaming || registry_buffer_pending(&connection->out) >= STREAM_LOW_WATER) return;
+    RegistryFrame frame = { .type = REGISTRY_RECORD };
+    size_t end = connection->stream_next + STREAM_BATCH;
+    if (end > connection->stream_count) end = connection->stream_count;
+    for (; connection->stream_next < end && !connection->dead; connection->stream_next++) {
+        patient_snapshot_get(connection->snapshot, connection->stream_next, &frame.record);
+        send_frame(connection, &frame);
+    }
+    if (connection->stream_next < connection->stream_count) return;
+    send_done(connection, connection->stream_count);
+    stream_end(connection);
+    RegistryBuffer *held = &connection->held;
+    size_t pending = registry_buffer_pending(held);
+    if (pending == 0 || connection->dead) return;
+    if (!registry_buffer_reserve(&connection->out, pending)) {
+        connection->dead = true;
+        return;
+    }
+    memcpy(connection->out.data + connection->out.len, held->data + held->head, pending);
+    connection->out.len += pending;
+    registry_buffer_consume(held, pending);
+}
+
+static void start_list(RegistryServer *server, Connection *connection) {
+    PatientSnapshot *snapshot = patient_store_snapshot(server->store);
+    if (!snapshot) {
+        send_error(connection, ENOMEM, NULL);
+        return;
+    }
+    stream_start(connection, snapshot);
+}
+
+static void start_query(RegistryServer *server, Connection *connection, const char *text) {
+    PatientQuery query;
+    char error[128];
+    if (patient_query_parse(text, patient_time_now(), &query, error, sizeof(error)) != 0) {
+        send_error(connection, errno, errno == EINVAL ? error : NULL);
+        patient_query_clear(&query);
+        return;
+    }
+    PatientHandle *handles = NULL;
+    long count = patient_store_query(server->store, &query, &handles);
+    patient_query_clear(&query);
+    // The records are captured now, so later edits don't show through
+    PatientSnapshot *snapshot = count >= 0 ? patient_store_snapshot_of(server->store, handles, count) : NULL;
+    free(handles);
+    if (!snapshot) {
+        send_error(connection, ENOMEM, NULL);
+        return;
+    }
+    stream_start(connection, snapshot);
+}
+
+// --- Exports ---
+
+static void* export_thread(void *data) {
+    ExportJob *job = data;
+    job->result = job->changes ? patient_export_changes(job->changes, job->path, &job->options)
+                               : patient_export_csv(job->snapshot, job->path, &job->options);
+    job->error = errno;
+    atomic_store(&job->finished, true);
+    wake_up(job->server);
+    return NULL;
+}
+
+static void free_export(ExportJob *job) {
+    patient_snapshot_free(job->snapshot);
+    patient_changes_free(job->changes);
+    free(job->path);
+    free(job);
+}
+
+// A change export goes on from the watermark the last one to path left
+static void start_export(RegistryServer *server, Connection *connection, const char *path, uint32_t flags,
+                         bool changes) {
+    ExportJob *job = calloc(1, sizeof(ExportJob));
+    bool ready = false;
+    if (job) {
+        job->server = server;
+        job->connection = connection;
+        if (changes) job->changes = patient_store_changes(server->store, patient_export_watermark(path));
+        else job->snapshot = patient_store_snapshot(server->store);
+        job->path = strdup(path);
+        job->options.gzip = flags & REGISTRY_EXPORT_GZIP;
+        job->options.json_lines = flags & REGISTRY_EXPORT_JSON_LINES;
+        job->options.cancel = &job->cancel;
+        atomic_init(&job->cancel, false);
+        atomic_init(&job->finished, false);
+        ready = (job->snapshot || job->changes) && job->path;
+    }
+    if (!ready || pthread_create(&job->thread, NULL, export_thread, job) != 0) {
+        int error = ready ? EAGAIN : ENOMEM;
+        if (job) free_export(job);
+        send_error(connection, error, NULL);
+        return;
+    }
+    job->next = server->exports;
+    server->exports = job;
+    connection->export = job;
+}
+
+// Answers the clients of finished exports and frees the jobs
+static void reap_exports(RegistryServer *server, bool wait) {
+    ExportJob **link = &server->exports;
+    while (*link) {
+        ExportJob *job = *link;
+        if (!wait && !atomic_load(&job->finished)) {
+            link = &job->next;
+            continue;
+        }
+        pthread_join(job->thread, NULL);
+        if (job->connection) {
+            job->connection->export = NULL;
+            if (job->result != 0) send_error(job->connection, job->error, NULL);
+            else if (job->changes) send_changes_done(job->connection, job->changes);
+            else send_done(job->connection, patient_snapshot_count(job->snapshot));
+        }
+        *link = job->next;
+        free_export(job);
+    }
+}
+
+// --- Requests ---
+
+// The record an UPDATE or DELETE names: by MRN unless that is 0, else by handle
+static PatientHandle request_handle(const PatientStore *store, const PatientRecord *record) {
+    return record->id != PATIENT_NO_ID ? patient_store_find_id(store, record->id) : record->handle;
+}
+
+static void handle_request(RegistryServer *server, Connection *connection, const RegistryFrame *frame) {
+    PatientStore *store = server->store;
+    const PatientRecord *record = &frame->record;
+    PatientHandle handle = PATIENT_NO_HANDLE;
+    int result;
+    switch (frame->type) {
+        case REGISTRY_COUNT:
+            send_done(connection, patient_store_count(store));
+            return;
+        case REGISTRY_SUBSCRIBE:
+            connection->subscribed = true;
+            start_list(server, connection);
+            return;
+        case REGISTRY_LIST:
+            start_list(server, connection);
+            return;
+        case REGISTRY_QUERY:
+            start_query(server, connection, frame->text);
+            return;
+        case REGISTRY_EXPORT:
+        case REGISTRY_EXPORT_CHANGES:
+            start_export(server, connection, frame->text, frame->value, frame->type == REGISTRY_EXPORT_CHANGES);
+            return;
+        case REGISTRY_ADD:
+            result = patient_store_add(store, record->name, record->age, record->gender, record->added, &handle);
+            break;
+        case REGISTRY_UPDATE:
+            handle = request_handle(store, record);
+            result = patient_store_update(store, handle, record->name, record->age, record->gender);
+            break;
+        case REGISTRY_DELETE:
+            handle = request_handle(store, record);
+            result = patient_store_delete(store, handle);
+            break;
+        default:
+            // Replies and events only ever flow the other way
+            connection->dead = true;
+            return;
+    }
+    // A change stands in memory even if its journal write failed (EIO), so
+    // the others hear of it either way
+    int error = errno;
+    if (result == 0 || error == EIO) {
+        if (frame->type == REGISTRY_DELETE) broadcast_removal(server, handle);
+        else broadcast_record(server, handle);
+    }
+    if (result == 0) send_done(connection, handle);
+    else send_error(connection, error, NULL);
+}
+
+// Applies count ADD, UPDATE or DELETE requests of one type as one store
+// batch, so a client's import or bulk edit costs one sweep of the sorted
+// orders and one journal write. A batch that is refused (a record invalid,
+// gone, archived or named twice) changes nothing, and each request then
+// runs on its own to get its own answer.
+static void handle_batch(RegistryServer *server, Connection *connection, const RegistryFrame *frames, size_t count) {
+    PatientStore *store = server->store;
+    bool deleting = frames[0].type == REGISTRY_DELETE;
+    bool adding = frames[0].type == REGISTRY_ADD;
+    PatientRecord *records = malloc(count * sizeof(PatientRecord));
+    PatientHandle *handles = malloc(count * sizeof(PatientHandle));
+    int result = -1, error = ENOMEM;
+    if (records && handles) {
+        PatientHandle first = PATIENT_NO_HANDLE;
+        for (size_t i = 0; i < count; i++) {
+            records[i] = frames[i].record;
+            if (!adding) records[i].handle = handles[i] = request_handle(store, &frames[i].record);
+        }
+        result = adding ? patient_store_add_batch(store, records, count, &first)
+                 : deleting ? patient_store_delete_batch(store, handles, count)
+                 : patient_store_update_batch(store, records, count);
+        error = errno;
+        // An add batch takes consecutive handles
+        for (size_t i = 0; adding && i < count; i++) handles[i] = first + i;
+    }
+    // As for a single change, a batch that stands despite a failed journal write is announced
+    if (result == 0 || error == EIO) {
+        for (size_t i = 0; i < count; i++) {
+            if (deleting) broadcast_removal(server, handles[i]);
+            else broadcast_record(server, handles[i]);
+            if (result == 0) send_done(connection, handles[i]);
+            else send_error(connection, error, NULL);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) handle_request(server, connection, &frames[i]);
+    }
+    free(records);
+    free(handles);
+}
+
+// Runs the requests that have arrived, in order. A streaming reply or an
+// export holds up the ones behind it until it completes. A run of adds,
+// updates or deletes already queued is timed as one request.
+static void handle_requests(RegistryServer *server, Connection *connection) {
+    RegistryFrame *run = NULL;
+    while (!connection->dead && !connection->streaming && !connection->export) {
+        RegistryFrame frame;
+        long size = registry_frame_decode(&connection->in, &frame);
+        if (size < 0) connection->dead = true;
+        if (size <= 0) break;
+        LatencyProbe probe = latency_begin(LATENCY_REQUEST);
+        size_t count = 1;
+        if ((frame.type == REGISTRY_ADD || frame.type == REGISTRY_UPDATE || frame.type == REGISTRY_DELETE)
+            && (run || (run = malloc(EDIT_BATCH_MAX * sizeof(RegistryFrame))))) {
+            run[0] = frame;
+            for (long next; count < EDIT_BATCH_MAX
+                            && (next = registry_frame_decode_at(&connection->in, size, &run[count])) > 0
+                            && run[count].type == frame.type;) {
+                size += next;
+                count++;
+            }
+        }
+        if (count > 1) handle_batch(server, connection, run, count);
+        else handle_request(server, connection, &frame);
+        latency_end(probe);
+        registry_buffer_consume(&connection->in, size);
+    }
+    free(run);
+}
+
+// --- Event Loop ---
+
+static bool add_connection(RegistryServer *server, int fd) {
+    if (server->count == server->capacity) {
+        size_t capacity = server->capacity ? server->capacity * 2 : 16;
+        Connection **grown = realloc(server->connections, capacity * sizeof(Connection*));
+        if (!grown) return false;
+        server->connections = grown;
+        server->capacity = capacity;
+    }
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (!connection) return false;
+    connection->fd = fd;
+    server->connections[server->count++] = connection;
+    return true;
+}
+
+static void accept_clients(RegistryServer *server) {
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) return;
+        if (!set_fd_flags(fd) || !add_connection(server, fd)) close(fd);
+    }
+}
+
+// Reads, runs and answers what one connection has ready
+static void serve_connection(RegistryServer *server, Connection *connection, short revents) {
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (registry_buffer_read(&connection->in, connection->fd) < 0) connection->dead = true;
+    }
+    for (;;) {
+        handle_requests(server, connection);
+        bool was_streaming = connection->streaming;
+        stream_more(connection);
+        // A stream that just ended may have requests queued behind it
+        if (!was_streaming || connection->streaming || connection->dead) break;
+    }
+    if (!connection->dead && registry_buffer_write(&connection->out, connection->fd) < 0) connection->dead = true;
+}
+
+static void drop_dead(RegistryServer *server) {
+    size_t kept = 0;
+    for (size_t i = 0; i < server->count; i++) {
+        Connection *connection = server->connections[i];
+        if (connection->dead) connection_free(connection);
+        else server->connections[kept++] = connection;
+    }
+    server->count = kept;
+}
+
+RegistryServer* registry_server_new(PatientStore *store, const char *socket_path) {
+    RegistryServer *server = calloc(1, sizeof(RegistryServer));
+    if (!server) return NULL;
+    server->store = store;
+    server->wake[0] = server->wake[1] = -1;
+    server->socket_path = strdup(socket_path);
+    server->listen_fd = server->socket_path ? listen_on(socket_path) : -1;
+    if (server->listen_fd < 0 || pipe(server->wake) != 0 || !set_fd_flags(server->wake[0])
+        || !set_fd_flags(server->wake[1])) {
+        int saved = server->socket_path ? errno : ENOMEM;
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+            unlink(socket_path);
+        }
+        if (server->wake[0] >= 0) close(server->wake[0]);
+        if (server->wake[1] >= 0) close(server->wake[1]);
+        free(server->socket_path);
+        free(server);
+        errno = saved;
+        return NULL;
+    }
+    return server;
+}
+
+int registry_server_run(RegistryServer *server) {
+    struct pollfd *fds = NULL;
+    size_t fds_capacity = 0;
+    int result = 0;
+    while (!server->stopping) {
+        if (fds_capacity < server->count + 2) {
+            size_t capacity = server->count + 2 > 2 * fds_capacity ? server->count + 2 : 2 * fds_capacity;
+            struct pollfd *grown = realloc(fds, capacity * sizeof(struct pollfd));
+            if (!grown) {
+                errno = ENOMEM;
+                result = -1;
+                break;
+            }
+            fds = grown;
+            fds_capacity = capacity;
+        }
+        fds[0] = (struct pollfd){ .fd = server->listen_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = server->wake[0], .events = POLLIN };
+        size_t polled = server->count;
+        for (size_t i = 0; i < polled; i++) {
+            Connection *connection = server->connections[i];
+            bool sending = registry_buffer_pending(&connection->out) > 0 || connection->streaming;
+            fds[i + 2] = (struct pollfd){ .fd = connection->fd, .events = POLLIN | (sending ? POLLOUT : 0) };
+        }
+        if (poll(fds, polled + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(server->wake[0], drain, sizeof(drain)) > 0) {}
+            reap_exports(server, false);
+        }
+        // Connections accepted below join the next round
+        for (size_t i = 0; i < polled; i++) {
+            Connection *connection = server->connections[i];
+            if (!connection->dead) serve_connection(server, connection, fds[i + 2].revents);
+        }
+        // A broadcast can reach a connection served earlier in the round
+        for (size_t i = 0; i < polled; i++) {
+            Connection *connection = server->connections[i];
+            if (!connection->dead && registry_buffer_write(&connection->out, connection->fd) < 0) connection->dead = true;
+        }
+        drop_dead(server);
+        if (fds[0].revents & POLLIN) accept_clients(server);
+    }
+    free(fds);
+    return result;
+}
+
+void registry_server_stop(RegistryServer *server) {
+    server->stopping = 1;
+    wake_up(server);
+}
+
+void registry_server_free(RegistryServer *server) {
+    if (!server) return;
+    for (size_t i = 0; i < server->count; i++) connection_free(server->connections[i]);
+    reap_exports(server, true);
+    free(server->connections);
+    close(server->listen_fd);
+    unlink(server->socket_path);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    free(server->socket_path);
+    free(server);
+}
@@ -0,0 +1,30 @@
+#ifndef REGISTRY_SERVER_H
+#define REGISTRY_SERVER_H
+
+#include "patient_store.h"
+
+// --- Registry Daemon ---
+//
+// Serves one PatientStore to every workstation on the host over a Unix
+// socket (see registry_protocol.h), so they all share one copy of the
+// registry instead of each loading and saving the files on its own. One
+// thread owns the store and runs every request to completion, so writes
+// apply in one order for everyone. Replies that list records are streamed
+// from a snapshot taken when the request arrived, a batch at a time, so a
+// long listing reflects a single moment yet never holds up other clients'
+// writes. Exports run on their own threads, also from a snapshot.
+
+typedef struct RegistryServer RegistryServer;
+
+// Listens on socket_path. A leftover socket file nobody answers on is
+// replaced; one with a live daemon behind it fails with EADDRINUSE. Returns
+// NULL with errno set on failure. store must outlive the server.
+RegistryServer* registry_server_new(PatientStore *store, const char *socket_path);
+// Serves clients until registry_server_stop. Returns 0, or -1 with errno set.
+int registry_server_run(RegistryServer *server);
+// Makes registry_server_run return soon; safe to call from a signal handler
+void registry_server_stop(RegistryServer *server);
+// Disconnects every client, waits out running exports and removes the socket
+void registry_server_free(RegistryServer *server);
+
+#endif
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include "symptom_triage.h"
+#include "latency_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// --- Constants ---
+
+#define BATCH_MIN_CHUNK (64 * 1024)
+#define NO_STATE 0              // Root; no keyword ends there, so it also ends output chains
+
+static const struct {
+    const char *keyword;
+    const char *department;
+} DEFAULT_RULES[] = {
+    { "chest", "Cardiology" }, { "heart", "Cardiology" }, { "pressure", "Cardiology" },
+    { "skin", "Dermatology" }, { "rash", "Dermatology" }, { "acne", "Dermatology" },
+    { "headache", "Neurology" }, { "dizzy", "Neurology" }, { "numbness", "Neurology" },
+    { "bone", "Orthopedics" }, { "fracture", "Orthopedics" }, { "joint", "Orthopedics" },
+    { "child", "Pediatrics" }, { "baby", "Pediatrics" }, { "infant", "Pediatrics" },
+    { "stomach", "Gastroenterology" }, { "digest", "Gastroenterology" }, { "acid", "Gastroenterology" },
+};
+
+// --- Structs ---
+
+typedef struct {
+    char *keyword;          // Lowercased
+    int department;
+    double weight;
+    int32_t next;           // Next rule ending in the same state, or -1
+} TriageRule;
+
+// The automaton is a complete DFA over byte classes: every byte that occurs
+// in some keyword (upper and lower case together) gets its own class and
+// all other bytes share class 0, which keeps the transition table small.
+struct TriageEngine {
+    char *departments[TRIAGE_MAX_DEPARTMENTS];
+    size_t department_count;
+    TriageRule *rules;
+    size_t rule_count;
+    size_t rule_capacity;
+
+    uint8_t class_of[256];
+    unsigned classes;
+    int32_t *next;          // [state * classes + class] -> state
+    int32_t *first_rule;    // Rules ending in a state, or -1
+    int32_t *output_link;   // Longest proper suffix state where a rule ends, or NO_STATE
+    int32_t *first_hit;     // The state itself if a rule ends there, else its output_link
+    size_t states;
+};
+
+// Growable text output of one batch worker
+typedef struct {
+    const TriageEngine *engine;
+    const char *start;
+    const char *end;
+    char *out;
+    size_t len;
+    size_t cap;
+    size_t notes;
+    size_t matched;
+    bool failed;
+} BatchChunk;
+
+// --- Helpers ---
+
+static char fold(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static unsigned online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+// --- Rule Table ---
+
+static int engine_department(TriageEngine *engine, const char *name) {
+    for (size_t i = 0; i < engine->department_count; i++) {
+        if (strcmp(engine->departments[i], name) == 0) return i;
+    }
+    if (engine->department_count == TRIAGE_MAX_DEPARTMENTS) {
+        errno = E2BIG;
+        return -1;
+    }
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    engine->departments[engine->department_count] = copy;
+    return engine->department_count++;
+}
+
+static bool engine_add_rule(TriageEngine *engine, const char *keyword, const char *department, double weight) {
+    if (!*keyword || !*department) {
+        errno = EINVAL;
+        return false;
+    }
+    int index = engine_department(engine, department);
+    if (index < 0) return false;
+    if (engine->rule_count == engine->rule_capacity) {
+        size_t capacity = engine->rule_capacity ? engine->rule_capacity * 2 : 32;
+        TriageRule *rules = realloc(engine->rules, capacity * sizeof(TriageRule));
+        if (!rules) return false;
+        engine->rules = rules;
+        engine->rule_capacity = capacity;
+    }
+    char *copy = strdup(keyword);
+    if (!copy) return false;
+    for (char *c = copy; *c; c++) *c = fold(*c);
+    engine->rules[engine->rule_count++] = (TriageRule){ copy, index, weight, -1 };
+    return true;
+}
+
+// --- Automaton ---
+
+static bool engine_compile(TriageEngine *engine) {
+    // Byte classes, shared by both cases of a letter
+    engine->classes = 1;
+    for (size_t r = 0; r < engine->rule_count; r++) {
+        for (const unsigned char *c = (const unsigned char*)engine->rules[r].keyword; *c; c++) {
+            if (engine->class_of[*c]) continue;
+            engine->class_of[*c] = engine->classes;
+            if (*c >= 'a' && *c <= 'z') engine->class_of[*c - ('a' - 'A')] = engine->classes;
+            engine->classes++;
+        }
+    }
+
+    // Trie of the keywords; 0 doubles as "no edge yet" since nothing leads back to the root
+    size_t max_states = 1;
+    for (size_t r = 0; r < engine->rule_count; r++) max_states += strlen(engine->rules[r].keyword);
+    unsigned classes = engine->classes;
+    engine->next = calloc(max_states * classes, sizeof(int32_t));
+    engine->first_rule = malloc(max_states * sizeof(int32_t));
+    engine->output_link = calloc(max_states, sizeof(int32_t));
+    int32_t *fail = calloc(max_states, sizeof(int32_t));
+    int32_t *queue = malloc(max_states * sizeof(int32_t));
+    if (!engine->next || !engine->first_rule || !engine->output_link || !fail || !queue) {
+        free(fail);
+        free(queue);
+        errno = ENOMEM;
+        return false;
+    }
+    for (size_t s = 0; s < max_states; s++) engine->first_rule[s] = -1;
+    engine->states = 1;
+    for (size_t r = 0; r < engine->rule_count; r++) {
+        int32_t state = 0;
+        for (const unsigned char *c = (const unsigned char*)engine->rules[r].keyword; *c; c++) {
+            int32_t *edge = &engine->next[state * classes + engine->class_of[*c]];
+            if (!*edge) *edge = engine->states++;
+            state = *edge;
+        }
+        engine->rules[r].next = engine->first_rule[state];
+        engine->first_rule[state] = r;
+    }
+
+    // Breadth-first, so every state's failure target is finished before it;
+    // missing edges are filled in from the failure state to make a DFA
+    size_t head = 0, tail = 0;
+    for (unsigned c = 0; c < classes; c++) {
+        if (engine->next[c]) queue[tail++] = engine->next[c];
+    }
+    while (head < tail) {
+        int32_t state = queue[head++];
+        for (unsigned c = 0; c < classes; c++) {
+            int32_t *edge = &engine->next[state * classes + c];
+            int32_t fallback = engine->next[fail[state] * classes + c];
+            if (!*edge) {
+                *edge = fallback;
+                continue;
+            }
+            fail[*edge] = fallback;
+            engine->output_link[*edge] = engine->first_rule[fallback] >= 0 ? fallback : engine->output_link[fallback];
+            queue[tail++] = *edge;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    // Lets the scan test for matches with one load per byte
+    engine->first_hit = malloc(engine->states * sizeof(int32_t));
+    if (!engine->first_hit) {
+        errno = ENOMEM;
+        return false;
+    }
+    for (size_t s = 0; s < engine->states; s++) {
+        engine->first_hit[s] = engine->first_rule[s] >= 0 ? (int32_t)s : engine->output_link[s];
+    }
+    return true;
+}
+
+// --- Public API ---
+
+static TriageEngine* engine_finish(TriageEngine *engine) {
+    if (engine_compile(engine)) return engine;
+    int saved = errno;
+    triage_engine_free(engine);
+    errno = saved;
+    return NULL;
+}
+
+TriageEngine* triage_engine_new_default(void) {
+    TriageEngine *engine = calloc(1, sizeof(TriageEngine));
+    if (!engine) return NULL;
+    for (size_t i = 0; i < sizeof(DEFAULT_RULES) / sizeof(DEFAULT_RULES[0]); i++) {
+        if (!engine_add_rule(engine, DEFAULT_RULES[i].keyword, DEFAULT_RULES[i].department, 1.0)) {
+            triage_engine_free(engine);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return engine_finish(engine);
+}
+
+TriageEngine* triage_engine_load(const char *path, unsigned *bad_line) {
+    FILE *in = fopen(path, "r");
+    if (!in) return NULL;
+    TriageEngine *engine = calloc(1, sizeof(TriageEngine));
+    char *line = NULL;
+    size_t line_cap = 0;
+    unsigned line_no = 0;
+    bool ok = engine != NULL;
+    while (ok && getline(&line, &line_cap, in) > 0) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        char *keyword = line;
+        char *department = strchr(keyword, '\t');
+        char *weight_text = department ? strchr(department + 1, '\t') : NULL;
+        if (department) *department++ = '\0';
+        if (weight_text) *weight_text++ = '\0';
+        double weight = 1.0;
+        if (weight_text) {
+            char *end;
+            weight = strtod(weight_text, &end);
+            if (end == weight_text || *end != '\0' || !(weight > 0)) department = NULL;
+        }
+        if (!department) errno = EINVAL;
+        ok = department && engine_add_rule(engine, keyword, department, weight);
+        if (!ok && errno == EINVAL && bad_line) *bad_line = line_no;
+    }
+    int saved = ok ? 0 : errno;
+    free(line);
+    fclose(in);
+    if (!ok) {
+        triage_engine_free(engine);
+        errno = saved ? saved : ENOMEM;
+        return NULL;
+    }
+    return engine_finish(engine);
+}
+
+void triage_engine_free(TriageEngine *engine) {
+    if (!engine) return;
+    for (size_t i = 0; i < engine->department_count; i++) free(engine->departments[i]);
+    for (size_t r = 0; r < engine->rule_count; r++) free(engine->rules[r].keyword);
+    free(engine->rules);
+    free(engine->next);
+    free(engine->first_rule);
+    free(engine->output_link);
+    free(engine->first_hit);
+    free(engine);
+}
+
+size_t triage_engine_rule_count(const TriageEngine *engine) {
+    return engine->rule_count;
+}
+
+size_t triage_engine_department_count(const TriageEngine *engine) {
+    return engine->department_count;
+}
+
+const char* triage_engine_department(const TriageEngine *engine, size_t department) {
+    return engine->departments[department];
+}
+
+static void classify_note(const TriageEngine *engine, const char *text, size_t len, TriageResult *result) {
+    double scores[TRIAGE_MAX_DEPARTMENTS] = {0};
+    unsigned matches = 0;
+    const int32_t *next = engine->next;
+    unsigned classes = engine->classes;
+    int32_t state = 0;
+    for (size_t i = 0; i < len; i++) {
+        state = next[state * classes + engine->class_of[(unsigned char)text[i]]];
+        for (int32_t hit = engine->first_hit[state]; hit != NO_STATE; hit = engine->output_link[hit]) {
+            for (int32_t r = engine->first_rule[hit]; r >= 0; r = engine->rules[r].next) {
+                scores[engine->rules[r].department] += engine->rules[r].weight;
+                matches++;
+            }
+        }
+    }
+
+    // Ties go to the department listed first, as the rule table reads
+    result->department = -1;
+    result->score = 0;
+    result->matches = matches;
+    double total = 0;
+    for (size_t d = 0; d < engine->department_count; d++) {
+        total += scores[d];
+        if (scores[d] > result->score) {
+            result->score = scores[d];
+            result->department = d;
+        }
+    }
+    result->confidence = total > 0 ? result->score / total : 0;
+}
+
+void triage_classify(const TriageEngine *engine, const char *text, size_t len, TriageResult *result) {
+    LatencyProbe probe = latency_begin(LATENCY_TRIAGE);
+    classify_note(engine, text, len, result);
+    latency_end(probe);
+}
+
+const char* triage_suggest(const TriageEngine *engine, const char *text, TriageResult *result) {
+    TriageResult scratch;
+    if (!result) result = &scratch;
+    triage_classify(engine, text, strlen(text), result);
+    return result->department < 0 ? TRIAGE_FALLBACK_DEPARTMENT : engine->departments[result->department];
+}
+
+// --- Batch Mode ---
+
+static bool chunk_put(BatchChunk *chunk, const char *text, size_t len) {
+    if (chunk->len + len > chunk->cap) {
+        size_t cap = chunk->cap ? chunk->cap * 2 : 1 << 16;
+        while (cap < chunk->len + len) cap *= 2;
+        char *out = realloc(chunk->out, cap);
+        if (!out) return false;
+        chunk->out = out;
+        chunk->cap = cap;
+    }
+    memcpy(chunk->out + chunk->len, text, len);
+    chunk->len += len;
+    return true;
+}
+
+static void* batch_worker(void *data) {
+    BatchChunk *chunk = data;
+    const char *line = chunk->start;
+    while (line < chunk->end && !chunk->failed) {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *end = newline ? newline : chunk->end;
+        TriageResult result;
+        classify_note(chunk->engine, line, end - line, &result);
+        const char *department = "-";
+        if (result.department >= 0) {
+            department = triage_engine_department(chunk->engine, result.department);
+            chunk->matched++;
+        }
+        // "\t0.67\n" by hand; printf would cost more than the scan
+        unsigned hundredths = (unsigned)(result.confidence * 100 + 0.5);
+        char text[] = { '\t', '0' + hundredths / 100, '.', '0' + hundredths / 10 % 10, '0' + hundredths % 10, '\n' };
+        chunk->failed = !chunk_put(chunk, department, strlen(department)) || !chunk_put(chunk, text, sizeof(text));
+        chunk->notes++;
+        line = end + 1;
+    }
+    return NULL;
+}
+
+int triage_batch_file(const TriageEngine *engine, const char *path, FILE *out, TriageBatchStats *stats) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    LatencyProbe probe = latency_begin(LATENCY_TRIAGE_BATCH);
+
+    // Line-aligned chunks, one per core, as the patient loader does
+    unsigned n_chunks = online_cpus();
+    if (n_chunks > size / BATCH_MIN_CHUNK) n_chunks = size / BATCH_MIN_CHUNK;
+    if (n_chunks == 0) n_chunks = 1;
+    BatchChunk *chunks = calloc(n_chunks, sizeof(BatchChunk));
+    pthread_t *workers = calloc(n_chunks, sizeof(pthread_t));
+    bool *started_worker = calloc(n_chunks, sizeof(bool));
+    if (!chunks || !workers || !started_worker) {
+        free(chunks); free(workers); free(started_worker);
+        if (map) munmap(map, size);
+        latency_end(probe);
+        errno = ENOMEM;
+        return -1;
+    }
+    const char *cursor = map;
+    for (unsigned c = 0; c < n_chunks; c++) {
+        const char *end = (c == n_chunks - 1) ? map + size : map + size * (c + 1) / n_chunks;
+        if (end < cursor) end = cursor;
+        if (end < map + size) {
+            const char *newline = memchr(end, '\n', map + size - end);
+            end = newline ? newline + 1 : map + size;
+        }
+        chunks[c] = (BatchChunk){ .engine = engine, .start = cursor, .end = end };
+        cursor = end;
+        if (c > 0) started_worker[c] = pthread_create(&workers[c], NULL, batch_worker, &chunks[c]) == 0;
+        if (c > 0 && !started_worker[c]) batch_worker(&chunks[c]);
+    }
+    batch_worker(&chunks[0]);
+
+    bool ok = true;
+    size_t notes = 0, matched = 0;
+    for (unsigned c = 0; c < n_chunks; c++) {
+        if (started_worker[c]) pthread_join(workers[c], NULL);
+        ok = ok && !chunks[c].failed && fwrite(chunks[c].out, 1, chunks[c].len, out) == chunks[c].len;
+        notes += chunks[c].notes;
+        matched += chunks[c].matched;
+        free(chunks[c].out);
+    }
+    free(chunks);
+    free(workers);
+    free(started_worker);
+    if (map) munmap(map, size);
+    latency_end(probe);
+
+    if (stats) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        stats->notes = notes;
+        stats->matched = matched;
+        stats->threads = n_chunks;
+        stats->seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    }
+    if (!ok) errno = EIO;
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,65 @@
+#ifndef SYMPTOM_TRIAGE_H
+#define SYMPTOM_TRIAGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// --- Symptom Triage ---
+//
+// Scores free-text symptoms against a table of keyword -> department rules.
+// The keywords are compiled into one Aho-Corasick automaton, so a single
+// pass over the text finds every keyword at once and adds its weight to its
+// department; the department with the highest total wins. Matching ignores
+// ASCII case and finds keywords anywhere, including inside longer words.
+//
+// A rule table is a text file with one rule per line:
+//
+//     keyword TAB department [TAB weight]
+//
+// The weight defaults to 1. Blank lines and lines starting with # are
+// skipped.
+
+#define TRIAGE_MAX_DEPARTMENTS 64
+#define TRIAGE_FALLBACK_DEPARTMENT "General Medicine"   // Suggested when no keyword matches
+
+typedef struct TriageEngine TriageEngine;
+
+typedef struct {
+    int department;         // Index of the best department, or -1 if no keyword matched
+    double score;           // Its summed weight
+    double confidence;      // Its share of all matched weight, 0..1
+    unsigned matches;       // Keyword occurrences found
+} TriageResult;
+
+typedef struct {
+    size_t notes;
+    size_t matched;         // Notes that hit at least one keyword
+    unsigned threads;
+    double seconds;
+} TriageBatchStats;
+
+// The built-in rules: cardiology, dermatology, neurology, orthopedics,
+// pediatrics and gastroenterology keywords, weighted alike
+TriageEngine* triage_engine_new_default(void);
+// Loads and compiles a rule table. Returns NULL with errno set; EINVAL means
+// a malformed line, whose number is stored in *bad_line if given.
+TriageEngine* triage_engine_load(const char *path, unsigned *bad_line);
+void triage_engine_free(TriageEngine *engine);
+
+size_t triage_engine_rule_count(const TriageEngine *engine);
+size_t triage_engine_department_count(const TriageEngine *engine);
+const char* triage_engine_department(const TriageEngine *engine, size_t department);
+
+// Scores len bytes of text. Safe to call from several threads at once.
+void triage_classify(const TriageEngine *engine, const char *text, size_t len, TriageResult *result);
+// The department to suggest for a NUL-terminated note: the best match, or
+// TRIAGE_FALLBACK_DEPARTMENT. The scores go to result if given.
+const char* triage_suggest(const TriageEngine *engine, const char *text, TriageResult *result);
+
+// Triages every line of the notes file as one note, splitting the file
+// across all cores, and writes one "department TAB confidence" line per
+// note to out, in input order ("-" for notes that matched nothing).
+// Returns 0, or -1 with errno set.
+int triage_batch_file(const TriageEngine *engine, const char *path, FILE *out, TriageBatchStats *stats);
+
+#endif
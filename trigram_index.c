@@ -0,0 +1,278 @@
+#include "trigram_index.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- Structs ---
+
+typedef struct {
+    uint32_t key;       // Three folded bytes; 0 marks an empty bucket
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *ids;      // Ascending
+} PostingList;
+
+struct TrigramIndex {
+    PostingList *buckets;
+    size_t capacity;    // Power of two
+    size_t used;
+    size_t postings;
+};
+
+// --- Helpers ---
+
+static inline uint32_t trigram_key(const unsigned char *p) {
+    // The top byte is always set so that no real trigram collides with the empty key
+    return 0x01000000u | ((uint32_t)tolower(p[0]) << 16) | ((uint32_t)tolower(p[1]) << 8) | (uint32_t)tolower(p[2]);
+}
+
+static inline size_t trigram_hash(uint32_t key) {
+    return (size_t)(key * 2654435761u);
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+#define INLINE_KEYS 64
+
+// Distinct trigram keys of text, sorted, in *keys: the caller's inline buffer
+// for typical names, or a heap block it has to free() if *keys != inline_keys.
+// Returns the count, or -1 on ENOMEM.
+static long collect_trigrams(const char *text, uint32_t inline_keys[INLINE_KEYS], uint32_t **keys) {
+    size_t len = strlen(text);
+    *keys = inline_keys;
+    if (len < 3) return 0;
+    size_t total = len - 2;
+    uint32_t *out = inline_keys;
+    if (total > INLINE_KEYS && !(out = malloc(total * sizeof(uint32_t)))) return -1;
+    for (size_t i = 0; i < total; i++) out[i] = trigram_key((const unsigned char*)text + i);
+    if (total > INLINE_KEYS) {
+        qsort(out, total, sizeof(uint32_t), compare_keys);
+    } else {
+        for (size_t i = 1; i < total; i++) {
+            uint32_t key = out[i];
+            size_t j = i;
+            for (; j > 0 && out[j - 1] > key; j--) out[j] = out[j - 1];
+            out[j] = key;
+        }
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (n == 0 || out[n - 1] != out[i]) out[n++] = out[i];
+    }
+    *keys = out;
+    return n;
+}
+
+static void release_trigrams(uint32_t *keys, uint32_t inline_keys[INLINE_KEYS]) {
+    if (keys != inline_keys) free(keys);
+}
+
+static bool index_grow(TrigramIndex *index) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 4096;
+    PostingList *buckets = calloc(capacity, sizeof(PostingList));
+    if (!buckets) return false;
+    for (size_t i = 0; i < index->capacity; i++) {
+        PostingList *old = &index->buckets[i];
+        if (!old->key) continue;
+        size_t j = trigram_hash(old->key) & (capacity - 1);
+        while (buckets[j].key) j = (j + 1) & (capacity - 1);
+        buckets[j] = *old;
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->capacity = capacity;
+    return true;
+}
+
+static PostingList* index_lookup(const TrigramIndex *index, uint32_t key) {
+    if (index->capacity == 0) return NULL;
+    size_t i = trigram_hash(key) & (index->capacity - 1);
+    while (index->buckets[i].key) {
+        if (index->buckets[i].key == key) return &index->buckets[i];
+        i = (i + 1) & (index->capacity - 1);
+    }
+    return NULL;
+}
+
+static PostingList* index_insert_key(TrigramIndex *index, uint32_t key) {
+    PostingList *list = index_lookup(index, key);
+    if (list) return list;
+    if ((index->used + 1) * 4 > index->capacity * 3 && !index_grow(index)) return NULL;
+    size_t i = trigram_hash(key) & (index->capacity - 1);
+    while (index->buckets[i].key) i = (i + 1) & (index->capacity - 1);
+    index->buckets[i].key = key;
+    index->used++;
+    return &index->buckets[i];
+}
+
+// First position in list whose id is >= id
+static size_t lower_bound(const uint32_t *ids, size_t len, uint32_t id) {
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool posting_insert(PostingList *list, uint32_t id) {
+    // New records get the highest id so far, which makes this an append
+    size_t at = (list->len == 0 || list->ids[list->len - 1] < id) ? list->len : lower_bound(list->ids, list->len, id);
+    if (at < list->len && list->ids[at] == id) return true;
+    if (list->len == list->cap) {
+        uint32_t cap = list->cap ? list->cap * 2 : 4;
+        uint32_t *ids = realloc(list->ids, cap * sizeof(uint32_t));
+        if (!ids) return false;
+        list->ids = ids;
+        list->cap = cap;
+    }
+    memmove(list->ids + at + 1, list->ids + at, (list->len - at) * sizeof(uint32_t));
+    list->ids[at] = id;
+    list->len++;
+    return true;
+}
+
+static bool posting_remove(PostingList *list, uint32_t id) {
+    size_t at = lower_bound(list->ids, list->len, id);
+    if (at >= list->len || list->ids[at] != id) return false;
+    memmove(list->ids + at, list->ids + at + 1, (list->len - at - 1) * sizeof(uint32_t));
+    list->len--;
+    return true;
+}
+
+// --- Public API ---
+
+TrigramIndex* trigram_index_new(void) {
+    return calloc(1, sizeof(TrigramIndex));
+}
+
+void trigram_index_free(TrigramIndex *index) {
+    if (!index) return;
+    for (size_t i = 0; i < index->capacity; i++) free(index->buckets[i].ids);
+    free(index->buckets);
+    free(index);
+}
+
+int trigram_index_add(TrigramIndex *index, uint32_t id, const char *text) {
+    uint32_t inline_keys[INLINE_KEYS], *keys;
+    long n = collect_trigrams(text, inline_keys, &keys);
+    bool ok = n >= 0;
+    for (long i = 0; ok && i < n; i++) {
+        PostingList *list = index_insert_key(index, keys[i]);
+        size_t before = list ? list->len : 0;
+        ok = list && posting_insert(list, id);
+        if (ok) index->postings += list->len - before;
+    }
+    release_trigrams(keys, inline_keys);
+    if (!ok) errno = ENOMEM;
+    return ok ? 0 : -1;
+}
+
+int trigram_index_remove(TrigramIndex *index, uint32_t id, const char *text) {
+    uint32_t inline_keys[INLINE_KEYS], *keys;
+    long n = collect_trigrams(text, inline_keys, &keys);
+    if (n < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        PostingList *list = index_lookup(index, keys[i]);
+        if (list && posting_remove(list, id)) index->postings--;
+    }
+    release_trigrams(keys, inline_keys);
+    return 0;
+}
+
+void trigram_index_remove_marked(TrigramIndex *index, const uint64_t *marked, size_t n_ids) {
+    for (size_t i = 0; i < index->capacity; i++) {
+        PostingList *list = &index->buckets[i];
+        uint32_t kept = 0;
+        for (uint32_t j = 0; j < list->len; j++) {
+            uint32_t id = list->ids[j];
+            if (id < n_ids && (marked[id / 64] >> (id % 64) & 1)) continue;
+            list->ids[kept++] = id;
+        }
+        index->postings -= list->len - kept;
+        list->len = kept;
+    }
+}
+
+static int compare_lengths(const void *a, const void *b) {
+    const PostingList *x = *(PostingList* const*)a, *y = *(PostingList* const*)b;
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
+long trigram_index_candidates(const TrigramIndex *index, const char *pattern, uint32_t **ids) {
+    *ids = NULL;
+    uint32_t inline_keys[INLINE_KEYS], *keys;
+    long n = collect_trigrams(pattern, inline_keys, &keys);
+    if (n <= 0) return -1;
+
+    // A trigram nobody has means no candidates at all
+    PostingList **lists = malloc(n * sizeof(PostingList*));
+    if (!lists) {
+        release_trigrams(keys, inline_keys);
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        lists[i] = index_lookup(index, keys[i]);
+        if (!lists[i] || lists[i]->len == 0) {
+            release_trigrams(keys, inline_keys);
+            free(lists);
+            return 0;
+        }
+    }
+    release_trigrams(keys, inline_keys);
+    qsort(lists, n, sizeof(PostingList*), compare_lengths);
+
+    // Start from the rarest trigram and narrow with binary searches into the rest
+    size_t count = lists[0]->len;
+    uint32_t *out = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!out) {
+        free(lists);
+        return -1;
+    }
+    memcpy(out, lists[0]->ids, count * sizeof(uint32_t));
+    for (long l = 1; l < n && count > 0; l++) {
+        const PostingList *list = lists[l];
+        size_t kept = 0, from = 0;
+        for (size_t i = 0; i < count; i++) {
+            from += lower_bound(list->ids + from, list->len - from, out[i]);
+            if (from >= list->len) break;
+            if (list->ids[from] == out[i]) out[kept++] = out[i];
+        }
+        count = kept;
+    }
+    free(lists);
+    *ids = out;
+    return count;
+}
+
+void trigram_index_stats(const TrigramIndex *index, size_t *trigrams, size_t *postings) {
+    if (trigrams) *trigrams = index->used;
+    if (postings) *postings = index->postings;
+}
+
+void trigram_index_shrink(TrigramIndex *index) {
+    for (size_t i = 0; i < index->capacity; i++) {
+        PostingList *list = &index->buckets[i];
+        if (list->len == list->cap || list->len == 0) continue;
+        uint32_t *ids = realloc(list->ids, list->len * sizeof(uint32_t));
+        if (!ids) continue;
+        list->ids = ids;
+        list->cap = list->len;
+    }
+}
+
+size_t trigram_index_bytes(const TrigramIndex *index) {
+    size_t bytes = index->capacity * sizeof(PostingList);
+    for (size_t i = 0; i < index->capacity; i++) bytes += (size_t)index->buckets[i].cap * sizeof(uint32_t);
+    return bytes;
+}
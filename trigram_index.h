@@ -0,0 +1,41 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Trigram Index ---
+//
+// Maps every three-byte window of a case-folded string to a sorted posting
+// list of ids. A substring query intersects the posting lists of the
+// pattern's trigrams, smallest first; the survivors are candidates that
+// still need an exact check, since sharing all trigrams does not imply a
+// contiguous match. Folding is ASCII-only; other bytes index as they are.
+
+typedef struct TrigramIndex TrigramIndex;
+
+TrigramIndex* trigram_index_new(void);
+void trigram_index_free(TrigramIndex *index);
+
+// Both return 0, or -1 with errno set if memory ran out
+int trigram_index_add(TrigramIndex *index, uint32_t id, const char *text);
+int trigram_index_remove(TrigramIndex *index, uint32_t id, const char *text);
+// Removes every id whose bit is set in marked (bit i of marked[i / 64]
+// stands for id i, for ids below n_ids) from every posting list in one
+// pass, which beats removing many ids one by one
+void trigram_index_remove_marked(TrigramIndex *index, const uint64_t *marked, size_t n_ids);
+
+// Stores the ascending candidate ids for pattern in *ids (free() it) and
+// returns how many there are. Returns -1 when pattern is shorter than three
+// bytes, in which case the caller has to scan instead.
+long trigram_index_candidates(const TrigramIndex *index, const char *pattern, uint32_t **ids);
+
+// Distinct trigrams and total postings, for sizing reports
+void trigram_index_stats(const TrigramIndex *index, size_t *trigrams, size_t *postings);
+// Bytes allocated for the buckets and posting lists
+size_t trigram_index_bytes(const TrigramIndex *index);
+// Gives back the room posting lists grew into but don't use, e.g. after
+// indexing a whole registry at once
+void trigram_index_shrink(TrigramIndex *index);
+
+#endif